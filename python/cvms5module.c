@@ -0,0 +1,223 @@
+/**
+ * @file cvms5module.c
+ * @brief Python bindings for CVM-S5.
+ * @version 1.0
+ *
+ * Exposes the model to Python as the cvms5 module. query hands the
+ * buffers of NumPy arrays of longitudes, latitudes and depths to
+ * cvms5_query_arrays, which writes the properties into the NumPy arrays
+ * returned. No NumPy array is converted when the inputs are already
+ * contiguous float64, though cvms5_query_arrays still copies the points
+ * into and the properties out of its own chunks. The GIL is released
+ * while the model is initialized, queried or finalized, and query_lock
+ * keeps those calls from overlapping.
+ *
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <pythread.h>
+#define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
+#include <numpy/arrayobject.h>
+#include "cvms5.h"
+
+/** Held while the model is initialized, configured, queried or finalized, as it only takes one call at a time */
+static PyThread_type_lock query_lock = NULL;
+
+/**
+ * Initializes the model.
+ *
+ * @param self The module.
+ * @param args The UCVM install directory and the optional model label.
+ * @return None, or NULL with RuntimeError raised.
+ */
+static PyObject *cvms5_py_init(PyObject *self, PyObject *args) {
+	const char *dir = NULL, *label = "cvms5";
+	int status = SUCCESS;
+
+	if (!PyArg_ParseTuple(args, "s|s", &dir, &label)) return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	PyThread_acquire_lock(query_lock, WAIT_LOCK);
+	status = cvms5_init(dir, label);
+	PyThread_release_lock(query_lock);
+	Py_END_ALLOW_THREADS
+
+	if (status != SUCCESS) {
+		PyErr_SetString(PyExc_RuntimeError, "Could not initialize the model.");
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+/**
+ * Queries the model at the points given as three arrays. Arrays of contiguous doubles are
+ * passed on without conversion, anything else is converted first.
+ *
+ * @param self The module.
+ * @param args The longitudes, latitudes and depths, of the same length.
+ * @return Vp, Vs, density, Qp and Qs as a tuple of float32 arrays, or NULL with an error raised.
+ */
+static PyObject *cvms5_py_query(PyObject *self, PyObject *args) {
+	PyObject *lon_arg = NULL, *lat_arg = NULL, *depth_arg = NULL;
+	PyArrayObject *lon = NULL, *lat = NULL, *depth = NULL;
+	PyArrayObject *out[5] = { NULL, NULL, NULL, NULL, NULL };
+	PyObject *result = NULL;
+	npy_intp numpoints = 0;
+	int status = SUCCESS;
+	int i = 0;
+
+	if (!PyArg_ParseTuple(args, "OOO", &lon_arg, &lat_arg, &depth_arg)) return NULL;
+
+	lon = (PyArrayObject *)PyArray_FROM_OTF(lon_arg, NPY_DOUBLE, NPY_ARRAY_IN_ARRAY);
+	lat = (PyArrayObject *)PyArray_FROM_OTF(lat_arg, NPY_DOUBLE, NPY_ARRAY_IN_ARRAY);
+	depth = (PyArrayObject *)PyArray_FROM_OTF(depth_arg, NPY_DOUBLE, NPY_ARRAY_IN_ARRAY);
+	if (lon == NULL || lat == NULL || depth == NULL) goto done;
+
+	numpoints = PyArray_SIZE(lon);
+	if (PyArray_SIZE(lat) != numpoints || PyArray_SIZE(depth) != numpoints) {
+		PyErr_SetString(PyExc_ValueError, "The longitudes, latitudes and depths must be the same length.");
+		goto done;
+	}
+	if (numpoints > INT_MAX) {
+		PyErr_SetString(PyExc_ValueError, "Too many points for one query.");
+		goto done;
+	}
+
+	for (i = 0; i < 5; i++) {
+		out[i] = (PyArrayObject *)PyArray_SimpleNew(1, &numpoints, NPY_FLOAT32);
+		if (out[i] == NULL) goto done;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	PyThread_acquire_lock(query_lock, WAIT_LOCK);
+	status = cvms5_query_arrays((double *)PyArray_DATA(lon), (double *)PyArray_DATA(lat), (double *)PyArray_DATA(depth),
+								(int)numpoints, (float *)PyArray_DATA(out[0]), (float *)PyArray_DATA(out[1]),
+								(float *)PyArray_DATA(out[2]), (float *)PyArray_DATA(out[3]), (float *)PyArray_DATA(out[4]));
+	PyThread_release_lock(query_lock);
+	Py_END_ALLOW_THREADS
+
+	if (status != SUCCESS && PyErr_WarnEx(PyExc_RuntimeWarning, "Some points could not be queried.", 1) < 0) goto done;
+
+	result = Py_BuildValue("(NNNNN)", out[0], out[1], out[2], out[3], out[4]);
+	for (i = 0; i < 5; i++) out[i] = NULL;
+
+done:
+	Py_XDECREF(lon);
+	Py_XDECREF(lat);
+	Py_XDECREF(depth);
+	for (i = 0; i < 5; i++) Py_XDECREF(out[i]);
+
+	return result;
+}
+
+/**
+ * Sets how queries are interpolated.
+ *
+ * @param self The module.
+ * @param args One of the INTERP constants.
+ * @return None, or NULL with ValueError raised.
+ */
+static PyObject *cvms5_py_set_interpolation(PyObject *self, PyObject *args) {
+	int interpolation = 0, status = SUCCESS;
+
+	if (!PyArg_ParseTuple(args, "i", &interpolation)) return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	PyThread_acquire_lock(query_lock, WAIT_LOCK);
+	status = cvms5_set_interpolation(interpolation);
+	PyThread_release_lock(query_lock);
+	Py_END_ALLOW_THREADS
+
+	if (status != SUCCESS) {
+		PyErr_SetString(PyExc_ValueError, "Unknown interpolation.");
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+/**
+ * Sets whether query depths are depths below the surface or elevations above sea level.
+ *
+ * @param self The module.
+ * @param args COORD_DEPTH or COORD_ELEVATION.
+ * @return None, or NULL with ValueError raised.
+ */
+static PyObject *cvms5_py_set_query_mode(PyObject *self, PyObject *args) {
+	int mode = 0, status = SUCCESS;
+
+	if (!PyArg_ParseTuple(args, "i", &mode)) return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	PyThread_acquire_lock(query_lock, WAIT_LOCK);
+	status = cvms5_set_query_mode(mode);
+	PyThread_release_lock(query_lock);
+	Py_END_ALLOW_THREADS
+
+	if (status != SUCCESS) {
+		PyErr_SetString(PyExc_ValueError, "Unknown query mode.");
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+/**
+ * Finalizes the model.
+ *
+ * @param self The module.
+ * @param args None.
+ * @return None.
+ */
+static PyObject *cvms5_py_finalize(PyObject *self, PyObject *args) {
+	Py_BEGIN_ALLOW_THREADS
+	PyThread_acquire_lock(query_lock, WAIT_LOCK);
+	cvms5_finalize();
+	PyThread_release_lock(query_lock);
+	Py_END_ALLOW_THREADS
+
+	Py_RETURN_NONE;
+}
+
+/** The module's functions */
+static PyMethodDef cvms5_methods[] = {
+	{ "init", cvms5_py_init, METH_VARARGS, "init(ucvm_dir, label='cvms5')\n\nInitializes the model." },
+	{ "query", cvms5_py_query, METH_VARARGS,
+	  "query(lon, lat, depth) -> (vp, vs, rho, qp, qs)\n\n"
+	  "Queries the model at each point, -1 where there is no data. Contiguous float64 arrays\n"
+	  "are passed on without conversion." },
+	{ "set_interpolation", cvms5_py_set_interpolation, METH_VARARGS,
+	  "set_interpolation(INTERP_TRILINEAR | INTERP_NEAREST | INTERP_TRICUBIC)" },
+	{ "set_query_mode", cvms5_py_set_query_mode, METH_VARARGS, "set_query_mode(COORD_DEPTH | COORD_ELEVATION)" },
+	{ "finalize", cvms5_py_finalize, METH_NOARGS, "finalize()\n\nFinalizes the model." },
+	{ NULL, NULL, 0, NULL }
+};
+
+/** The module */
+static struct PyModuleDef cvms5_module = {
+	PyModuleDef_HEAD_INIT, "cvms5", "Queries the CVM-S5 velocity model.", -1, cvms5_methods
+};
+
+/**
+ * Creates the module.
+ *
+ * @return The module, or NULL.
+ */
+PyMODINIT_FUNC PyInit_cvms5(void) {
+	PyObject *module = NULL;
+
+	import_array();
+
+	if (query_lock == NULL && (query_lock = PyThread_allocate_lock()) == NULL) return PyErr_NoMemory();
+	if ((module = PyModule_Create(&cvms5_module)) == NULL) return NULL;
+
+	PyModule_AddIntConstant(module, "INTERP_TRILINEAR", CVMS5_INTERP_TRILINEAR);
+	PyModule_AddIntConstant(module, "INTERP_NEAREST", CVMS5_INTERP_NEAREST);
+	PyModule_AddIntConstant(module, "INTERP_TRICUBIC", CVMS5_INTERP_TRICUBIC);
+	PyModule_AddIntConstant(module, "COORD_DEPTH", CVMS5_COORD_DEPTH);
+	PyModule_AddIntConstant(module, "COORD_ELEVATION", CVMS5_COORD_ELEVATION);
+
+	return module;
+}
@@ -0,0 +1,21 @@
+# Builds the cvms5 Python module against the library built in ../src.
+#
+#   CFLAGS="${ETREE_INCLUDES} ${PROJ_INCLUDES}" python3 setup.py build_ext --inplace
+
+import numpy
+from setuptools import Extension, setup
+
+setup(
+    name="cvms5",
+    version="1.0",
+    description="Python bindings for the CVM-S5 velocity model",
+    ext_modules=[
+        Extension(
+            "cvms5",
+            sources=["cvms5module.c"],
+            include_dirs=[numpy.get_include(), "../src"],
+            library_dirs=["../src"],
+            libraries=["cvms5"],
+        )
+    ],
+)
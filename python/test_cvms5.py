@@ -0,0 +1,88 @@
+"""Tests the cvms5 Python module against the model in UCVM_INSTALL_PATH.
+
+Build the module in place first, then run
+
+    UCVM_INSTALL_PATH=<ucvm install dir> python3 test_cvms5.py
+"""
+
+import os
+import threading
+import unittest
+
+import numpy
+
+import cvms5
+
+UCVM_DIR = os.environ.get("UCVM_INSTALL_PATH", "..")
+
+
+def grid_points(count):
+    """Points around Los Angeles, a few hundred meters apart and at several depths."""
+    index = numpy.arange(count)
+    lon = -118.2 + 0.003 * (index % 50)
+    lat = 33.9 + 0.003 * (index // 50)
+    depth = 100.0 * (index % 7)
+    return lon, lat, depth
+
+
+class QueryTest(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        cvms5.init(UCVM_DIR)
+
+    @classmethod
+    def tearDownClass(cls):
+        cvms5.finalize()
+
+    def test_properties_are_float32_per_point(self):
+        lon, lat, depth = grid_points(500)
+        result = cvms5.query(lon, lat, depth)
+        self.assertEqual(len(result), 5)
+        for values in result:
+            self.assertEqual(values.dtype, numpy.float32)
+            self.assertEqual(values.shape, (500,))
+        self.assertTrue(numpy.all(result[1] > 0))
+
+    def test_converted_input_matches(self):
+        lon, lat, depth = grid_points(500)
+        expected = cvms5.query(lon, lat, depth)
+        result = cvms5.query(list(lon), list(lat), depth.astype(numpy.float32))
+        for values, expected_values in zip(result, expected):
+            numpy.testing.assert_array_equal(values, expected_values)
+
+    def test_strided_input_matches(self):
+        lon, lat, depth = grid_points(1000)
+        expected = cvms5.query(lon[::2].copy(), lat[::2].copy(), depth[::2].copy())
+        result = cvms5.query(lon[::2], lat[::2], depth[::2])
+        for values, expected_values in zip(result, expected):
+            numpy.testing.assert_array_equal(values, expected_values)
+
+    def test_outside_model_has_no_data(self):
+        vp, vs, rho, qp, qs = cvms5.query([-125.0], [34.0], [0.0])
+        self.assertEqual(vs[0], -1)
+        self.assertEqual(vp[0], -1)
+
+    def test_mismatched_lengths_raise(self):
+        with self.assertRaises(ValueError):
+            cvms5.query([-118.0, -118.1], [34.0], [0.0])
+
+    def test_concurrent_queries_match(self):
+        lon, lat, depth = grid_points(5000)
+        expected = cvms5.query(lon, lat, depth)
+        results = [None] * 4
+
+        def query(slot):
+            results[slot] = cvms5.query(lon, lat, depth)
+
+        threads = [threading.Thread(target=query, args=(slot,)) for slot in range(4)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        for result in results:
+            for values, expected_values in zip(result, expected):
+                numpy.testing.assert_array_equal(values, expected_values)
+
+
+if __name__ == "__main__":
+    unittest.main()
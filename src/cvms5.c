@@ -14,6 +14,16 @@
 #include "ucvm_model_dtypes.h"
 #include "cvms5.h"
 #include <assert.h>
+#include <float.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <errno.h>
 
 
 /** The config of the model */
@@ -50,30 +60,27 @@ int cvms5_init(const char *dir, const char *label) {
     // Configuration file location.
     sprintf(configbuf, "%s/model/%s/data/config", dir, label);
 
-    // Read the cvms5_configuration file.
-    if (cvms5_read_configuration(configbuf, cvms5_configuration) != SUCCESS)
-        tempVal = FAIL;
+    // A prepared snapshot, if present and current, replaces the whole data load below. It always
+    // holds the whole model, so a region of interest or a partition is read from the source files instead.
+    if (cvms5_use_snapshot == 0 || cvms5_region != NULL || cvms5_partition != NULL ||
+        cvms5_load_snapshot(dir, label) != SUCCESS) {
+        // Read the cvms5_configuration file.
+        if (cvms5_read_configuration(configbuf, cvms5_configuration) != SUCCESS)
+            tempVal = FAIL;
 
-    // Set up the iteration directory.
-    sprintf(cvms5_iteration_directory, "%s/model/%s/data/%s/", dir, label, cvms5_configuration->model_dir);
-
-    // Can we allocate the model, or parts of it, to memory. If so, we do.
-    tempVal = cvms5_try_reading_model(cvms5_velocity_model);
-
-    if (tempVal == SUCCESS) {
-        fprintf(stderr, "WARNING: Could not load model into memory. Reading the model from the\n");
-        fprintf(stderr, "hard disk may result in slow performance.");
-    } else if (tempVal == FAIL) {
-        cvms5_print_error("No model file was found to read from.");
-        return FAIL;
-    }
+        // Set up the iteration directory.
+        if (snprintf(cvms5_iteration_directory, sizeof(cvms5_iteration_directory), "%s/model/%s/data/%s/",
+                     dir, label, cvms5_configuration->model_dir) >= (int)sizeof(cvms5_iteration_directory)) {
+            cvms5_print_error("The path to the model's data directory is too long.");
+            return FAIL;
+        }
 
-    if (cvms5_read_vs30_map(vs30_etree_file, cvms5_vs30_map) != SUCCESS) {
-        cvms5_print_error("Could not read the Vs30 map data from UCVM.");
-        return FAIL;
+        if (cvms5_read_vs30_map(vs30_etree_file, cvms5_vs30_map) != SUCCESS) {
+            cvms5_print_error("Could not read the Vs30 map data from UCVM.");
+            return FAIL;
+        }
     }
 
-    char* pstr= "+proj=utm +zone=11 +ellps=clrk66 +datum=NAD27 +units=m +no_defs";
     /* Setup projection */
     // We need to convert the point from lat, lon to UTM, let's set it up.
     snprintf(cvms5_projstr, 64, "+proj=utm +zone=%d +datum=NAD27 +units=m +no_defs", cvms5_configuration->utm_zone);
@@ -90,36 +97,94 @@ int cvms5_init(const char *dir, const char *label) {
         return (UCVM_CODE_ERROR);
     }
 
+    // Points clearly outside of the model are turned away before they are projected.
+    cvms5_footprint = calloc(1, sizeof(cvms5_footprint_t));
+    if (cvms5_set_footprint(cvms5_footprint) != SUCCESS) {
+        fprintf(stderr, "WARNING: Could not bound the model's footprint. Every query point will be projected.\n");
+        free(cvms5_footprint);
+        cvms5_footprint = NULL;
+    }
+
 
     // In order to simplify our calculations in the query, we want to rotate the box so that the bottom-left
     // corner is at (0m,0m). Our box's height is total_height_m and total_width_m. We then rotate the
     // point so that is is somewhere between (0,0) and (total_width_m, total_height_m). How far along
     // the X and Y axis determines which grid points we use for the interpolation routine.
 
-    // Calculate the rotation angle of the box.
-        assert(cvms5_configuration);    
-    north_height_m = cvms5_configuration->top_left_corner_n - cvms5_configuration->bottom_left_corner_n;
-    east_width_m = cvms5_configuration->top_left_corner_e - cvms5_configuration->bottom_left_corner_e;
+    // Calculate the rotation angle of the box. A snapshot already holds these constants.
+    if (cvms5_snapshot_base == NULL) {
+        assert(cvms5_configuration);
+        north_height_m = cvms5_configuration->top_left_corner_n - cvms5_configuration->bottom_left_corner_n;
+        east_width_m = cvms5_configuration->top_left_corner_e - cvms5_configuration->bottom_left_corner_e;
+
+        // Rotation angle. Cos, sin, and tan are expensive computationally, so calculate once.
+        rotation_angle = atan(east_width_m / north_height_m);
+
+        cvms5_cos_rotation_angle = cos(rotation_angle);
+        cvms5_sin_rotation_angle = sin(rotation_angle);
+
+        cvms5_total_height_m = sqrt(pow(cvms5_configuration->top_left_corner_n - cvms5_configuration->bottom_left_corner_n, 2.0f) +
+                              pow(cvms5_configuration->top_left_corner_e - cvms5_configuration->bottom_left_corner_e, 2.0f));
+        cvms5_total_width_m  = sqrt(pow(cvms5_configuration->top_right_corner_n - cvms5_configuration->top_left_corner_n, 2.0f) +
+                              pow(cvms5_configuration->top_right_corner_e - cvms5_configuration->top_left_corner_e, 2.0f));
+
+        // Get the cos and sin for the Vs30 map rotation.
+        cvms5_cos_vs30_rotation_angle = cos(cvms5_vs30_map->rotation * DEG_TO_RAD);
+        cvms5_sin_vs30_rotation_angle = sin(cvms5_vs30_map->rotation * DEG_TO_RAD);
+
+        // Work out which part of the grid covers the region of interest, if there is one.
+        if (cvms5_region != NULL && cvms5_set_region_block(cvms5_region, cvms5_velocity_model) != SUCCESS) {
+            cvms5_print_error("The region of interest does not overlap the model.");
+            return FAIL;
+        }
+        if (cvms5_partition != NULL && cvms5_set_partition_block(cvms5_partition, cvms5_velocity_model) != SUCCESS) {
+            cvms5_print_error("There are more processes than cells along the model's x axis.");
+            return FAIL;
+        }
 
-    // Rotation angle. Cos, sin, and tan are expensive computationally, so calculate once.
-    rotation_angle = atan(east_width_m / north_height_m);
+        // Can we allocate the model, or parts of it, to memory. If so, we do.
+        tempVal = cvms5_try_reading_model(cvms5_velocity_model);
 
-    cvms5_cos_rotation_angle = cos(rotation_angle);
-    cvms5_sin_rotation_angle = sin(rotation_angle);
+        if (tempVal == SUCCESS) {
+            fprintf(stderr, "WARNING: Could not load model into memory. Reading the model from the\n");
+            fprintf(stderr, "hard disk may result in slow performance.");
+        } else if (tempVal == FAIL) {
+            cvms5_print_error("No model file was found to read from.");
+            return FAIL;
+        }
+    }
 
-    cvms5_total_height_m = sqrt(pow(cvms5_configuration->top_left_corner_n - cvms5_configuration->bottom_left_corner_n, 2.0f) +
-                          pow(cvms5_configuration->top_left_corner_e - cvms5_configuration->bottom_left_corner_e, 2.0f));
-    cvms5_total_width_m  = sqrt(pow(cvms5_configuration->top_right_corner_n - cvms5_configuration->top_left_corner_n, 2.0f) +
-                          pow(cvms5_configuration->top_right_corner_e - cvms5_configuration->top_left_corner_e, 2.0f));
+    // Overlays named in the configuration are read over the model's own grids.
+    if (cvms5_configuration->overlays[0] != '\0' &&
+        cvms5_add_overlays(cvms5_iteration_directory, cvms5_configuration->overlays, cvms5_velocity_model) != SUCCESS) {
+        cvms5_print_error("Could not read the overlays named in the configuration file.");
+        return FAIL;
+    }
 
-    // Get the cos and sin for the Vs30 map rotation.
-    cvms5_cos_vs30_rotation_angle = cos(cvms5_vs30_map->rotation * DEG_TO_RAD);
-    cvms5_sin_vs30_rotation_angle = sin(cvms5_vs30_map->rotation * DEG_TO_RAD);
+    // The model itself is level 0 of the pyramid.
+    cvms5_pyramid[0].nx = cvms5_configuration->nx;
+    cvms5_pyramid[0].ny = cvms5_configuration->ny;
+    cvms5_pyramid[0].nz = cvms5_configuration->nz;
+    cvms5_pyramid[0].factor = 1;
+    cvms5_pyramid[0].top_plane = cvms5_configuration->depth / cvms5_configuration->depth_interval - 1;
+    cvms5_pyramid[0].model = cvms5_velocity_model;
+    cvms5_query_level = 0;
+    cvms5_query_mode = CVMS5_COORD_DEPTH;
+    cvms5_interpolation = CVMS5_INTERP_TRILINEAR;
+    cvms5_select_kernels();
 
          /* setup config_string */
          sprintf(cvms5_config_string,"config = %s\n",configbuf);
          cvms5_config_sz=1;
 
+    // Cached results are only used while the configuration and data files are as they are now.
+    cvms5_model_stamp = cvms5_stamp_model(configbuf);
+    if (cvms5_cache_directory == NULL && getenv("CVMS5_CACHE") != NULL) cvms5_set_cache(getenv("CVMS5_CACHE"));
+
+    // Queries are traced for cvms5_replay when CVMS5_TRACE names a file.
+    if (cvms5_trace == NULL && getenv("CVMS5_TRACE") != NULL && cvms5_start_trace(getenv("CVMS5_TRACE")) != SUCCESS)
+        fprintf(stderr, "WARNING: Could not open %s, queries will not be traced.\n", getenv("CVMS5_TRACE"));
+
     // Let everyone know that we are initialized and ready for business.
     cvms5_is_initialized = 1;
 
@@ -127,711 +192,5204 @@ int cvms5_init(const char *dir, const char *label) {
 }
 
 /**
- * Queries CVM-S5 at the given points and returns the data that it finds.
- * If GTL is enabled, it also adds the Vs30 GTL as described by Po Chen.
+ * Initializes the model like cvms5_init, but only reads the block of the grid that covers a
+ * region of interest, plus a one cell halo. Queries outside of that block return the same
+ * -1 no-data values as queries outside of the model.
  *
- * @param points The points at which the queries will be made.
- * @param data The data that will be returned (Vp, Vs, density, Qs, and/or Qp).
- * @param numpoints The total number of points to query.
- * @return SUCCESS or FAIL.
+ * @param dir The directory in which UCVM has been installed.
+ * @param label A unique identifier for the velocity model.
+ * @param bbox_lonlat Minimum longitude, minimum latitude, maximum longitude and maximum latitude.
+ * @param zmin Minimum depth of the region, in meters.
+ * @param zmax Maximum depth of the region, in meters.
+ * @return Success or failure, if initialization was successful.
  */
-int cvms5_query(cvms5_point_t *points, cvms5_properties_t *data, int numpoints) {
-    int i = 0;
+int cvms5_init_region(const char *dir, const char *label, double *bbox_lonlat, double zmin, double zmax) {
+    cvms5_region = calloc(1, sizeof(cvms5_region_t));
+    cvms5_region->min_longitude = bbox_lonlat[0];
+    cvms5_region->min_latitude = bbox_lonlat[1];
+    cvms5_region->max_longitude = bbox_lonlat[2];
+    cvms5_region->max_latitude = bbox_lonlat[3];
+    cvms5_region->min_depth = zmin;
+    cvms5_region->max_depth = zmax;
 
-    double point_u = 0, point_v = 0;
-    double point_x = 0, point_y = 0;
-
-    int load_x_coord = 0, load_y_coord = 0, load_z_coord = 0;
-    double x_percent = 0, y_percent = 0, z_percent = 0;
-    cvms5_properties_t surrounding_points[8];
+    if (cvms5_init(dir, label) != SUCCESS) {
+        free(cvms5_region);
+        cvms5_region = NULL;
+        return FAIL;
+    }
 
-    int zone =11;
-    int longlat2utm = 0;
+    return SUCCESS;
+}
 
-    for (i = 0; i < numpoints; i++) {
-        data[i].vp = -1;
-        data[i].vs = -1;
-        data[i].rho = -1;
-        data[i].qp = -1;
-        data[i].qs = -1;
+/**
+ * Initializes the model like cvms5_init, but maps the grid from its files instead of reading
+ * it in, for meshers that sweep the model one slab at a time and never come back. Planes are
+ * faulted in as they are queried, a window of planes ahead of the sweep is prefetched in the
+ * background and the planes left behind are released, so the resident grid stays at a few
+ * planes. By default the window follows the planes touched by each cvms5_query call; calling
+ * cvms5_advance_window hands control of it to the caller instead.
+ *
+ * @param dir The directory in which UCVM has been installed.
+ * @param label A unique identifier for the velocity model.
+ * @param axis CVMS5_WINDOW_Z to sweep by depth, CVMS5_WINDOW_X to sweep along the model's x axis.
+ * @param planes Number of planes to prefetch ahead of the window.
+ * @return Success or failure, if initialization was successful.
+ */
+int cvms5_init_streaming(const char *dir, const char *label, int axis, int planes) {
+    if (axis != CVMS5_WINDOW_Z && axis != CVMS5_WINDOW_X) {
+        cvms5_print_error("Streaming is only supported along the z and x axes.");
+        return FAIL;
+    }
 
-        // if depth is not positive (incorrectly set, then it is a DATAGAP)
-        if(points[i].depth < 0) {
-            continue;
-        }
+    cvms5_window = calloc(1, sizeof(cvms5_window_t));
+    cvms5_window->axis = axis;
+    cvms5_window->planes = planes;
+    cvms5_window->automatic = 1;
+    cvms5_window->first = -1;
+    cvms5_window->last = -1;
 
-        PJ_COORD xyzSrc = proj_coord(points[i].latitude, points[i].longitude, 0.0, HUGE_VAL);
-        PJ_COORD xyzDest = proj_trans(cvms5_geo2utm, PJ_FWD, xyzSrc);
-        int err = proj_context_errno(PJ_DEFAULT_CTX);
-        if (err) {
-            fprintf(stderr, "Error occurred while transforming latitude=%.4f, longitude=%.4f to UTM.\n",
-                                points[i].latitude, points[i].longitude);
-            fprintf(stderr, "Proj error: %s\n", proj_context_errno_string(PJ_DEFAULT_CTX, err));
-            return UCVM_CODE_ERROR;
-        }
-        point_u = xyzDest.xyzt.x;
-        point_v = xyzDest.xyzt.y;
-                
-        // Point within rectangle.
-        point_u -= cvms5_configuration->bottom_left_corner_e;
-        point_v -= cvms5_configuration->bottom_left_corner_n;
-
-        // We need to rotate that point, the number of degrees we calculated above.
-        point_x = cvms5_cos_rotation_angle * point_u - cvms5_sin_rotation_angle * point_v;
-        point_y = cvms5_sin_rotation_angle * point_u + cvms5_cos_rotation_angle * point_v;
-
-        // Which point base point does that correspond to?
-        load_x_coord = floor(point_x / cvms5_total_width_m * (cvms5_configuration->nx -1));
-        load_y_coord = floor(point_y / cvms5_total_height_m * (cvms5_configuration->ny - 1));
-
-        // And on the Z-axis?
-        load_z_coord = (cvms5_configuration->depth / cvms5_configuration->depth_interval - 1) -
-                       floor(points[i].depth / cvms5_configuration->depth_interval);
-
-        // Get the Z percent.
-        z_percent = fmod(points[i].depth, cvms5_configuration->depth_interval) / cvms5_configuration->depth_interval;
-
-        if (load_z_coord == 0 && z_percent == 0) {
-            cvms5_read_properties(load_x_coord,     load_y_coord,     load_z_coord,     &(surrounding_points[0]));        // Orgin.
-                        cvms5_read_properties(load_x_coord + 1, load_y_coord,     load_z_coord,     &(surrounding_points[1]));        // Orgin + 1x
-                        cvms5_read_properties(load_x_coord,     load_y_coord + 1, load_z_coord,     &(surrounding_points[2]));        // Orgin + 1y
-                        cvms5_read_properties(load_x_coord + 1, load_y_coord + 1, load_z_coord,     &(surrounding_points[3]));        // Orgin + x + y, forms top plane.
-            cvms5_bilinear_interpolation(x_percent, y_percent, surrounding_points, &(data[i]));
-            
-            // Calculate density.
-                    data[i].rho = cvms5_calculate_density(data[i].vs);
-
-                    // Calculate Qp and Qs.
-                    if (data[i].vs < 1500)
-                            data[i].qs = data[i].vs * 0.02;
-                    else
-                            data[i].qs = data[i].vs * 0.10;
-
-                    data[i].qp = data[i].qs * 1.5;
-            continue;
-        }
+    if (cvms5_init(dir, label) != SUCCESS) {
+        free(cvms5_window);
+        cvms5_window = NULL;
+        return FAIL;
+    }
 
-        // Are we outside the model's X and Y boundaries?
-        if (load_x_coord > cvms5_configuration->nx - 2 || load_y_coord > cvms5_configuration->ny - 2 || load_x_coord < 0 || load_y_coord < 0 || load_z_coord < 1) {
-            data[i].vp = -1;
-            data[i].vs = -1;
-            data[i].rho = -1;
-            data[i].qp = -1;
-            data[i].qs = -1;
-            continue;
-        }
+    return SUCCESS;
+}
 
-        // Get the X and Y percentages for the bilinear or trilinear interpolation below.
-        x_percent = fmod(point_x, cvms5_total_width_m / (cvms5_configuration->nx - 1)) / (cvms5_total_width_m / (cvms5_configuration->nx - 1));
-        y_percent = fmod(point_y, cvms5_total_height_m / (cvms5_configuration->ny - 1)) / (cvms5_total_height_m / (cvms5_configuration->ny - 1));
+/**
+ * Initializes the model like cvms5_init, then loads the grids of further iterations of it, such
+ * as other tomographic inversions, from directories next to the configured one. Every iteration
+ * must share the model's grid geometry, so cvms5_query_ensemble can locate a point once and
+ * read all of them at the same grid points. An iteration that is the configured one shares the
+ * model's grids.
+ *
+ * @param dir The directory in which UCVM has been installed.
+ * @param label A unique identifier for the velocity model.
+ * @param model_dirs The iteration directories, relative to the model's data directory.
+ * @param count Number of iteration directories.
+ * @return Success or failure, if initialization was successful.
+ */
+int cvms5_init_ensemble(const char *dir, const char *label, const char **model_dirs, int count) {
+    char directory[512];
+    int i = 0;
 
-        // Check to see if we're in the GTL layer and we actually want the GTL.
-        if (points[i].depth < cvms5_configuration->depth_interval && cvms5_configuration->gtl == 1) {
-            cvms5_get_vs30_based_gtl(&(points[i]), &(data[i]));
+    if (count < 1) {
+        cvms5_print_error("An ensemble needs at least one iteration.");
+        return FAIL;
+    }
 
-        } else {
+    if (cvms5_init(dir, label) != SUCCESS) return FAIL;
 
-            // Read all the surrounding point properties.
-            cvms5_read_properties(load_x_coord,     load_y_coord,     load_z_coord,     &(surrounding_points[0]));    // Orgin.
-            cvms5_read_properties(load_x_coord + 1, load_y_coord,     load_z_coord,     &(surrounding_points[1]));    // Orgin + 1x
-            cvms5_read_properties(load_x_coord,     load_y_coord + 1, load_z_coord,     &(surrounding_points[2]));    // Orgin + 1y
-            cvms5_read_properties(load_x_coord + 1, load_y_coord + 1, load_z_coord,     &(surrounding_points[3]));    // Orgin + x + y, forms top plane.
-            cvms5_read_properties(load_x_coord,     load_y_coord,     load_z_coord - 1, &(surrounding_points[4]));    // Bottom plane origin
-            cvms5_read_properties(load_x_coord + 1, load_y_coord,     load_z_coord - 1, &(surrounding_points[5]));    // +1x
-            cvms5_read_properties(load_x_coord,     load_y_coord + 1, load_z_coord - 1, &(surrounding_points[6]));    // +1y
-            cvms5_read_properties(load_x_coord + 1, load_y_coord + 1, load_z_coord - 1, &(surrounding_points[7]));    // +x +y, forms bottom plane.
+    cvms5_ensemble = calloc(count, sizeof(cvms5_model_t *));
+    cvms5_ensemble_size = count;
 
-            cvms5_trilinear_interpolation(x_percent, y_percent, z_percent, surrounding_points, &(data[i]));
+    for (i = 0; i < count; i++) {
+        if (strcmp(model_dirs[i], cvms5_configuration->model_dir) == 0) {
+            cvms5_ensemble[i] = cvms5_velocity_model;
+            continue;
         }
 
-        // Calculate density.
-        data[i].rho = cvms5_calculate_density(data[i].vs);
+        snprintf(directory, sizeof(directory), "%s/model/%s/data/%s/", dir, label, model_dirs[i]);
+        if (cvms5_check_grid_geometry(directory) != SUCCESS) {
+            cvms5_print_error("An iteration of the ensemble does not share the model's grid.");
+            return FAIL;
+        }
 
-        // Calculate Qp and Qs.
-        if (data[i].vs < 1500)
-            data[i].qs = data[i].vs * 0.02;
-        else
-            data[i].qs = data[i].vs * 0.10;
+        // The iteration's grids cover the same block as the model's.
+        cvms5_ensemble[i] = calloc(1, sizeof(cvms5_model_t));
+        cvms5_ensemble[i]->block_x = cvms5_velocity_model->block_x;
+        cvms5_ensemble[i]->block_y = cvms5_velocity_model->block_y;
+        cvms5_ensemble[i]->block_z = cvms5_velocity_model->block_z;
+        cvms5_ensemble[i]->block_nx = cvms5_velocity_model->block_nx;
+        cvms5_ensemble[i]->block_ny = cvms5_velocity_model->block_ny;
+        cvms5_ensemble[i]->block_nz = cvms5_velocity_model->block_nz;
 
-        data[i].qp = data[i].qs * 1.5;
+        if (cvms5_try_reading_model_from(directory, cvms5_ensemble[i]) == FAIL) {
+            cvms5_print_error("No model file was found to read from for an iteration of the ensemble.");
+            return FAIL;
+        }
     }
 
     return SUCCESS;
 }
 
 /**
- * Retrieves the material properties (whatever is available) for the given data point, expressed
- * in x, y, and z co-ordinates.
+ * Adds a variant of the model to the ensemble: the model's own grids, shared rather than copied,
+ * with overlays applied after the model's own. An ensemble started this way has the model as its
+ * first iteration, and cvms5_query_ensemble answers every variant at the same cells.
  *
- * @param x The x coordinate of the data point.
- * @param y The y coordinate of the data point.
- * @param z The z coordinate of the data point.
- * @param data The properties struct to which the material properties will be written.
+ * @param overlays The variant's overlay files within the model directory, comma separated, in the order they are applied.
+ * @return SUCCESS or FAIL.
  */
-void cvms5_read_properties(int x, int y, int z, cvms5_properties_t *data) {
-  
-    // Set everything to -1 to indicate not found.
-    data->vp = -1;
-    data->vs = -1;
-    data->rho = -1;
-    data->qp = -1;
-    data->qs = -1;
+int cvms5_add_variant(const char *overlays) {
+    cvms5_model_t *variant = NULL;
 
-    float *ptr = NULL;
-    FILE *fp = NULL;
-    int location = z * cvms5_configuration->nx * cvms5_configuration->ny + (cvms5_configuration->nx - x - 1) * cvms5_configuration->ny + y;
+    if (!cvms5_is_initialized || cvms5_window != NULL) {
+        cvms5_print_error("Variants need the model initialized with its grids held in place.");
+        return FAIL;
+    }
 
-    // Check our loaded components of the model.
-    if (cvms5_velocity_model->vs_status == 2) {
-        // Read from memory.
-        ptr = (float *)cvms5_velocity_model->vs;
-        data->vs = ptr[location];
-    } else if (cvms5_velocity_model->vs_status == 1) {
-        // Read from file.
-        fp = (FILE *)cvms5_velocity_model->vs;
-        fseek(fp, location * sizeof(float), SEEK_SET);
-        fread(&(data->vs), sizeof(float), 1, fp);
+    variant = calloc(1, sizeof(cvms5_model_t));
+    if (variant == NULL) {
+        cvms5_print_error("Could not allocate memory for a variant.");
+        return FAIL;
+    }
+    *variant = *cvms5_velocity_model;
+    variant->shared = 1;
+    variant->overlays = NULL;
+    variant->overlay_count = 0;
+    if (cvms5_velocity_model->overlay_count > 0) {
+        variant->overlays = malloc(cvms5_velocity_model->overlay_count * sizeof(cvms5_overlay_t *));
+        memcpy(variant->overlays, cvms5_velocity_model->overlays, cvms5_velocity_model->overlay_count * sizeof(cvms5_overlay_t *));
+        variant->overlay_count = cvms5_velocity_model->overlay_count;
     }
 
-    // Check our loaded components of the model.
-    if (cvms5_velocity_model->vp_status == 2) {
-        // Read from memory.
-        ptr = (float *)cvms5_velocity_model->vp;
-        data->vp = ptr[location];
-    } else if (cvms5_velocity_model->vp_status == 1) {
-        // Read from file.
-        fseek(fp, location * sizeof(float), SEEK_SET);
-        fread(&(data->vp), sizeof(float), 1, fp);
+    if (cvms5_add_overlays(cvms5_iteration_directory, overlays, variant) != SUCCESS) {
+        free(variant->overlays);
+        free(variant);
+        return FAIL;
+    }
+
+    if (cvms5_ensemble == NULL) {
+        cvms5_ensemble = calloc(1, sizeof(cvms5_model_t *));
+        cvms5_ensemble[0] = cvms5_velocity_model;
+        cvms5_ensemble_size = 1;
     }
+    cvms5_ensemble = realloc(cvms5_ensemble, (cvms5_ensemble_size + 1) * sizeof(cvms5_model_t *));
+    cvms5_ensemble[cvms5_ensemble_size++] = variant;
 
+    return SUCCESS;
 }
 
 /**
- * Trilinearly interpolates given a x percentage, y percentage, z percentage and a cube of
- * data properties in top origin format (top plane first, bottom plane second).
+ * Moves the streaming window to the given planes. Planes are z indices, counted up from the
+ * bottom of the model, for CVMS5_WINDOW_Z and x indices for CVMS5_WINDOW_X. Once this has been
+ * called, the window no longer follows the queries on its own.
  *
- * @param x_percent X percentage
- * @param y_percent Y percentage
- * @param z_percent Z percentage
- * @param eight_points Eight surrounding data properties
- * @param ret_properties Returned data properties
+ * @param first The first plane the next queries will touch.
+ * @param last The last plane the next queries will touch.
+ * @return SUCCESS, or FAIL if the model was not initialized for streaming.
  */
-void cvms5_trilinear_interpolation(double x_percent, double y_percent, double z_percent,
-                             cvms5_properties_t *eight_points, cvms5_properties_t *ret_properties) {
-    cvms5_properties_t *temp_array = calloc(2, sizeof(cvms5_properties_t));
-    cvms5_properties_t *four_points = eight_points;
-
-    cvms5_bilinear_interpolation(x_percent, y_percent, four_points, &temp_array[0]);
-
-    // Now advance the pointer four "cvms5_properties_t" spaces.
-    four_points += 4;
-
-    // Another interpolation.
-    cvms5_bilinear_interpolation(x_percent, y_percent, four_points, &temp_array[1]);
+int cvms5_advance_window(int first, int last) {
+    if (cvms5_window == NULL) return FAIL;
 
-    // Now linearly interpolate between the two.
-    cvms5_linear_interpolation(z_percent, &temp_array[0], &temp_array[1], ret_properties);
+    cvms5_window->automatic = 0;
+    cvms5_move_window(cvms5_window, first, last);
 
-    free(temp_array);
+    return SUCCESS;
 }
 
 /**
- * Bilinearly interpolates given a x percentage, y percentage, and a plane of data properties in
- * origin, bottom-right, top-left, top-right format.
+ * Queries CVM-S5 at the given points and returns the data that it finds.
+ * If GTL is enabled, it also adds the Vs30 GTL as described by Po Chen.
+ * The points' depths are read as set by cvms5_set_query_mode. With a result
+ * cache set, a batch queried before is answered from the cache. While a
+ * trace is being recorded, each batch is added to it.
  *
- * @param x_percent X percentage.
- * @param y_percent Y percentage.
- * @param four_points Data property plane.
- * @param ret_properties Returned data properties.
+ * @param points The points at which the queries will be made.
+ * @param data The data that will be returned (Vp, Vs, density, Qs, and/or Qp).
+ * @param numpoints The total number of points to query.
+ * @return SUCCESS or FAIL.
  */
-void cvms5_bilinear_interpolation(double x_percent, double y_percent, cvms5_properties_t *four_points, cvms5_properties_t *ret_properties) {
-    cvms5_properties_t *temp_array = calloc(2, sizeof(cvms5_properties_t));
-    cvms5_linear_interpolation(x_percent, &four_points[0], &four_points[1], &temp_array[0]);
-    cvms5_linear_interpolation(x_percent, &four_points[2], &four_points[3], &temp_array[1]);
-    cvms5_linear_interpolation(y_percent, &temp_array[0], &temp_array[1], ret_properties);
-    free(temp_array);
+int cvms5_query(cvms5_point_t *points, cvms5_properties_t *data, int numpoints) {
+    int cached = cvms5_cache_directory != NULL && numpoints >= CVMS5_CACHE_MIN_POINTS;
+    double start = cvms5_trace != NULL ? cvms5_seconds() : 0;
+    uint64_t key = 0;
+    int retVal = SUCCESS;
+
+    if (cached) key = cvms5_cache_key(points, numpoints);
+
+    if (!cached || cvms5_cache_read(key, data, numpoints) != SUCCESS) {
+        retVal = cvms5_query_points(points, data, numpoints, cvms5_query_mode, cvms5_interpolation, NULL, NULL);
+
+        // Only batches answered in full are kept.
+        if (cached && retVal == SUCCESS) cvms5_cache_write(key, data, numpoints);
+    }
+
+    if (cvms5_trace != NULL) cvms5_trace_batch(points, numpoints, retVal, start, cvms5_seconds() - start);
+
+    return retVal;
 }
 
 /**
- * Linearly interpolates given a percentage from x0 to x1, a data point at x0, and a data point at x1.
+ * Queries CVM-S5 like cvms5_query, but always answers the whole batch and gives each point its
+ * own status, so a point that cannot be projected does not cost the points after it their
+ * data. Points with no data are -1, as from cvms5_query.
  *
- * @param percent Percent of the way from x0 to x1 (from 0 to 1 interval).
- * @param x0 Data point at x0.
- * @param x1 Data point at x1.
- * @param ret_properties Resulting data properties.
+ * @param points The points at which the queries will be made.
+ * @param data The data that will be returned (Vp, Vs, density, Qs, and/or Qp).
+ * @param status UCVM_CODE_SUCCESS for each point answered, UCVM_CODE_DATAGAP above the surface,
+ *               UCVM_CODE_NODATA outside the model and UCVM_CODE_ERROR if it could not be projected.
+ * @param numpoints The total number of points to query.
+ * @return SUCCESS.
  */
-void cvms5_linear_interpolation(double percent, cvms5_properties_t *x0, cvms5_properties_t *x1, cvms5_properties_t *ret_properties) {
-    ret_properties->vp  = (1 - percent) * x0->vp  + percent * x1->vp;
-    ret_properties->vs  = (1 - percent) * x0->vs  + percent * x1->vs;
-    ret_properties->rho = (1 - percent) * x0->rho + percent * x1->rho;
-    ret_properties->qp  = (1 - percent) * x0->qp  + percent * x1->qp;
-    ret_properties->qs  = (1 - percent) * x0->qs  + percent * x1->qs;
+int cvms5_query_status(cvms5_point_t *points, cvms5_properties_t *data, int *status, int numpoints) {
+    return cvms5_query_points(points, data, numpoints, cvms5_query_mode, cvms5_interpolation, NULL, status);
 }
 
 /**
- * Called when the model is being discarded. Free all variables.
+ * Queries CVM-S5 like cvms5_query, with the points given as separate longitude, latitude and
+ * depth arrays and each property written to its own float array, which may be NULL if the
+ * property is not wanted. This is a convenience over cvms5_query rather than a faster path:
+ * the points are copied into cvms5_point_t CVMS5_ARRAYS_CHUNK at a time, answered point by
+ * point as cvms5_query would, and the wanted properties copied back out. Only a chunk of full
+ * cvms5_properties_t is ever held, whatever the number of points.
  *
- * @return SUCCESS
+ * @param longitude The longitudes of the points.
+ * @param latitude The latitudes of the points.
+ * @param depth The depths of the points, read as set by cvms5_set_query_mode.
+ * @param numpoints The total number of points to query.
+ * @param vp Vp at the points, or NULL.
+ * @param vs Vs at the points, or NULL.
+ * @param rho Density at the points, or NULL.
+ * @param qp Qp at the points, or NULL.
+ * @param qs Qs at the points, or NULL.
+ * @return SUCCESS or FAIL.
  */
-int cvms5_finalize() {
-    proj_destroy(cvms5_geo2utm);
-    cvms5_geo2utm = NULL;
+int cvms5_query_arrays(const double *longitude, const double *latitude, const double *depth, int numpoints,
+                       float *vp, float *vs, float *rho, float *qp, float *qs) {
+    cvms5_point_t *points = malloc(CVMS5_ARRAYS_CHUNK * sizeof(cvms5_point_t));
+    cvms5_properties_t *data = malloc(CVMS5_ARRAYS_CHUNK * sizeof(cvms5_properties_t));
+    int first = 0, count = 0, i = 0;
+    int retVal = SUCCESS;
 
-    proj_destroy(cvms5_geo2aeqd);
-    cvms5_geo2aeqd = NULL;
+    if (points == NULL || data == NULL) {
+        free(points);
+        free(data);
+        cvms5_print_error("Could not allocate memory for the points.");
+        return FAIL;
+    }
 
-    if (cvms5_velocity_model) free(cvms5_velocity_model);
-    if (cvms5_configuration) free(cvms5_configuration);
-    if (cvms5_vs30_map) free(cvms5_vs30_map);
+    for (first = 0; first < numpoints; first += count) {
+        count = numpoints - first < CVMS5_ARRAYS_CHUNK ? numpoints - first : CVMS5_ARRAYS_CHUNK;
 
-        if (cvms5_config_string) free(cvms5_config_string);
+        for (i = 0; i < count; i++) {
+            points[i].longitude = longitude[first + i];
+            points[i].latitude = latitude[first + i];
+            points[i].depth = depth[first + i];
+        }
 
-    return SUCCESS;
+        // As in cvms5_query, the points after one that could not be projected are left without data.
+        if (retVal == SUCCESS) {
+            retVal = cvms5_query_points(points, data, count, cvms5_query_mode, cvms5_interpolation, NULL, NULL);
+        } else {
+            for (i = 0; i < count; i++) data[i].vp = data[i].vs = data[i].rho = data[i].qp = data[i].qs = -1;
+        }
+
+        if (vp != NULL) for (i = 0; i < count; i++) vp[first + i] = data[i].vp;
+        if (vs != NULL) for (i = 0; i < count; i++) vs[first + i] = data[i].vs;
+        if (rho != NULL) for (i = 0; i < count; i++) rho[first + i] = data[i].rho;
+        if (qp != NULL) for (i = 0; i < count; i++) qp[first + i] = data[i].qp;
+        if (qs != NULL) for (i = 0; i < count; i++) qs[first + i] = data[i].qs;
+    }
+
+    free(points);
+    free(data);
+
+    return retVal;
 }
 
 /**
- * Returns the version information.
+ * Queries CVM-S5 like cvms5_query, but with the given interpolation rather than the one set
+ * by cvms5_set_interpolation.
  *
- * @param ver Version string to return.
- * @param len Maximum length of buffer.
- * @return Zero
+ * @param points The points at which the queries will be made.
+ * @param data The data that will be returned (Vp, Vs, density, Qs, and/or Qp).
+ * @param numpoints The total number of points to query.
+ * @param interpolation One of the CVMS5_INTERP constants.
+ * @return SUCCESS or FAIL.
  */
-int cvms5_version(char *ver, int len)
-{
-  int verlen;
-  verlen = strlen(cvms5_version_string);
-  if (verlen > len - 1) {
-    verlen = len - 1;
-  }
-  memset(ver, 0, len);
-  strncpy(ver, cvms5_version_string, verlen);
-  return 0;
+int cvms5_query_interpolated(cvms5_point_t *points, cvms5_properties_t *data, int numpoints, int interpolation) {
+    if (interpolation != CVMS5_INTERP_TRILINEAR && interpolation != CVMS5_INTERP_NEAREST &&
+        interpolation != CVMS5_INTERP_TRICUBIC) {
+        cvms5_print_error("Unknown interpolation.");
+        return FAIL;
+    }
+
+    return cvms5_query_points(points, data, numpoints, cvms5_query_mode, interpolation, NULL, NULL);
 }
 
 /**
- * Returns the model config information.
+ * Sets how queries are interpolated. Trilinear interpolation between the cell's corners is the
+ * default. Taking the nearest grid point reads one grid point per query and does no weighting,
+ * for coarse meshes. Tricubic interpolation through the 64 grid points around the cell is
+ * smoother, with continuous gradients, at several times the cost, and may overshoot the grid
+ * values where they change sharply. Points within the GTL are tapered from a trilinear base
+ * whatever the interpolation.
  *
- * @param key Config key string to return.
- * @param sz Number of config term to return.
- * @return Zero
+ * @param interpolation One of the CVMS5_INTERP constants.
+ * @return SUCCESS or FAIL.
  */
-int cvms5_config(char **config, int *sz)
-{
-  int len=strlen(cvms5_config_string);
-  if(len > 0) {
-    *config=cvms5_config_string;
-    *sz=cvms5_config_sz;
+int cvms5_set_interpolation(int interpolation) {
+    if (interpolation != CVMS5_INTERP_TRILINEAR && interpolation != CVMS5_INTERP_NEAREST &&
+        interpolation != CVMS5_INTERP_TRICUBIC) {
+        cvms5_print_error("Unknown interpolation.");
+        return FAIL;
+    }
+
+    cvms5_interpolation = interpolation;
+
     return SUCCESS;
-  }
-  return FAIL;
 }
 
-
 /**
- * Reads the cvms5_configuration file describing the various properties of CVM-S5 and populates
- * the cvms5_configuration struct. This assumes cvms5_configuration has been "calloc'ed" and validates
- * that each value is not zero at the end.
+ * Queries CVM-S5 like cvms5_query, and also returns the spatial gradients of Vp and Vs. The
+ * gradients are those of the trilinear interpolation, worked out from the same corners of the
+ * same cell, so they cost no further reads. Gradients are zero where there is no data, within
+ * the GTL and with any other interpolation, and on the bottom plane there is no gradient with
+ * depth.
  *
- * @param file The cvms5_configuration file location on disk to read.
- * @param config The cvms5_configuration struct to which the data should be written.
- * @return Success or failure, depending on if file was read successfully.
- */
-int cvms5_read_configuration(char *file, cvms5_configuration_t *config) {
-    FILE *fp = fopen(file, "r");
+ * @param points The points at which the queries will be made.
+ * @param data The data that will be returned (Vp, Vs, density, Qs, and/or Qp).
+ * @param gradients The gradients that will be returned.
+ * @param numpoints The total number of points to query.
+ * @return SUCCESS or FAIL.
+ */
+int cvms5_query_gradient(cvms5_point_t *points, cvms5_properties_t *data, cvms5_gradient_t *gradients, int numpoints) {
+    return cvms5_query_points(points, data, numpoints, cvms5_query_mode, cvms5_interpolation, gradients, NULL);
+}
+
+/**
+ * Queries CVM-S5 at the given points, with their depths given as depths below the surface or
+ * as elevations above sea level. Elevations are turned into depths against the surface of the
+ * UCVM map, read from its raster where the point falls within it. The whole batch is projected
+ * at once. Without a status array, the points after the first that cannot be projected are left
+ * without data, as UCVM expects; with one, every point is queried and given its own status.
+ *
+ * @param points The points at which the queries will be made.
+ * @param data The data that will be returned (Vp, Vs, density, Qs, and/or Qp).
+ * @param numpoints The total number of points to query.
+ * @param mode CVMS5_COORD_DEPTH or CVMS5_COORD_ELEVATION.
+ * @param interpolation One of the CVMS5_INTERP constants.
+ * @param gradients The gradients of Vp and Vs at the points, or NULL if they are not wanted.
+ * @param status The ucvm_code_t of each point, or NULL if they are not wanted.
+ * @return SUCCESS, or UCVM_CODE_ERROR if a point could not be projected and there is no status array.
+ */
+int cvms5_query_points(cvms5_point_t *points, cvms5_properties_t *data, int numpoints, int mode, int interpolation,
+                       cvms5_gradient_t *gradients, int *status) {
+    int i = 0;
+    int retVal = SUCCESS;
+    double depth = 0;
+
+    cvms5_cell_t *cells = malloc(numpoints * sizeof(cvms5_cell_t));
+    cvms5_cell_t *cell = NULL;
+
+    int window_first = -1, window_last = -1;
+
+    cvms5_project_points(cvms5_geo2utm, cvms5_footprint, points, numpoints, cells);
+
+    for (i = 0; i < numpoints; i++) {
+        cell = &(cells[i]);
+        cell->type = CVMS5_CELL_NONE;
+
+        data[i].vp = -1;
+        data[i].vs = -1;
+        data[i].rho = -1;
+        data[i].qp = -1;
+        data[i].qs = -1;
+
+        if (status != NULL) status[i] = UCVM_CODE_NODATA;
+
+        // if depth is not positive (incorrectly set, or above the surface, then it is a DATAGAP)
+        if (cvms5_get_point_depth(&(points[i]), mode, &depth) != SUCCESS || retVal != SUCCESS) continue;
+        if (depth < 0) {
+            if (status != NULL) status[i] = UCVM_CODE_DATAGAP;
+            continue;
+        }
+
+        // Points outside of the model's footprint were never projected.
+        if (cell->point_x == -HUGE_VAL) continue;
+
+        // Points after one that cannot be projected are left without data, unless each has a status.
+        if (cell->point_x == HUGE_VAL) {
+            if (status != NULL) {
+                status[i] = UCVM_CODE_ERROR;
+            } else {
+                fprintf(stderr, "Error occurred while transforming latitude=%.4f, longitude=%.4f to UTM.\n",
+                        points[i].latitude, points[i].longitude);
+                retVal = UCVM_CODE_ERROR;
+            }
+            continue;
+        }
+
+        // Which cell does that correspond to?
+        cvms5_locate_point(depth, cell);
+
+        if (cell->type == CVMS5_CELL_NONE) continue;
+        if (status != NULL) status[i] = UCVM_CODE_SUCCESS;
+
+        // Note the planes the batch touches so that a streaming window can follow it.
+        if (cvms5_window != NULL && cell->level == 0 && cell->type != CVMS5_CELL_BOTTOM) {
+            int plane_first = cvms5_window->axis == CVMS5_WINDOW_Z ? cell->z - 1 : cell->x;
+            if (window_first < 0 || plane_first < window_first) window_first = plane_first;
+            if (plane_first + 1 > window_last) window_last = plane_first + 1;
+        }
+    }
+
+    cvms5_interpolate_cells(points, cells, data, numpoints, NULL, interpolation, gradients);
+    free(cells);
+
+    // A point within the GTL has no data if the base of the layer below it has none.
+    if (status != NULL)
+        for (i = 0; i < numpoints; i++)
+            if (status[i] == UCVM_CODE_SUCCESS && data[i].vs < 0) status[i] = UCVM_CODE_NODATA;
+
+    if (cvms5_window != NULL && cvms5_window->automatic && window_first >= 0)
+        cvms5_move_window(cvms5_window, window_first, window_last);
+
+    return retVal;
+}
+
+/**
+ * Queries every iteration loaded by cvms5_init_ensemble at the given points. Each point is
+ * projected and located once, and the grid points a batch reads from disk are worked out
+ * once, then every iteration is interpolated at the same cells as set by
+ * cvms5_set_interpolation. The GTL of each iteration is tapered from its own properties at
+ * the base of the layer. Queries are answered from the model's own grid, whatever the query
+ * resolution.
+ *
+ * @param points The points at which the queries will be made.
+ * @param data The data returned, cvms5_ensemble_size properties per point, in iteration order.
+ * @param numpoints The total number of points to query.
+ * @return SUCCESS or FAIL.
+ */
+int cvms5_query_ensemble(cvms5_point_t *points, cvms5_properties_t *data, int numpoints) {
+    cvms5_cell_t *cells = NULL;
+    cvms5_level_t level = cvms5_pyramid[0];
+    cvms5_staging_t staging;
+    cvms5_staging_t *staged = NULL;
+    int retVal = SUCCESS;
+    int file_backed = 0;
+    double depth = 0;
+    int i = 0, m = 0;
+
+    if (cvms5_ensemble == NULL) {
+        cvms5_print_error("No ensemble has been loaded.");
+        return FAIL;
+    }
+
+    cells = malloc(numpoints * sizeof(cvms5_cell_t));
+
+    for (i = 0; i < numpoints; i++) {
+        cells[i].type = CVMS5_CELL_NONE;
+        cells[i].level = 0;
+        for (m = 0; m < cvms5_ensemble_size; m++) {
+            data[i * cvms5_ensemble_size + m].vp = -1;
+            data[i * cvms5_ensemble_size + m].vs = -1;
+            data[i * cvms5_ensemble_size + m].rho = -1;
+            data[i * cvms5_ensemble_size + m].qp = -1;
+            data[i * cvms5_ensemble_size + m].qs = -1;
+        }
+
+        if (cvms5_get_point_depth(&(points[i]), cvms5_query_mode, &depth) != SUCCESS || depth < 0 || retVal != SUCCESS)
+            continue;
+
+        if (cvms5_project_point(cvms5_geo2utm, PJ_DEFAULT_CTX, &(points[i]), &(cells[i])) != SUCCESS) {
+            retVal = UCVM_CODE_ERROR;
+            continue;
+        }
+
+        cvms5_locate_cell(&(cvms5_pyramid[0]), depth, &(cells[i]));
+    }
+
+    for (m = 0; m < cvms5_ensemble_size; m++)
+        if (cvms5_ensemble[m]->vp_status == 1 || cvms5_ensemble[m]->vs_status == 1) file_backed = 1;
+    if (file_backed) cvms5_plan_staging(cells, numpoints, cvms5_interpolation, &staging);
+
+    for (m = 0; m < cvms5_ensemble_size; m++) {
+        level.model = cvms5_ensemble[m];
+
+        staged = NULL;
+        if (cvms5_ensemble[m]->vp_status == 1 || cvms5_ensemble[m]->vs_status == 1) {
+            if (cvms5_fill_staging(cvms5_ensemble[m], &staging) == SUCCESS) staged = &staging;
+        }
+
+        cvms5_interpolate_batch(&level, staged, points, cells, data + m, cvms5_ensemble_size, numpoints, NULL,
+                                cvms5_interpolation, NULL);
+
+        if (file_backed) {
+            free(staging.vp);
+            free(staging.vs);
+            staging.vp = NULL;
+            staging.vs = NULL;
+        }
+    }
+
+    if (file_backed) cvms5_free_staging(&staging);
+    free(cells);
+
+    return retVal;
+}
+
+#ifdef CVMS5_MPI
+/**
+ * Initializes the model like cvms5_init, partitioned between the ranks of a communicator. Each
+ * rank reads only its slab of cells along the model's x axis, plus a halo for interpolation,
+ * so the grid is spread over the ranks' memory rather than copied to each. The call is
+ * collective and fails on every rank if any rank could not read its slab.
+ *
+ * @param dir The directory in which UCVM has been installed.
+ * @param label A unique identifier for the velocity model.
+ * @param comm The communicator the model is shared between.
+ * @return Success or failure, if initialization was successful.
+ */
+int cvms5_mpi_init(const char *dir, const char *label, MPI_Comm comm) {
+    int status = SUCCESS, worst = SUCCESS;
+
+    cvms5_partition = calloc(1, sizeof(cvms5_partition_t));
+    MPI_Comm_rank(comm, &(cvms5_partition->rank));
+    MPI_Comm_size(comm, &(cvms5_partition->ranks));
+    cvms5_mpi_comm = comm;
+
+    if (cvms5_init(dir, label) != SUCCESS) status = FAIL;
+
+    MPI_Allreduce(&status, &worst, 1, MPI_INT, MPI_MAX, comm);
+    if (worst != SUCCESS) {
+        if (status == SUCCESS) {
+            cvms5_finalize();
+        } else {
+            free(cvms5_partition);
+            cvms5_partition = NULL;
+        }
+        return FAIL;
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Queries the model initialized by cvms5_mpi_init. Every rank must call it, with its own
+ * points, which may be none. Each point is projected on the rank that asks for it and sent,
+ * with an all-to-all exchange, to the rank owning its cell, which locates and interpolates
+ * it as set by cvms5_set_interpolation and sends the properties back in a second exchange.
+ * The points' depths are read as set by cvms5_set_query_mode.
+ *
+ * @param points The points at which the queries will be made.
+ * @param data The data that will be returned (Vp, Vs, density, Qs, and/or Qp).
+ * @param numpoints The total number of points this rank queries.
+ * @return SUCCESS or FAIL.
+ */
+int cvms5_mpi_query(cvms5_point_t *points, cvms5_properties_t *data, int numpoints) {
+    int *send_counts = NULL, *send_offsets = NULL, *recv_counts = NULL, *recv_offsets = NULL;
+    int *cursors = NULL, *owners = NULL;
+    cvms5_cell_t *cells = NULL, *send_cells = NULL, *recv_cells = NULL;
+    cvms5_point_t *send_points = NULL, *recv_points = NULL;
+    cvms5_properties_t *send_data = NULL, *recv_data = NULL;
+    MPI_Datatype point_type, cell_type, properties_type;
+    double depth = 0;
+    int retVal = SUCCESS;
+    int ranks = 0, numcells = 0, numrecv = 0, x = 0, i = 0, r = 0;
+
+    if (cvms5_partition == NULL) {
+        cvms5_print_error("The model has not been initialized with cvms5_mpi_init.");
+        return FAIL;
+    }
+
+    ranks = cvms5_partition->ranks;
+    numcells = cvms5_configuration->nx - 1;
+    send_counts = calloc(ranks, sizeof(int));
+    send_offsets = calloc(ranks, sizeof(int));
+    recv_counts = calloc(ranks, sizeof(int));
+    recv_offsets = calloc(ranks, sizeof(int));
+    cursors = calloc(ranks, sizeof(int));
+    owners = malloc((numpoints > 0 ? numpoints : 1) * sizeof(int));
+    cells = malloc((numpoints > 0 ? numpoints : 1) * sizeof(cvms5_cell_t));
+
+    // Projection and the cell's x index are all the asking rank needs to route a point.
+    for (i = 0; i < numpoints; i++) {
+        owners[i] = -1;
+        data[i].vp = data[i].vs = data[i].rho = data[i].qp = data[i].qs = -1;
+
+        if (cvms5_get_point_depth(&(points[i]), cvms5_query_mode, &depth) != SUCCESS || depth < 0 || retVal != SUCCESS)
+            continue;
+
+        // Points after one that cannot be projected are left without data.
+        if (cvms5_project_point(cvms5_geo2utm, PJ_DEFAULT_CTX, &(points[i]), &(cells[i])) != SUCCESS) {
+            retVal = UCVM_CODE_ERROR;
+            continue;
+        }
+
+        x = floor(cells[i].point_x / cvms5_total_width_m * numcells);
+        if (x < 0 || x > numcells - 1) continue;
+
+        cells[i].depth = depth;
+        owners[i] = cvms5_partition_owner(x, ranks, numcells);
+        send_counts[owners[i]]++;
+    }
+
+    MPI_Type_contiguous(sizeof(cvms5_point_t), MPI_BYTE, &point_type);
+    MPI_Type_contiguous(sizeof(cvms5_cell_t), MPI_BYTE, &cell_type);
+    MPI_Type_contiguous(sizeof(cvms5_properties_t), MPI_BYTE, &properties_type);
+    MPI_Type_commit(&point_type);
+    MPI_Type_commit(&cell_type);
+    MPI_Type_commit(&properties_type);
+
+    MPI_Alltoall(send_counts, 1, MPI_INT, recv_counts, 1, MPI_INT, cvms5_mpi_comm);
+    for (r = 1; r < ranks; r++) {
+        send_offsets[r] = send_offsets[r - 1] + send_counts[r - 1];
+        recv_offsets[r] = recv_offsets[r - 1] + recv_counts[r - 1];
+    }
+    numrecv = recv_offsets[ranks - 1] + recv_counts[ranks - 1];
+
+    // Group the points by owner, keeping the order asked within each owner.
+    send_points = malloc((numpoints > 0 ? numpoints : 1) * sizeof(cvms5_point_t));
+    send_cells = malloc((numpoints > 0 ? numpoints : 1) * sizeof(cvms5_cell_t));
+    send_data = malloc((numpoints > 0 ? numpoints : 1) * sizeof(cvms5_properties_t));
+    memcpy(cursors, send_offsets, ranks * sizeof(int));
+    for (i = 0; i < numpoints; i++) {
+        if (owners[i] < 0) continue;
+        send_points[cursors[owners[i]]] = points[i];
+        send_cells[cursors[owners[i]]] = cells[i];
+        cursors[owners[i]]++;
+    }
+
+    recv_points = malloc((numrecv > 0 ? numrecv : 1) * sizeof(cvms5_point_t));
+    recv_cells = malloc((numrecv > 0 ? numrecv : 1) * sizeof(cvms5_cell_t));
+    recv_data = malloc((numrecv > 0 ? numrecv : 1) * sizeof(cvms5_properties_t));
+
+    MPI_Alltoallv(send_points, send_counts, send_offsets, point_type,
+                  recv_points, recv_counts, recv_offsets, point_type, cvms5_mpi_comm);
+    MPI_Alltoallv(send_cells, send_counts, send_offsets, cell_type,
+                  recv_cells, recv_counts, recv_offsets, cell_type, cvms5_mpi_comm);
+
+    // The owning rank holds every grid point the cell reads, so it locates the cell in full.
+    for (i = 0; i < numrecv; i++) {
+        recv_data[i].vp = recv_data[i].vs = recv_data[i].rho = recv_data[i].qp = recv_data[i].qs = -1;
+        recv_cells[i].level = 0;
+        cvms5_locate_cell(&(cvms5_pyramid[0]), recv_cells[i].depth, &(recv_cells[i]));
+    }
+    cvms5_interpolate_cells(recv_points, recv_cells, recv_data, numrecv, NULL, cvms5_interpolation, NULL);
+
+    MPI_Alltoallv(recv_data, recv_counts, recv_offsets, properties_type,
+                  send_data, send_counts, send_offsets, properties_type, cvms5_mpi_comm);
+
+    memcpy(cursors, send_offsets, ranks * sizeof(int));
+    for (i = 0; i < numpoints; i++) {
+        if (owners[i] < 0) continue;
+        data[i] = send_data[cursors[owners[i]]];
+        cursors[owners[i]]++;
+    }
+
+    MPI_Type_free(&point_type);
+    MPI_Type_free(&cell_type);
+    MPI_Type_free(&properties_type);
+    free(send_counts);
+    free(send_offsets);
+    free(recv_counts);
+    free(recv_offsets);
+    free(cursors);
+    free(owners);
+    free(cells);
+    free(send_points);
+    free(send_cells);
+    free(send_data);
+    free(recv_points);
+    free(recv_cells);
+    free(recv_data);
+
+    return retVal;
+}
+#endif
+
+/**
+ * Sets whether the depths of query points are depths below the surface, the default, or
+ * elevations above sea level. Elevation queries need the surface of the UCVM map under every
+ * point, so the map is rasterized over the model's footprint here if the snapshot did not
+ * already hold it, rather than searched in the e-tree point by point. The mode must not be
+ * changed while batches are in the query pipeline.
+ *
+ * @param mode CVMS5_COORD_DEPTH or CVMS5_COORD_ELEVATION.
+ * @return SUCCESS or FAIL.
+ */
+int cvms5_set_query_mode(int mode) {
+    cvms5_vs30_raster_t *raster = NULL;
+
+    if (mode != CVMS5_COORD_DEPTH && mode != CVMS5_COORD_ELEVATION) {
+        cvms5_print_error("Queries can only be made by depth or by elevation.");
+        return FAIL;
+    }
+
+    if (mode == CVMS5_COORD_ELEVATION && cvms5_vs30_raster == NULL) {
+        // The raster is only installed once complete, as cvms5_get_vs30_payload reads from it.
+        raster = calloc(1, sizeof(cvms5_vs30_raster_t));
+        if (cvms5_rasterize_vs30_map(cvms5_vs30_map, raster) == SUCCESS) {
+            cvms5_vs30_raster = raster;
+        } else {
+            fprintf(stderr, "WARNING: Could not rasterize the surface, it will be read from the e-tree.\n");
+            free(raster->payload);
+            free(raster);
+        }
+    }
+
+    cvms5_query_mode = mode;
+
+    return SUCCESS;
+}
+
+/**
+ * Submits a batch of points to the query pipeline and returns straight away. The batch is
+ * answered like cvms5_query, but in stages: one thread projects the points and locates their
+ * cells while a pool of threads reads the cells and interpolates, so when the model is read
+ * from disk the next batch is already being located while the last one waits on its reads.
+ * The callback is called from a pipeline thread once the batch is answered, and batches may
+ * complete out of order. The points and properties must stay valid until then, the callback
+ * may free the batch, and cvms5_query must not be called while batches are in the pipeline.
+ *
+ * @param batch The batch, with its points, properties and number of points set.
+ * @param callback Called once the batch is answered, or NULL.
+ * @return SUCCESS or FAIL if the pipeline could not be started.
+ */
+int cvms5_query_submit(cvms5_batch_t *batch, cvms5_batch_callback_t callback) {
+    if (cvms5_is_initialized == 0) {
+        cvms5_print_error("The model must be initialized before submitting queries.");
+        return FAIL;
+    }
+    if (cvms5_pipeline == NULL && cvms5_start_pipeline() != SUCCESS) return FAIL;
+
+    batch->callback = callback;
+    batch->cells = NULL;
+    batch->status = UCVM_CODE_SUCCESS;
+    batch->next = NULL;
+
+    pthread_mutex_lock(&(cvms5_pipeline->lock));
+    if (cvms5_pipeline->submitted_tail != NULL)
+        cvms5_pipeline->submitted_tail->next = batch;
+    else
+        cvms5_pipeline->submitted_head = batch;
+    cvms5_pipeline->submitted_tail = batch;
+    cvms5_pipeline->outstanding++;
+    pthread_cond_broadcast(&(cvms5_pipeline->changed));
+    pthread_mutex_unlock(&(cvms5_pipeline->lock));
+
+    return SUCCESS;
+}
+
+/**
+ * Waits for every batch submitted to the query pipeline to be answered.
+ *
+ * @return UCVM_CODE_SUCCESS or the first error any of the batches stopped with.
+ */
+int cvms5_query_wait() {
+    int status = UCVM_CODE_SUCCESS;
+
+    if (cvms5_pipeline == NULL) return status;
+
+    pthread_mutex_lock(&(cvms5_pipeline->lock));
+    while (cvms5_pipeline->outstanding > 0)
+        pthread_cond_wait(&(cvms5_pipeline->changed), &(cvms5_pipeline->lock));
+    status = cvms5_pipeline->status;
+    cvms5_pipeline->status = UCVM_CODE_SUCCESS;
+    pthread_mutex_unlock(&(cvms5_pipeline->lock));
+
+    return status;
+}
+
+/**
+ * Starts the query pipeline's threads. PROJ objects must not be shared between threads,
+ * so the locating thread gets its own context and projection.
+ *
+ * @return SUCCESS or FAIL.
+ */
+int cvms5_start_pipeline() {
+    cvms5_pipeline_t *pipeline = calloc(1, sizeof(cvms5_pipeline_t));
+    char cvms5_projstr[64];
+    int i = 0;
+
+    snprintf(cvms5_projstr, 64, "+proj=utm +zone=%d +datum=NAD27 +units=m +no_defs", cvms5_configuration->utm_zone);
+    pipeline->context = proj_context_create();
+    if (!(pipeline->geo2utm = proj_create_crs_to_crs(pipeline->context, "EPSG:4326", cvms5_projstr, NULL))) {
+        cvms5_print_error("Could not set up the query pipeline's projection.");
+        proj_context_destroy(pipeline->context);
+        free(pipeline);
+        return FAIL;
+    }
+
+    pthread_mutex_init(&(pipeline->lock), NULL);
+    pthread_mutex_init(&(pipeline->gtl_lock), NULL);
+    pthread_cond_init(&(pipeline->changed), NULL);
+    pipeline->status = UCVM_CODE_SUCCESS;
+
+    cvms5_pipeline = pipeline;
+
+    pthread_create(&(pipeline->locator), NULL, cvms5_pipeline_locate, pipeline);
+    for (i = 0; i < CVMS5_PIPELINE_READERS; i++)
+        pthread_create(&(pipeline->readers[i]), NULL, cvms5_pipeline_read, pipeline);
+
+    return SUCCESS;
+}
+
+/**
+ * Waits for the batches in the query pipeline and stops its threads.
+ */
+void cvms5_stop_pipeline() {
+    cvms5_pipeline_t *pipeline = cvms5_pipeline;
+    int i = 0;
+
+    if (pipeline == NULL) return;
+
+    cvms5_query_wait();
+
+    pthread_mutex_lock(&(pipeline->lock));
+    pipeline->stopping = 1;
+    pthread_cond_broadcast(&(pipeline->changed));
+    pthread_mutex_unlock(&(pipeline->lock));
+
+    pthread_join(pipeline->locator, NULL);
+    for (i = 0; i < CVMS5_PIPELINE_READERS; i++)
+        pthread_join(pipeline->readers[i], NULL);
+
+    proj_destroy(pipeline->geo2utm);
+    proj_context_destroy(pipeline->context);
+    pthread_mutex_destroy(&(pipeline->lock));
+    pthread_mutex_destroy(&(pipeline->gtl_lock));
+    pthread_cond_destroy(&(pipeline->changed));
+    free(pipeline);
+
+    cvms5_pipeline = NULL;
+}
+
+/**
+ * The first stage of the query pipeline. Projects the points of each submitted batch and
+ * works out their cells, then hands the batch on to the readers.
+ *
+ * @param arg The pipeline.
+ * @return NULL.
+ */
+void *cvms5_pipeline_locate(void *arg) {
+    cvms5_pipeline_t *pipeline = (cvms5_pipeline_t *)arg;
+    cvms5_batch_t *batch = NULL;
+    cvms5_cell_t *cell = NULL;
+    double depth = 0;
+    int i = 0, located = 0;
+
+    while (1) {
+        pthread_mutex_lock(&(pipeline->lock));
+        while (pipeline->submitted_head == NULL && !pipeline->stopping)
+            pthread_cond_wait(&(pipeline->changed), &(pipeline->lock));
+        if (pipeline->submitted_head == NULL) {
+            pthread_mutex_unlock(&(pipeline->lock));
+            return NULL;
+        }
+        batch = pipeline->submitted_head;
+        pipeline->submitted_head = batch->next;
+        if (pipeline->submitted_head == NULL) pipeline->submitted_tail = NULL;
+        pthread_mutex_unlock(&(pipeline->lock));
+
+        batch->cells = malloc(batch->numpoints * sizeof(cvms5_cell_t));
+
+        for (i = 0; i < batch->numpoints; i++) {
+            cell = &(batch->cells[i]);
+            cell->type = CVMS5_CELL_NONE;
+
+            batch->data[i].vp = -1;
+            batch->data[i].vs = -1;
+            batch->data[i].rho = -1;
+            batch->data[i].qp = -1;
+            batch->data[i].qs = -1;
+
+            if (batch->status != UCVM_CODE_SUCCESS) continue;
+
+            // The surface is looked up through the same map as the GTL, which the readers share.
+            if (cvms5_query_mode == CVMS5_COORD_ELEVATION) {
+                pthread_mutex_lock(&(pipeline->gtl_lock));
+                located = cvms5_get_point_depth(&(batch->points[i]), cvms5_query_mode, &depth);
+                pthread_mutex_unlock(&(pipeline->gtl_lock));
+            } else {
+                located = cvms5_get_point_depth(&(batch->points[i]), cvms5_query_mode, &depth);
+            }
+
+            // As in cvms5_query, points with negative depths and the rest of a batch that
+            // could not be projected are left without data.
+            if (located != SUCCESS || depth < 0) continue;
+
+            if (cvms5_project_point(pipeline->geo2utm, pipeline->context, &(batch->points[i]), cell) != SUCCESS) {
+                batch->status = UCVM_CODE_ERROR;
+                continue;
+            }
+
+            cvms5_locate_point(depth, cell);
+        }
+
+        pthread_mutex_lock(&(pipeline->lock));
+        batch->next = NULL;
+        if (pipeline->located_tail != NULL)
+            pipeline->located_tail->next = batch;
+        else
+            pipeline->located_head = batch;
+        pipeline->located_tail = batch;
+        pthread_cond_broadcast(&(pipeline->changed));
+        pthread_mutex_unlock(&(pipeline->lock));
+    }
+}
+
+/**
+ * The second stage of the query pipeline. Reads the cells of each located batch, from
+ * memory or from disk, and interpolates. The readers only exit once the locator has and
+ * every located batch is answered.
+ *
+ * @param arg The pipeline.
+ * @return NULL.
+ */
+void *cvms5_pipeline_read(void *arg) {
+    cvms5_pipeline_t *pipeline = (cvms5_pipeline_t *)arg;
+    cvms5_batch_callback_t callback = NULL;
+    cvms5_batch_t *batch = NULL;
+    int status = UCVM_CODE_SUCCESS;
+
+    while (1) {
+        pthread_mutex_lock(&(pipeline->lock));
+        while (pipeline->located_head == NULL && !(pipeline->stopping && pipeline->outstanding == 0))
+            pthread_cond_wait(&(pipeline->changed), &(pipeline->lock));
+        if (pipeline->located_head == NULL) {
+            pthread_mutex_unlock(&(pipeline->lock));
+            return NULL;
+        }
+        batch = pipeline->located_head;
+        pipeline->located_head = batch->next;
+        if (pipeline->located_head == NULL) pipeline->located_tail = NULL;
+        pthread_mutex_unlock(&(pipeline->lock));
+
+        cvms5_interpolate_cells(batch->points, batch->cells, batch->data, batch->numpoints, &(pipeline->gtl_lock),
+                                cvms5_interpolation, NULL);
+
+        free(batch->cells);
+        batch->cells = NULL;
+
+        // The callback may free the batch, so it is not touched again once the callback is made.
+        status = batch->status;
+        callback = batch->callback;
+
+        pthread_mutex_lock(&(pipeline->lock));
+        if (status != UCVM_CODE_SUCCESS && pipeline->status == UCVM_CODE_SUCCESS)
+            pipeline->status = status;
+        pthread_mutex_unlock(&(pipeline->lock));
+
+        if (callback != NULL) callback(batch, status);
+
+        // Only counted as answered after its callback, so cvms5_query_wait also waits for the callbacks.
+        pthread_mutex_lock(&(pipeline->lock));
+        pipeline->outstanding--;
+        pthread_cond_broadcast(&(pipeline->changed));
+        pthread_mutex_unlock(&(pipeline->lock));
+    }
+}
+
+/**
+ * Extracts a horizontal slice of the model at a fixed depth, sampled on a regular longitude
+ * and latitude raster. The slice is projected a row at a time and interpolated straight from
+ * the grid, without going through cvms5_query point by point. After
+ * cvms5_set_query_mode(CVMS5_COORD_ELEVATION) the slice is at a fixed elevation instead, and
+ * pixels above the surface of the UCVM map have no data.
+ *
+ * @param bbox_lonlat Minimum longitude, minimum latitude, maximum longitude and maximum latitude.
+ * @param depth Depth of the slice, or its elevation above sea level, in meters.
+ * @param nx Number of pixels across.
+ * @param ny Number of pixels down.
+ * @param data The properties at the pixel centres, row by row from the north edge.
+ * @return SUCCESS or UCVM_CODE_ERROR.
+ */
+int cvms5_extract_slice(double *bbox_lonlat, double depth, int nx, int ny, cvms5_properties_t *data) {
+    size_t count = (size_t)nx * ny;
+    cvms5_point_t *points = NULL;
+    cvms5_cell_t *cells = NULL;
+    double *row_x = NULL, *row_y = NULL;
+    double pixel_width = (bbox_lonlat[2] - bbox_lonlat[0]) / nx;
+    double pixel_height = (bbox_lonlat[3] - bbox_lonlat[1]) / ny;
+    double point_depth = 0;
+    size_t n = 0;
+    int i = 0, j = 0, err = 0;
+
+    if (cvms5_is_initialized == 0 || nx < 1 || ny < 1 || (depth < 0 && cvms5_query_mode != CVMS5_COORD_ELEVATION)) {
+        cvms5_print_error("The model must be initialized and the slice must have pixels and a depth.");
+        return UCVM_CODE_ERROR;
+    }
+
+    points = malloc(count * sizeof(cvms5_point_t));
+    cells = malloc(count * sizeof(cvms5_cell_t));
+    row_x = malloc(nx * sizeof(double));
+    row_y = malloc(nx * sizeof(double));
+
+    for (j = 0; j < ny; j++) {
+        for (i = 0; i < nx; i++) {
+            n = (size_t)j * nx + i;
+            points[n].longitude = bbox_lonlat[0] + (i + 0.5) * pixel_width;
+            points[n].latitude = bbox_lonlat[3] - (j + 0.5) * pixel_height;
+            points[n].depth = depth;
+            row_x[i] = points[n].latitude;
+            row_y[i] = points[n].longitude;
+        }
+
+        proj_trans_generic(cvms5_geo2utm, PJ_FWD, row_x, sizeof(double), nx, row_y, sizeof(double), nx,
+                           NULL, 0, 0, NULL, 0, 0);
+        err = proj_context_errno(PJ_DEFAULT_CTX);
+        if (err) {
+            fprintf(stderr, "Error occurred while transforming the slice to UTM.\n");
+            fprintf(stderr, "Proj error: %s\n", proj_context_errno_string(PJ_DEFAULT_CTX, err));
+            free(points);
+            free(cells);
+            free(row_x);
+            free(row_y);
+            return UCVM_CODE_ERROR;
+        }
+
+        for (i = 0; i < nx; i++) {
+            n = (size_t)j * nx + i;
+            data[n].vp = -1;
+            data[n].vs = -1;
+            data[n].rho = -1;
+            data[n].qp = -1;
+            data[n].qs = -1;
+            cvms5_utm_to_model(row_x[i], row_y[i], &(cells[n]));
+            if (cvms5_get_point_depth(&(points[n]), cvms5_query_mode, &point_depth) == SUCCESS && point_depth >= 0)
+                cvms5_locate_point(point_depth, &(cells[n]));
+            else
+                cells[n].type = CVMS5_CELL_NONE;
+        }
+    }
+
+    cvms5_interpolate_cells(points, cells, data, count, NULL, cvms5_interpolation, NULL);
+
+    free(points);
+    free(cells);
+    free(row_x);
+    free(row_y);
+
+    return SUCCESS;
+}
+
+/**
+ * Extracts a vertical cross-section of the model between two surface points. Samples are
+ * spaced evenly along the straight line between the points in UTM and evenly in depth, so
+ * each sample is placed in the model's frame directly and only one point per column is
+ * projected. After cvms5_set_query_mode(CVMS5_COORD_ELEVATION) the rows are at elevations
+ * instead, and samples above the surface of the UCVM map have no data.
+ *
+ * @param start_lonlat Longitude and latitude of the start of the section.
+ * @param end_lonlat Longitude and latitude of the end of the section.
+ * @param zmin Depth of the top row, or its elevation above sea level, in meters.
+ * @param zmax Depth of the bottom row, or its elevation above sea level, in meters.
+ * @param nh Number of samples along the section.
+ * @param nz Number of samples in depth.
+ * @param data The properties at the samples, row by row from the top, each row from the start.
+ * @return SUCCESS or UCVM_CODE_ERROR.
+ */
+int cvms5_extract_cross_section(double *start_lonlat, double *end_lonlat, double zmin, double zmax, int nh, int nz,
+                                cvms5_properties_t *data) {
+    size_t count = (size_t)nh * nz;
+    cvms5_point_t *points = NULL;
+    cvms5_cell_t *cells = NULL;
+    PJ_COORD start, end, xyzSrc, xyzDest;
+    double fraction = 0, easting = 0, northing = 0, point_depth = 0;
+    int elevation = cvms5_query_mode == CVMS5_COORD_ELEVATION;
+    size_t n = 0;
+    int i = 0, k = 0, err = 0;
+
+    if (cvms5_is_initialized == 0 || nh < 1 || nz < 1 || (elevation ? zmax > zmin : zmin < 0 || zmax < zmin)) {
+        cvms5_print_error("The model must be initialized and the section must have samples and depths.");
+        return UCVM_CODE_ERROR;
+    }
+
+    start = proj_trans(cvms5_geo2utm, PJ_FWD, proj_coord(start_lonlat[1], start_lonlat[0], 0.0, HUGE_VAL));
+    end = proj_trans(cvms5_geo2utm, PJ_FWD, proj_coord(end_lonlat[1], end_lonlat[0], 0.0, HUGE_VAL));
+    err = proj_context_errno(PJ_DEFAULT_CTX);
+    if (err) {
+        fprintf(stderr, "Error occurred while transforming the section to UTM.\n");
+        fprintf(stderr, "Proj error: %s\n", proj_context_errno_string(PJ_DEFAULT_CTX, err));
+        return UCVM_CODE_ERROR;
+    }
+
+    points = malloc(count * sizeof(cvms5_point_t));
+    cells = malloc(count * sizeof(cvms5_cell_t));
+
+    for (i = 0; i < nh; i++) {
+        fraction = nh > 1 ? (double)i / (nh - 1) : 0;
+        easting = start.xyzt.x + fraction * (end.xyzt.x - start.xyzt.x);
+        northing = start.xyzt.y + fraction * (end.xyzt.y - start.xyzt.y);
+
+        // The geographic position is needed by the GTL and for elevations.
+        xyzSrc = proj_coord(easting, northing, 0.0, HUGE_VAL);
+        xyzDest = proj_trans(cvms5_geo2utm, PJ_INV, xyzSrc);
+
+        for (k = 0; k < nz; k++) {
+            n = (size_t)k * nh + i;
+            points[n].latitude = xyzDest.xyzt.x;
+            points[n].longitude = xyzDest.xyzt.y;
+            points[n].depth = zmin + (nz > 1 ? (zmax - zmin) * k / (nz - 1) : 0);
+
+            data[n].vp = -1;
+            data[n].vs = -1;
+            data[n].rho = -1;
+            data[n].qp = -1;
+            data[n].qs = -1;
+            cvms5_utm_to_model(easting, northing, &(cells[n]));
+            if (cvms5_get_point_depth(&(points[n]), cvms5_query_mode, &point_depth) == SUCCESS && point_depth >= 0)
+                cvms5_locate_point(point_depth, &(cells[n]));
+            else
+                cells[n].type = CVMS5_CELL_NONE;
+        }
+    }
+
+    cvms5_interpolate_cells(points, cells, data, count, NULL, cvms5_interpolation, NULL);
+
+    free(points);
+    free(cells);
+
+    return SUCCESS;
+}
+
+/**
+ * Projects a query point to UTM and rotates it into the model's frame, measured from the
+ * model's bottom-left corner.
+ *
+ * @param geo2utm The projection from geographic coordinates to UTM.
+ * @param context The PROJ context the projection was created in.
+ * @param point The query point.
+ * @param cell The cell, of which the point's position along the model's x and y axes is set.
+ * @return SUCCESS or UCVM_CODE_ERROR if the point could not be projected.
+ */
+int cvms5_project_point(PJ *geo2utm, PJ_CONTEXT *context, cvms5_point_t *point, cvms5_cell_t *cell) {
+    PJ_COORD xyzSrc = proj_coord(point->latitude, point->longitude, 0.0, HUGE_VAL);
+    PJ_COORD xyzDest = proj_trans(geo2utm, PJ_FWD, xyzSrc);
+    int err = proj_context_errno(context);
+    if (err) {
+        fprintf(stderr, "Error occurred while transforming latitude=%.4f, longitude=%.4f to UTM.\n",
+                            point->latitude, point->longitude);
+        fprintf(stderr, "Proj error: %s\n", proj_context_errno_string(context, err));
+        return UCVM_CODE_ERROR;
+    }
+
+    cvms5_utm_to_model(xyzDest.xyzt.x, xyzDest.xyzt.y, cell);
+
+    return SUCCESS;
+}
+
+/**
+ * Bounds the model's footprint in longitude and latitude. The model's edges are straight in UTM
+ * but not quite in longitude and latitude, so the footprint is traced along them and each edge
+ * is pushed out past every traced point, then padded by CVMS5_FOOTPRINT_MARGIN. A point outside
+ * of the bound can never fall within the model.
+ *
+ * @param footprint The footprint to fill in.
+ * @return SUCCESS or FAIL if the model's edges could not be projected.
+ */
+int cvms5_set_footprint(cvms5_footprint_t *footprint) {
+    double corner_e[4], corner_n[4];
+    double longitude[4 * CVMS5_FOOTPRINT_STEPS], latitude[4 * CVMS5_FOOTPRINT_STEPS];
+    double point_e = 0, point_n = 0, length = 0, center_longitude = 0, center_latitude = 0, projection = 0;
+    int edge = 0, step = 0, count = 0, i = 0;
+
+    // Walk around the box: bottom left, top left, top right, bottom right.
+    corner_e[0] = cvms5_configuration->bottom_left_corner_e;  corner_n[0] = cvms5_configuration->bottom_left_corner_n;
+    corner_e[1] = cvms5_configuration->top_left_corner_e;     corner_n[1] = cvms5_configuration->top_left_corner_n;
+    corner_e[2] = cvms5_configuration->top_right_corner_e;    corner_n[2] = cvms5_configuration->top_right_corner_n;
+    corner_e[3] = cvms5_configuration->bottom_right_corner_e; corner_n[3] = cvms5_configuration->bottom_right_corner_n;
+
+    for (edge = 0; edge < 4; edge++) {
+        for (step = 0; step < CVMS5_FOOTPRINT_STEPS; step++) {
+            point_e = corner_e[edge] + (corner_e[(edge + 1) % 4] - corner_e[edge]) * step / CVMS5_FOOTPRINT_STEPS;
+            point_n = corner_n[edge] + (corner_n[(edge + 1) % 4] - corner_n[edge]) * step / CVMS5_FOOTPRINT_STEPS;
+
+            PJ_COORD xyzSrc = proj_coord(point_e, point_n, 0.0, HUGE_VAL);
+            PJ_COORD xyzDest = proj_trans(cvms5_geo2utm, PJ_INV, xyzSrc);
+            if (xyzDest.xyzt.x == HUGE_VAL || xyzDest.xyzt.y == HUGE_VAL) {
+                proj_errno_reset(cvms5_geo2utm);
+                return FAIL;
+            }
+
+            latitude[count] = xyzDest.xyzt.x;
+            longitude[count] = xyzDest.xyzt.y;
+            center_latitude += latitude[count] / (4 * CVMS5_FOOTPRINT_STEPS);
+            center_longitude += longitude[count] / (4 * CVMS5_FOOTPRINT_STEPS);
+            count++;
+        }
+    }
+
+    footprint->min_longitude = footprint->max_longitude = longitude[0];
+    footprint->min_latitude = footprint->max_latitude = latitude[0];
+    for (i = 1; i < count; i++) {
+        if (longitude[i] < footprint->min_longitude) footprint->min_longitude = longitude[i];
+        if (longitude[i] > footprint->max_longitude) footprint->max_longitude = longitude[i];
+        if (latitude[i] < footprint->min_latitude) footprint->min_latitude = latitude[i];
+        if (latitude[i] > footprint->max_latitude) footprint->max_latitude = latitude[i];
+    }
+    footprint->min_longitude -= CVMS5_FOOTPRINT_MARGIN;
+    footprint->max_longitude += CVMS5_FOOTPRINT_MARGIN;
+    footprint->min_latitude -= CVMS5_FOOTPRINT_MARGIN;
+    footprint->max_latitude += CVMS5_FOOTPRINT_MARGIN;
+
+    for (edge = 0; edge < 4; edge++) {
+        // The normal of the line between the edge's corners, turned to face away from the center.
+        footprint->normal_longitude[edge] = -(latitude[((edge + 1) % 4) * CVMS5_FOOTPRINT_STEPS] - latitude[edge * CVMS5_FOOTPRINT_STEPS]);
+        footprint->normal_latitude[edge] = longitude[((edge + 1) % 4) * CVMS5_FOOTPRINT_STEPS] - longitude[edge * CVMS5_FOOTPRINT_STEPS];
+        length = sqrt(footprint->normal_longitude[edge] * footprint->normal_longitude[edge] +
+                      footprint->normal_latitude[edge] * footprint->normal_latitude[edge]);
+        if (length == 0) return FAIL;
+        footprint->normal_longitude[edge] /= length;
+        footprint->normal_latitude[edge] /= length;
+        if (footprint->normal_longitude[edge] * (longitude[edge * CVMS5_FOOTPRINT_STEPS] - center_longitude) +
+            footprint->normal_latitude[edge] * (latitude[edge * CVMS5_FOOTPRINT_STEPS] - center_latitude) < 0) {
+            footprint->normal_longitude[edge] = -footprint->normal_longitude[edge];
+            footprint->normal_latitude[edge] = -footprint->normal_latitude[edge];
+        }
+
+        footprint->offset[edge] = -HUGE_VAL;
+        for (i = 0; i < count; i++) {
+            projection = footprint->normal_longitude[edge] * longitude[i] + footprint->normal_latitude[edge] * latitude[i];
+            if (projection > footprint->offset[edge]) footprint->offset[edge] = projection;
+        }
+        footprint->offset[edge] += CVMS5_FOOTPRINT_MARGIN;
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Checks a point against the bound on the model's footprint. Longitudes outside of -180 to 180
+ * degrees are left for PROJ to wrap.
+ *
+ * @param footprint The footprint.
+ * @param longitude The point's longitude.
+ * @param latitude The point's latitude.
+ * @return 1 if the point may fall within the model, 0 if it cannot.
+ */
+int cvms5_footprint_contains(cvms5_footprint_t *footprint, double longitude, double latitude) {
+    int edge = 0;
+
+    if (longitude < -180 || longitude > 180) return 1;
+    if (longitude < footprint->min_longitude || longitude > footprint->max_longitude ||
+        latitude < footprint->min_latitude || latitude > footprint->max_latitude) return 0;
+
+    for (edge = 0; edge < 4; edge++)
+        if (footprint->normal_longitude[edge] * longitude + footprint->normal_latitude[edge] * latitude > footprint->offset[edge])
+            return 0;
+
+    return 1;
+}
+
+/**
+ * Projects a batch of query points to UTM in one call and rotates them into the model's frame,
+ * rather than checking PROJ's error state after every point. Points that could not be projected
+ * are marked with a point_x of HUGE_VAL, as PROJ marks them. Points outside of the footprint are
+ * not projected at all and are marked with a point_x of -HUGE_VAL.
+ *
+ * @param geo2utm The projection from geographic coordinates to UTM.
+ * @param footprint The bound on the model's footprint, or NULL to project every point.
+ * @param points The query points.
+ * @param numpoints Number of points.
+ * @param cells The cells, of which each point's position along the model's x and y axes is set.
+ */
+void cvms5_project_points(PJ *geo2utm, cvms5_footprint_t *footprint, cvms5_point_t *points, int numpoints,
+                          cvms5_cell_t *cells) {
+    PJ_COORD *coords = malloc((numpoints > 0 ? numpoints : 1) * sizeof(PJ_COORD));
+    int *index = malloc((numpoints > 0 ? numpoints : 1) * sizeof(int));
+    int i = 0, count = 0;
+
+    for (i = 0; i < numpoints; i++) {
+        if (footprint != NULL && !cvms5_footprint_contains(footprint, points[i].longitude, points[i].latitude)) {
+            cells[i].point_x = cells[i].point_y = -HUGE_VAL;
+            continue;
+        }
+        index[count] = i;
+        coords[count++] = proj_coord(points[i].latitude, points[i].longitude, 0.0, HUGE_VAL);
+    }
+
+#if PROJ_VERSION_MAJOR > 9 || (PROJ_VERSION_MAJOR == 9 && PROJ_VERSION_MINOR >= 1)
+    // Failures are left in the projection's error state, which later point by point calls check.
+    if (proj_trans_array(geo2utm, PJ_FWD, count, coords) != 0) proj_errno_reset(geo2utm);
+#else
+    // Before PROJ 9.1, proj_trans_array stops at the first point it cannot project and leaves
+    // the rest as they were, so each point is projected on its own.
+    for (i = 0; i < count; i++) {
+        coords[i] = proj_trans(geo2utm, PJ_FWD, coords[i]);
+        if (proj_errno(geo2utm) != 0) {
+            coords[i].xyzt.x = coords[i].xyzt.y = HUGE_VAL;
+            proj_errno_reset(geo2utm);
+        }
+    }
+#endif
+
+    for (i = 0; i < count; i++) {
+        if (coords[i].xyzt.x == HUGE_VAL || coords[i].xyzt.y == HUGE_VAL)
+            cells[index[i]].point_x = cells[index[i]].point_y = HUGE_VAL;
+        else
+            cvms5_utm_to_model(coords[i].xyzt.x, coords[i].xyzt.y, &(cells[index[i]]));
+    }
+
+    free(coords);
+    free(index);
+}
+
+/**
+ * Rotates a point in UTM into the model's frame, measured from the model's bottom-left corner.
+ *
+ * @param easting The point's easting.
+ * @param northing The point's northing.
+ * @param cell The cell, of which the point's position along the model's x and y axes is set.
+ */
+void cvms5_utm_to_model(double easting, double northing, cvms5_cell_t *cell) {
+    // Point within rectangle.
+    double point_u = easting - cvms5_configuration->bottom_left_corner_e;
+    double point_v = northing - cvms5_configuration->bottom_left_corner_n;
+
+    // We need to rotate that point, the number of degrees we calculated above.
+    cell->point_x = cvms5_cos_rotation_angle * point_u - cvms5_sin_rotation_angle * point_v;
+    cell->point_y = cvms5_sin_rotation_angle * point_u + cvms5_cos_rotation_angle * point_v;
+}
+
+/**
+ * Works out which cell a projected point falls in at the pyramid level queries are answered
+ * from. Cells at the edge of a coarser level may still lie within the model itself, so those
+ * points are located in the model instead.
+ *
+ * @param depth The depth of the point, in meters.
+ * @param cell The cell, with the point's position along the model's x and y axes set.
+ */
+void cvms5_locate_point(double depth, cvms5_cell_t *cell) {
+    cell->level = cvms5_query_level;
+    cvms5_locate_cell(&(cvms5_pyramid[cell->level]), depth, cell);
+
+    if (cell->type == CVMS5_CELL_NONE && cell->level != 0) {
+        cell->level = 0;
+        cvms5_locate_cell(&(cvms5_pyramid[0]), depth, cell);
+    }
+}
+
+/**
+ * Works out which cell of a level a projected point falls in, how far across the cell it
+ * lies and how the cell is to be interpolated. Levels are laid out like the model, with each
+ * grid point a factor of the model's spacing apart and the top plane at the surface.
+ *
+ * @param level The level of the model pyramid.
+ * @param depth The depth of the point, in meters.
+ * @param cell The cell, with the point's position along the model's x and y axes set.
+ */
+void cvms5_locate_cell(cvms5_level_t *level, double depth, cvms5_cell_t *cell) {
+    double x_spacing = cvms5_total_width_m / (cvms5_configuration->nx - 1) * level->factor;
+    double y_spacing = cvms5_total_height_m / (cvms5_configuration->ny - 1) * level->factor;
+    double z_spacing = cvms5_configuration->depth_interval * level->factor;
+    double x_position = cell->point_x / x_spacing;
+    double y_position = cell->point_y / y_spacing;
+    double z_position = depth / z_spacing;
+
+    cell->type = CVMS5_CELL_NONE;
+    cell->depth = depth;
+
+    // Which point base point does that correspond to?
+    cell->x = floor(x_position);
+    cell->y = floor(y_position);
+
+    // And on the Z-axis?
+    cell->z = level->top_plane - floor(z_position);
+
+    // Get the X, Y and Z percentages for the bilinear or trilinear interpolation. They are taken
+    // from the same positions as the cell, so a point on a grid line that rounds into the cell
+    // below is not given a percentage of the whole cell.
+    cell->x_percent = x_position - floor(x_position);
+    cell->y_percent = y_position - floor(y_position);
+    cell->z_percent = z_position - floor(z_position);
+
+    if (cell->z == 0 && cell->z_percent == 0) {
+        if (cvms5_cell_in_block(level->model, cell->x, cell->y, cell->z, cell->z))
+            cell->type = CVMS5_CELL_BOTTOM;
+        return;
+    }
+
+    // Are we outside the model's X and Y boundaries?
+    if (cell->x > level->nx - 2 || cell->y > level->ny - 2 || cell->x < 0 || cell->y < 0 || cell->z < 1)
+        return;
+
+    // Are we outside the block of the grid held for the region of interest?
+    if (!cvms5_cell_in_block(level->model, cell->x, cell->y, cell->z, cell->z - 1))
+        return;
+
+    // Check to see if we're in the GTL layer and we actually want the GTL.
+    if (depth < cvms5_configuration->depth_interval && cvms5_configuration->gtl == 1)
+        cell->type = CVMS5_CELL_GTL;
+    else
+        cell->type = CVMS5_CELL_VOLUME;
+}
+
+/**
+ * Interpolates the material properties of a batch of located cells. When any of the model's
+ * grids is read from disk, the grid points the whole batch needs are gathered first and read
+ * in a few large sorted reads, rather than one small read per corner in query order.
+ *
+ * @param points The query points.
+ * @param cells The cells the points fall in.
+ * @param data The material properties at the points.
+ * @param numpoints Number of points.
+ * @param gtl_lock Held around GTL lookups when called from several threads, or NULL.
+ * @param interpolation One of the CVMS5_INTERP constants.
+ * @param gradients The gradients of Vp and Vs at the points, or NULL.
+ */
+void cvms5_interpolate_cells(cvms5_point_t *points, cvms5_cell_t *cells, cvms5_properties_t *data, int numpoints,
+                             pthread_mutex_t *gtl_lock, int interpolation, cvms5_gradient_t *gradients) {
+    cvms5_staging_t staging;
+    cvms5_staging_t *staged = NULL;
+
+    if (cvms5_velocity_model->vp_status == 1 || cvms5_velocity_model->vs_status == 1) {
+        cvms5_plan_staging(cells, numpoints, interpolation, &staging);
+        if (cvms5_fill_staging(cvms5_velocity_model, &staging) == SUCCESS) staged = &staging;
+    }
+
+    cvms5_interpolate_batch(cvms5_pyramid, staged, points, cells, data, 1, numpoints, gtl_lock, interpolation, gradients);
+
+    if (cvms5_velocity_model->vp_status == 1 || cvms5_velocity_model->vs_status == 1)
+        cvms5_free_staging(&staging);
+}
+
+/**
+ * Interpolates a batch of located cells with one of the kernels. The nearest, tricubic and,
+ * unless gradients are wanted, trilinear kernels run over the whole batch, and the GTL, the
+ * bottom plane and every cell when working out gradients are then done cell by cell.
+ *
+ * @param levels The levels of the model pyramid, indexed by the cells' levels.
+ * @param staging The model's grid points read ahead for the batch, or NULL.
+ * @param points The query points.
+ * @param cells The cells the points fall in.
+ * @param data The material properties at the points.
+ * @param stride Number of properties from one point's to the next in data.
+ * @param numpoints Number of points.
+ * @param gtl_lock Held around GTL lookups when called from several threads, or NULL.
+ * @param interpolation One of the CVMS5_INTERP constants.
+ * @param gradients The gradients of Vp and Vs at the points, or NULL.
+ */
+void cvms5_interpolate_batch(cvms5_level_t *levels, cvms5_staging_t *staging, cvms5_point_t *points, cvms5_cell_t *cells,
+                             cvms5_properties_t *data, int stride, int numpoints, pthread_mutex_t *gtl_lock,
+                             int interpolation, cvms5_gradient_t *gradients) {
+    int i = 0;
+
+    if (interpolation == CVMS5_INTERP_NEAREST)
+        cvms5_interpolate_nearest(levels, staging, cells, data, stride, numpoints);
+    else if (interpolation == CVMS5_INTERP_TRICUBIC)
+        cvms5_interpolate_tricubic(levels, staging, cells, data, stride, numpoints);
+    else if (gradients == NULL)
+        cvms5_interpolate_trilinear(levels, staging, cells, data, stride, numpoints);
+
+    for (i = 0; i < numpoints; i++) {
+        if (gradients != NULL) memset(&(gradients[i]), 0, sizeof(cvms5_gradient_t));
+
+        if (cells[i].type == CVMS5_CELL_NONE) continue;
+        if (interpolation != CVMS5_INTERP_TRILINEAR && cells[i].type != CVMS5_CELL_GTL) continue;
+        if (gradients == NULL && cells[i].type == CVMS5_CELL_VOLUME) continue;
+
+        if (cells[i].type == CVMS5_CELL_GTL && gtl_lock != NULL) {
+            pthread_mutex_lock(gtl_lock);
+            cvms5_interpolate_cell(&(levels[cells[i].level]), staging, &(points[i]), &(cells[i]), &(data[i * stride]),
+                                   gradients != NULL ? &(gradients[i]) : NULL);
+            pthread_mutex_unlock(gtl_lock);
+        } else {
+            cvms5_interpolate_cell(&(levels[cells[i].level]), staging, &(points[i]), &(cells[i]), &(data[i * stride]),
+                                   gradients != NULL ? &(gradients[i]) : NULL);
+        }
+    }
+}
+
+/**
+ * Takes the material properties of a batch of cells from the grid point nearest each query
+ * point, one read per point and no weighting. Cells without data and within the GTL are left.
+ *
+ * @param levels The levels of the model pyramid, indexed by the cells' levels.
+ * @param staging The model's grid points read ahead for the batch, or NULL.
+ * @param cells The cells the points fall in.
+ * @param data The material properties at the points.
+ * @param stride Number of properties from one point's to the next in data.
+ * @param numpoints Number of points.
+ */
+void cvms5_interpolate_nearest(cvms5_level_t *levels, cvms5_staging_t *staging, cvms5_cell_t *cells,
+                               cvms5_properties_t *data, int stride, int numpoints) {
+    cvms5_cell_t *cell = NULL;
+    int i = 0;
+
+    for (i = 0; i < numpoints; i++) {
+        cell = &(cells[i]);
+        if (cell->type != CVMS5_CELL_VOLUME && cell->type != CVMS5_CELL_BOTTOM) continue;
+
+        cvms5_read_corner(&(levels[cell->level]), staging, cell->x + (cell->x_percent >= 0.5),
+                          cell->y + (cell->y_percent >= 0.5), cell->z - (cell->z_percent >= 0.5), &(data[i * stride]));
+        cvms5_derive_properties(&(data[i * stride]));
+    }
+}
+
+/**
+ * Interpolates the material properties of a batch of cells with Catmull-Rom cubics through
+ * the 4 x 4 x 4 grid points around each cell, one axis at a time. Grid points beyond the
+ * edges of the grid held are taken from the edge. Cells without data and within the GTL are
+ * left.
+ *
+ * @param levels The levels of the model pyramid, indexed by the cells' levels.
+ * @param staging The model's grid points read ahead for the batch, or NULL.
+ * @param cells The cells the points fall in.
+ * @param data The material properties at the points.
+ * @param stride Number of properties from one point's to the next in data.
+ * @param numpoints Number of points.
+ */
+void cvms5_interpolate_tricubic(cvms5_level_t *levels, cvms5_staging_t *staging, cvms5_cell_t *cells,
+                                cvms5_properties_t *data, int stride, int numpoints) {
+    double vp[64 * CVMS5_KERNEL_CHUNK], vs[64 * CVMS5_KERNEL_CHUNK];
+    double wx[4 * CVMS5_KERNEL_CHUNK], wy[4 * CVMS5_KERNEL_CHUNK], wz[4 * CVMS5_KERNEL_CHUNK];
+    double vp_values[CVMS5_KERNEL_CHUNK], vs_values[CVMS5_KERNEL_CHUNK], weights[4];
+    int chunk[CVMS5_KERNEL_CHUNK];
+    cvms5_properties_t corner;
+    cvms5_level_t *level = NULL;
+    cvms5_model_t *model = NULL;
+    cvms5_cell_t *cell = NULL;
+    int i = 0, j = 0, k = 0, count = 0, dx = 0, dy = 0, dz = 0;
+
+    // Lanes past the end of the last chunk are blended too, so they must hold numbers.
+    memset(vp, 0, sizeof(vp));
+    memset(vs, 0, sizeof(vs));
+    memset(wx, 0, sizeof(wx));
+    memset(wy, 0, sizeof(wy));
+    memset(wz, 0, sizeof(wz));
+
+    for (i = 0; i <= numpoints; i++) {
+        if (count == CVMS5_KERNEL_CHUNK || (i == numpoints && count > 0)) {
+            cvms5_kernels->tricubic(vp, wx, wy, wz, vp_values);
+            cvms5_kernels->tricubic(vs, wx, wy, wz, vs_values);
+            for (j = 0; j < count; j++) {
+                data[chunk[j] * stride].vp = vp_values[j];
+                data[chunk[j] * stride].vs = vs_values[j];
+                cvms5_derive_properties(&(data[chunk[j] * stride]));
+            }
+            count = 0;
+        }
+        if (i == numpoints) break;
+
+        cell = &(cells[i]);
+        if (cell->type != CVMS5_CELL_VOLUME && cell->type != CVMS5_CELL_BOTTOM) continue;
+
+        level = &(levels[cell->level]);
+        model = level->model;
+
+        // Gather, with depth running down from the plane above the cell's top plane.
+        for (dz = 0; dz < 4; dz++)
+            for (dx = 0; dx < 4; dx++)
+                for (dy = 0; dy < 4; dy++) {
+                    cvms5_read_corner(level, staging,
+                                      cvms5_clamp_index(cell->x + dx - 1, model->block_x, model->block_nx),
+                                      cvms5_clamp_index(cell->y + dy - 1, model->block_y, model->block_ny),
+                                      cvms5_clamp_index(cell->z - dz + 1, model->block_z, model->block_nz), &corner);
+                    vp[(dz * 16 + dx * 4 + dy) * CVMS5_KERNEL_CHUNK + count] = corner.vp;
+                    vs[(dz * 16 + dx * 4 + dy) * CVMS5_KERNEL_CHUNK + count] = corner.vs;
+                }
+
+        cvms5_cubic_weights(cell->x_percent, weights);
+        for (k = 0; k < 4; k++) wx[k * CVMS5_KERNEL_CHUNK + count] = weights[k];
+        cvms5_cubic_weights(cell->y_percent, weights);
+        for (k = 0; k < 4; k++) wy[k * CVMS5_KERNEL_CHUNK + count] = weights[k];
+        cvms5_cubic_weights(cell->z_percent, weights);
+        for (k = 0; k < 4; k++) wz[k * CVMS5_KERNEL_CHUNK + count] = weights[k];
+
+        chunk[count++] = i;
+    }
+}
+
+/**
+ * Interpolates the material properties of a batch of cells trilinearly between their 8
+ * corners, a chunk of cells at a time. Only cells within the volume are interpolated here,
+ * the others are left for cvms5_interpolate_cell.
+ *
+ * @param levels The levels of the model pyramid, indexed by the cells' levels.
+ * @param staging The model's grid points read ahead for the batch, or NULL.
+ * @param cells The cells the points fall in.
+ * @param data The material properties at the points.
+ * @param stride Number of properties from one point's to the next in data.
+ * @param numpoints Number of points.
+ */
+void cvms5_interpolate_trilinear(cvms5_level_t *levels, cvms5_staging_t *staging, cvms5_cell_t *cells,
+                                 cvms5_properties_t *data, int stride, int numpoints) {
+    double vp[8 * CVMS5_KERNEL_CHUNK], vs[8 * CVMS5_KERNEL_CHUNK];
+    double x_percent[CVMS5_KERNEL_CHUNK], y_percent[CVMS5_KERNEL_CHUNK], z_percent[CVMS5_KERNEL_CHUNK];
+    double vp_values[CVMS5_KERNEL_CHUNK], vs_values[CVMS5_KERNEL_CHUNK];
+    int chunk[CVMS5_KERNEL_CHUNK];
+    cvms5_properties_t corner;
+    cvms5_level_t *level = NULL;
+    cvms5_cell_t *cell = NULL;
+    int i = 0, j = 0, k = 0, count = 0;
+
+    // Lanes past the end of the last chunk are blended too, so they must hold numbers.
+    memset(vp, 0, sizeof(vp));
+    memset(vs, 0, sizeof(vs));
+    memset(x_percent, 0, sizeof(x_percent));
+    memset(y_percent, 0, sizeof(y_percent));
+    memset(z_percent, 0, sizeof(z_percent));
+
+    for (i = 0; i <= numpoints; i++) {
+        if (count == CVMS5_KERNEL_CHUNK || (i == numpoints && count > 0)) {
+            cvms5_kernels->trilinear(vp, x_percent, y_percent, z_percent, vp_values);
+            cvms5_kernels->trilinear(vs, x_percent, y_percent, z_percent, vs_values);
+            for (j = 0; j < count; j++) {
+                data[chunk[j] * stride].vp = vp_values[j];
+                data[chunk[j] * stride].vs = vs_values[j];
+                cvms5_derive_properties(&(data[chunk[j] * stride]));
+            }
+            count = 0;
+        }
+        if (i == numpoints) break;
+
+        cell = &(cells[i]);
+        if (cell->type != CVMS5_CELL_VOLUME) continue;
+
+        level = &(levels[cell->level]);
+
+        // The corners in the order cvms5_trilinear_interpolation takes them.
+        for (k = 0; k < 8; k++) {
+            cvms5_read_corner(level, staging, cell->x + (k & 1), cell->y + ((k >> 1) & 1), cell->z - (k >> 2), &corner);
+            vp[k * CVMS5_KERNEL_CHUNK + count] = corner.vp;
+            vs[k * CVMS5_KERNEL_CHUNK + count] = corner.vs;
+        }
+        x_percent[count] = cell->x_percent;
+        y_percent[count] = cell->y_percent;
+        z_percent[count] = cell->z_percent;
+
+        chunk[count++] = i;
+    }
+}
+
+/**
+ * Works out the Catmull-Rom weights of the four grid points around a fraction of a cell: the
+ * one before the cell, the cell's two and the one after it.
+ *
+ * @param t How far across the cell, from 0 to 1.
+ * @param weights The four weights.
+ */
+void cvms5_cubic_weights(double t, double *weights) {
+    double t2 = t * t, t3 = t2 * t;
+
+    weights[0] = 0.5 * (-t3 + 2 * t2 - t);
+    weights[1] = 0.5 * (3 * t3 - 5 * t2 + 2);
+    weights[2] = 0.5 * (-3 * t3 + 4 * t2 + t);
+    weights[3] = 0.5 * (t3 - t2);
+}
+
+/**
+ * Keeps a grid index within a block of the grid.
+ *
+ * @param index The index.
+ * @param first The first index of the block.
+ * @param count The number of indices in the block.
+ * @return The index, or the nearest one in the block.
+ */
+int cvms5_clamp_index(int index, int first, int count) {
+    if (index < first) return first;
+    if (index > first + count - 1) return first + count - 1;
+    return index;
+}
+
+/**
+ * Blends the 8 corners of a chunk of cells trilinearly, each cell a lane, in the same order of
+ * operations as cvms5_trilinear_interpolation so that every instruction set gives the same
+ * values. Inlined into each instruction set's kernel, and vectorized for it.
+ *
+ * @param corners The corners, in the order cvms5_trilinear_interpolation takes them, each a chunk of lanes.
+ * @param x_percent X percentage across each cell.
+ * @param y_percent Y percentage across each cell.
+ * @param z_percent Z percentage down each cell.
+ * @param values The blended value of each cell.
+ */
+static inline __attribute__((always_inline)) void cvms5_trilinear_lanes(const double *restrict corners,
+        const double *restrict x_percent, const double *restrict y_percent, const double *restrict z_percent,
+        double *restrict values) {
+    const double *c = corners;
+    double top = 0, bottom = 0;
+    int i = 0;
+
+    for (i = 0; i < CVMS5_KERNEL_CHUNK; i++) {
+        top = (1 - y_percent[i]) * ((1 - x_percent[i]) * c[i] + x_percent[i] * c[CVMS5_KERNEL_CHUNK + i]) +
+              y_percent[i] * ((1 - x_percent[i]) * c[2 * CVMS5_KERNEL_CHUNK + i] + x_percent[i] * c[3 * CVMS5_KERNEL_CHUNK + i]);
+        bottom = (1 - y_percent[i]) * ((1 - x_percent[i]) * c[4 * CVMS5_KERNEL_CHUNK + i] + x_percent[i] * c[5 * CVMS5_KERNEL_CHUNK + i]) +
+                 y_percent[i] * ((1 - x_percent[i]) * c[6 * CVMS5_KERNEL_CHUNK + i] + x_percent[i] * c[7 * CVMS5_KERNEL_CHUNK + i]);
+        values[i] = (1 - z_percent[i]) * top + z_percent[i] * bottom;
+    }
+}
+
+/**
+ * Collapses the 4 x 4 x 4 grid points around a chunk of cells with their cubic weights, each
+ * cell a lane, depth first, then x, then y, in the same order of operations as for a single
+ * cell. Inlined into each instruction set's kernel, and vectorized for it.
+ *
+ * @param points The grid points, laid out depth, x, y as cvms5_interpolate_tricubic gathers them, each a chunk of lanes.
+ * @param wx The four weights along x of each cell.
+ * @param wy The four weights along y of each cell.
+ * @param wz The four weights along z of each cell.
+ * @param values The collapsed value of each cell.
+ */
+static inline __attribute__((always_inline)) void cvms5_tricubic_lanes(const double *restrict points,
+        const double *restrict wx, const double *restrict wy, const double *restrict wz, double *restrict values) {
+    double plane[16 * CVMS5_KERNEL_CHUNK], row[4 * CVMS5_KERNEL_CHUNK];
+    const int n = CVMS5_KERNEL_CHUNK;
+    int i = 0, j = 0, k = 0;
+
+    for (j = 0; j < 16; j++)
+        for (i = 0; i < n; i++)
+            plane[j * n + i] = wz[i] * points[j * n + i] + wz[n + i] * points[(16 + j) * n + i] +
+                               wz[2 * n + i] * points[(32 + j) * n + i] + wz[3 * n + i] * points[(48 + j) * n + i];
+    for (k = 0; k < 4; k++)
+        for (i = 0; i < n; i++)
+            row[k * n + i] = wx[i] * plane[k * n + i] + wx[n + i] * plane[(4 + k) * n + i] +
+                             wx[2 * n + i] * plane[(8 + k) * n + i] + wx[3 * n + i] * plane[(12 + k) * n + i];
+    for (i = 0; i < n; i++)
+        values[i] = wy[i] * row[i] + wy[n + i] * row[n + i] + wy[2 * n + i] * row[2 * n + i] + wy[3 * n + i] * row[3 * n + i];
+}
+
+/** The trilinear kernel at the baseline instruction set */
+static void cvms5_trilinear_baseline(const double *corners, const double *x_percent, const double *y_percent,
+                                     const double *z_percent, double *values) {
+    cvms5_trilinear_lanes(corners, x_percent, y_percent, z_percent, values);
+}
+
+/** The tricubic kernel at the baseline instruction set */
+static void cvms5_tricubic_baseline(const double *points, const double *wx, const double *wy, const double *wz,
+                                    double *values) {
+    cvms5_tricubic_lanes(points, wx, wy, wz, values);
+}
+
+#ifdef CVMS5_KERNELS_X86
+// Fused multiply-adds are left out, they would round differently from the baseline.
+/** The trilinear kernel with AVX2 */
+__attribute__((target("avx2,no-fma")))
+static void cvms5_trilinear_avx2(const double *corners, const double *x_percent, const double *y_percent,
+                                 const double *z_percent, double *values) {
+    cvms5_trilinear_lanes(corners, x_percent, y_percent, z_percent, values);
+}
+
+/** The tricubic kernel with AVX2 */
+__attribute__((target("avx2,no-fma")))
+static void cvms5_tricubic_avx2(const double *points, const double *wx, const double *wy, const double *wz,
+                                double *values) {
+    cvms5_tricubic_lanes(points, wx, wy, wz, values);
+}
+
+/** The trilinear kernel with AVX-512 */
+__attribute__((target("avx512f"), optimize("fp-contract=off")))
+static void cvms5_trilinear_avx512(const double *corners, const double *x_percent, const double *y_percent,
+                                   const double *z_percent, double *values) {
+    cvms5_trilinear_lanes(corners, x_percent, y_percent, z_percent, values);
+}
+
+/** The tricubic kernel with AVX-512 */
+__attribute__((target("avx512f"), optimize("fp-contract=off")))
+static void cvms5_tricubic_avx512(const double *points, const double *wx, const double *wy, const double *wz,
+                                  double *values) {
+    cvms5_tricubic_lanes(points, wx, wy, wz, values);
+}
+#endif
+
+/** The kernels for each instruction set, indexed by the CVMS5_ISA constants */
+static cvms5_kernels_t cvms5_kernel_sets[3] = {
+    { "baseline", cvms5_trilinear_baseline, cvms5_tricubic_baseline },
+#ifdef CVMS5_KERNELS_X86
+    { "avx2", cvms5_trilinear_avx2, cvms5_tricubic_avx2 },
+    { "avx512", cvms5_trilinear_avx512, cvms5_tricubic_avx512 }
+#endif
+};
+
+/**
+ * Returns the widest instruction set the host CPU runs that kernels were built for.
+ *
+ * @return One of the CVMS5_ISA constants.
+ */
+int cvms5_host_isa() {
+#ifdef CVMS5_KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return CVMS5_ISA_AVX512;
+    if (__builtin_cpu_supports("avx2")) return CVMS5_ISA_AVX2;
+#endif
+    return CVMS5_ISA_BASELINE;
+}
+
+/**
+ * Chooses the instruction set the interpolation kernels run with. The widest one the host CPU
+ * runs is chosen by cvms5_init, unless the CVMS5_ISA environment variable names another, so
+ * one build runs at full width on every node. Every instruction set gives the same values. The
+ * instruction set must not be changed while batches are in the query pipeline.
+ *
+ * @param isa One of the CVMS5_ISA constants.
+ * @return SUCCESS, or FAIL if the host CPU does not run it.
+ */
+int cvms5_set_isa(int isa) {
+    if (isa < CVMS5_ISA_BASELINE || isa > cvms5_host_isa()) {
+        cvms5_print_error("The host CPU does not support the instruction set asked for.");
+        return FAIL;
+    }
+
+    cvms5_kernels = &(cvms5_kernel_sets[isa]);
+
+    return SUCCESS;
+}
+
+/**
+ * Chooses the interpolation kernels, as named by the CVMS5_ISA environment variable or else
+ * the widest the host CPU runs.
+ */
+void cvms5_select_kernels() {
+    const char *name = getenv("CVMS5_ISA");
+    int isa = 0;
+
+    if (name != NULL) {
+        for (isa = CVMS5_ISA_BASELINE; isa <= CVMS5_ISA_AVX512; isa++)
+            if (cvms5_kernel_sets[isa].name != NULL && strcmp(name, cvms5_kernel_sets[isa].name) == 0) break;
+        if (isa <= CVMS5_ISA_AVX512 && cvms5_set_isa(isa) == SUCCESS) return;
+        fprintf(stderr, "WARNING: CVMS5_ISA=%s is not available here, using %s.\n", name,
+                cvms5_kernel_sets[cvms5_host_isa()].name);
+    }
+
+    cvms5_set_isa(cvms5_host_isa());
+}
+
+/**
+ * Interpolates the material properties within a located cell and derives density, Qp and
+ * Qs from them.
+ *
+ * @param level The level of the model pyramid the cell was located in.
+ * @param staging The model's grid points read ahead for the batch, or NULL.
+ * @param point The query point.
+ * @param cell The cell the point falls in.
+ * @param data The material properties at the point.
+ * @param gradient The gradients of Vp and Vs at the point, or NULL.
+ */
+void cvms5_interpolate_cell(cvms5_level_t *level, cvms5_staging_t *staging, cvms5_point_t *point, cvms5_cell_t *cell,
+                            cvms5_properties_t *data, cvms5_gradient_t *gradient) {
+    cvms5_properties_t surrounding_points[8];
+    cvms5_properties_t base;
+    cvms5_point_t gtl_point;
+    cvms5_cell_t base_cell;
+    int x = cell->x, y = cell->y, z = cell->z;
+
+    if (gradient != NULL) memset(gradient, 0, sizeof(cvms5_gradient_t));
+
+    if (cell->type == CVMS5_CELL_BOTTOM) {
+        cvms5_read_corner(level, staging, x,     y,     z, &(surrounding_points[0]));    // Orgin.
+        cvms5_read_corner(level, staging, x + 1, y,     z, &(surrounding_points[1]));    // Orgin + 1x
+        cvms5_read_corner(level, staging, x,     y + 1, z, &(surrounding_points[2]));    // Orgin + 1y
+        cvms5_read_corner(level, staging, x + 1, y + 1, z, &(surrounding_points[3]));    // Orgin + x + y, forms top plane.
+        cvms5_bilinear_interpolation(cell->x_percent, cell->y_percent, surrounding_points, data);
+        if (gradient != NULL) cvms5_trilinear_gradient(level, cell, surrounding_points, 1, gradient);
+    } else if (cell->type == CVMS5_CELL_GTL) {
+        // The GTL is tapered from the properties at its base, one plane down, in the same grids.
+        // The point may have been given by elevation.
+        data->vp = -1;
+        data->vs = -1;
+        base_cell = *cell;
+        cvms5_locate_cell(level, cvms5_configuration->depth_interval, &base_cell);
+        if (base_cell.type != CVMS5_CELL_NONE) {
+            cvms5_interpolate_cell(level, staging, point, &base_cell, &base, NULL);
+            gtl_point = *point;
+            gtl_point.depth = cell->depth;
+            cvms5_apply_vs30_gtl(&gtl_point, &base, data);
+        }
+    } else {
+        // Read all the surrounding point properties.
+        cvms5_read_corner(level, staging, x,     y,     z,     &(surrounding_points[0]));    // Orgin.
+        cvms5_read_corner(level, staging, x + 1, y,     z,     &(surrounding_points[1]));    // Orgin + 1x
+        cvms5_read_corner(level, staging, x,     y + 1, z,     &(surrounding_points[2]));    // Orgin + 1y
+        cvms5_read_corner(level, staging, x + 1, y + 1, z,     &(surrounding_points[3]));    // Orgin + x + y, forms top plane.
+        cvms5_read_corner(level, staging, x,     y,     z - 1, &(surrounding_points[4]));    // Bottom plane origin
+        cvms5_read_corner(level, staging, x + 1, y,     z - 1, &(surrounding_points[5]));    // +1x
+        cvms5_read_corner(level, staging, x,     y + 1, z - 1, &(surrounding_points[6]));    // +1y
+        cvms5_read_corner(level, staging, x + 1, y + 1, z - 1, &(surrounding_points[7]));    // +x +y, forms bottom plane.
+
+        cvms5_trilinear_interpolation(cell->x_percent, cell->y_percent, cell->z_percent, surrounding_points, data);
+        if (gradient != NULL) cvms5_trilinear_gradient(level, cell, surrounding_points, 2, gradient);
+    }
+
+    cvms5_derive_properties(data);
+}
+
+/**
+ * Derives density, Qp and Qs from the interpolated Vs.
+ *
+ * @param data The material properties, with Vp and Vs set.
+ */
+void cvms5_derive_properties(cvms5_properties_t *data) {
+    // Calculate density.
+    data->rho = cvms5_calculate_density(data->vs);
+
+    // Calculate Qp and Qs.
+    if (data->vs < 1500)
+        data->qs = data->vs * 0.02;
+    else
+        data->qs = data->vs * 0.10;
+
+    data->qp = data->qs * 1.5;
+}
+
+/**
+ * Retrieves the material properties (whatever is available) for the given data point, expressed
+ * in x, y, and z co-ordinates.
+ *
+ * @param x The x coordinate of the data point.
+ * @param y The y coordinate of the data point.
+ * @param z The z coordinate of the data point.
+ * @param data The properties struct to which the material properties will be written.
+ */
+void cvms5_read_properties(int x, int y, int z, cvms5_properties_t *data) {
+    cvms5_read_model_properties(cvms5_velocity_model, x, y, z, data);
+}
+
+/**
+ * Retrieves the material properties (whatever is available) for the given data point of
+ * a set of grids: the model's own, or those of a level of the model pyramid. Only the
+ * model's own grids are ever read from file.
+ *
+ * @param model The grids to read from.
+ * @param x The x coordinate of the data point.
+ * @param y The y coordinate of the data point.
+ * @param z The z coordinate of the data point.
+ * @param data The properties struct to which the material properties will be written.
+ */
+void cvms5_read_model_properties(cvms5_model_t *model, int x, int y, int z, cvms5_properties_t *data) {
+  
+    // Set everything to -1 to indicate not found.
+    data->vp = -1;
+    data->vs = -1;
+    data->rho = -1;
+    data->qp = -1;
+    data->qs = -1;
+
+    float *ptr = NULL;
+    float value = 0;
+    FILE *fp = NULL;
+    int location = z * cvms5_configuration->nx * cvms5_configuration->ny + (cvms5_configuration->nx - x - 1) * cvms5_configuration->ny + y;
+    int block_location = 0;
+
+    // Nothing is held outside of the block for the region of interest.
+    if (x < model->block_x || y < model->block_y || z < model->block_z || x >= model->block_x + model->block_nx ||
+        y >= model->block_y + model->block_ny || z >= model->block_z + model->block_nz)
+        return;
+
+    // Where the point lies in the block in memory. The x axis is stored in reverse, as in the files.
+    block_location = (z - model->block_z) * model->block_nx * model->block_ny +
+                     (model->block_x + model->block_nx - x - 1) * model->block_ny + (y - model->block_y);
+
+    // Check our loaded components of the model.
+    if (model->vs_status == 2) {
+        // Read from memory.
+        ptr = (float *)model->vs;
+        data->vs = ptr[block_location];
+    } else if (model->vs_status == 1) {
+        // Read from file.
+        fp = (FILE *)model->vs;
+        if (pread(fileno(fp), &value, sizeof(float), (off_t)location * sizeof(float)) == sizeof(float)) data->vs = value;
+    }
+
+    // Check our loaded components of the model.
+    if (model->vp_status == 2) {
+        // Read from memory.
+        ptr = (float *)model->vp;
+        data->vp = ptr[block_location];
+    } else if (model->vp_status == 1) {
+        // Read from file.
+        fp = (FILE *)model->vp;
+        if (pread(fileno(fp), &value, sizeof(float), (off_t)location * sizeof(float)) == sizeof(float)) data->vp = value;
+    }
+
+    if (model->overlay_count > 0) cvms5_apply_overlays(model, x, y, z, data);
+}
+
+/**
+ * Reads an overlay file. Its bricks are indexed by where they lie in the model, so a grid point
+ * is looked up in the overlay with one read of the index, however many bricks it covers.
+ *
+ * @param file The overlay file.
+ * @param overlay The overlay to fill in. Whatever is allocated is left to the caller, even on failure.
+ * @return SUCCESS or FAIL if the file could not be read or does not fit the model.
+ */
+int cvms5_read_overlay(const char *file, cvms5_overlay_t *overlay) {
+    cvms5_overlay_header_t header;
+    size_t brick_points = CVMS5_BRICK_SIZE * CVMS5_BRICK_SIZE * CVMS5_BRICK_SIZE;
+    size_t bricks = 0, i = 0;
+    int brick[3];
+    int slot = 0;
+    FILE *fp = fopen(file, "rb");
+
+    if (fp == NULL) {
+        cvms5_print_error("Could not open an overlay file.");
+        return FAIL;
+    }
+
+    if (fread(&header, sizeof(cvms5_overlay_header_t), 1, fp) != 1 ||
+        memcmp(header.magic, CVMS5_OVERLAY_MAGIC, sizeof(header.magic)) != 0 || header.bricks < 0 ||
+        (header.mode != CVMS5_OVERLAY_DELTA && header.mode != CVMS5_OVERLAY_REPLACE)) {
+        cvms5_print_error("An overlay file does not have an overlay header.");
+        fclose(fp);
+        return FAIL;
+    }
+
+    overlay->mode = header.mode;
+    overlay->nbx = (cvms5_configuration->nx + CVMS5_BRICK_SIZE - 1) / CVMS5_BRICK_SIZE;
+    overlay->nby = (cvms5_configuration->ny + CVMS5_BRICK_SIZE - 1) / CVMS5_BRICK_SIZE;
+    overlay->nbz = (cvms5_configuration->nz + CVMS5_BRICK_SIZE - 1) / CVMS5_BRICK_SIZE;
+    bricks = (size_t)overlay->nbx * overlay->nby * overlay->nbz;
+
+    overlay->slots = malloc(bricks * sizeof(int));
+    overlay->vp = malloc(((size_t)header.bricks + 1) * brick_points * sizeof(float));
+    overlay->vs = malloc(((size_t)header.bricks + 1) * brick_points * sizeof(float));
+    if (overlay->slots == NULL || overlay->vp == NULL || overlay->vs == NULL) {
+        cvms5_print_error("Could not allocate memory for an overlay.");
+        fclose(fp);
+        return FAIL;
+    }
+    for (i = 0; i < bricks; i++) overlay->slots[i] = -1;
+
+    for (i = 0; i < (size_t)header.bricks; i++) {
+        if (fread(brick, sizeof(int), 3, fp) != 3 || brick[0] < 0 || brick[1] < 0 || brick[2] < 0 ||
+            brick[0] >= overlay->nbx || brick[1] >= overlay->nby || brick[2] >= overlay->nbz) {
+            cvms5_print_error("An overlay file has a brick outside of the model.");
+            fclose(fp);
+            return FAIL;
+        }
+
+        slot = (brick[2] * overlay->nbx + brick[0]) * overlay->nby + brick[1];
+        if (overlay->slots[slot] >= 0) {
+            cvms5_print_error("An overlay file has a brick more than once.");
+            fclose(fp);
+            return FAIL;
+        }
+
+        if (fread(overlay->vp + i * brick_points, sizeof(float), brick_points, fp) != brick_points ||
+            fread(overlay->vs + i * brick_points, sizeof(float), brick_points, fp) != brick_points) {
+            cvms5_print_error("An overlay file is truncated.");
+            fclose(fp);
+            return FAIL;
+        }
+
+        overlay->slots[slot] = i;
+        overlay->count++;
+    }
+
+    fclose(fp);
+
+    return SUCCESS;
+}
+
+/**
+ * Reads a list of overlay files and applies them over a model's grids, after any it already has.
+ *
+ * @param directory The directory the files are in, ending in a slash.
+ * @param overlays The overlay files, comma separated, in the order they are applied.
+ * @param model The model.
+ * @return SUCCESS or FAIL if an overlay could not be read.
+ */
+int cvms5_add_overlays(const char *directory, const char *overlays, cvms5_model_t *model) {
+    char list[CVMS5_OVERLAYS_MAX];
+    char file[512];
+    char *name = NULL, *save = NULL;
+    cvms5_overlay_t *overlay = NULL;
+    cvms5_overlay_t **overlays_grown = NULL;
+
+    snprintf(list, sizeof(list), "%s", overlays);
+
+    for (name = strtok_r(list, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)) {
+        // Every overlay is kept on one list, so it is freed once whatever models it is applied to.
+        overlay = calloc(1, sizeof(cvms5_overlay_t));
+        if (overlay == NULL) {
+            cvms5_print_error("Could not allocate memory for an overlay.");
+            return FAIL;
+        }
+        overlay->next = cvms5_overlays;
+        cvms5_overlays = overlay;
+
+        snprintf(file, sizeof(file), "%s%s", directory, name);
+        if (cvms5_read_overlay(file, overlay) != SUCCESS) return FAIL;
+
+        overlays_grown = realloc(model->overlays, (model->overlay_count + 1) * sizeof(cvms5_overlay_t *));
+        if (overlays_grown == NULL) {
+            cvms5_print_error("Could not allocate memory for an overlay.");
+            return FAIL;
+        }
+        model->overlays = overlays_grown;
+        model->overlays[model->overlay_count++] = overlay;
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Applies a model's overlays, in order, to the values read from its grids at a grid point.
+ * Delta overlays leave grid points without data as they are.
+ *
+ * @param model The model.
+ * @param x The x coordinate of the data point.
+ * @param y The y coordinate of the data point.
+ * @param z The z coordinate of the data point.
+ * @param data The values read from the grids, to which the overlays are applied.
+ */
+void cvms5_apply_overlays(cvms5_model_t *model, int x, int y, int z, cvms5_properties_t *data) {
+    cvms5_overlay_t *overlay = NULL;
+    size_t offset = 0;
+    float vp = 0, vs = 0;
+    int i = 0, slot = 0;
+
+    for (i = 0; i < model->overlay_count; i++) {
+        overlay = model->overlays[i];
+        slot = overlay->slots[((z / CVMS5_BRICK_SIZE) * overlay->nbx + x / CVMS5_BRICK_SIZE) * overlay->nby +
+                              y / CVMS5_BRICK_SIZE];
+        if (slot < 0) continue;
+
+        offset = (size_t)slot * CVMS5_BRICK_SIZE * CVMS5_BRICK_SIZE * CVMS5_BRICK_SIZE +
+                 ((z % CVMS5_BRICK_SIZE) * CVMS5_BRICK_SIZE + x % CVMS5_BRICK_SIZE) * CVMS5_BRICK_SIZE + y % CVMS5_BRICK_SIZE;
+        vp = overlay->vp[offset];
+        vs = overlay->vs[offset];
+
+        if (overlay->mode == CVMS5_OVERLAY_REPLACE) {
+            if (!isnan(vp)) data->vp = vp;
+            if (!isnan(vs)) data->vs = vs;
+        } else {
+            if (!isnan(vp) && data->vp >= 0) data->vp += vp;
+            if (!isnan(vs) && data->vs >= 0) data->vs += vs;
+        }
+    }
+}
+
+/**
+ * Retrieves the material properties at one corner of a cell, from the batch's staged grid
+ * points if there are any and the cell is in the model itself, otherwise from the level.
+ *
+ * @param level The level of the model pyramid the cell was located in.
+ * @param staging The model's grid points read ahead for the batch, or NULL.
+ * @param x The x coordinate of the data point.
+ * @param y The y coordinate of the data point.
+ * @param z The z coordinate of the data point.
+ * @param data The properties struct to which the material properties will be written.
+ */
+void cvms5_read_corner(cvms5_level_t *level, cvms5_staging_t *staging, int x, int y, int z, cvms5_properties_t *data) {
+    if (staging != NULL && level->factor == 1 && cvms5_read_staged_properties(staging, x, y, z, data) == SUCCESS) {
+        if (level->model->overlay_count > 0) cvms5_apply_overlays(level->model, x, y, z, data);
+        return;
+    }
+
+    cvms5_read_model_properties(level->model, x, y, z, data);
+}
+
+/**
+ * Compares two grid locations for qsort.
+ *
+ * @param a The first location.
+ * @param b The second location.
+ * @return Less than, equal to or greater than zero as a is before, at or after b.
+ */
+int cvms5_compare_locations(const void *a, const void *b) {
+    size_t first = *(const size_t *)a, second = *(const size_t *)b;
+    return first < second ? -1 : (first > second ? 1 : 0);
+}
+
+/**
+ * Works out every grid point of the model that a batch of cells reads, in file order and
+ * without duplicates. Only cells in the model itself read grid points from disk.
+ *
+ * @param cells The cells of the batch.
+ * @param numpoints Number of cells.
+ * @param interpolation How the cells will be interpolated, one of the CVMS5_INTERP constants.
+ * @param staging The staging to plan, with the values left unallocated.
+ */
+void cvms5_plan_staging(cvms5_cell_t *cells, int numpoints, int interpolation, cvms5_staging_t *staging) {
+    cvms5_model_t *model = cvms5_velocity_model;
+    size_t nx = cvms5_configuration->nx, ny = cvms5_configuration->ny;
+    size_t count = 0, i = 0;
+    int per_cell = interpolation == CVMS5_INTERP_TRICUBIC ? 64 : (interpolation == CVMS5_INTERP_NEAREST ? 1 : 8);
+    int j = 0, dx = 0, dy = 0, dz = 0;
+    int x = 0, y = 0, z = 0;
+
+    memset(staging, 0, sizeof(cvms5_staging_t));
+    staging->locations = malloc((size_t)numpoints * per_cell * sizeof(size_t));
+
+    for (j = 0; j < numpoints; j++) {
+        if (cells[j].level != 0 || (cells[j].type != CVMS5_CELL_VOLUME && cells[j].type != CVMS5_CELL_BOTTOM))
+            continue;
+
+        if (interpolation == CVMS5_INTERP_NEAREST) {
+            x = cells[j].x + (cells[j].x_percent >= 0.5);
+            y = cells[j].y + (cells[j].y_percent >= 0.5);
+            z = cells[j].z - (cells[j].z_percent >= 0.5);
+            staging->locations[count++] = z * nx * ny + (nx - x - 1) * ny + y;
+        } else if (interpolation == CVMS5_INTERP_TRICUBIC) {
+            // As read by cvms5_interpolate_tricubic, kept to the block.
+            for (dz = -1; dz < 3; dz++)
+                for (dx = -1; dx < 3; dx++)
+                    for (dy = -1; dy < 3; dy++) {
+                        x = cvms5_clamp_index(cells[j].x + dx, model->block_x, model->block_nx);
+                        y = cvms5_clamp_index(cells[j].y + dy, model->block_y, model->block_ny);
+                        z = cvms5_clamp_index(cells[j].z - dz, model->block_z, model->block_nz);
+                        staging->locations[count++] = z * nx * ny + (nx - x - 1) * ny + y;
+                    }
+        } else {
+            for (dz = 0; dz < (cells[j].type == CVMS5_CELL_VOLUME ? 2 : 1); dz++)
+                for (dx = 0; dx < 2; dx++)
+                    for (dy = 0; dy < 2; dy++)
+                        staging->locations[count++] = (cells[j].z - dz) * nx * ny + (nx - (cells[j].x + dx) - 1) * ny + cells[j].y + dy;
+        }
+    }
+
+    qsort(staging->locations, count, sizeof(size_t), cvms5_compare_locations);
+
+    // Neighbouring cells share corners.
+    for (i = 0; i < count; i++)
+        if (staging->count == 0 || staging->locations[staging->count - 1] != staging->locations[i])
+            staging->locations[staging->count++] = staging->locations[i];
+}
+
+/**
+ * Reads the planned grid points of the model. Grid points no more than CVMS5_STAGING_GAP
+ * apart in a file are read together, gap included, so a dense batch costs a few large
+ * sequential reads.
+ *
+ * @param model The model.
+ * @param staging The planned staging, into which the values are read.
+ * @return SUCCESS or FAIL if a file could not be read.
+ */
+int cvms5_fill_staging(cvms5_model_t *model, cvms5_staging_t *staging) {
+    size_t nx = cvms5_configuration->nx, ny = cvms5_configuration->ny;
+    size_t first = 0, last = 0, i = 0, k = 0;
+    size_t x = 0, y = 0, z = 0;
+    float *buffer = NULL;
+    float *values = NULL;
+    void *grid = NULL;
+    int status = 0, j = 0;
+
+    staging->vp = malloc(staging->count * sizeof(float));
+    staging->vs = malloc(staging->count * sizeof(float));
+
+    for (j = 0; j < 2; j++) {
+        values = j == 0 ? staging->vp : staging->vs;
+        grid = j == 0 ? model->vp : model->vs;
+        status = j == 0 ? model->vp_status : model->vs_status;
+
+        if (status == 1) {
+            if (buffer == NULL) buffer = malloc(CVMS5_STAGING_RUN * sizeof(float));
+
+            for (first = 0; first < staging->count; first = last + 1) {
+                // Extend the run while the next grid point is close enough.
+                last = first;
+                while (last + 1 < staging->count &&
+                       staging->locations[last + 1] - staging->locations[last] <= CVMS5_STAGING_GAP &&
+                       staging->locations[last + 1] - staging->locations[first] < CVMS5_STAGING_RUN)
+                    last++;
+
+                k = staging->locations[last] - staging->locations[first] + 1;
+                if (pread(fileno((FILE *)grid), buffer, k * sizeof(float),
+                          (off_t)staging->locations[first] * sizeof(float)) != (ssize_t)(k * sizeof(float))) {
+                    free(buffer);
+                    return FAIL;
+                }
+
+                for (i = first; i <= last; i++)
+                    values[i] = buffer[staging->locations[i] - staging->locations[first]];
+            }
+        } else {
+            for (i = 0; i < staging->count; i++) {
+                values[i] = -1;
+                if (status != 2) continue;
+
+                // Back from the location to the grid point, and on to where it lies in the block.
+                z = staging->locations[i] / (nx * ny);
+                x = nx - 1 - (staging->locations[i] % (nx * ny)) / ny;
+                y = staging->locations[i] % ny;
+                values[i] = ((float *)grid)[(z - model->block_z) * model->block_nx * model->block_ny +
+                                            (model->block_x + model->block_nx - x - 1) * model->block_ny + (y - model->block_y)];
+            }
+        }
+    }
+
+    free(buffer);
+
+    return SUCCESS;
+}
+
+/**
+ * Retrieves the material properties at a grid point of the model from the batch's staging.
+ *
+ * @param staging The filled staging.
+ * @param x The x coordinate of the data point.
+ * @param y The y coordinate of the data point.
+ * @param z The z coordinate of the data point.
+ * @param data The properties struct to which the material properties will be written.
+ * @return SUCCESS or FAIL if the grid point was not staged.
+ */
+int cvms5_read_staged_properties(cvms5_staging_t *staging, int x, int y, int z, cvms5_properties_t *data) {
+    size_t nx = cvms5_configuration->nx, ny = cvms5_configuration->ny;
+    size_t location = z * nx * ny + (nx - x - 1) * ny + y;
+    size_t *found = bsearch(&location, staging->locations, staging->count, sizeof(size_t), cvms5_compare_locations);
+
+    if (found == NULL) return FAIL;
+
+    data->vp = staging->vp[found - staging->locations];
+    data->vs = staging->vs[found - staging->locations];
+    data->rho = -1;
+    data->qp = -1;
+    data->qs = -1;
+
+    return SUCCESS;
+}
+
+/**
+ * Frees a batch's staging.
+ *
+ * @param staging The staging.
+ */
+void cvms5_free_staging(cvms5_staging_t *staging) {
+    free(staging->locations);
+    free(staging->vp);
+    free(staging->vs);
+    memset(staging, 0, sizeof(cvms5_staging_t));
+}
+
+/**
+ * Trilinearly interpolates given a x percentage, y percentage, z percentage and a cube of
+ * data properties in top origin format (top plane first, bottom plane second).
+ *
+ * @param x_percent X percentage
+ * @param y_percent Y percentage
+ * @param z_percent Z percentage
+ * @param eight_points Eight surrounding data properties
+ * @param ret_properties Returned data properties
+ */
+void cvms5_trilinear_interpolation(double x_percent, double y_percent, double z_percent,
+                             cvms5_properties_t *eight_points, cvms5_properties_t *ret_properties) {
+    cvms5_properties_t *temp_array = calloc(2, sizeof(cvms5_properties_t));
+    cvms5_properties_t *four_points = eight_points;
+
+    cvms5_bilinear_interpolation(x_percent, y_percent, four_points, &temp_array[0]);
+
+    // Now advance the pointer four "cvms5_properties_t" spaces.
+    four_points += 4;
+
+    // Another interpolation.
+    cvms5_bilinear_interpolation(x_percent, y_percent, four_points, &temp_array[1]);
+
+    // Now linearly interpolate between the two.
+    cvms5_linear_interpolation(z_percent, &temp_array[0], &temp_array[1], ret_properties);
+
+    free(temp_array);
+}
+
+/**
+ * Differentiates the trilinear interpolation of Vp and Vs within a cell, with the corners in
+ * the order cvms5_trilinear_interpolation takes them, then turns the gradient along the model's
+ * axes into one along the UTM axes.
+ *
+ * @param level The level of the model pyramid the cell was located in.
+ * @param cell The cell.
+ * @param eight_points The corners of the top plane, then of the bottom plane.
+ * @param planes 2, or 1 if only the top plane is given and there is no gradient with depth.
+ * @param gradient The gradients of Vp and Vs.
+ */
+void cvms5_trilinear_gradient(cvms5_level_t *level, cvms5_cell_t *cell, cvms5_properties_t *eight_points, int planes,
+                              cvms5_gradient_t *gradient) {
+    double x_spacing = cvms5_total_width_m / (cvms5_configuration->nx - 1) * level->factor;
+    double y_spacing = cvms5_total_height_m / (cvms5_configuration->ny - 1) * level->factor;
+    double z_spacing = cvms5_configuration->depth_interval * level->factor;
+    double xp = cell->x_percent, yp = cell->y_percent, zp = planes == 2 ? cell->z_percent : 0;
+    cvms5_properties_t *p = eight_points;
+    cvms5_properties_t top, bottom;
+    double weight[2];
+    int k = 0;
+
+    weight[0] = 1 - zp;
+    weight[1] = zp;
+
+    // Along x and y, each plane's bilinear gradient weighted as the planes are.
+    for (k = 0; k < planes; k++) {
+        p = eight_points + 4 * k;
+        gradient->vp_x += weight[k] * ((1 - yp) * (p[1].vp - p[0].vp) + yp * (p[3].vp - p[2].vp)) / x_spacing;
+        gradient->vs_x += weight[k] * ((1 - yp) * (p[1].vs - p[0].vs) + yp * (p[3].vs - p[2].vs)) / x_spacing;
+        gradient->vp_y += weight[k] * ((1 - xp) * (p[2].vp - p[0].vp) + xp * (p[3].vp - p[1].vp)) / y_spacing;
+        gradient->vs_y += weight[k] * ((1 - xp) * (p[2].vs - p[0].vs) + xp * (p[3].vs - p[1].vs)) / y_spacing;
+    }
+
+    // With depth, the difference between the planes.
+    if (planes == 2) {
+        cvms5_bilinear_interpolation(xp, yp, eight_points, &top);
+        cvms5_bilinear_interpolation(xp, yp, eight_points + 4, &bottom);
+        gradient->vp_z = (bottom.vp - top.vp) / z_spacing;
+        gradient->vs_z = (bottom.vs - top.vs) / z_spacing;
+    }
+
+    // The model's axes are the UTM axes rotated, as in cvms5_utm_to_model.
+    gradient->vp_east = cvms5_cos_rotation_angle * gradient->vp_x + cvms5_sin_rotation_angle * gradient->vp_y;
+    gradient->vs_east = cvms5_cos_rotation_angle * gradient->vs_x + cvms5_sin_rotation_angle * gradient->vs_y;
+    gradient->vp_north = cvms5_cos_rotation_angle * gradient->vp_y - cvms5_sin_rotation_angle * gradient->vp_x;
+    gradient->vs_north = cvms5_cos_rotation_angle * gradient->vs_y - cvms5_sin_rotation_angle * gradient->vs_x;
+}
+
+/**
+ * Bilinearly interpolates given a x percentage, y percentage, and a plane of data properties in
+ * origin, bottom-right, top-left, top-right format.
+ *
+ * @param x_percent X percentage.
+ * @param y_percent Y percentage.
+ * @param four_points Data property plane.
+ * @param ret_properties Returned data properties.
+ */
+void cvms5_bilinear_interpolation(double x_percent, double y_percent, cvms5_properties_t *four_points, cvms5_properties_t *ret_properties) {
+    cvms5_properties_t *temp_array = calloc(2, sizeof(cvms5_properties_t));
+    cvms5_linear_interpolation(x_percent, &four_points[0], &four_points[1], &temp_array[0]);
+    cvms5_linear_interpolation(x_percent, &four_points[2], &four_points[3], &temp_array[1]);
+    cvms5_linear_interpolation(y_percent, &temp_array[0], &temp_array[1], ret_properties);
+    free(temp_array);
+}
+
+/**
+ * Linearly interpolates given a percentage from x0 to x1, a data point at x0, and a data point at x1.
+ *
+ * @param percent Percent of the way from x0 to x1 (from 0 to 1 interval).
+ * @param x0 Data point at x0.
+ * @param x1 Data point at x1.
+ * @param ret_properties Resulting data properties.
+ */
+void cvms5_linear_interpolation(double percent, cvms5_properties_t *x0, cvms5_properties_t *x1, cvms5_properties_t *ret_properties) {
+    ret_properties->vp  = (1 - percent) * x0->vp  + percent * x1->vp;
+    ret_properties->vs  = (1 - percent) * x0->vs  + percent * x1->vs;
+    ret_properties->rho = (1 - percent) * x0->rho + percent * x1->rho;
+    ret_properties->qp  = (1 - percent) * x0->qp  + percent * x1->qp;
+    ret_properties->qs  = (1 - percent) * x0->qs  + percent * x1->qs;
+}
+
+/**
+ * Called when the model is being discarded. Free all variables.
+ *
+ * @return SUCCESS
+ */
+int cvms5_finalize() {
+    int i = 0;
+
+    cvms5_stop_pipeline();
+
+    proj_destroy(cvms5_geo2utm);
+    cvms5_geo2utm = NULL;
+
+    proj_destroy(cvms5_geo2aeqd);
+    cvms5_geo2aeqd = NULL;
+
+    // Iterations of the ensemble that are not the model itself.
+    for (i = 0; i < cvms5_ensemble_size; i++) {
+        if (cvms5_ensemble[i] == NULL || cvms5_ensemble[i] == cvms5_velocity_model) continue;
+        // A variant's grids are the model's own.
+        if (!cvms5_ensemble[i]->shared) {
+            cvms5_release_grid(cvms5_ensemble[i]->vp, cvms5_ensemble[i]->vp_status);
+            cvms5_release_grid(cvms5_ensemble[i]->vs, cvms5_ensemble[i]->vs_status);
+            cvms5_release_grid(cvms5_ensemble[i]->rho, cvms5_ensemble[i]->rho_status);
+            cvms5_release_grid(cvms5_ensemble[i]->qp, cvms5_ensemble[i]->qp_status);
+            cvms5_release_grid(cvms5_ensemble[i]->qs, cvms5_ensemble[i]->qs_status);
+        }
+        free(cvms5_ensemble[i]->overlays);
+        free(cvms5_ensemble[i]);
+    }
+    free(cvms5_ensemble);
+    cvms5_ensemble = NULL;
+    cvms5_ensemble_size = 0;
+
+    // Grids mapped from a snapshot go away with the mapping.
+    if (cvms5_velocity_model && cvms5_snapshot_base == NULL) {
+        cvms5_release_grid(cvms5_velocity_model->vp, cvms5_velocity_model->vp_status);
+        cvms5_release_grid(cvms5_velocity_model->vs, cvms5_velocity_model->vs_status);
+        cvms5_release_grid(cvms5_velocity_model->rho, cvms5_velocity_model->rho_status);
+        cvms5_release_grid(cvms5_velocity_model->qp, cvms5_velocity_model->qp_status);
+        cvms5_release_grid(cvms5_velocity_model->qs, cvms5_velocity_model->qs_status);
+    }
+    // A raster built after loading a snapshot without one is not part of the mapping.
+    if (cvms5_vs30_raster) {
+        if (cvms5_snapshot_base == NULL || (char *)cvms5_vs30_raster->payload < (char *)cvms5_snapshot_base ||
+            (char *)cvms5_vs30_raster->payload >= (char *)cvms5_snapshot_base + cvms5_snapshot_size)
+            free(cvms5_vs30_raster->payload);
+        free(cvms5_vs30_raster);
+        cvms5_vs30_raster = NULL;
+    }
+    if (cvms5_snapshot_base) {
+        munmap(cvms5_snapshot_base, cvms5_snapshot_size);
+        cvms5_snapshot_base = NULL;
+        cvms5_snapshot_size = 0;
+    }
+    if (cvms5_vs30_map && cvms5_vs30_map->vs30_map) etree_close(cvms5_vs30_map->vs30_map);
+
+    if (cvms5_region) {
+        free(cvms5_region);
+        cvms5_region = NULL;
+    }
+    if (cvms5_footprint) {
+        free(cvms5_footprint);
+        cvms5_footprint = NULL;
+    }
+    if (cvms5_partition) {
+        free(cvms5_partition);
+        cvms5_partition = NULL;
+    }
+    if (cvms5_window) {
+        free(cvms5_window);
+        cvms5_window = NULL;
+    }
+    free(cvms5_cache_directory);
+    cvms5_cache_directory = NULL;
+    cvms5_stop_trace();
+
+    // Level 0 is the model itself, which is released above.
+    for (i = 1; i < CVMS5_PYRAMID_LEVELS; i++) {
+        if (cvms5_pyramid[i].model) {
+            free(cvms5_pyramid[i].model->vp);
+            free(cvms5_pyramid[i].model->vs);
+            free(cvms5_pyramid[i].model);
+        }
+    }
+    memset(cvms5_pyramid, 0, sizeof(cvms5_pyramid));
+    cvms5_query_level = 0;
+    cvms5_query_mode = CVMS5_COORD_DEPTH;
+    cvms5_interpolation = CVMS5_INTERP_TRILINEAR;
+
+    cvms5_free_summary(cvms5_summary);
+    cvms5_summary = NULL;
+
+    for (i = 0; i < CVMS5_ZDEPTH_INDEXES; i++) free(cvms5_zdepth_indexes[i].first_plane);
+    memset(cvms5_zdepth_indexes, 0, sizeof(cvms5_zdepth_indexes));
+    cvms5_zdepth_next = 0;
+
+    while (cvms5_overlays != NULL) {
+        cvms5_overlay_t *next = cvms5_overlays->next;
+        free(cvms5_overlays->slots);
+        free(cvms5_overlays->vp);
+        free(cvms5_overlays->vs);
+        free(cvms5_overlays);
+        cvms5_overlays = next;
+    }
+
+    if (cvms5_velocity_model) {
+        free(cvms5_velocity_model->overlays);
+        free(cvms5_velocity_model);
+    }
+    if (cvms5_configuration) free(cvms5_configuration);
+    if (cvms5_vs30_map) free(cvms5_vs30_map);
+
+        if (cvms5_config_string) free(cvms5_config_string);
+
+    return SUCCESS;
+}
+
+/**
+ * Returns the version information.
+ *
+ * @param ver Version string to return.
+ * @param len Maximum length of buffer.
+ * @return Zero
+ */
+int cvms5_version(char *ver, int len)
+{
+  int verlen;
+  verlen = strlen(cvms5_version_string);
+  if (verlen > len - 1) {
+    verlen = len - 1;
+  }
+  memset(ver, 0, len);
+  strncpy(ver, cvms5_version_string, verlen);
+  return 0;
+}
+
+/**
+ * Returns the model config information.
+ *
+ * @param key Config key string to return.
+ * @param sz Number of config term to return.
+ * @return Zero
+ */
+int cvms5_config(char **config, int *sz)
+{
+  int len=strlen(cvms5_config_string);
+  if(len > 0) {
+    *config=cvms5_config_string;
+    *sz=cvms5_config_sz;
+    return SUCCESS;
+  }
+  return FAIL;
+}
+
+
+/**
+ * Reads the cvms5_configuration file describing the various properties of CVM-S5 and populates
+ * the cvms5_configuration struct. This assumes cvms5_configuration has been "calloc'ed" and validates
+ * that each value is not zero at the end.
+ *
+ * @param file The cvms5_configuration file location on disk to read.
+ * @param config The cvms5_configuration struct to which the data should be written.
+ * @return Success or failure, depending on if file was read successfully.
+ */
+int cvms5_read_configuration(char *file, cvms5_configuration_t *config) {
+    FILE *fp = fopen(file, "r");
     char key[40];
     char value[80];
     char line_holder[128];
 
-    // If our file pointer is null, an error has occurred. Return fail.
+    // If our file pointer is null, an error has occurred. Return fail.
+    if (fp == NULL) {
+        cvms5_print_error("Could not open the cvms5_configuration file.");
+        return FAIL;
+    }
+
+    // Read the lines in the cvms5_configuration file.
+    while (fgets(line_holder, sizeof(line_holder), fp) != NULL) {
+        if (line_holder[0] != '#' && line_holder[0] != ' ' && line_holder[0] != '\n') {
+            sscanf(line_holder, "%s = %s", key, value);
+
+            // Which variable are we editing?
+            if (strcmp(key, "utm_zone") == 0)                 config->utm_zone = atoi(value);
+            if (strcmp(key, "model_dir") == 0)                sprintf(config->model_dir, "%s", value);
+            if (strcmp(key, "nx") == 0)                       config->nx = atoi(value);
+            if (strcmp(key, "ny") == 0)                        config->ny = atoi(value);
+            if (strcmp(key, "nz") == 0)                        config->nz = atoi(value);
+            if (strcmp(key, "depth") == 0)                        config->depth = atof(value);
+            if (strcmp(key, "top_left_corner_e") == 0)         config->top_left_corner_e = atof(value);
+            if (strcmp(key, "top_left_corner_n") == 0)        config->top_left_corner_n = atof(value);
+            if (strcmp(key, "top_right_corner_e") == 0)        config->top_right_corner_e = atof(value);
+            if (strcmp(key, "top_right_corner_n") == 0)        config->top_right_corner_n = atof(value);
+            if (strcmp(key, "bottom_left_corner_e") == 0)    config->bottom_left_corner_e = atof(value);
+            if (strcmp(key, "bottom_left_corner_n") == 0)    config->bottom_left_corner_n = atof(value);
+            if (strcmp(key, "bottom_right_corner_e") == 0)    config->bottom_right_corner_e = atof(value);
+            if (strcmp(key, "bottom_right_corner_n") == 0)    config->bottom_right_corner_n = atof(value);
+            if (strcmp(key, "depth_interval") == 0)            config->depth_interval = atof(value);
+            if (strcmp(key, "p0") == 0)                        config->p0 = atof(value);
+            if (strcmp(key, "p1") == 0)                        config->p1 = atof(value);
+            if (strcmp(key, "p2") == 0)                        config->p2 = atof(value);
+            if (strcmp(key, "p3") == 0)                        config->p3 = atof(value);
+            if (strcmp(key, "p4") == 0)                        config->p4 = atof(value);
+            if (strcmp(key, "p5") == 0)                        config->p5 = atof(value);
+            if (strcmp(key, "overlay") == 0) {
+                if (config->overlays[0] != '\0') strncat(config->overlays, ",", CVMS5_OVERLAYS_MAX - strlen(config->overlays) - 1);
+                strncat(config->overlays, value, CVMS5_OVERLAYS_MAX - strlen(config->overlays) - 1);
+            }
+            if (strcmp(key, "gtl") == 0) {
+                if (strcmp(value, "on") == 0) config->gtl = 1;
+                else config->gtl = 0;
+            }
+        }
+    }
+
+    // Have we set up all cvms5_configuration parameters?
+    if (config->utm_zone == 0 || config->nx == 0 || config->ny == 0 || config->nz == 0 || config->model_dir[0] == '\0' ||
+        config->top_left_corner_e == 0 || config->top_left_corner_n == 0 || config->top_right_corner_e == 0 ||
+        config->top_right_corner_n == 0 || config->bottom_left_corner_e == 0 || config->bottom_left_corner_n == 0 ||
+        config->bottom_right_corner_e == 0 || config->bottom_right_corner_n == 0 || config->depth == 0 ||
+        config->depth_interval == 0 || config->p0 == 0 || config->p1 == 0 || config->p2 == 0 || config->p3 == 0 ||
+        config->p4 == 0 || config->p5 == 0) {
+        cvms5_print_error("One cvms5_configuration parameter not specified. Please check your cvms5_configuration file.");
+        return FAIL;
+    }
+
+    fclose(fp);
+
+    return SUCCESS;
+}
+
+/**
+ * Reads the format of the Vs30 data e-tree. This file location is typically specified
+ * in the cvms5_configuration file of the model.
+ *
+ * @param filename The e-tree's file location from which to read.
+ * @param map The outputted map cvms5_configuration structure.
+ */
+int cvms5_read_vs30_map(char *filename, cvms5_vs30_map_config_t *map) {
+    char appmeta[512];
+    char *token;
+    int index = 0, retVal = 0;
+    map->vs30_map = etree_open(filename, O_RDONLY, 64, 0, 3);
+    retVal = snprintf(appmeta, sizeof(appmeta), "%s", etree_getappmeta(map->vs30_map));
+
+    if (retVal >= 0 && retVal < 128) {
+        return FAIL;
+    }
+
+    // Now we need to parse the map cvms5_configuration.
+    index = 0;
+    token = strtok(appmeta, "|");
+
+    while (token != NULL) {
+        switch (index) {
+        case 0:
+            snprintf(map->type, sizeof(map->type), "%s", token);
+            break;
+        case 1:
+            snprintf(map->description, sizeof(map->description), "%s", token);
+            break;
+        case 2:
+            snprintf(map->author, sizeof(map->author), "%s", token);
+            break;
+        case 3:
+            snprintf(map->date, sizeof(map->date), "%s", token);
+            break;
+        case 4:
+            sscanf(token, "%lf", &(map->spacing));
+            break;
+        case 5:
+            snprintf(map->schema, sizeof(map->schema), "%s", token);
+            break;
+        case 6:
+            snprintf(map->projection, sizeof(map->projection), "%s", token);
+            break;
+        case 7:
+            sscanf(token, "%lf,%lf,%lf", &(map->origin_point.longitude), &(map->origin_point.latitude),
+                    &(map->origin_point.depth));
+            break;
+        case 8:
+            sscanf(token, "%lf", &(map->rotation));
+            break;
+        case 9:
+            sscanf(token, "%lf,%lf,%lf", &(map->x_dimension), &(map->y_dimension), &(map->z_dimension));
+            break;
+        case 10:
+            sscanf(token, "%u,%u,%u", &(map->x_ticks), &(map->y_ticks), &(map->z_ticks));
+            break;
+        default:
+            fprintf(stderr, "Unexpected metadata. Please check your Vs30 e-tree within UCVM.\n");
+            return FAIL;
+            break;
+        }
+        index++;
+        token = strtok(NULL, "|");
+    }
+
+    return SUCCESS;
+
+}
+
+/**
+ * Given a latitude and longitude in WGS84 co-ordinates, we find the corresponding e-tree octant
+ * in the Vs30 map e-tree and read the value as well as interpolate bilinearly.
+ *
+ * @param longitude The longitude in WGS84 format.
+ * @param latitude The latitude in WGS84 format.
+ * @param map The Vs30 map structure as defined during the initialization procedure.
+ * @return The Vs30 value at that point, or -1 if outside the boundaries.
+ */
+double cvms5_get_vs30_value(double longitude, double latitude, cvms5_vs30_map_config_t *map) {
+    // Convert both points to UTM.
+    double point_x, point_y;
+    double origin_x, origin_y;
+
+    double temp_rotated_point_x = 0.0, temp_rotated_point_y = 0.0;
+    double rotated_point_x = 0.0, rotated_point_y = 0.0;
+
+    double percent = 0.0;
+
+    int loc_x = 0, loc_y = 0;
+    cvms5_vs30_mpayload_t vs30_payload[4];
+
+    int max_level = ceil(log(map->x_dimension / map->spacing) / log(2.0));
+
+    double map_edgesize = map->x_dimension / (double)((etree_tick_t)1<<max_level);
+
+    PJ_COORD xyzSrc = proj_coord(latitude, longitude, 0.0, HUGE_VAL);
+    PJ_COORD xyzDest = proj_trans(cvms5_geo2aeqd, PJ_FWD, xyzSrc);
+    point_x = xyzDest.xyzt.x;
+    point_y = xyzDest.xyzt.y;
+
+    xyzSrc = proj_coord(map->origin_point.latitude, map->origin_point.longitude, 0.0, HUGE_VAL);
+    xyzDest = proj_trans(cvms5_geo2aeqd, PJ_FWD, xyzSrc);
+    origin_x = xyzDest.xyzt.x;
+    origin_y = xyzDest.xyzt.y;
+
+    // Now that both are in UTM, we can subtract and rotate.
+    temp_rotated_point_x = point_x - origin_x;
+    temp_rotated_point_y = point_y - origin_y;
+
+    rotated_point_x = cvms5_cos_vs30_rotation_angle * temp_rotated_point_x - cvms5_sin_vs30_rotation_angle * temp_rotated_point_y;
+    rotated_point_y = cvms5_sin_vs30_rotation_angle * temp_rotated_point_x + cvms5_cos_vs30_rotation_angle * temp_rotated_point_y;
+
+    // Are we within the box?
+    if (rotated_point_x < 0 || rotated_point_y < 0 || rotated_point_x > map->x_dimension ||
+        rotated_point_y > map->y_dimension) return -1;
+
+    // Get the integer location of the grid point within the map.
+    loc_x = floor(rotated_point_x / map_edgesize);
+    loc_y = floor(rotated_point_y / map_edgesize);
+
+    // We need the four surrounding points for bilinear interpolation.
+    cvms5_get_vs30_payload(map, loc_x,     loc_y,     &(vs30_payload[0]));
+    cvms5_get_vs30_payload(map, loc_x + 1, loc_y,     &(vs30_payload[1]));
+    cvms5_get_vs30_payload(map, loc_x,     loc_y + 1, &(vs30_payload[2]));
+    cvms5_get_vs30_payload(map, loc_x + 1, loc_y + 1, &(vs30_payload[3]));
+
+    percent = fmod(rotated_point_x / map->spacing, map->spacing) / map->spacing;
+    vs30_payload[0].vs30 = percent * vs30_payload[0].vs30 + (1 - percent) * vs30_payload[1].vs30;
+    vs30_payload[1].vs30 = percent * vs30_payload[2].vs30 + (1 - percent) * vs30_payload[3].vs30;
+
+    return vs30_payload[0].vs30;
+}
+
+/**
+ * Gets the surface elevation from the UCVM map at a point, interpolated bilinearly between
+ * the map's cells.
+ *
+ * @param longitude The longitude in WGS84 format.
+ * @param latitude The latitude in WGS84 format.
+ * @param map The Vs30 map structure as defined during the initialization procedure.
+ * @param surface The surface elevation, in meters above sea level.
+ * @return SUCCESS, or FAIL if the point is outside the map.
+ */
+int cvms5_get_surface_value(double longitude, double latitude, cvms5_vs30_map_config_t *map, double *surface) {
+    double point_x = 0, point_y = 0, origin_x = 0, origin_y = 0;
+    double temp_rotated_point_x = 0, temp_rotated_point_y = 0;
+    double rotated_point_x = 0, rotated_point_y = 0;
+    double x_percent = 0, y_percent = 0;
+    cvms5_vs30_mpayload_t payload[4];
+    int loc_x = 0, loc_y = 0;
+
+    int max_level = ceil(log(map->x_dimension / map->spacing) / log(2.0));
+    double map_edgesize = map->x_dimension / (double)((etree_tick_t)1<<max_level);
+
+    PJ_COORD xyzSrc = proj_coord(latitude, longitude, 0.0, HUGE_VAL);
+    PJ_COORD xyzDest = proj_trans(cvms5_geo2aeqd, PJ_FWD, xyzSrc);
+    point_x = xyzDest.xyzt.x;
+    point_y = xyzDest.xyzt.y;
+
+    xyzSrc = proj_coord(map->origin_point.latitude, map->origin_point.longitude, 0.0, HUGE_VAL);
+    xyzDest = proj_trans(cvms5_geo2aeqd, PJ_FWD, xyzSrc);
+    origin_x = xyzDest.xyzt.x;
+    origin_y = xyzDest.xyzt.y;
+
+    temp_rotated_point_x = point_x - origin_x;
+    temp_rotated_point_y = point_y - origin_y;
+    rotated_point_x = cvms5_cos_vs30_rotation_angle * temp_rotated_point_x - cvms5_sin_vs30_rotation_angle * temp_rotated_point_y;
+    rotated_point_y = cvms5_sin_vs30_rotation_angle * temp_rotated_point_x + cvms5_cos_vs30_rotation_angle * temp_rotated_point_y;
+
+    if (rotated_point_x < 0 || rotated_point_y < 0 || rotated_point_x > map->x_dimension ||
+        rotated_point_y > map->y_dimension) return FAIL;
+
+    loc_x = floor(rotated_point_x / map_edgesize);
+    loc_y = floor(rotated_point_y / map_edgesize);
+    x_percent = rotated_point_x / map_edgesize - loc_x;
+    y_percent = rotated_point_y / map_edgesize - loc_y;
+
+    cvms5_get_vs30_payload(map, loc_x,     loc_y,     &(payload[0]));
+    cvms5_get_vs30_payload(map, loc_x + 1, loc_y,     &(payload[1]));
+    cvms5_get_vs30_payload(map, loc_x,     loc_y + 1, &(payload[2]));
+    cvms5_get_vs30_payload(map, loc_x + 1, loc_y + 1, &(payload[3]));
+
+    *surface = (1 - y_percent) * ((1 - x_percent) * payload[0].surf + x_percent * payload[1].surf) +
+               y_percent * ((1 - x_percent) * payload[2].surf + x_percent * payload[3].surf);
+
+    return SUCCESS;
+}
+
+/**
+ * Works out how far below the surface a query point is. Points given by elevation are
+ * measured against the surface of the UCVM map.
+ *
+ * @param point The query point.
+ * @param mode CVMS5_COORD_DEPTH or CVMS5_COORD_ELEVATION.
+ * @param depth The depth of the point, in meters, negative if it is above the surface.
+ * @return SUCCESS, or FAIL if there is no surface at the point.
+ */
+int cvms5_get_point_depth(cvms5_point_t *point, int mode, double *depth) {
+    double surface = 0;
+
+    if (mode != CVMS5_COORD_ELEVATION) {
+        *depth = point->depth;
+        return SUCCESS;
+    }
+
+    if (cvms5_get_surface_value(point->longitude, point->latitude, cvms5_vs30_map, &surface) != SUCCESS)
+        return FAIL;
+
+    *depth = surface - point->depth;
+
+    return SUCCESS;
+}
+
+/**
+ * Reads the payload of one Vs30 map cell. Cells inside the raster built by cvms5_rasterize_vs30_map
+ * are read from memory, anything else is searched for in the e-tree, which is opened on first use
+ * if the model was loaded from a snapshot.
+ *
+ * @param map The Vs30 map structure as defined during the initialization procedure.
+ * @param loc_x The map column, in units of map cells.
+ * @param loc_y The map row, in units of map cells.
+ * @param payload The payload read at that cell.
+ */
+void cvms5_get_vs30_payload(cvms5_vs30_map_config_t *map, int loc_x, int loc_y, cvms5_vs30_mpayload_t *payload) {
+    etree_addr_t addr;
+    int max_level = ceil(log(map->x_dimension / map->spacing) / log(2.0));
+    etree_tick_t edgetics = (etree_tick_t)1 << (ETREE_MAXLEVEL - max_level);
+
+    if (cvms5_vs30_raster != NULL && loc_x >= cvms5_vs30_raster->x0 && loc_y >= cvms5_vs30_raster->y0 &&
+        loc_x < cvms5_vs30_raster->x0 + cvms5_vs30_raster->nx && loc_y < cvms5_vs30_raster->y0 + cvms5_vs30_raster->ny) {
+        *payload = cvms5_vs30_raster->payload[(loc_y - cvms5_vs30_raster->y0) * cvms5_vs30_raster->nx +
+                                              (loc_x - cvms5_vs30_raster->x0)];
+        return;
+    }
+
+    if (map->vs30_map == NULL) map->vs30_map = etree_open(vs30_etree_file, O_RDONLY, 64, 0, 3);
+
+    addr.level = ETREE_MAXLEVEL;
+    addr.x = loc_x * edgetics; addr.y = loc_y * edgetics; addr.z = 0;
+    /* Adjust addresses for edges of grid */
+    if (addr.x >= (etree_tick_t)map->x_ticks) addr.x = map->x_ticks - edgetics;
+    if (addr.y >= (etree_tick_t)map->y_ticks) addr.y = map->y_ticks - edgetics;
+    etree_search(map->vs30_map, addr, NULL, "*", payload);
+}
+
+/**
+ * Gets the GTL value using the Wills and Wald dataset, given a latitude, longitude and depth.
+ *
+ * @param point The point at which to retrieve the property. Note, depth is ignored.
+ * @param data The material properties at the point specified, or -1 if not found.
+ * @return Success or failure.
+ */
+int cvms5_get_vs30_based_gtl(cvms5_point_t *point, cvms5_properties_t *data) {
+    double percent_z = point->depth / cvms5_configuration->depth_interval;
+
+    // Double check that we're above the first layer.
+    if (percent_z > 1) return FAIL;
+
+    // Query for the point at depth_interval.
+    cvms5_point_t *pt = calloc(1, sizeof(cvms5_point_t));
+    cvms5_properties_t *dt = calloc(1, sizeof(cvms5_properties_t));
+
+    pt->latitude = point->latitude;
+    pt->longitude = point->longitude;
+    pt->depth = cvms5_configuration->depth_interval;
+
+    if (cvms5_query_points(pt, dt, 1, CVMS5_COORD_DEPTH, CVMS5_INTERP_TRILINEAR, NULL, NULL) != SUCCESS) return FAIL;
+
+    cvms5_apply_vs30_gtl(point, dt, data);
+
+    free(pt);
+    free(dt);
+
+    return SUCCESS;
+}
+
+/**
+ * Tapers Vp and Vs from the properties at the base of the GTL up to the Vs30 from the Wills
+ * and Wald dataset at the point's depth, as described by Po Chen.
+ *
+ * @param point The point, with its depth below the surface.
+ * @param base The material properties at the base of the GTL, depth_interval down.
+ * @param data The material properties at the point, Vp and Vs -1 if there is no Vs30.
+ */
+void cvms5_apply_vs30_gtl(cvms5_point_t *point, cvms5_properties_t *base, cvms5_properties_t *data) {
+    double a = 0.5, b = 0.6, c = 0.5;
+    double percent_z = point->depth / cvms5_configuration->depth_interval;
+    double f = 0.0, g = 0.0;
+    double vs30 = 0.0, vp30 = 0.0;
+
+    // Now we need the Vs30 data value.
+    vs30 = cvms5_get_vs30_value(point->longitude, point->latitude, cvms5_vs30_map);
+
+    if (vs30 == -1) {
+        data->vp = -1;
+        data->vs = -1;
+    } else {
+        // Get the point's material properties within the GTL.
+        f = percent_z + b * (percent_z - pow(percent_z, 2.0f));
+        g = a - a * percent_z + c * (pow(percent_z, 2.0f) + 2.0 * sqrt(percent_z) - 3.0 * percent_z);
+        data->vs = f * base->vs + g * vs30;
+        vs30 = vs30 / 1000;
+        vp30 = 0.9409 + 2.0947 * vs30 - 0.8206 * pow(vs30, 2.0f) + 0.2683 * pow(vs30, 3.0f) - 0.0251 * pow(vs30, 4.0f);
+        vp30 = vp30 * 1000;
+        data->vp = f * base->vp + g * vp30;
+    }
+}
+
+/**
+ * Calculates the density based off of Vs. Based on Nafe-Drake scaling relationship.
+ *
+ * @param vs The Vs value off which to scale.
+ * @return Density, in g/m^3.
+ */
+double cvms5_calculate_density(double vs) {
+    double retVal;
+    vs = vs / 1000;
+    retVal = cvms5_configuration->p0 + cvms5_configuration->p1 * vs + cvms5_configuration->p2 * pow(vs, 2) +
+             cvms5_configuration->p3 * pow(vs, 3) + cvms5_configuration->p4 * pow(vs, 4) + cvms5_configuration->p5 * pow(vs, 5);
+    retVal = retVal * 1000;
+    return retVal;
+}
+
+/**
+ * Prints the error string provided.
+ *
+ * @param err The error string to print out to stderr.
+ */
+void cvms5_print_error(char *err) {
+    fprintf(stderr, "An error has occurred while executing CVM-S5: %s\n",err);
+    fprintf(stderr, "\n\nPlease contact software@scec.org and describe both the error and a bit\n");
+    fprintf(stderr, "about the computer you are running CVM-S5 on (Linux, Mac, etc.).\n");
+}
+
+/**
+ * Tries to read the model into memory.
+ *
+ * @param model The model parameter struct which will hold the pointers to the data either on disk or in memory.
+ * @return 2 if all files are read to memory, SUCCESS if file is found but at least 1
+ * is not in memory, FAIL if no file found or one could not be read.
+ */
+int cvms5_try_reading_model(cvms5_model_t *model) {
+    return cvms5_try_reading_model_from(cvms5_iteration_directory, model);
+}
+
+/**
+ * Tries to read the grids of an iteration directory into memory.
+ *
+ * @param directory The iteration directory.
+ * @param model The model parameter struct which will hold the pointers to the data either on disk or in memory.
+ * @return 2 if all files are read to memory, SUCCESS if file is found but at least 1
+ * is not in memory, FAIL if no file found or one could not be read.
+ */
+int cvms5_try_reading_model_from(char *directory, cvms5_model_t *model) {
+    const char *names[5] = { "vp", "vs", "rho", "qp", "qs" };
+    void **grids[5] = { &(model->vp), &(model->vs), &(model->rho), &(model->qp), &(model->qs) };
+    int *statuses[5] = { &(model->vp_status), &(model->vs_status), &(model->rho_status), &(model->qp_status),
+                         &(model->qs_status) };
+    int file_count = 0;
+    int all_read_to_memory = 1;
+    char current_file[640];
+    int i = 0;
+
+    // Without a region of interest, the block is the whole grid.
+    if (model->block_nx == 0) {
+        model->block_nx = cvms5_configuration->nx;
+        model->block_ny = cvms5_configuration->ny;
+        model->block_nz = cvms5_configuration->nz;
+    }
+
+    // Let's see what data we actually have.
+    for (i = 0; i < 5; i++) {
+        sprintf(current_file, "%s/%s.dat", directory, names[i]);
+        if (access(current_file, R_OK) != 0) continue;
+
+        if (cvms5_load_grid_file(current_file, model, grids[i]) != SUCCESS) return FAIL;
+        if (*grids[i] != NULL) {
+            *statuses[i] = 2;
+        } else {
+            all_read_to_memory = 0;
+            *grids[i] = fopen(current_file, "rb");
+            if (*grids[i] == NULL) {
+                cvms5_print_error("Could not open one of the model's files.");
+                return FAIL;
+            }
+            *statuses[i] = 1;
+        }
+        file_count++;
+    }
+
+    if (file_count == 0)
+        return FAIL;
+    else if (file_count > 0 && all_read_to_memory == 0)
+        return SUCCESS;
+    else
+        return 2;
+}
+
+/**
+ * Checks that the grids of an iteration directory have the model's geometry, so they can be
+ * read at the same grid points as the model's own.
+ *
+ * @param directory The iteration directory.
+ * @return SUCCESS, or FAIL if a grid is the wrong size or there is none.
+ */
+int cvms5_check_grid_geometry(char *directory) {
+    const char *names[5] = { "vp", "vs", "rho", "qp", "qs" };
+    off_t size = (off_t)cvms5_configuration->nx * cvms5_configuration->ny * cvms5_configuration->nz * sizeof(float);
+    char current_file[640];
+    struct stat st;
+    int i = 0, found = 0;
+
+    for (i = 0; i < 5; i++) {
+        sprintf(current_file, "%s/%s.dat", directory, names[i]);
+        if (stat(current_file, &st) != 0) continue;
+        if (st.st_size != size) return FAIL;
+        found++;
+    }
+
+    return found > 0 ? SUCCESS : FAIL;
+}
+
+/**
+ * Reads one of the model's files into memory. When streaming, the whole file is mapped
+ * instead and its pages are only read in as the window reaches them.
+ *
+ * @param file The file to read.
+ * @param model The model, with the block to read set.
+ * @param grid Set to the grid in memory, or NULL if it does not fit and must be read from the file.
+ * @return SUCCESS, or FAIL if the file could not be opened or is too short for the block.
+ */
+int cvms5_load_grid_file(char *file, cvms5_model_t *model, void **grid) {
+    size_t size = (size_t)model->block_nx * model->block_ny * model->block_nz * sizeof(float);
+    struct stat info;
+    FILE *fp;
+    int fd;
+
+    *grid = NULL;
+
+    if (cvms5_window != NULL) {
+        fd = open(file, O_RDONLY);
+        if (fd < 0) {
+            cvms5_print_error("Could not open one of the model's files.");
+            return FAIL;
+        }
+        // Pages past the end of a short file would only fault once the window reached them.
+        if (fstat(fd, &info) != 0 || (size_t)info.st_size < size) {
+            cvms5_print_error("One of the model's files is too short for its grid.");
+            close(fd);
+            return FAIL;
+        }
+        *grid = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (*grid == MAP_FAILED) *grid = NULL;
+        return SUCCESS;
+    }
+
+    fp = fopen(file, "rb");
+    if (fp == NULL) {
+        cvms5_print_error("Could not open one of the model's files.");
+        return FAIL;
+    }
+
+    *grid = malloc(size);
+    if (*grid == NULL) {
+        fclose(fp);
+        return SUCCESS;
+    }
+
+    // Read the model in.
+    if (cvms5_read_model_block(fp, model, *grid) != SUCCESS) {
+        cvms5_print_error("One of the model's files is too short for its grid.");
+        free(*grid);
+        *grid = NULL;
+        fclose(fp);
+        return FAIL;
+    }
+    fclose(fp);
+
+    return SUCCESS;
+}
+
+/**
+ * Releases one of the model's grids, however it was loaded.
+ *
+ * @param grid The grid, or the file it is read from.
+ * @param status The grid's status: 0 = not found, 1 = not in memory, 2 = in memory.
+ */
+void cvms5_release_grid(void *grid, int status) {
+    if (status == 1) {
+        fclose((FILE *)grid);
+    } else if (status == 2 && cvms5_window != NULL) {
+        munmap(grid, (size_t)cvms5_configuration->nx * cvms5_configuration->ny * cvms5_configuration->nz * sizeof(float));
+    } else if (status == 2) {
+        free(grid);
+    }
+}
+
+/**
+ * Moves the streaming window. The planes the window has moved past, in whichever direction it
+ * moves, are released and the window plus the planes ahead of it are prefetched. The kernel
+ * reads the prefetched planes in the background, and released planes are read back from the
+ * file if a query ever returns to them.
+ *
+ * @param window The streaming window.
+ * @param first The first plane of the new window.
+ * @param last The last plane of the new window.
+ */
+void cvms5_move_window(cvms5_window_t *window, int first, int last) {
+    if (window->first >= 0 && first == window->first && last == window->last) return;
+
+    if (window->first >= 0 && first > window->first) {
+        cvms5_advise_planes(window->axis, window->first, first - 1, MADV_DONTNEED);
+        cvms5_advise_planes(window->axis, first, last + window->planes, MADV_WILLNEED);
+    } else if (window->first >= 0 && last < window->last) {
+        cvms5_advise_planes(window->axis, last + 1, window->last, MADV_DONTNEED);
+        cvms5_advise_planes(window->axis, first - window->planes, last, MADV_WILLNEED);
+    } else {
+        cvms5_advise_planes(window->axis, first, last + window->planes, MADV_WILLNEED);
+    }
+
+    window->first = first;
+    window->last = last;
+}
+
+/**
+ * Gives the kernel advice about a range of planes of every grid in memory, which are all
+ * mapped when streaming. A z plane is one contiguous run of the files; an x plane is a run of
+ * ny values in every z plane, since x is stored in reverse ahead of y. Prefetches are widened
+ * to whole pages, while releases are narrowed to the pages lying wholly within the planes.
+ *
+ * @param axis CVMS5_WINDOW_Z or CVMS5_WINDOW_X.
+ * @param first The first plane.
+ * @param last The last plane.
+ * @param advice MADV_WILLNEED or MADV_DONTNEED.
+ */
+void cvms5_advise_planes(int axis, int first, int last, int advice) {
+    void *grids[5];
+    int statuses[5];
+    int nx = cvms5_configuration->nx, ny = cvms5_configuration->ny, nz = cvms5_configuration->nz;
+    int count = axis == CVMS5_WINDOW_Z ? nz : nx;
+    long page = sysconf(_SC_PAGESIZE);
+    size_t offset = 0, length = 0;
+    uintptr_t start = 0, end = 0;
+    int i = 0, z = 0, runs = 0;
+
+    if (first < 0) first = 0;
+    if (last > count - 1) last = count - 1;
+    if (last < first) return;
+
+    grids[0] = cvms5_velocity_model->vp;  statuses[0] = cvms5_velocity_model->vp_status;
+    grids[1] = cvms5_velocity_model->vs;  statuses[1] = cvms5_velocity_model->vs_status;
+    grids[2] = cvms5_velocity_model->rho; statuses[2] = cvms5_velocity_model->rho_status;
+    grids[3] = cvms5_velocity_model->qp;  statuses[3] = cvms5_velocity_model->qp_status;
+    grids[4] = cvms5_velocity_model->qs;  statuses[4] = cvms5_velocity_model->qs_status;
+
+    runs = axis == CVMS5_WINDOW_Z ? 1 : nz;
+
+    for (i = 0; i < 5; i++) {
+        if (statuses[i] != 2) continue;
+        for (z = 0; z < runs; z++) {
+            if (axis == CVMS5_WINDOW_Z) {
+                offset = (size_t)first * nx * ny;
+                length = (size_t)(last - first + 1) * nx * ny;
+            } else {
+                offset = ((size_t)z * nx + (nx - last - 1)) * ny;
+                length = (size_t)(last - first + 1) * ny;
+            }
+            start = (uintptr_t)((float *)grids[i] + offset);
+            end = (uintptr_t)((float *)grids[i] + offset + length);
+            if (advice == MADV_DONTNEED) {
+                // Only whole pages are released, so planes sharing a page with the window stay.
+                start = (start + page - 1) / page * page;
+                end = end / page * page;
+                if (end <= start) continue;
+            } else {
+                start = start / page * page;
+            }
+            madvise((void *)start, end - start, advice);
+        }
+    }
+}
+
+/**
+ * Reads the block of the grid held by the model from one of its files. The x axis is stored
+ * in reverse, so the block is a run of block_ny values for each of its x and z indices, and
+ * a single run per z plane when it spans the whole y axis.
+ *
+ * @param fp The file to read from.
+ * @param model The model, with the block to read set.
+ * @param dest Where to read the block to.
+ * @return SUCCESS or FAIL.
+ */
+int cvms5_read_model_block(FILE *fp, cvms5_model_t *model, float *dest) {
+    int nx = cvms5_configuration->nx, ny = cvms5_configuration->ny;
+    int first_x = nx - model->block_x - model->block_nx;
+    int rows = model->block_ny == ny ? 1 : model->block_nx;
+    size_t run = model->block_ny == ny ? (size_t)model->block_nx * ny : (size_t)model->block_ny;
+    int z = 0, row = 0;
+
+    for (z = 0; z < model->block_nz; z++) {
+        for (row = 0; row < rows; row++) {
+            long location = ((long)(model->block_z + z) * nx + first_x + row) * ny + model->block_y;
+            if (fseek(fp, location * sizeof(float), SEEK_SET) != 0 || fread(dest, sizeof(float), run, fp) != run)
+                return FAIL;
+            dest += run;
+        }
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Works out the block of the grid covering a region of interest. The edges of the region are
+ * traced into the model's rotated frame, since a longitude and latitude box is not a box in
+ * UTM, and the block is padded with a one cell halo for the interpolation.
+ *
+ * @param region The region of interest.
+ * @param model The model to set the block of.
+ * @return SUCCESS or FAIL if the region does not overlap the model.
+ */
+int cvms5_set_region_block(cvms5_region_t *region, cvms5_model_t *model) {
+    double corner_lon[4], corner_lat[4];
+    double point_u = 0, point_v = 0, point_x = 0, point_y = 0;
+    int min_x = 0, min_y = 0, max_x = -1, max_y = -1, max_z = 0, min_z = 0, load_x = 0, load_y = 0;
+    int edge = 0, step = 0, steps = 16;
+    int nx = cvms5_configuration->nx, ny = cvms5_configuration->ny, nz = cvms5_configuration->nz;
+
+    corner_lon[0] = region->min_longitude; corner_lat[0] = region->min_latitude;
+    corner_lon[1] = region->min_longitude; corner_lat[1] = region->max_latitude;
+    corner_lon[2] = region->max_longitude; corner_lat[2] = region->max_latitude;
+    corner_lon[3] = region->max_longitude; corner_lat[3] = region->min_latitude;
+
+    for (edge = 0; edge < 4; edge++) {
+        for (step = 0; step < steps; step++) {
+            PJ_COORD xyzSrc = proj_coord(corner_lat[edge] + (corner_lat[(edge + 1) % 4] - corner_lat[edge]) * step / steps,
+                                         corner_lon[edge] + (corner_lon[(edge + 1) % 4] - corner_lon[edge]) * step / steps,
+                                         0.0, HUGE_VAL);
+            PJ_COORD xyzDest = proj_trans(cvms5_geo2utm, PJ_FWD, xyzSrc);
+
+            point_u = xyzDest.xyzt.x - cvms5_configuration->bottom_left_corner_e;
+            point_v = xyzDest.xyzt.y - cvms5_configuration->bottom_left_corner_n;
+            point_x = cvms5_cos_rotation_angle * point_u - cvms5_sin_rotation_angle * point_v;
+            point_y = cvms5_sin_rotation_angle * point_u + cvms5_cos_rotation_angle * point_v;
+
+            load_x = floor(point_x / cvms5_total_width_m * (nx - 1));
+            load_y = floor(point_y / cvms5_total_height_m * (ny - 1));
+
+            if (max_x < min_x) {
+                min_x = max_x = load_x;
+                min_y = max_y = load_y;
+            }
+            if (load_x < min_x) min_x = load_x;
+            if (load_x > max_x) max_x = load_x;
+            if (load_y < min_y) min_y = load_y;
+            if (load_y > max_y) max_y = load_y;
+        }
+    }
+
+    // Planes are numbered from the bottom up, and a cell spans its plane and the one below.
+    max_z = (cvms5_configuration->depth / cvms5_configuration->depth_interval - 1) -
+            floor(region->min_depth / cvms5_configuration->depth_interval);
+    min_z = (cvms5_configuration->depth / cvms5_configuration->depth_interval - 1) -
+            floor(region->max_depth / cvms5_configuration->depth_interval) - 1;
+
+    // A cell spans its grid point and the next one, plus the halo on either side.
+    min_x -= 1; min_y -= 1; min_z -= 1;
+    max_x += 2; max_y += 2; max_z += 1;
+    if (min_x < 0) min_x = 0;
+    if (min_y < 0) min_y = 0;
+    if (min_z < 0) min_z = 0;
+    if (max_x > nx - 1) max_x = nx - 1;
+    if (max_y > ny - 1) max_y = ny - 1;
+    if (max_z > nz - 1) max_z = nz - 1;
+
+    if (max_x <= min_x || max_y <= min_y || max_z < min_z) return FAIL;
+
+    model->block_x = min_x;
+    model->block_y = min_y;
+    model->block_z = min_z;
+    model->block_nx = max_x - min_x + 1;
+    model->block_ny = max_y - min_y + 1;
+    model->block_nz = max_z - min_z + 1;
+
+    return SUCCESS;
+}
+
+/**
+ * Checks that all the grid points of a cell, from its x and y origin to the next grid point
+ * and from its top plane to its bottom plane, are held by the model.
+ *
+ * @param model The model.
+ * @param x The x index of the cell's origin.
+ * @param y The y index of the cell's origin.
+ * @param z_top The z index of the cell's top plane.
+ * @param z_bottom The z index of the cell's bottom plane.
+ * @return 1 if the cell is held, 0 if not.
+ */
+int cvms5_cell_in_block(cvms5_model_t *model, int x, int y, int z_top, int z_bottom) {
+    return x >= model->block_x && y >= model->block_y && z_bottom >= model->block_z &&
+           x + 1 < model->block_x + model->block_nx && y + 1 < model->block_y + model->block_ny &&
+           z_top < model->block_z + model->block_nz;
+}
+
+/**
+ * Works out the block of the grid held by one process of a partitioned model. The cells along
+ * the model's x axis are shared out between the processes in slabs, each process holding its
+ * slab's grid points plus the grid point before it and the two after it, which tricubic
+ * interpolation reads, and the whole of the y and z axes.
+ *
+ * @param partition The process's share of the model.
+ * @param model The model to set the block of.
+ * @return SUCCESS or FAIL if the process owns no cells.
+ */
+int cvms5_set_partition_block(cvms5_partition_t *partition, cvms5_model_t *model) {
+    int nx = cvms5_configuration->nx;
+    int first = cvms5_partition_first(partition->rank, partition->ranks, nx - 1);
+    int last = cvms5_partition_first(partition->rank + 1, partition->ranks, nx - 1);
+
+    if (last <= first) return FAIL;
+
+    model->block_x = first > 0 ? first - 1 : 0;
+    model->block_nx = (last + 2 < nx ? last + 2 : nx) - model->block_x;
+    model->block_y = 0;
+    model->block_ny = cvms5_configuration->ny;
+    model->block_z = 0;
+    model->block_nz = cvms5_configuration->nz;
+
+    return SUCCESS;
+}
+
+/**
+ * Returns the first cell along the model's x axis owned by a rank of a partitioned model.
+ *
+ * @param rank The rank, or the number of ranks for one past the last cell.
+ * @param ranks The number of ranks.
+ * @param cells The number of cells along the x axis.
+ * @return The x index of the rank's first cell.
+ */
+int cvms5_partition_first(int rank, int ranks, int cells) {
+    return (int)((int64_t)cells * rank / ranks);
+}
+
+/**
+ * Returns the rank of a partitioned model owning a cell along the model's x axis.
+ *
+ * @param x The x index of the cell's origin.
+ * @param ranks The number of ranks.
+ * @param cells The number of cells along the x axis.
+ * @return The rank.
+ */
+int cvms5_partition_owner(int x, int ranks, int cells) {
+    int rank = (int)((int64_t)x * ranks / cells);
+
+    while (rank > 0 && cvms5_partition_first(rank, ranks, cells) > x) rank--;
+    while (rank < ranks - 1 && cvms5_partition_first(rank + 1, ranks, cells) <= x) rank++;
+
+    return rank;
+}
+
+/**
+ * Works out the minimum, maximum and mean Vp and Vs over the model's grid points within a
+ * box, for sizing meshes. The first call builds a summary of the grid in bricks, each level
+ * of bricks merging two by two by two of the level below, so whole bricks inside the box are
+ * answered from the summary and only the grid points of bricks on its edges are visited.
+ * Bricks whose corners all lie within the box are taken whole.
+ *
+ * @param bbox_lonlat Minimum longitude, minimum latitude, maximum longitude and maximum latitude.
+ * @param zmin Minimum depth of the box, in meters.
+ * @param zmax Maximum depth of the box, in meters.
+ * @param stats The statistics, -1 if there are no grid points in the box.
+ * @return SUCCESS or FAIL if there are no grid points in the box.
+ */
+int cvms5_region_stats(double *bbox_lonlat, double zmin, double zmax, cvms5_stats_t *stats) {
+    cvms5_brick_t total;
+    cvms5_box_t box;
+    int top = 0, x = 0, y = 0, z = 0;
+
+    stats->vp_min = stats->vp_max = stats->vp_mean = -1;
+    stats->vs_min = stats->vs_max = stats->vs_mean = -1;
+    stats->count = 0;
+
+    if (cvms5_is_initialized == 0) {
+        cvms5_print_error("The model must be initialized before working out statistics.");
+        return FAIL;
+    }
+
+    if (cvms5_summary == NULL) {
+        cvms5_summary = calloc(1, sizeof(cvms5_summary_t));
+        if (cvms5_build_summary(cvms5_velocity_model, cvms5_summary) != SUCCESS) {
+            cvms5_print_error("Could not build the brick summary of the model.");
+            cvms5_free_summary(cvms5_summary);
+            cvms5_summary = NULL;
+            return FAIL;
+        }
+    }
+
+    if (cvms5_trace_box(bbox_lonlat, zmin, zmax, cvms5_velocity_model, &box) != SUCCESS) return FAIL;
+
+    memset(&total, 0, sizeof(cvms5_brick_t));
+    total.vp_min = total.vs_min = FLT_MAX;
+    total.vp_max = total.vs_max = -FLT_MAX;
+
+    top = cvms5_summary->levels - 1;
+    for (z = 0; z < cvms5_summary->nz[top]; z++)
+        for (x = 0; x < cvms5_summary->nx[top]; x++)
+            for (y = 0; y < cvms5_summary->ny[top]; y++)
+                cvms5_brick_stats(cvms5_velocity_model, cvms5_summary, top, x, y, z, &box, &total);
+
+    if (total.vp_count > 0) {
+        stats->vp_min = total.vp_min;
+        stats->vp_max = total.vp_max;
+        stats->vp_mean = total.vp_sum / total.vp_count;
+    }
+    if (total.vs_count > 0) {
+        stats->vs_min = total.vs_min;
+        stats->vs_max = total.vs_max;
+        stats->vs_mean = total.vs_sum / total.vs_count;
+    }
+    stats->count = total.vp_count > total.vs_count ? total.vp_count : total.vs_count;
+
+    return stats->count > 0 ? SUCCESS : FAIL;
+}
+
+/**
+ * Builds the brick summary of the block of the grid the model holds, reading the grid one
+ * row at a time whether it is in memory or on disk.
+ *
+ * @param model The model.
+ * @param summary The summary to build.
+ * @return SUCCESS or FAIL.
+ */
+int cvms5_build_summary(cvms5_model_t *model, cvms5_summary_t *summary) {
+    size_t count = 0, i = 0;
+    float *rows[2];
+    int level = 0, x = 0, y = 0, z = 0;
+    int dx = 0, dy = 0, dz = 0;
+
+    summary->nx[0] = (model->block_nx + CVMS5_BRICK_SIZE - 1) / CVMS5_BRICK_SIZE;
+    summary->ny[0] = (model->block_ny + CVMS5_BRICK_SIZE - 1) / CVMS5_BRICK_SIZE;
+    summary->nz[0] = (model->block_nz + CVMS5_BRICK_SIZE - 1) / CVMS5_BRICK_SIZE;
+
+    // Each level halves the bricks along every axis, down to a single brick.
+    for (level = 0; level < CVMS5_SUMMARY_LEVELS; level++) {
+        if (level > 0) {
+            summary->nx[level] = (summary->nx[level - 1] + 1) / 2;
+            summary->ny[level] = (summary->ny[level - 1] + 1) / 2;
+            summary->nz[level] = (summary->nz[level - 1] + 1) / 2;
+        }
+        count = (size_t)summary->nx[level] * summary->ny[level] * summary->nz[level];
+        summary->bricks[level] = malloc(count * sizeof(cvms5_brick_t));
+        if (summary->bricks[level] == NULL) return FAIL;
+        summary->levels = level + 1;
+
+        for (i = 0; i < count; i++) {
+            memset(&(summary->bricks[level][i]), 0, sizeof(cvms5_brick_t));
+            summary->bricks[level][i].vp_min = summary->bricks[level][i].vs_min = FLT_MAX;
+            summary->bricks[level][i].vp_max = summary->bricks[level][i].vs_max = -FLT_MAX;
+        }
+
+        if (count == 1) break;
+    }
+
+    rows[0] = malloc(model->block_ny * sizeof(float));
+    rows[1] = malloc(model->block_ny * sizeof(float));
+
+    for (z = 0; z < model->block_nz; z++) {
+        for (x = 0; x < model->block_nx; x++) {
+            if (cvms5_read_model_row(model, x, z, rows[0], rows[1]) != SUCCESS) {
+                free(rows[0]);
+                free(rows[1]);
+                return FAIL;
+            }
+
+            for (y = 0; y < model->block_ny; y++)
+                cvms5_brick_add(&(summary->bricks[0][((size_t)(z / CVMS5_BRICK_SIZE) * summary->nx[0] + x / CVMS5_BRICK_SIZE) *
+                                                     summary->ny[0] + y / CVMS5_BRICK_SIZE]), rows[0][y], rows[1][y]);
+        }
+    }
+
+    free(rows[0]);
+    free(rows[1]);
+
+    for (level = 1; level < summary->levels; level++)
+        for (z = 0; z < summary->nz[level - 1]; z++)
+            for (x = 0; x < summary->nx[level - 1]; x++)
+                for (y = 0; y < summary->ny[level - 1]; y++) {
+                    dx = x / 2; dy = y / 2; dz = z / 2;
+                    cvms5_brick_merge(&(summary->bricks[level][((size_t)dz * summary->nx[level] + dx) * summary->ny[level] + dy]),
+                                      &(summary->bricks[level - 1][((size_t)z * summary->nx[level - 1] + x) * summary->ny[level - 1] + y]));
+                }
+
+    return SUCCESS;
+}
+
+/**
+ * Reads one row of the block the model holds, all of its y points at one x and z, with the
+ * model's overlays applied. Whatever is worked out from whole rows of the grid reads them
+ * here, so that it agrees with what a query of the model returns.
+ *
+ * @param model The model.
+ * @param x The row's x index in the block.
+ * @param z The row's z index in the block.
+ * @param vp The row of Vp, or NULL if it is not wanted.
+ * @param vs The row of Vs, or NULL if it is not wanted.
+ * @return SUCCESS or FAIL if a file could not be read.
+ */
+int cvms5_read_model_row(cvms5_model_t *model, int x, int z, float *vp, float *vs) {
+    cvms5_properties_t data;
+    int y = 0;
+
+    if (vp != NULL && cvms5_read_grid_row(model, model->vp, model->vp_status, x, z, vp) != SUCCESS) return FAIL;
+    if (vs != NULL && cvms5_read_grid_row(model, model->vs, model->vs_status, x, z, vs) != SUCCESS) return FAIL;
+    if (model->overlay_count == 0) return SUCCESS;
+
+    for (y = 0; y < model->block_ny; y++) {
+        data.vp = vp != NULL ? vp[y] : -1;
+        data.vs = vs != NULL ? vs[y] : -1;
+        cvms5_apply_overlays(model, model->block_x + x, model->block_y + y, model->block_z + z, &data);
+        if (vp != NULL) vp[y] = data.vp;
+        if (vs != NULL) vs[y] = data.vs;
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Reads one row of the block of a grid the model holds, all of its y points at one x and
+ * z, from memory or from disk, as the grid holds it without the model's overlays.
+ *
+ * @param model The model.
+ * @param grid The grid, in memory or an open file.
+ * @param status The grid's status: 2 in memory, 1 on disk, 0 missing.
+ * @param x The row's x index in the block.
+ * @param z The row's z index in the block.
+ * @param row The row, -1 throughout if the grid is missing.
+ * @return SUCCESS or FAIL if the file could not be read.
+ */
+int cvms5_read_grid_row(cvms5_model_t *model, void *grid, int status, int x, int z, float *row) {
+    size_t nx = cvms5_configuration->nx, ny = cvms5_configuration->ny;
+    size_t location = 0;
+    int y = 0;
+
+    if (status == 2) {
+        memcpy(row, (float *)grid + ((size_t)z * model->block_nx + (model->block_nx - x - 1)) * model->block_ny,
+               model->block_ny * sizeof(float));
+    } else if (status == 1) {
+        location = ((size_t)(model->block_z + z) * nx + (nx - (model->block_x + x) - 1)) * ny + model->block_y;
+        if (pread(fileno((FILE *)grid), row, model->block_ny * sizeof(float), (off_t)location * sizeof(float)) !=
+            (ssize_t)(model->block_ny * sizeof(float)))
+            return FAIL;
+    } else {
+        for (y = 0; y < model->block_ny; y++) row[y] = -1;
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Frees the brick summary.
+ *
+ * @param summary The summary.
+ */
+void cvms5_free_summary(cvms5_summary_t *summary) {
+    int level = 0;
+
+    if (summary == NULL) return;
+
+    for (level = 0; level < CVMS5_SUMMARY_LEVELS; level++)
+        free(summary->bricks[level]);
+    free(summary);
+}
+
+/**
+ * Adds the values at one grid point to a brick. Negative values are not data.
+ *
+ * @param brick The brick.
+ * @param vp Vp at the grid point.
+ * @param vs Vs at the grid point.
+ */
+void cvms5_brick_add(cvms5_brick_t *brick, float vp, float vs) {
+    if (vp >= 0) {
+        if (vp < brick->vp_min) brick->vp_min = vp;
+        if (vp > brick->vp_max) brick->vp_max = vp;
+        brick->vp_sum += vp;
+        brick->vp_count++;
+    }
+    if (vs >= 0) {
+        if (vs < brick->vs_min) brick->vs_min = vs;
+        if (vs > brick->vs_max) brick->vs_max = vs;
+        brick->vs_sum += vs;
+        brick->vs_count++;
+    }
+}
+
+/**
+ * Adds one brick's summary to another's.
+ *
+ * @param brick The brick added to.
+ * @param other The brick added.
+ */
+void cvms5_brick_merge(cvms5_brick_t *brick, cvms5_brick_t *other) {
+    if (other->vp_min < brick->vp_min) brick->vp_min = other->vp_min;
+    if (other->vp_max > brick->vp_max) brick->vp_max = other->vp_max;
+    if (other->vs_min < brick->vs_min) brick->vs_min = other->vs_min;
+    if (other->vs_max > brick->vs_max) brick->vs_max = other->vs_max;
+    brick->vp_sum += other->vp_sum;
+    brick->vs_sum += other->vs_sum;
+    brick->vp_count += other->vp_count;
+    brick->vs_count += other->vs_count;
+}
+
+/**
+ * Traces the outline of a longitude and latitude box into the model's frame, in grid point
+ * indices of the block the model holds, and works out the block's planes within its depths.
+ *
+ * @param bbox_lonlat Minimum longitude, minimum latitude, maximum longitude and maximum latitude.
+ * @param zmin Minimum depth of the box, in meters.
+ * @param zmax Maximum depth of the box, in meters.
+ * @param model The model.
+ * @param box The traced box.
+ * @return SUCCESS or FAIL if the box misses the block.
+ */
+int cvms5_trace_box(double *bbox_lonlat, double zmin, double zmax, cvms5_model_t *model, cvms5_box_t *box) {
+    double corner_lon[4], corner_lat[4];
+    double top_plane = cvms5_configuration->depth / cvms5_configuration->depth_interval - 1;
+    cvms5_cell_t cell;
+    int edge = 0, step = 0, n = 0;
+
+    corner_lon[0] = bbox_lonlat[0]; corner_lat[0] = bbox_lonlat[1];
+    corner_lon[1] = bbox_lonlat[0]; corner_lat[1] = bbox_lonlat[3];
+    corner_lon[2] = bbox_lonlat[2]; corner_lat[2] = bbox_lonlat[3];
+    corner_lon[3] = bbox_lonlat[2]; corner_lat[3] = bbox_lonlat[1];
+
+    for (edge = 0; edge < 4; edge++) {
+        for (step = 0; step < CVMS5_BOX_STEPS; step++) {
+            PJ_COORD xyzSrc = proj_coord(corner_lat[edge] + (corner_lat[(edge + 1) % 4] - corner_lat[edge]) * step / CVMS5_BOX_STEPS,
+                                         corner_lon[edge] + (corner_lon[(edge + 1) % 4] - corner_lon[edge]) * step / CVMS5_BOX_STEPS,
+                                         0.0, HUGE_VAL);
+            PJ_COORD xyzDest = proj_trans(cvms5_geo2utm, PJ_FWD, xyzSrc);
+
+            cvms5_utm_to_model(xyzDest.xyzt.x, xyzDest.xyzt.y, &cell);
+            box->x[n] = cell.point_x / cvms5_total_width_m * (cvms5_configuration->nx - 1) - model->block_x;
+            box->y[n] = cell.point_y / cvms5_total_height_m * (cvms5_configuration->ny - 1) - model->block_y;
+
+            if (n == 0 || box->x[n] < box->min_x) box->min_x = box->x[n];
+            if (n == 0 || box->x[n] > box->max_x) box->max_x = box->x[n];
+            if (n == 0 || box->y[n] < box->min_y) box->min_y = box->y[n];
+            if (n == 0 || box->y[n] > box->max_y) box->max_y = box->y[n];
+            n++;
+        }
+    }
+
+    // Planes are numbered from the bottom up.
+    box->max_z = floor(top_plane - zmin / cvms5_configuration->depth_interval) - model->block_z;
+    box->min_z = ceil(top_plane - zmax / cvms5_configuration->depth_interval) - model->block_z;
+    if (box->min_z < 0) box->min_z = 0;
+    if (box->max_z > model->block_nz - 1) box->max_z = model->block_nz - 1;
+
+    if (box->min_z > box->max_z || box->max_x < 0 || box->max_y < 0 ||
+        box->min_x > model->block_nx - 1 || box->min_y > model->block_ny - 1)
+        return FAIL;
+
+    return SUCCESS;
+}
+
+/**
+ * Checks whether a grid point lies within the outline of a traced box.
+ *
+ * @param box The traced box.
+ * @param x The grid point's x index in the block.
+ * @param y The grid point's y index in the block.
+ * @return 1 if it does, 0 if not.
+ */
+int cvms5_box_contains(cvms5_box_t *box, double x, double y) {
+    int inside = 0, i = 0, j = 4 * CVMS5_BOX_STEPS - 1;
+
+    if (x < box->min_x || x > box->max_x || y < box->min_y || y > box->max_y) return 0;
+
+    for (i = 0; i < 4 * CVMS5_BOX_STEPS; j = i++) {
+        if ((box->y[i] > y) != (box->y[j] > y) &&
+            x < (box->x[j] - box->x[i]) * (y - box->y[i]) / (box->y[j] - box->y[i]) + box->x[i])
+            inside = !inside;
+    }
+
+    return inside;
+}
+
+/**
+ * Adds the part of a brick that lies within a traced box to the total. Bricks wholly in the
+ * box are added from the summary, bricks partly in it are split into the bricks of the level
+ * below and, at the finest level, into their grid points.
+ *
+ * @param model The model.
+ * @param summary The brick summary.
+ * @param level The brick's level.
+ * @param bx The brick's x index.
+ * @param by The brick's y index.
+ * @param bz The brick's z index.
+ * @param box The traced box.
+ * @param total The total so far.
+ */
+void cvms5_brick_stats(cvms5_model_t *model, cvms5_summary_t *summary, int level, int bx, int by, int bz,
+                       cvms5_box_t *box, cvms5_brick_t *total) {
+    int size = CVMS5_BRICK_SIZE << level;
+    int x0 = bx * size, y0 = by * size, z0 = bz * size;
+    int x1 = x0 + size - 1, y1 = y0 + size - 1, z1 = z0 + size - 1;
+    cvms5_properties_t data;
+    int x = 0, y = 0, z = 0, dx = 0, dy = 0, dz = 0;
+
+    if (x1 > model->block_nx - 1) x1 = model->block_nx - 1;
+    if (y1 > model->block_ny - 1) y1 = model->block_ny - 1;
+    if (z1 > model->block_nz - 1) z1 = model->block_nz - 1;
+
+    // Outside the box?
+    if (x1 < box->min_x || x0 > box->max_x || y1 < box->min_y || y0 > box->max_y || z1 < box->min_z || z0 > box->max_z)
+        return;
+
+    // Wholly inside the box?
+    if (z0 >= box->min_z && z1 <= box->max_z && cvms5_box_contains(box, x0, y0) && cvms5_box_contains(box, x1, y0) &&
+        cvms5_box_contains(box, x0, y1) && cvms5_box_contains(box, x1, y1)) {
+        cvms5_brick_merge(total, &(summary->bricks[level][((size_t)bz * summary->nx[level] + bx) * summary->ny[level] + by]));
+        return;
+    }
+
+    if (level == 0) {
+        if (z0 < box->min_z) z0 = box->min_z;
+        if (z1 > box->max_z) z1 = box->max_z;
+        for (x = x0; x <= x1; x++) {
+            for (y = y0; y <= y1; y++) {
+                if (!cvms5_box_contains(box, x, y)) continue;
+                for (z = z0; z <= z1; z++) {
+                    cvms5_read_model_properties(model, model->block_x + x, model->block_y + y, model->block_z + z, &data);
+                    cvms5_brick_add(total, data.vp, data.vs);
+                }
+            }
+        }
+        return;
+    }
+
+    for (dz = 0; dz < 2; dz++)
+        for (dx = 0; dx < 2; dx++)
+            for (dy = 0; dy < 2; dy++)
+                if (2 * bx + dx < summary->nx[level - 1] && 2 * by + dy < summary->ny[level - 1] &&
+                    2 * bz + dz < summary->nz[level - 1])
+                    cvms5_brick_stats(model, summary, level - 1, 2 * bx + dx, 2 * by + dy, 2 * bz + dz, box, total);
+}
+
+/**
+ * Returns the depth at which Vs first reaches a threshold going down from the surface, such
+ * as Z1.0 and Z2.5 for thresholds of 1000 and 2500 m/s, on the model's interpolated profile at
+ * a point. The first call for a threshold indexes the first plane at which each column of the
+ * grid reaches it. Above the shallowest of those planes among the point's four columns the
+ * profile cannot reach the threshold, so only the profile from there down is interpolated.
+ * The GTL is not taken into account.
+ *
+ * @param longitude The longitude of the point.
+ * @param latitude The latitude of the point.
+ * @param vs_threshold The Vs threshold, in m/s.
+ * @return The depth in meters, or -1 if the point is outside the model or Vs never reaches the threshold.
+ */
+double cvms5_query_zdepth(double longitude, double latitude, double vs_threshold) {
+    cvms5_model_t *model = cvms5_velocity_model;
+    cvms5_zdepth_index_t *index = NULL;
+    cvms5_properties_t four_points[4];
+    cvms5_properties_t above, here;
+    cvms5_point_t point;
+    cvms5_cell_t cell;
+    double top_plane = 0;
+    int columns[4];
+    int first = -1, plane = 0, i = 0;
+
+    if (cvms5_is_initialized == 0) {
+        cvms5_print_error("The model must be initialized before querying basin depths.");
+        return -1;
+    }
+
+    point.longitude = longitude;
+    point.latitude = latitude;
+    point.depth = 0;
+    if (cvms5_project_point(cvms5_geo2utm, PJ_DEFAULT_CTX, &point, &cell) != SUCCESS) return -1;
+
+    // The point's columns, from the cell at the surface.
+    cvms5_locate_cell(&(cvms5_pyramid[0]), 0, &cell);
+    if (cell.type == CVMS5_CELL_NONE) return -1;
+
+    if ((index = cvms5_get_zdepth_index(vs_threshold)) == NULL) return -1;
+
+    columns[0] = (cell.x - model->block_x) * model->block_ny + (cell.y - model->block_y);
+    columns[1] = columns[0] + model->block_ny;
+    columns[2] = columns[0] + 1;
+    columns[3] = columns[1] + 1;
+    for (i = 0; i < 4; i++)
+        if (index->first_plane[columns[i]] > first) first = index->first_plane[columns[i]];
+    if (first < 0) return -1;
+
+    top_plane = cvms5_configuration->depth / cvms5_configuration->depth_interval - 1;
+    above.vs = -1;
+
+    for (plane = model->block_z + first; plane >= model->block_z; plane--) {
+        cvms5_read_model_properties(model, cell.x,     cell.y,     plane, &(four_points[0]));
+        cvms5_read_model_properties(model, cell.x + 1, cell.y,     plane, &(four_points[1]));
+        cvms5_read_model_properties(model, cell.x,     cell.y + 1, plane, &(four_points[2]));
+        cvms5_read_model_properties(model, cell.x + 1, cell.y + 1, plane, &(four_points[3]));
+        cvms5_bilinear_interpolation(cell.x_percent, cell.y_percent, four_points, &here);
+
+        if (here.vs >= vs_threshold) {
+            // The profile is linear between planes.
+            if (plane == model->block_z + first && plane + 1 < model->block_z + model->block_nz) {
+                cvms5_read_model_properties(model, cell.x,     cell.y,     plane + 1, &(four_points[0]));
+                cvms5_read_model_properties(model, cell.x + 1, cell.y,     plane + 1, &(four_points[1]));
+                cvms5_read_model_properties(model, cell.x,     cell.y + 1, plane + 1, &(four_points[2]));
+                cvms5_read_model_properties(model, cell.x + 1, cell.y + 1, plane + 1, &(four_points[3]));
+                cvms5_bilinear_interpolation(cell.x_percent, cell.y_percent, four_points, &above);
+            }
+            if (above.vs < 0 || above.vs >= vs_threshold)
+                return (top_plane - plane) * cvms5_configuration->depth_interval;
+            return (top_plane - plane - 1 + (vs_threshold - above.vs) / (here.vs - above.vs)) *
+                   cvms5_configuration->depth_interval;
+        }
+
+        above = here;
+    }
+
+    return -1;
+}
+
+/**
+ * Returns the depth index for a Vs threshold, building it if it is not one of the
+ * CVMS5_ZDEPTH_INDEXES kept.
+ *
+ * @param vs_threshold The Vs threshold, in m/s.
+ * @return The index, or NULL if it could not be built.
+ */
+cvms5_zdepth_index_t *cvms5_get_zdepth_index(double vs_threshold) {
+    cvms5_zdepth_index_t *index = NULL;
+    int i = 0;
+
+    for (i = 0; i < CVMS5_ZDEPTH_INDEXES; i++)
+        if (cvms5_zdepth_indexes[i].first_plane != NULL && cvms5_zdepth_indexes[i].threshold == vs_threshold)
+            return &(cvms5_zdepth_indexes[i]);
+
+    index = &(cvms5_zdepth_indexes[cvms5_zdepth_next]);
+    cvms5_zdepth_next = (cvms5_zdepth_next + 1) % CVMS5_ZDEPTH_INDEXES;
+
+    free(index->first_plane);
+    index->first_plane = NULL;
+    index->threshold = vs_threshold;
+
+    if (cvms5_build_zdepth_index(cvms5_velocity_model, index) != SUCCESS) {
+        cvms5_print_error("Could not build the basin depth index.");
+        free(index->first_plane);
+        index->first_plane = NULL;
+        return NULL;
+    }
+
+    return index;
+}
+
+/**
+ * Builds the depth index for a Vs threshold, reading the grid a plane at a time from the
+ * surface down and stopping once every column has reached the threshold.
+ *
+ * @param model The model.
+ * @param index The index, with the threshold set.
+ * @return SUCCESS or FAIL.
+ */
+int cvms5_build_zdepth_index(cvms5_model_t *model, cvms5_zdepth_index_t *index) {
+    size_t columns = (size_t)model->block_nx * model->block_ny;
+    size_t remaining = columns, i = 0;
+    float *row = malloc(model->block_ny * sizeof(float));
+    int x = 0, y = 0, z = 0;
+
+    index->first_plane = malloc(columns * sizeof(int));
+    for (i = 0; i < columns; i++) index->first_plane[i] = -1;
+
+    for (z = model->block_nz - 1; z >= 0 && remaining > 0; z--) {
+        for (x = 0; x < model->block_nx; x++) {
+            if (cvms5_read_model_row(model, x, z, NULL, row) != SUCCESS) {
+                free(row);
+                return FAIL;
+            }
+            for (y = 0; y < model->block_ny; y++) {
+                i = (size_t)x * model->block_ny + y;
+                if (index->first_plane[i] < 0 && row[y] >= index->threshold) {
+                    index->first_plane[i] = z;
+                    remaining--;
+                }
+            }
+        }
+    }
+
+    free(row);
+
+    return SUCCESS;
+}
+
+/**
+ * Chooses the pyramid level that queries are answered from. Coarser levels are smoothed
+ * before they are decimated, so a caller meshing at a coarse resolution gets values that
+ * represent the whole of its cells instead of point samples aliased from the fine grid.
+ * The coarsest level whose grid spacing is no larger than the resolution is used, or the
+ * coarsest one below it that has been built. Points that fall outside the grid of a level,
+ * near the edges of the model, are answered from the model itself.
+ *
+ * @param resolution The target resolution in meters, zero or less for the model itself.
+ * @return The level used, or -1 if the model is not initialized.
+ */
+int cvms5_set_query_resolution(double resolution) {
+    double spacing = 0;
+    int level = 0;
+
+    if (cvms5_is_initialized == 0) {
+        cvms5_print_error("The model must be initialized before choosing a resolution.");
+        return -1;
+    }
+
+    spacing = cvms5_total_width_m / (cvms5_configuration->nx - 1);
+    if (cvms5_total_height_m / (cvms5_configuration->ny - 1) > spacing)
+        spacing = cvms5_total_height_m / (cvms5_configuration->ny - 1);
+    if (cvms5_configuration->depth_interval > spacing)
+        spacing = cvms5_configuration->depth_interval;
+
+    while (level + 1 < CVMS5_PYRAMID_LEVELS && spacing * (1 << (level + 1)) <= resolution) {
+        if (cvms5_pyramid[level + 1].model == NULL && cvms5_load_level(level + 1) != SUCCESS)
+            break;
+        level++;
+    }
+
+    cvms5_query_level = level;
+
+    return level;
+}
+
+/**
+ * Loads one level of the model pyramid from the vp_level and vs_level files that
+ * cvms5_build_pyramid wrote into the model's directory. Levels are always held in memory.
+ *
+ * @param level The level to load, from 1 to CVMS5_PYRAMID_LEVELS - 1.
+ * @return SUCCESS or FAIL if the level's files are missing, out of date or cannot be read.
+ */
+int cvms5_load_level(int level) {
+    cvms5_level_t *pyramid_level = NULL;
+    cvms5_model_t *model = NULL;
+    char current_file[256], source_file[256];
+    size_t points = 0;
+    int factor = 0;
+    int j = 0;
+
+    if (level < 1 || level >= CVMS5_PYRAMID_LEVELS) return FAIL;
+    if (cvms5_region != NULL || cvms5_partition != NULL) return FAIL;
+
+    pyramid_level = &(cvms5_pyramid[level]);
+    factor = 1 << level;
+    pyramid_level->nx = (cvms5_configuration->nx - 1) / factor + 1;
+    pyramid_level->ny = (cvms5_configuration->ny - 1) / factor + 1;
+    pyramid_level->nz = (cvms5_configuration->nz - 1) / factor + 1;
+    pyramid_level->factor = factor;
+    pyramid_level->top_plane = pyramid_level->nz - 1;
+    points = (size_t)pyramid_level->nx * pyramid_level->ny * pyramid_level->nz;
+
+    if (pyramid_level->nx < 2 || pyramid_level->ny < 2 || pyramid_level->nz < 2) return FAIL;
+
+    model = calloc(1, sizeof(cvms5_model_t));
+    model->block_nx = pyramid_level->nx;
+    model->block_ny = pyramid_level->ny;
+    model->block_nz = pyramid_level->nz;
+
+    for (j = 0; j < 2; j++) {
+        sprintf(current_file, "%s/%s_level%d.dat", cvms5_iteration_directory, j == 0 ? "vp" : "vs", level);
+        sprintf(source_file, "%s/%s.dat", cvms5_iteration_directory, j == 0 ? "vp" : "vs");
+        if (cvms5_read_level_grid(current_file, source_file, points, j == 0 ? &(model->vp) : &(model->vs)) != SUCCESS)
+            continue;
+        if (j == 0)
+            model->vp_status = 2;
+        else
+            model->vs_status = 2;
+    }
+
+    // A level must hold what the model holds.
+    if ((cvms5_velocity_model->vp_status != 0 && model->vp_status == 0) ||
+        (cvms5_velocity_model->vs_status != 0 && model->vs_status == 0)) {
+        free(model->vp);
+        free(model->vs);
+        free(model);
+        return FAIL;
+    }
+
+    pyramid_level->model = model;
+
+    return SUCCESS;
+}
+
+/**
+ * Reads one grid of a pyramid level. The level's header records the size and modification
+ * time of the grid file it was built from and of the overlays applied over it, and a level
+ * built from another version of the model is ignored with a warning so it is not mixed with
+ * the current grid.
+ *
+ * @param file The level file.
+ * @param source The model's grid file the level was built from.
+ * @param points Number of points in the level's grid.
+ * @param grid Set to the grid, NULL unless SUCCESS is returned.
+ * @return SUCCESS or FAIL if the level file is missing, out of date or cannot be read.
+ */
+int cvms5_read_level_grid(char *file, char *source, size_t points, void **grid) {
+    cvms5_level_header_t header;
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    FILE *fp = NULL;
+
+    *grid = NULL;
+
+    fp = fopen(file, "rb");
+    if (fp == NULL) return FAIL;
+
+    if (fread(&header, sizeof(header), 1, fp) != 1 ||
+        memcmp(header.magic, CVMS5_LEVEL_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != CVMS5_LEVEL_VERSION ||
+        cvms5_source_stamp(source, &size, &mtime) != SUCCESS ||
+        size != header.source_size || mtime != header.source_mtime ||
+        header.overlays_stamp != cvms5_stamp_overlays()) {
+        fprintf(stderr, "WARNING: Ignoring out of date pyramid level %s, run cvms5_pyramid to rebuild it.\n", file);
+        fclose(fp);
+        return FAIL;
+    }
+
+    *grid = malloc(points * sizeof(float));
+    if (*grid == NULL || fread(*grid, sizeof(float), points, fp) != points) {
+        free(*grid);
+        *grid = NULL;
+        fclose(fp);
+        return FAIL;
+    }
+    fclose(fp);
+
+    return SUCCESS;
+}
+
+/**
+ * Builds the model pyramid from the model, which must be held in memory in full. Each level
+ * is the previous one smoothed and decimated by two along every axis, the first built from
+ * the model with its overlays applied. The levels are written as vp_level and vs_level files
+ * next to the model's own, stamped with the grid files and overlays they were built from,
+ * and loaded for querying.
+ *
+ * @param levels Number of levels to build, not counting the model itself.
+ * @return SUCCESS or FAIL.
+ */
+int cvms5_build_pyramid(int levels) {
+    cvms5_level_t *coarse = NULL, *fine = NULL;
+    cvms5_level_header_t header;
+    char current_file[256];
+    size_t points = 0;
+    FILE *fp = NULL;
+    int i = 0, j = 0;
+
+    if (cvms5_is_initialized == 0) {
+        cvms5_print_error("The model must be initialized before building the pyramid.");
+        return FAIL;
+    }
+    if (cvms5_region != NULL || cvms5_partition != NULL || cvms5_window != NULL ||
+        cvms5_velocity_model->vp_status == 1 || cvms5_velocity_model->vs_status == 1) {
+        cvms5_print_error("The whole model must be held in memory to build the pyramid.");
+        return FAIL;
+    }
+
+    for (i = 1; i <= levels && i < CVMS5_PYRAMID_LEVELS; i++) {
+        fine = &(cvms5_pyramid[i - 1]);
+        coarse = &(cvms5_pyramid[i]);
+
+        if (coarse->model != NULL) {
+            free(coarse->model->vp);
+            free(coarse->model->vs);
+            free(coarse->model);
+        }
+        memset(coarse, 0, sizeof(cvms5_level_t));
+
+        coarse->factor = 1 << i;
+        coarse->nx = (cvms5_configuration->nx - 1) / coarse->factor + 1;
+        coarse->ny = (cvms5_configuration->ny - 1) / coarse->factor + 1;
+        coarse->nz = (cvms5_configuration->nz - 1) / coarse->factor + 1;
+        coarse->top_plane = coarse->nz - 1;
+        points = (size_t)coarse->nx * coarse->ny * coarse->nz;
+
+        if (coarse->nx < 2 || coarse->ny < 2 || coarse->nz < 2) {
+            fprintf(stderr, "WARNING: The model is too small for more than %d pyramid levels.\n", i - 1);
+            break;
+        }
+
+        coarse->model = calloc(1, sizeof(cvms5_model_t));
+        coarse->model->block_nx = coarse->nx;
+        coarse->model->block_ny = coarse->ny;
+        coarse->model->block_nz = coarse->nz;
+
+        for (j = 0; j < 2; j++) {
+            float *fine_grid = j == 0 ? fine->model->vp : fine->model->vs;
+            int fine_status = j == 0 ? fine->model->vp_status : fine->model->vs_status;
+            float *grid = NULL, *overlaid = NULL, *row = NULL;
+            int x = 0, z = 0;
+
+            if (fine_status != 2) continue;
+
+            grid = malloc(points * sizeof(float));
+            if (grid == NULL) {
+                cvms5_print_error("Could not allocate a level of the pyramid.");
+                return FAIL;
+            }
+
+            // The overlays are applied over a copy of the model's grid, which is laid out the same.
+            if (fine->model->overlay_count > 0) {
+                overlaid = malloc((size_t)fine->nx * fine->ny * fine->nz * sizeof(float));
+                if (overlaid == NULL) {
+                    free(grid);
+                    cvms5_print_error("Could not allocate a level of the pyramid.");
+                    return FAIL;
+                }
+                for (z = 0; z < fine->nz; z++)
+                    for (x = 0; x < fine->nx; x++) {
+                        row = overlaid + ((size_t)z * fine->nx + (fine->nx - x - 1)) * fine->ny;
+                        cvms5_read_model_row(fine->model, x, z, j == 0 ? row : NULL, j == 0 ? NULL : row);
+                    }
+                fine_grid = overlaid;
+            }
+
+            cvms5_downsample_grid(fine_grid, fine->nx, fine->ny, fine->nz, grid, coarse->nx, coarse->ny, coarse->nz);
+            free(overlaid);
+
+            if (j == 0) {
+                coarse->model->vp = grid;
+                coarse->model->vp_status = 2;
+            } else {
+                coarse->model->vs = grid;
+                coarse->model->vs_status = 2;
+            }
+
+            // Stamp the level with the grid file it was built from.
+            memset(&header, 0, sizeof(header));
+            memcpy(header.magic, CVMS5_LEVEL_MAGIC, sizeof(header.magic));
+            header.version = CVMS5_LEVEL_VERSION;
+            sprintf(current_file, "%s/%s.dat", cvms5_iteration_directory, j == 0 ? "vp" : "vs");
+            cvms5_source_stamp(current_file, &(header.source_size), &(header.source_mtime));
+            header.overlays_stamp = cvms5_stamp_overlays();
+
+            sprintf(current_file, "%s/%s_level%d.dat", cvms5_iteration_directory, j == 0 ? "vp" : "vs", i);
+            fp = fopen(current_file, "wb");
+            if (fp == NULL || fwrite(&header, sizeof(header), 1, fp) != 1 ||
+                fwrite(grid, sizeof(float), points, fp) != points) {
+                if (fp != NULL) fclose(fp);
+                cvms5_print_error("Could not write a level of the pyramid.");
+                return FAIL;
+            }
+            fclose(fp);
+        }
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Smooths a grid with a [1 2 1] / 4 binomial filter along each axis and keeps every other
+ * point, so that grid point (x, y, z) of the coarse grid lies on grid point (2x, 2y, z') of
+ * the fine grid, where the planes are counted up from the surface. Points beyond the edges
+ * of the fine grid take the value at the edge.
+ *
+ * @param src The fine grid, laid out like the model's files.
+ * @param nx Number of x points in the fine grid.
+ * @param ny Number of y points in the fine grid.
+ * @param nz Number of z points in the fine grid.
+ * @param dst The coarse grid, laid out like the model's files.
+ * @param dnx Number of x points in the coarse grid.
+ * @param dny Number of y points in the coarse grid.
+ * @param dnz Number of z points in the coarse grid.
+ */
+void cvms5_downsample_grid(float *src, int nx, int ny, int nz, float *dst, int dnx, int dny, int dnz) {
+    double weights[3] = {0.25, 0.5, 0.25};
+    double sum = 0;
+    int x = 0, y = 0, z = 0, dx = 0, dy = 0, dz = 0;
+    int fx = 0, fy = 0, fz = 0;
+
+    for (z = 0; z < dnz; z++) {
+        for (x = 0; x < dnx; x++) {
+            for (y = 0; y < dny; y++) {
+                sum = 0;
+                for (dz = -1; dz <= 1; dz++) {
+                    fz = (nz - 1) - 2 * (dnz - 1 - z) + dz;
+                    if (fz < 0) fz = 0;
+                    if (fz > nz - 1) fz = nz - 1;
+                    for (dx = -1; dx <= 1; dx++) {
+                        fx = 2 * x + dx;
+                        if (fx < 0) fx = 0;
+                        if (fx > nx - 1) fx = nx - 1;
+                        for (dy = -1; dy <= 1; dy++) {
+                            fy = 2 * y + dy;
+                            if (fy < 0) fy = 0;
+                            if (fy > ny - 1) fy = ny - 1;
+                            sum += weights[dz + 1] * weights[dx + 1] * weights[dy + 1] *
+                                   src[((size_t)fz * nx + (nx - fx - 1)) * ny + fy];
+                        }
+                    }
+                }
+                dst[((size_t)z * dnx + (dnx - x - 1)) * dny + y] = sum;
+            }
+        }
+    }
+}
+
+/**
+ * Prepares the snapshot for the given model. The model is read from its source files, the Vs30
+ * map is rasterized over the model's footprint and everything is written to CVMS5_SNAPSHOT_FILE
+ * in the model's data directory, where cvms5_init picks it up from then on.
+ *
+ * @param dir The directory in which UCVM has been installed.
+ * @param label A unique identifier for the velocity model.
+ * @return SUCCESS or FAIL.
+ */
+int cvms5_prepare(const char *dir, const char *label) {
+    char snapshot_file[512];
+    char config_file[512];
+    cvms5_vs30_raster_t *raster = NULL;
+    int retVal = 0;
+
+    // Always start from the source files, never from an older snapshot.
+    cvms5_use_snapshot = 0;
+    retVal = cvms5_init(dir, label);
+    cvms5_use_snapshot = 1;
+
+    if (retVal != SUCCESS) return FAIL;
+
+    if (cvms5_velocity_model->vp_status == 1 || cvms5_velocity_model->vs_status == 1) {
+        cvms5_print_error("The model must fit in memory to prepare a snapshot.");
+        cvms5_finalize();
+        return FAIL;
+    }
+
+    // The raster is only installed once complete, as cvms5_get_vs30_payload reads from it.
+    raster = calloc(1, sizeof(cvms5_vs30_raster_t));
+    if (cvms5_rasterize_vs30_map(cvms5_vs30_map, raster) == SUCCESS) {
+        cvms5_vs30_raster = raster;
+    } else {
+        fprintf(stderr, "WARNING: Could not rasterize the Vs30 map, the snapshot will not include it.\n");
+        free(raster);
+    }
+
+    sprintf(snapshot_file, "%s/model/%s/data/%s", dir, label, CVMS5_SNAPSHOT_FILE);
+    sprintf(config_file, "%s/model/%s/data/config", dir, label);
+    retVal = cvms5_write_snapshot(snapshot_file, config_file);
+
+    cvms5_finalize();
+
+    return retVal;
+}
+
+/**
+ * Writes the currently loaded model to a snapshot. The file is written next to its final
+ * location and renamed into place so that a running cvms5_init never sees a partial snapshot.
+ *
+ * @param file The snapshot file to write.
+ * @param config_file The configuration file the model was read from.
+ * @return SUCCESS or FAIL.
+ */
+int cvms5_write_snapshot(char *file, char *config_file) {
+    cvms5_snapshot_header_t header;
+    char temp_file[520];
+    char current_file[256];
+    uint64_t grid_size = (uint64_t)cvms5_configuration->nx * cvms5_configuration->ny * cvms5_configuration->nz * sizeof(float);
+    uint64_t offset = 0;
+    FILE *fp;
+
+    memset(&header, 0, sizeof(cvms5_snapshot_header_t));
+    memcpy(header.magic, CVMS5_SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = CVMS5_SNAPSHOT_VERSION;
+    header.header_size = sizeof(cvms5_snapshot_header_t);
+    header.byte_order = CVMS5_SNAPSHOT_BYTE_ORDER;
+
+    if (cvms5_checksum_file(config_file, &(header.config_checksum)) != SUCCESS) {
+        cvms5_print_error("Could not read the configuration file to prepare the snapshot.");
+        return FAIL;
+    }
+    sprintf(current_file, "%s/vp.dat", cvms5_iteration_directory);
+    cvms5_source_stamp(current_file, &(header.vp_source_size), &(header.vp_source_mtime));
+    sprintf(current_file, "%s/vs.dat", cvms5_iteration_directory);
+    cvms5_source_stamp(current_file, &(header.vs_source_size), &(header.vs_source_mtime));
+    cvms5_source_stamp(vs30_etree_file, &(header.vs30_source_size), &(header.vs30_source_mtime));
+
+    header.configuration = *cvms5_configuration;
+    header.vs30_map = *cvms5_vs30_map;
+    header.vs30_map.vs30_map = NULL;
+    header.cos_rotation_angle = cvms5_cos_rotation_angle;
+    header.sin_rotation_angle = cvms5_sin_rotation_angle;
+    header.total_height_m = cvms5_total_height_m;
+    header.total_width_m = cvms5_total_width_m;
+    header.cos_vs30_rotation_angle = cvms5_cos_vs30_rotation_angle;
+    header.sin_vs30_rotation_angle = cvms5_sin_vs30_rotation_angle;
+
+    // Lay out the sections one after the other, each aligned for mapping.
+    offset = sizeof(cvms5_snapshot_header_t);
+    if (cvms5_velocity_model->vp_status == 2) {
+        offset = (offset + CVMS5_SNAPSHOT_ALIGNMENT - 1) / CVMS5_SNAPSHOT_ALIGNMENT * CVMS5_SNAPSHOT_ALIGNMENT;
+        header.vp.offset = offset;
+        header.vp.size = grid_size;
+        header.vp.checksum = cvms5_checksum(cvms5_velocity_model->vp, grid_size, 0);
+        offset += grid_size;
+    }
+    if (cvms5_velocity_model->vs_status == 2) {
+        offset = (offset + CVMS5_SNAPSHOT_ALIGNMENT - 1) / CVMS5_SNAPSHOT_ALIGNMENT * CVMS5_SNAPSHOT_ALIGNMENT;
+        header.vs.offset = offset;
+        header.vs.size = grid_size;
+        header.vs.checksum = cvms5_checksum(cvms5_velocity_model->vs, grid_size, 0);
+        offset += grid_size;
+    }
+    if (cvms5_vs30_raster != NULL) {
+        offset = (offset + CVMS5_SNAPSHOT_ALIGNMENT - 1) / CVMS5_SNAPSHOT_ALIGNMENT * CVMS5_SNAPSHOT_ALIGNMENT;
+        header.vs30_raster = *cvms5_vs30_raster;
+        header.vs30_raster.payload = NULL;
+        header.vs30.offset = offset;
+        header.vs30.size = (uint64_t)cvms5_vs30_raster->nx * cvms5_vs30_raster->ny * sizeof(cvms5_vs30_mpayload_t);
+        header.vs30.checksum = cvms5_checksum(cvms5_vs30_raster->payload, header.vs30.size, 0);
+        offset += header.vs30.size;
+    }
+
+    header.header_checksum = cvms5_checksum(&header, sizeof(cvms5_snapshot_header_t), 0);
+
+    sprintf(temp_file, "%s.tmp", file);
+    fp = fopen(temp_file, "wb");
     if (fp == NULL) {
-        cvms5_print_error("Could not open the cvms5_configuration file.");
+        cvms5_print_error("Could not open the snapshot file for writing.");
         return FAIL;
     }
 
-    // Read the lines in the cvms5_configuration file.
-    while (fgets(line_holder, sizeof(line_holder), fp) != NULL) {
-        if (line_holder[0] != '#' && line_holder[0] != ' ' && line_holder[0] != '\n') {
-            sscanf(line_holder, "%s = %s", key, value);
+    // Seeking past the end leaves the alignment gaps as zeros.
+    if (fwrite(&header, sizeof(cvms5_snapshot_header_t), 1, fp) != 1 ||
+        (header.vp.offset != 0 && (fseek(fp, header.vp.offset, SEEK_SET) != 0 ||
+         fwrite(cvms5_velocity_model->vp, 1, header.vp.size, fp) != header.vp.size)) ||
+        (header.vs.offset != 0 && (fseek(fp, header.vs.offset, SEEK_SET) != 0 ||
+         fwrite(cvms5_velocity_model->vs, 1, header.vs.size, fp) != header.vs.size)) ||
+        (header.vs30.offset != 0 && (fseek(fp, header.vs30.offset, SEEK_SET) != 0 ||
+         fwrite(cvms5_vs30_raster->payload, 1, header.vs30.size, fp) != header.vs30.size))) {
+        cvms5_print_error("Could not write the snapshot file.");
+        fclose(fp);
+        unlink(temp_file);
+        return FAIL;
+    }
 
-            // Which variable are we editing?
-            if (strcmp(key, "utm_zone") == 0)                 config->utm_zone = atoi(value);
-            if (strcmp(key, "model_dir") == 0)                sprintf(config->model_dir, "%s", value);
-            if (strcmp(key, "nx") == 0)                       config->nx = atoi(value);
-            if (strcmp(key, "ny") == 0)                        config->ny = atoi(value);
-            if (strcmp(key, "nz") == 0)                        config->nz = atoi(value);
-            if (strcmp(key, "depth") == 0)                        config->depth = atof(value);
-            if (strcmp(key, "top_left_corner_e") == 0)         config->top_left_corner_e = atof(value);
-            if (strcmp(key, "top_left_corner_n") == 0)        config->top_left_corner_n = atof(value);
-            if (strcmp(key, "top_right_corner_e") == 0)        config->top_right_corner_e = atof(value);
-            if (strcmp(key, "top_right_corner_n") == 0)        config->top_right_corner_n = atof(value);
-            if (strcmp(key, "bottom_left_corner_e") == 0)    config->bottom_left_corner_e = atof(value);
-            if (strcmp(key, "bottom_left_corner_n") == 0)    config->bottom_left_corner_n = atof(value);
-            if (strcmp(key, "bottom_right_corner_e") == 0)    config->bottom_right_corner_e = atof(value);
-            if (strcmp(key, "bottom_right_corner_n") == 0)    config->bottom_right_corner_n = atof(value);
-            if (strcmp(key, "depth_interval") == 0)            config->depth_interval = atof(value);
-            if (strcmp(key, "p0") == 0)                        config->p0 = atof(value);
-            if (strcmp(key, "p1") == 0)                        config->p1 = atof(value);
-            if (strcmp(key, "p2") == 0)                        config->p2 = atof(value);
-            if (strcmp(key, "p3") == 0)                        config->p3 = atof(value);
-            if (strcmp(key, "p4") == 0)                        config->p4 = atof(value);
-            if (strcmp(key, "p5") == 0)                        config->p5 = atof(value);
-            if (strcmp(key, "gtl") == 0) {
-                if (strcmp(value, "on") == 0) config->gtl = 1;
-                else config->gtl = 0;
-            }
-        }
+    if (fclose(fp) != 0 || rename(temp_file, file) != 0) {
+        cvms5_print_error("Could not write the snapshot file.");
+        unlink(temp_file);
+        return FAIL;
     }
 
-    // Have we set up all cvms5_configuration parameters?
-    if (config->utm_zone == 0 || config->nx == 0 || config->ny == 0 || config->nz == 0 || config->model_dir[0] == '\0' ||
-        config->top_left_corner_e == 0 || config->top_left_corner_n == 0 || config->top_right_corner_e == 0 ||
-        config->top_right_corner_n == 0 || config->bottom_left_corner_e == 0 || config->bottom_left_corner_n == 0 ||
-        config->bottom_right_corner_e == 0 || config->bottom_right_corner_n == 0 || config->depth == 0 ||
-        config->depth_interval == 0 || config->p0 == 0 || config->p1 == 0 || config->p2 == 0 || config->p3 == 0 ||
-        config->p4 == 0 || config->p5 == 0) {
-        cvms5_print_error("One cvms5_configuration parameter not specified. Please check your cvms5_configuration file.");
+    return SUCCESS;
+}
+
+/**
+ * Maps the model from its snapshot, if there is one. Only the header is checked: the snapshot
+ * must match this library's layout, the configuration file it was prepared from and the size and
+ * modification time of the source grids and of UCVM's Vs30 map, where those are still present.
+ * The grids and the Vs30 raster are then used in place from the mapping.
+ *
+ * @param dir The directory in which UCVM has been installed.
+ * @param label A unique identifier for the velocity model.
+ * @return SUCCESS if the model was loaded from the snapshot, FAIL if it must be read from source.
+ */
+int cvms5_load_snapshot(const char *dir, const char *label) {
+    char snapshot_file[512];
+    char config_file[512];
+    char current_file[256];
+    cvms5_snapshot_header_t *header;
+    struct stat st;
+    uint64_t checksum = 0, size = 0;
+    int64_t mtime = 0;
+    void *base;
+    int fd;
+
+    sprintf(snapshot_file, "%s/model/%s/data/%s", dir, label, CVMS5_SNAPSHOT_FILE);
+    sprintf(config_file, "%s/model/%s/data/config", dir, label);
+
+    // No snapshot is the normal case, so fail quietly.
+    fd = open(snapshot_file, O_RDONLY);
+    if (fd < 0) return FAIL;
+
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(cvms5_snapshot_header_t)) {
+        close(fd);
         return FAIL;
     }
 
-    fclose(fp);
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return FAIL;
+
+    header = (cvms5_snapshot_header_t *)base;
+
+    if (cvms5_validate_snapshot_header(header, st.st_size) != SUCCESS) {
+        fprintf(stderr, "WARNING: Ignoring invalid snapshot %s, run cvms5_prepare to rebuild it.\n", snapshot_file);
+        munmap(base, st.st_size);
+        return FAIL;
+    }
+
+    // The snapshot is stale if the configuration or the source grids changed since it was prepared.
+    if (snprintf(cvms5_iteration_directory, sizeof(cvms5_iteration_directory), "%s/model/%s/data/%s/",
+                 dir, label, header->configuration.model_dir) >= (int)sizeof(cvms5_iteration_directory)) {
+        munmap(base, st.st_size);
+        return FAIL;
+    }
+    if (cvms5_checksum_file(config_file, &checksum) != SUCCESS || checksum != header->config_checksum) {
+        fprintf(stderr, "WARNING: Ignoring out of date snapshot %s, run cvms5_prepare to rebuild it.\n", snapshot_file);
+        munmap(base, st.st_size);
+        return FAIL;
+    }
+    sprintf(current_file, "%s/vp.dat", cvms5_iteration_directory);
+    if (cvms5_source_stamp(current_file, &size, &mtime) == SUCCESS &&
+        (size != header->vp_source_size || mtime != header->vp_source_mtime)) {
+        fprintf(stderr, "WARNING: Ignoring out of date snapshot %s, run cvms5_prepare to rebuild it.\n", snapshot_file);
+        munmap(base, st.st_size);
+        return FAIL;
+    }
+    sprintf(current_file, "%s/vs.dat", cvms5_iteration_directory);
+    if (cvms5_source_stamp(current_file, &size, &mtime) == SUCCESS &&
+        (size != header->vs_source_size || mtime != header->vs_source_mtime)) {
+        fprintf(stderr, "WARNING: Ignoring out of date snapshot %s, run cvms5_prepare to rebuild it.\n", snapshot_file);
+        munmap(base, st.st_size);
+        return FAIL;
+    }
+    // The Vs30 raster is built from UCVM's map, which may be updated apart from the model.
+    if (cvms5_source_stamp(vs30_etree_file, &size, &mtime) == SUCCESS &&
+        (size != header->vs30_source_size || mtime != header->vs30_source_mtime)) {
+        fprintf(stderr, "WARNING: Ignoring out of date snapshot %s, run cvms5_prepare to rebuild it.\n", snapshot_file);
+        munmap(base, st.st_size);
+        return FAIL;
+    }
+
+    *cvms5_configuration = header->configuration;
+    *cvms5_vs30_map = header->vs30_map;
+    cvms5_vs30_map->vs30_map = NULL;
+
+    cvms5_cos_rotation_angle = header->cos_rotation_angle;
+    cvms5_sin_rotation_angle = header->sin_rotation_angle;
+    cvms5_total_height_m = header->total_height_m;
+    cvms5_total_width_m = header->total_width_m;
+    cvms5_cos_vs30_rotation_angle = header->cos_vs30_rotation_angle;
+    cvms5_sin_vs30_rotation_angle = header->sin_vs30_rotation_angle;
+
+    cvms5_velocity_model->block_nx = cvms5_configuration->nx;
+    cvms5_velocity_model->block_ny = cvms5_configuration->ny;
+    cvms5_velocity_model->block_nz = cvms5_configuration->nz;
+    if (header->vp.offset != 0) {
+        cvms5_velocity_model->vp = (char *)base + header->vp.offset;
+        cvms5_velocity_model->vp_status = 2;
+    }
+    if (header->vs.offset != 0) {
+        cvms5_velocity_model->vs = (char *)base + header->vs.offset;
+        cvms5_velocity_model->vs_status = 2;
+    }
+    if (header->vs30.offset != 0) {
+        cvms5_vs30_raster = malloc(sizeof(cvms5_vs30_raster_t));
+        *cvms5_vs30_raster = header->vs30_raster;
+        cvms5_vs30_raster->payload = (cvms5_vs30_mpayload_t *)((char *)base + header->vs30.offset);
+    }
+
+    cvms5_snapshot_base = base;
+    cvms5_snapshot_size = st.st_size;
 
     return SUCCESS;
 }
 
 /**
- * Reads the format of the Vs30 data e-tree. This file location is typically specified
- * in the cvms5_configuration file of the model.
+ * Checks that a snapshot header was written by this version of the library on a machine of the
+ * same byte order, that it is intact and that all of its sections lie within the file.
  *
- * @param filename The e-tree's file location from which to read.
- * @param map The outputted map cvms5_configuration structure.
+ * @param header The snapshot header.
+ * @param file_size The size of the whole snapshot file.
+ * @return SUCCESS or FAIL.
  */
-int cvms5_read_vs30_map(char *filename, cvms5_vs30_map_config_t *map) {
-    char appmeta[512];
-    char *token;
-    int index = 0, retVal = 0;
-    map->vs30_map = etree_open(filename, O_RDONLY, 64, 0, 3);
-    retVal = snprintf(appmeta, sizeof(appmeta), "%s", etree_getappmeta(map->vs30_map));
+int cvms5_validate_snapshot_header(cvms5_snapshot_header_t *header, size_t file_size) {
+    cvms5_snapshot_header_t copy;
+    uint64_t grid_size = 0;
 
-    if (retVal >= 0 && retVal < 128) {
+    if (memcmp(header->magic, CVMS5_SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != CVMS5_SNAPSHOT_VERSION || header->header_size != sizeof(cvms5_snapshot_header_t) ||
+        header->byte_order != CVMS5_SNAPSHOT_BYTE_ORDER) return FAIL;
+
+    copy = *header;
+    copy.header_checksum = 0;
+    if (cvms5_checksum(&copy, sizeof(cvms5_snapshot_header_t), 0) != header->header_checksum) return FAIL;
+
+    grid_size = (uint64_t)header->configuration.nx * header->configuration.ny * header->configuration.nz * sizeof(float);
+    if ((header->vp.offset != 0 && (header->vp.size != grid_size || header->vp.offset + header->vp.size > file_size)) ||
+        (header->vs.offset != 0 && (header->vs.size != grid_size || header->vs.offset + header->vs.size > file_size)) ||
+        (header->vs30.offset != 0 && (header->vs30.size != (uint64_t)header->vs30_raster.nx * header->vs30_raster.ny *
+         sizeof(cvms5_vs30_mpayload_t) || header->vs30.offset + header->vs30.size > file_size))) return FAIL;
+
+    return SUCCESS;
+}
+
+/**
+ * Verifies a snapshot completely, including the checksum of every section. This reads the whole
+ * file, which cvms5_init deliberately never does.
+ *
+ * @param file The snapshot file to verify.
+ * @return SUCCESS or FAIL.
+ */
+int cvms5_verify_snapshot(char *file) {
+    cvms5_snapshot_header_t *header;
+    struct stat st;
+    void *base;
+    int retVal = SUCCESS;
+    int fd = open(file, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(cvms5_snapshot_header_t)) {
+        if (fd >= 0) close(fd);
+        fprintf(stderr, "Could not read snapshot %s.\n", file);
         return FAIL;
     }
 
-    // Now we need to parse the map cvms5_configuration.
-    index = 0;
-    token = strtok(appmeta, "|");
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return FAIL;
 
-    while (token != NULL) {
-        switch (index) {
-        case 0:
-            snprintf(map->type, sizeof(map->type), "%s", token);
-            break;
-        case 1:
-            snprintf(map->description, sizeof(map->description), "%s", token);
-            break;
-        case 2:
-            snprintf(map->author, sizeof(map->author), "%s", token);
-            break;
-        case 3:
-            snprintf(map->date, sizeof(map->date), "%s", token);
-            break;
-        case 4:
-            sscanf(token, "%lf", &(map->spacing));
-            break;
-        case 5:
-            snprintf(map->schema, sizeof(map->schema), "%s", token);
-            break;
-        case 6:
-            snprintf(map->projection, sizeof(map->projection), "%s", token);
-            break;
-        case 7:
-            sscanf(token, "%lf,%lf,%lf", &(map->origin_point.longitude), &(map->origin_point.latitude),
-                    &(map->origin_point.depth));
-            break;
-        case 8:
-            sscanf(token, "%lf", &(map->rotation));
-            break;
-        case 9:
-            sscanf(token, "%lf,%lf,%lf", &(map->x_dimension), &(map->y_dimension), &(map->z_dimension));
-            break;
-        case 10:
-            sscanf(token, "%u,%u,%u", &(map->x_ticks), &(map->y_ticks), &(map->z_ticks));
-            break;
-        default:
-            fprintf(stderr, "Unexpected metadata. Please check your Vs30 e-tree within UCVM.\n");
-            return FAIL;
-            break;
+    header = (cvms5_snapshot_header_t *)base;
+
+    if (cvms5_validate_snapshot_header(header, st.st_size) != SUCCESS) {
+        fprintf(stderr, "Snapshot %s has an invalid header.\n", file);
+        retVal = FAIL;
+    } else if ((header->vp.offset != 0 && cvms5_checksum((char *)base + header->vp.offset, header->vp.size, 0) != header->vp.checksum) ||
+               (header->vs.offset != 0 && cvms5_checksum((char *)base + header->vs.offset, header->vs.size, 0) != header->vs.checksum) ||
+               (header->vs30.offset != 0 && cvms5_checksum((char *)base + header->vs30.offset, header->vs30.size, 0) != header->vs30.checksum)) {
+        fprintf(stderr, "Snapshot %s is corrupt.\n", file);
+        retVal = FAIL;
+    }
+
+    munmap(base, st.st_size);
+
+    return retVal;
+}
+
+/**
+ * Rasterizes the Vs30 map over the model's footprint. The footprint is traced along the model's
+ * edges in the map's own frame and padded by a couple of map cells, so every cell that
+ * cvms5_get_vs30_value can touch for a point inside the model is read from memory.
+ *
+ * @param map The Vs30 map structure as defined during the initialization procedure.
+ * @param raster The raster to fill in. Its payload is allocated here.
+ * @return SUCCESS or FAIL if the raster would be too large.
+ */
+int cvms5_rasterize_vs30_map(cvms5_vs30_map_config_t *map, cvms5_vs30_raster_t *raster) {
+    double corner_e[4], corner_n[4];
+    double point_e = 0, point_n = 0, origin_x = 0, origin_y = 0;
+    double temp_rotated_point_x = 0, temp_rotated_point_y = 0;
+    int min_x = 0, min_y = 0, max_x = -1, max_y = -1, loc_x = 0, loc_y = 0;
+    int edge = 0, step = 0, steps = 32, margin = 2, x = 0, y = 0;
+
+    int max_level = ceil(log(map->x_dimension / map->spacing) / log(2.0));
+    etree_tick_t edgetics = (etree_tick_t)1 << (ETREE_MAXLEVEL - max_level);
+    double map_edgesize = map->x_dimension / (double)((etree_tick_t)1<<max_level);
+
+    // Walk around the box: bottom left, top left, top right, bottom right.
+    corner_e[0] = cvms5_configuration->bottom_left_corner_e;  corner_n[0] = cvms5_configuration->bottom_left_corner_n;
+    corner_e[1] = cvms5_configuration->top_left_corner_e;     corner_n[1] = cvms5_configuration->top_left_corner_n;
+    corner_e[2] = cvms5_configuration->top_right_corner_e;    corner_n[2] = cvms5_configuration->top_right_corner_n;
+    corner_e[3] = cvms5_configuration->bottom_right_corner_e; corner_n[3] = cvms5_configuration->bottom_right_corner_n;
+
+    PJ_COORD xyzSrc = proj_coord(map->origin_point.latitude, map->origin_point.longitude, 0.0, HUGE_VAL);
+    PJ_COORD xyzDest = proj_trans(cvms5_geo2aeqd, PJ_FWD, xyzSrc);
+    origin_x = xyzDest.xyzt.x;
+    origin_y = xyzDest.xyzt.y;
+
+    for (edge = 0; edge < 4; edge++) {
+        for (step = 0; step < steps; step++) {
+            point_e = corner_e[edge] + (corner_e[(edge + 1) % 4] - corner_e[edge]) * step / steps;
+            point_n = corner_n[edge] + (corner_n[(edge + 1) % 4] - corner_n[edge]) * step / steps;
+
+            // UTM back to geographic, then into the map's projection.
+            xyzSrc = proj_coord(point_e, point_n, 0.0, HUGE_VAL);
+            xyzDest = proj_trans(cvms5_geo2utm, PJ_INV, xyzSrc);
+            xyzSrc = proj_coord(xyzDest.xyzt.x, xyzDest.xyzt.y, 0.0, HUGE_VAL);
+            xyzDest = proj_trans(cvms5_geo2aeqd, PJ_FWD, xyzSrc);
+
+            temp_rotated_point_x = xyzDest.xyzt.x - origin_x;
+            temp_rotated_point_y = xyzDest.xyzt.y - origin_y;
+            loc_x = floor((cvms5_cos_vs30_rotation_angle * temp_rotated_point_x - cvms5_sin_vs30_rotation_angle * temp_rotated_point_y) / map_edgesize);
+            loc_y = floor((cvms5_sin_vs30_rotation_angle * temp_rotated_point_x + cvms5_cos_vs30_rotation_angle * temp_rotated_point_y) / map_edgesize);
+
+            if (max_x < min_x) {
+                min_x = max_x = loc_x;
+                min_y = max_y = loc_y;
+            }
+            if (loc_x < min_x) min_x = loc_x;
+            if (loc_x > max_x) max_x = loc_x;
+            if (loc_y < min_y) min_y = loc_y;
+            if (loc_y > max_y) max_y = loc_y;
         }
-        index++;
-        token = strtok(NULL, "|");
     }
 
+    // Pad, and keep to the cells whose e-tree address needs no adjustment at the map's edge.
+    min_x -= margin; min_y -= margin;
+    max_x += margin + 1; max_y += margin + 1;
+    if (min_x < 0) min_x = 0;
+    if (min_y < 0) min_y = 0;
+    if (max_x > (int)(((etree_tick_t)map->x_ticks - 1) / edgetics)) max_x = ((etree_tick_t)map->x_ticks - 1) / edgetics;
+    if (max_y > (int)(((etree_tick_t)map->y_ticks - 1) / edgetics)) max_y = ((etree_tick_t)map->y_ticks - 1) / edgetics;
+
+    if (max_x < min_x || max_y < min_y ||
+        (double)(max_x - min_x + 1) * (max_y - min_y + 1) > CVMS5_VS30_RASTER_MAX) return FAIL;
+
+    raster->x0 = min_x;
+    raster->y0 = min_y;
+    raster->nx = max_x - min_x + 1;
+    raster->ny = max_y - min_y + 1;
+    raster->payload = malloc((size_t)raster->nx * raster->ny * sizeof(cvms5_vs30_mpayload_t));
+    if (raster->payload == NULL) return FAIL;
+
+    for (y = 0; y < raster->ny; y++)
+        for (x = 0; x < raster->nx; x++)
+            cvms5_get_vs30_payload(map, raster->x0 + x, raster->y0 + y, &(raster->payload[y * raster->nx + x]));
+
+    return SUCCESS;
+}
+
+/**
+ * Computes the 64-bit FNV-1a checksum of a buffer. Pass the previous result as hash to
+ * continue a checksum over several buffers, or 0 to start a new one.
+ *
+ * @param buf The buffer.
+ * @param len The length of the buffer in bytes.
+ * @param hash The checksum so far, or 0.
+ * @return The checksum.
+ */
+uint64_t cvms5_checksum(const void *buf, size_t len, uint64_t hash) {
+    const unsigned char *ptr = (const unsigned char *)buf;
+    size_t i = 0;
+
+    if (hash == 0) hash = 14695981039346656037ULL;
+    for (i = 0; i < len; i++) {
+        hash ^= ptr[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+/**
+ * Computes the 64-bit FNV-1a checksum of a whole file.
+ *
+ * @param file The file to read.
+ * @param checksum The checksum of the file's contents.
+ * @return SUCCESS or FAIL if the file could not be read.
+ */
+int cvms5_checksum_file(char *file, uint64_t *checksum) {
+    char buf[4096];
+    size_t len = 0;
+    FILE *fp = fopen(file, "rb");
+
+    if (fp == NULL) return FAIL;
+
+    *checksum = 0;
+    while ((len = fread(buf, 1, sizeof(buf), fp)) > 0)
+        *checksum = cvms5_checksum(buf, len, *checksum);
+
+    fclose(fp);
+
+    return SUCCESS;
+}
+
+/**
+ * Retrieves the size and modification time of a source data file, which together identify
+ * the version of the data a snapshot was prepared from.
+ *
+ * @param file The file to stat.
+ * @param size The size of the file in bytes.
+ * @param mtime The modification time of the file.
+ * @return SUCCESS or FAIL if the file does not exist.
+ */
+int cvms5_source_stamp(char *file, uint64_t *size, int64_t *mtime) {
+    struct stat st;
+
+    if (stat(file, &st) != 0) return FAIL;
+
+    *size = st.st_size;
+    *mtime = st.st_mtime;
+
     return SUCCESS;
+}
+
+/**
+ * Caches the results of cvms5_query in a directory, or stops caching them. Each batch of at
+ * least CVMS5_CACHE_MIN_POINTS points is kept in a file of its own, named by its key, so a
+ * batch queried again, such as a station list or a map grid, is answered with one read.
+ * Setting the CVMS5_CACHE environment variable to a directory does the same from cvms5_init.
+ * The directory may be shared by processes and cleared at any time.
+ *
+ * @param directory The cache directory, created if need be, or NULL to stop caching.
+ * @return SUCCESS or FAIL if the directory could not be created.
+ */
+int cvms5_set_cache(const char *directory) {
+    free(cvms5_cache_directory);
+    cvms5_cache_directory = NULL;
+
+    if (directory == NULL) return SUCCESS;
+
+    if (mkdir(directory, 0755) != 0 && errno != EEXIST) {
+        cvms5_print_error("Could not create the result cache directory.");
+        return FAIL;
+    }
+    cvms5_cache_directory = strdup(directory);
 
+    return SUCCESS;
 }
 
 /**
- * Given a latitude and longitude in WGS84 co-ordinates, we find the corresponding e-tree octant
- * in the Vs30 map e-tree and read the value as well as interpolate bilinearly.
+ * Works out the stamp that identifies the model as loaded: the configuration file's contents,
+ * the size and modification time of the grids, the Vs30 map and the overlays, as for the
+ * snapshot, and the version of the results. Cached results made with a different stamp are
+ * never used, so the cache goes out of date by itself when any of them change.
  *
- * @param longitude The longitude in WGS84 format.
- * @param latitude The latitude in WGS84 format.
- * @param map The Vs30 map structure as defined during the initialization procedure.
- * @return The Vs30 value at that point, or -1 if outside the boundaries.
+ * @param config_file The configuration file the model was read from.
+ * @return The stamp.
  */
-double cvms5_get_vs30_value(double longitude, double latitude, cvms5_vs30_map_config_t *map) {
-    // Convert both points to UTM.
-    double point_x, point_y;
-    double origin_x, origin_y;
+uint64_t cvms5_stamp_model(char *config_file) {
+    char list[CVMS5_OVERLAYS_MAX + 16];
+    char current_file[640];
+    char *name = NULL, *save = NULL;
+    uint32_t version = CVMS5_CACHE_VERSION;
+    uint64_t stamp = 0, size = 0;
+    int64_t mtime = 0;
 
-    double temp_rotated_point_x = 0.0, temp_rotated_point_y = 0.0;
-    double rotated_point_x = 0.0, rotated_point_y = 0.0;
+    if (cvms5_checksum_file(config_file, &stamp) != SUCCESS) stamp = 0;
+    stamp = cvms5_checksum(cvms5_version_string, strlen(cvms5_version_string), stamp);
+    stamp = cvms5_checksum(&version, sizeof(uint32_t), stamp);
 
-    double percent = 0.0;
+    if (cvms5_source_stamp(vs30_etree_file, &size, &mtime) == SUCCESS) {
+        stamp = cvms5_checksum(&size, sizeof(uint64_t), stamp);
+        stamp = cvms5_checksum(&mtime, sizeof(int64_t), stamp);
+    }
 
-    int loc_x = 0, loc_y = 0;
-    etree_addr_t addr;
-    cvms5_vs30_mpayload_t vs30_payload[4];
+    snprintf(list, sizeof(list), "vp.dat,vs.dat,%s", cvms5_configuration->overlays);
+    for (name = strtok_r(list, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)) {
+        snprintf(current_file, sizeof(current_file), "%s%s", cvms5_iteration_directory, name);
+        if (cvms5_source_stamp(current_file, &size, &mtime) != SUCCESS) continue;
+        stamp = cvms5_checksum(&size, sizeof(uint64_t), stamp);
+        stamp = cvms5_checksum(&mtime, sizeof(int64_t), stamp);
+    }
 
-    int max_level = ceil(log(map->x_dimension / map->spacing) / log(2.0));
+    return stamp;
+}
 
-    etree_tick_t edgetics = (etree_tick_t)1 << (ETREE_MAXLEVEL - max_level);
-    double map_edgesize = map->x_dimension / (double)((etree_tick_t)1<<max_level);
+/**
+ * Works out the stamp of the overlays named in the configuration file, from their names and
+ * the size and modification time of their files, so that whatever was built with them applied
+ * can tell when they change.
+ *
+ * @return The stamp, or zero if the model has no overlays.
+ */
+uint64_t cvms5_stamp_overlays(void) {
+    char list[CVMS5_OVERLAYS_MAX];
+    char current_file[640];
+    char *name = NULL, *save = NULL;
+    uint64_t stamp = 0, size = 0;
+    int64_t mtime = 0;
 
-    PJ_COORD xyzSrc = proj_coord(latitude, longitude, 0.0, HUGE_VAL);
-    PJ_COORD xyzDest = proj_trans(cvms5_geo2aeqd, PJ_FWD, xyzSrc);
-    point_x = xyzDest.xyzt.x;
-    point_y = xyzDest.xyzt.y;
-    fprintf(stderr,"  xyzDest (%.6f)  (%.6f)\n",point_x, point_y);
+    if (cvms5_configuration->overlays[0] == '\0') return 0;
 
-    xyzSrc = proj_coord(map->origin_point.latitude, map->origin_point.longitude, 0.0, HUGE_VAL);
-    xyzDest = proj_trans(cvms5_geo2aeqd, PJ_FWD, xyzSrc);
-    origin_x = xyzDest.xyzt.x;
-    origin_y = xyzDest.xyzt.y;
-    fprintf(stderr,"  vs30Dest (%.6f)  (%.6f)\n",origin_x, origin_y);
+    snprintf(list, sizeof(list), "%s", cvms5_configuration->overlays);
+    for (name = strtok_r(list, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)) {
+        snprintf(current_file, sizeof(current_file), "%s%s", cvms5_iteration_directory, name);
+        stamp = cvms5_checksum(name, strlen(name), stamp);
+        if (cvms5_source_stamp(current_file, &size, &mtime) != SUCCESS) continue;
+        stamp = cvms5_checksum(&size, sizeof(uint64_t), stamp);
+        stamp = cvms5_checksum(&mtime, sizeof(int64_t), stamp);
+    }
 
-    // Now that both are in UTM, we can subtract and rotate.
-    temp_rotated_point_x = point_x - origin_x;
-    temp_rotated_point_y = point_y - origin_y;
+    // Zero is kept for a model without overlays.
+    return stamp == 0 ? 1 : stamp;
+}
 
-    rotated_point_x = cvms5_cos_vs30_rotation_angle * temp_rotated_point_x - cvms5_sin_vs30_rotation_angle * temp_rotated_point_y;
-    rotated_point_y = cvms5_sin_vs30_rotation_angle * temp_rotated_point_x + cvms5_cos_vs30_rotation_angle * temp_rotated_point_y;
+/**
+ * Works out the cache key of a batch of query points from the model's stamp, the settings the
+ * batch is answered with and the points, rounded to CVMS5_CACHE_DEGREES and CVMS5_CACHE_METERS.
+ *
+ * @param points The query points.
+ * @param numpoints Number of points.
+ * @return The key.
+ */
+uint64_t cvms5_cache_key(cvms5_point_t *points, int numpoints) {
+    int64_t quantized[3];
+    int settings[4];
+    uint64_t key = 0;
+    int i = 0;
 
-    // Are we within the box?
-    if (rotated_point_x < 0 || rotated_point_y < 0 || rotated_point_x > map->x_dimension ||
-        rotated_point_y > map->y_dimension) return -1;
+    settings[0] = numpoints;
+    settings[1] = cvms5_query_mode;
+    settings[2] = cvms5_interpolation;
+    settings[3] = cvms5_query_level;
 
-    // Get the integer location of the grid point within the map.
-    loc_x = floor(rotated_point_x / map_edgesize);
-    loc_y = floor(rotated_point_y / map_edgesize);
+    key = cvms5_checksum(&cvms5_model_stamp, sizeof(uint64_t), 0);
+    key = cvms5_checksum(settings, sizeof(settings), key);
 
-    // We need the four surrounding points for bilinear interpolation.
-    addr.level = ETREE_MAXLEVEL;
-    addr.x = loc_x * edgetics; addr.y = loc_y * edgetics; addr.z = 0;
-    /* Adjust addresses for edges of grid */
-    if (addr.x >= map->x_ticks) addr.x = map->x_ticks - edgetics;
-    if (addr.y >= map->y_ticks) addr.y = map->y_ticks - edgetics;
-    etree_search(map->vs30_map, addr, NULL, "*", &(vs30_payload[0]));
-    addr.x = (loc_x + 1) * edgetics; addr.y = loc_y * edgetics;
-    if (addr.x >= map->x_ticks) addr.x = map->x_ticks - edgetics;
-    if (addr.y >= map->y_ticks) addr.y = map->y_ticks - edgetics;
-    etree_search(map->vs30_map, addr, NULL, "*", &(vs30_payload[1]));
-    addr.x = loc_x * edgetics; addr.y = (loc_y + 1) * edgetics;
-    if (addr.x >= map->x_ticks) addr.x = map->x_ticks - edgetics;
-    if (addr.y >= map->y_ticks) addr.y = map->y_ticks - edgetics;
-    etree_search(map->vs30_map, addr, NULL, "*", &(vs30_payload[2]));
-    addr.x = (loc_x + 1) * edgetics; addr.y = (loc_y + 1) * edgetics;
-    if (addr.x >= map->x_ticks) addr.x = map->x_ticks - edgetics;
-    if (addr.y >= map->y_ticks) addr.y = map->y_ticks - edgetics;
-    etree_search(map->vs30_map, addr, NULL, "*", &(vs30_payload[3]));
+    // Points outside of a region of interest have no data.
+    if (cvms5_region != NULL) key = cvms5_checksum(cvms5_region, sizeof(cvms5_region_t), key);
 
-    percent = fmod(rotated_point_x / map->spacing, map->spacing) / map->spacing;
-    vs30_payload[0].vs30 = percent * vs30_payload[0].vs30 + (1 - percent) * vs30_payload[1].vs30;
-    vs30_payload[1].vs30 = percent * vs30_payload[2].vs30 + (1 - percent) * vs30_payload[3].vs30;
+    for (i = 0; i < numpoints; i++) {
+        quantized[0] = llround(points[i].longitude / CVMS5_CACHE_DEGREES);
+        quantized[1] = llround(points[i].latitude / CVMS5_CACHE_DEGREES);
+        quantized[2] = llround(points[i].depth / CVMS5_CACHE_METERS);
+        key = cvms5_checksum(quantized, sizeof(quantized), key);
+    }
 
-    return vs30_payload[0].vs30;
+    return key;
 }
 
 /**
- * Gets the GTL value using the Wills and Wald dataset, given a latitude, longitude and depth.
+ * Reads the results of a batch from the cache, if they are there and were made with the model
+ * as it is now.
  *
- * @param point The point at which to retrieve the property. Note, depth is ignored.
- * @param data The material properties at the point specified, or -1 if not found.
- * @return Success or failure.
+ * @param key The batch's key.
+ * @param data The material properties at the points.
+ * @param numpoints Number of points.
+ * @return SUCCESS or FAIL if the batch is not in the cache.
  */
-int cvms5_get_vs30_based_gtl(cvms5_point_t *point, cvms5_properties_t *data) {
-    double a = 0.5, b = 0.6, c = 0.5;
-    double percent_z = point->depth / cvms5_configuration->depth_interval;
-    double f = 0.0, g = 0.0;
-    double vs30 = 0.0, vp30 = 0.0;
+int cvms5_cache_read(uint64_t key, cvms5_properties_t *data, int numpoints) {
+    char file[640];
+    cvms5_cache_header_t *header;
+    size_t size = sizeof(cvms5_cache_header_t) + (size_t)numpoints * sizeof(cvms5_properties_t);
+    struct stat st;
+    int retVal = FAIL;
+    void *base;
+    int fd;
 
-    // Double check that we're above the first layer.
-    if (percent_z > 1) return FAIL;
+    snprintf(file, sizeof(file), "%s/%016llx.res", cvms5_cache_directory, (unsigned long long)key);
 
-    // Query for the point at depth_interval.
-    cvms5_point_t *pt = calloc(1, sizeof(cvms5_point_t));
-    cvms5_properties_t *dt = calloc(1, sizeof(cvms5_properties_t));
+    // A miss is the normal case, so fail quietly.
+    fd = open(file, O_RDONLY);
+    if (fd < 0) return FAIL;
 
-    pt->latitude = point->latitude;
-    pt->longitude = point->longitude;
-    pt->depth = cvms5_configuration->depth_interval;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size != size) {
+        close(fd);
+        return FAIL;
+    }
 
-    if (cvms5_query(pt, dt, 1) != SUCCESS) return FAIL;
+    base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return FAIL;
 
-    // Now we need the Vs30 data value.
-    vs30 = cvms5_get_vs30_value(point->longitude, point->latitude, cvms5_vs30_map);
+    header = (cvms5_cache_header_t *)base;
+    if (memcmp(header->magic, CVMS5_CACHE_MAGIC, sizeof(header->magic)) == 0 && header->version == CVMS5_CACHE_VERSION &&
+        header->numpoints == (uint32_t)numpoints && header->model_stamp == cvms5_model_stamp && header->key == key) {
+        memcpy(data, (char *)base + sizeof(cvms5_cache_header_t), (size_t)numpoints * sizeof(cvms5_properties_t));
+        retVal = SUCCESS;
+    }
 
-    if (vs30 == -1) {
-        data->vp = -1;
-        data->vs = -1;
-    } else {
-        // Get the point's material properties within the GTL.
-        f = percent_z + b * (percent_z - pow(percent_z, 2.0f));
-        g = a - a * percent_z + c * (pow(percent_z, 2.0f) + 2.0 * sqrt(percent_z) - 3.0 * percent_z);
-        data->vs = f * dt->vs + g * vs30;
-        vs30 = vs30 / 1000;
-        vp30 = 0.9409 + 2.0947 * vs30 - 0.8206 * pow(vs30, 2.0f) + 0.2683 * pow(vs30, 3.0f) - 0.0251 * pow(vs30, 4.0f);
-        vp30 = vp30 * 1000;
-        data->vp = f * dt->vp + g * vp30;
+    munmap(base, size);
+
+    return retVal;
+}
+
+/**
+ * Writes the results of a batch to the cache. The file is written next to its final name and
+ * renamed into place, so that no process ever reads part of one.
+ *
+ * @param key The batch's key.
+ * @param data The material properties at the points.
+ * @param numpoints Number of points.
+ * @return SUCCESS or FAIL.
+ */
+int cvms5_cache_write(uint64_t key, cvms5_properties_t *data, int numpoints) {
+    cvms5_cache_header_t header;
+    char file[640];
+    char temp_file[660];
+    FILE *fp;
+
+    memset(&header, 0, sizeof(cvms5_cache_header_t));
+    memcpy(header.magic, CVMS5_CACHE_MAGIC, sizeof(header.magic));
+    header.version = CVMS5_CACHE_VERSION;
+    header.numpoints = numpoints;
+    header.model_stamp = cvms5_model_stamp;
+    header.key = key;
+
+    snprintf(file, sizeof(file), "%s/%016llx.res", cvms5_cache_directory, (unsigned long long)key);
+    snprintf(temp_file, sizeof(temp_file), "%s.%d.tmp", file, (int)getpid());
+
+    fp = fopen(temp_file, "wb");
+    if (fp == NULL) return FAIL;
+
+    if (fwrite(&header, sizeof(cvms5_cache_header_t), 1, fp) != 1 ||
+        fwrite(data, sizeof(cvms5_properties_t), numpoints, fp) != (size_t)numpoints) {
+        fclose(fp);
+        unlink(temp_file);
+        return FAIL;
     }
 
-    free(pt);
-    free(dt);
+    if (fclose(fp) != 0 || rename(temp_file, file) != 0) {
+        unlink(temp_file);
+        return FAIL;
+    }
 
     return SUCCESS;
 }
 
 /**
- * Calculates the density based off of Vs. Based on Nafe-Drake scaling relationship.
+ * Records every batch given to cvms5_query, with its points, settings and how long it took, to a
+ * trace file that cvms5_replay runs again. Setting the CVMS5_TRACE environment variable to a
+ * file does the same from cvms5_init. A %p in the file name is replaced with the process id, so
+ * that each process of a parallel job writes a trace of its own. Any trace already being
+ * recorded is stopped first.
  *
- * @param vs The Vs value off which to scale.
- * @return Density, in g/m^3.
+ * @param file The trace file, which is overwritten.
+ * @return SUCCESS or FAIL if the file could not be written.
  */
-double cvms5_calculate_density(double vs) {
-    double retVal;
-    vs = vs / 1000;
-    retVal = cvms5_configuration->p0 + cvms5_configuration->p1 * vs + cvms5_configuration->p2 * pow(vs, 2) +
-             cvms5_configuration->p3 * pow(vs, 3) + cvms5_configuration->p4 * pow(vs, 4) + cvms5_configuration->p5 * pow(vs, 5);
-    retVal = retVal * 1000;
-    return retVal;
+int cvms5_start_trace(const char *file) {
+    cvms5_trace_header_t header;
+    char name[512];
+    const char *pid = strstr(file, "%p");
+
+    cvms5_stop_trace();
+
+    if (pid != NULL) snprintf(name, sizeof(name), "%.*s%d%s", (int)(pid - file), file, (int)getpid(), pid + 2);
+    else snprintf(name, sizeof(name), "%s", file);
+
+    memset(&header, 0, sizeof(cvms5_trace_header_t));
+    memcpy(header.magic, CVMS5_TRACE_MAGIC, sizeof(header.magic));
+    header.version = CVMS5_TRACE_VERSION;
+
+    cvms5_trace = fopen(name, "wb");
+    if (cvms5_trace == NULL) return FAIL;
+
+    if (fwrite(&header, sizeof(cvms5_trace_header_t), 1, cvms5_trace) != 1) {
+        fclose(cvms5_trace);
+        cvms5_trace = NULL;
+        return FAIL;
+    }
+    cvms5_trace_start = cvms5_seconds();
+
+    return SUCCESS;
 }
 
 /**
- * Prints the error string provided.
+ * Stops recording batches and closes the trace, if one is being recorded.
+ */
+void cvms5_stop_trace() {
+    if (cvms5_trace == NULL) return;
+
+    fclose(cvms5_trace);
+    cvms5_trace = NULL;
+}
+
+/**
+ * Records a batch to the trace with the settings it was answered with.
  *
- * @param err The error string to print out to stderr.
+ * @param points The batch's points.
+ * @param numpoints Number of points.
+ * @param status What the query returned.
+ * @param start When the batch was started, in seconds.
+ * @param seconds How long the batch took.
  */
-void cvms5_print_error(char *err) {
-    fprintf(stderr, "An error has occurred while executing CVM-S5: %s\n",err);
-    fprintf(stderr, "\n\nPlease contact software@scec.org and describe both the error and a bit\n");
-    fprintf(stderr, "about the computer you are running CVM-S5 on (Linux, Mac, etc.).\n");
+void cvms5_trace_batch(cvms5_point_t *points, int numpoints, int status, double start, double seconds) {
+    cvms5_trace_record_t record;
+
+    memset(&record, 0, sizeof(cvms5_trace_record_t));
+    record.numpoints = numpoints;
+    record.mode = cvms5_query_mode;
+    record.interpolation = cvms5_interpolation;
+    record.status = status;
+    record.start = start - cvms5_trace_start;
+    record.seconds = seconds;
+
+    // A trace that can no longer be written is stopped rather than left with a partial batch.
+    if (fwrite(&record, sizeof(cvms5_trace_record_t), 1, cvms5_trace) != 1 ||
+        fwrite(points, sizeof(cvms5_point_t), numpoints, cvms5_trace) != (size_t)numpoints) {
+        fprintf(stderr, "WARNING: Could not write to the query trace, queries will no longer be traced.\n");
+        cvms5_stop_trace();
+    }
 }
 
 /**
- * Tries to read the model into memory.
+ * Returns the time of day in seconds, for timing batches.
  *
- * @param model The model parameter struct which will hold the pointers to the data either on disk or in memory.
- * @return 2 if all files are read to memory, SUCCESS if file is found but at least 1
- * is not in memory, FAIL if no file found.
+ * @return The time of day in seconds.
  */
-int cvms5_try_reading_model(cvms5_model_t *model) {
-    double base_malloc = cvms5_configuration->nx * cvms5_configuration->ny * cvms5_configuration->nz * sizeof(float);
-    int file_count = 0;
-    int all_read_to_memory = 1;
-    char current_file[128];
-    FILE *fp;
+double cvms5_seconds() {
+    struct timeval now;
 
-    // Let's see what data we actually have.
-    sprintf(current_file, "%s/vp.dat", cvms5_iteration_directory);
-    if (access(current_file, R_OK) == 0) {
-        model->vp = malloc(base_malloc);
-        if (model->vp != NULL) {
-            // Read the model in.
-            fp = fopen(current_file, "rb");
-            fread(model->vp, 1, base_malloc, fp);
-            fclose(fp);
-            model->vp_status = 2;
-        } else {
-            all_read_to_memory = 0;
-            model->vp = fopen(current_file, "rb");
-            model->vp_status = 1;
-        }
-        file_count++;
+    gettimeofday(&now, NULL);
+
+    return now.tv_sec + now.tv_usec / 1.0e6;
+}
+
+/**
+ * Connects to a query server started with cvms5_server, so that short jobs can query a model
+ * the server has already initialized rather than paying for cvms5_init themselves. Only one
+ * connection is held, and cvms5_client_query is answered over it.
+ *
+ * @param socket_path The path of the server's Unix domain socket.
+ * @return SUCCESS or FAIL.
+ */
+int cvms5_client_connect(const char *socket_path) {
+    struct sockaddr_un address;
+
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        cvms5_print_error("The query server's socket path is too long.");
+        return FAIL;
     }
 
-    sprintf(current_file, "%s/vs.dat", cvms5_iteration_directory);
-    if (access(current_file, R_OK) == 0) {
-        model->vs = malloc(base_malloc);
-        if (model->vs != NULL) {
-            // Read the model in.
-            fp = fopen(current_file, "rb");
-            fread(model->vs, 1, base_malloc, fp);
-            fclose(fp);
-            model->vs_status = 2;
-        } else {
-            all_read_to_memory = 0;
-            model->vs = fopen(current_file, "rb");
-            model->vs_status = 1;
-        }
-        file_count++;
+    cvms5_client_close();
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socket_path);
+
+    if ((cvms5_client_socket = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+        connect(cvms5_client_socket, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        cvms5_print_error("Could not connect to the query server.");
+        cvms5_client_close();
+        return FAIL;
     }
 
-    sprintf(current_file, "%s/rho.dat", cvms5_iteration_directory);
-    if (access(current_file, R_OK) == 0) {
-        model->rho = malloc(base_malloc);
-        if (model->rho != NULL) {
-            // Read the model in.
-            fp = fopen(current_file, "rb");
-            fread(model->rho, 1, base_malloc, fp);
-            fclose(fp);
-            model->rho_status = 2;
-        } else {
-            all_read_to_memory = 0;
-            model->rho = fopen(current_file, "rb");
-            model->rho_status = 1;
-        }
-        file_count++;
+    return SUCCESS;
+}
+
+/**
+ * Queries the model like cvms5_query, through the query server connected to by
+ * cvms5_client_connect. The points are sent in requests of at most CVMS5_SERVER_REQUEST_MAX
+ * points, each answered with the query mode and interpolation the server was started with.
+ *
+ * @param points The points at which the queries will be made.
+ * @param data The data that will be returned (Vp, Vs, density, Qs, and/or Qp).
+ * @param numpoints The total number of points to query.
+ * @return The status of the query on the server, or FAIL if the server could not be reached.
+ */
+int cvms5_client_query(cvms5_point_t *points, cvms5_properties_t *data, int numpoints) {
+    cvms5_server_header_t header;
+    int retVal = SUCCESS;
+    int first = 0, count = 0;
+
+    if (cvms5_client_socket < 0) {
+        cvms5_print_error("Not connected to a query server.");
+        return FAIL;
     }
 
-    sprintf(current_file, "%s/qp.dat", cvms5_iteration_directory);
-    if (access(current_file, R_OK) == 0) {
-        model->qp = malloc(base_malloc);
-        if (model->qp != NULL) {
-            // Read the model in.
-            fp = fopen(current_file, "rb");
-            fread(model->qp, 1, base_malloc, fp);
-            fclose(fp);
-            model->qp_status = 2;
-        } else {
-            all_read_to_memory = 0;
-            model->qp = fopen(current_file, "rb");
-            model->qp_status = 1;
+    for (first = 0; first < numpoints; first += count) {
+        count = numpoints - first < CVMS5_SERVER_REQUEST_MAX ? numpoints - first : CVMS5_SERVER_REQUEST_MAX;
+
+        memset(&header, 0, sizeof(header));
+        header.magic = CVMS5_SERVER_MAGIC;
+        header.numpoints = count;
+
+        if (cvms5_write_fully(cvms5_client_socket, &header, sizeof(header)) != SUCCESS ||
+            cvms5_write_fully(cvms5_client_socket, &(points[first]), count * sizeof(cvms5_point_t)) != SUCCESS ||
+            cvms5_read_fully(cvms5_client_socket, &header, sizeof(header)) != SUCCESS ||
+            header.magic != CVMS5_SERVER_MAGIC || header.numpoints != count ||
+            cvms5_read_fully(cvms5_client_socket, &(data[first]), count * sizeof(cvms5_properties_t)) != SUCCESS) {
+            cvms5_print_error("Lost the connection to the query server.");
+            cvms5_client_close();
+            return FAIL;
         }
-        file_count++;
+
+        if (header.status != SUCCESS && retVal == SUCCESS) retVal = header.status;
     }
 
-    sprintf(current_file, "%s/qs.dat", cvms5_iteration_directory);
-    if (access(current_file, R_OK) == 0) {
-        model->qs = malloc(base_malloc);
-        if (model->qs != NULL) {
-            // Read the model in.
-            fp = fopen(current_file, "rb");
-            fread(model->qs, 1, base_malloc, fp);
-            fclose(fp);
-            model->qs_status = 2;
-        } else {
-            all_read_to_memory = 0;
-            model->qs = fopen(current_file, "rb");
-            model->qs_status = 1;
-        }
-        file_count++;
+    return retVal;
+}
+
+/**
+ * Closes the connection to the query server, if there is one.
+ */
+void cvms5_client_close() {
+    if (cvms5_client_socket >= 0) close(cvms5_client_socket);
+    cvms5_client_socket = -1;
+}
+
+/**
+ * Reads exactly the given number of bytes from a socket, however they arrive.
+ *
+ * @param fd The socket.
+ * @param buf Where the bytes are read to.
+ * @param len The number of bytes.
+ * @return SUCCESS or FAIL if the socket was closed or failed first.
+ */
+int cvms5_read_fully(int fd, void *buf, size_t len) {
+    ssize_t got = 0;
+
+    while (len > 0) {
+        got = read(fd, buf, len);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return FAIL;
+        buf = (char *)buf + got;
+        len -= got;
     }
 
-    if (file_count == 0)
-        return FAIL;
-    else if (file_count > 0 && all_read_to_memory == 0)
-        return SUCCESS;
-    else
-        return 2;
+    return SUCCESS;
+}
+
+/**
+ * Writes exactly the given number of bytes to a socket.
+ *
+ * @param fd The socket.
+ * @param buf The bytes.
+ * @param len The number of bytes.
+ * @return SUCCESS or FAIL if the socket was closed or failed first.
+ */
+int cvms5_write_fully(int fd, const void *buf, size_t len) {
+    ssize_t put = 0;
+
+    while (len > 0) {
+        put = send(fd, buf, len, MSG_NOSIGNAL);
+        if (put < 0 && errno == EINTR) continue;
+        if (put <= 0) return FAIL;
+        buf = (const char *)buf + put;
+        len -= put;
+    }
+
+    return SUCCESS;
 }
 
 // The following functions are for dynamic library mode. If we are compiling
@@ -892,6 +5450,31 @@ int model_config(char **config, int *sz) {
 }
 
 
+/**
+ * Setparam function loaded and called by the UCVM library. Sets the query mode from
+ * UCVM_PARAM_QUERY_MODE, other parameters are ignored.
+ *
+ * @param id The model's id within UCVM.
+ * @param param The parameter to set.
+ * @return Success or fail.
+ */
+int model_setparam(int id, int param, ...) {
+    va_list ap;
+    int mode = 0;
+    int retVal = UCVM_CODE_SUCCESS;
+
+    va_start(ap, param);
+    if (param == UCVM_PARAM_QUERY_MODE) {
+        mode = va_arg(ap, int);
+        if (cvms5_set_query_mode(mode == UCVM_COORD_GEO_ELEV ? CVMS5_COORD_ELEVATION : CVMS5_COORD_DEPTH) != SUCCESS)
+            retVal = UCVM_CODE_ERROR;
+    }
+    va_end(ap);
+
+    return retVal;
+}
+
+
 int (*get_model_init())(const char *, const char *) {
     return &cvms5_init;
 }
@@ -907,6 +5490,9 @@ int (*get_model_version())(char *, int) {
 int (*get_model_config())(char **, int*) {
     return &cvms5_config;
 }
+int (*get_model_setparam())(int, int, ...) {
+    return &model_setparam;
+}
 
 
 #endif
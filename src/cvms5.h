@@ -15,9 +15,14 @@
 #include <string.h>
 #include <unistd.h>
 #include <math.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #include "etree.h"
 #include "proj.h"
+#ifdef CVMS5_MPI
+#include <mpi.h>
+#endif
 
 // Constants
 #ifndef M_PI
@@ -34,6 +39,118 @@
 
 #define CVMS5_CONFIG_MAX 1000
 
+/** Name of the preprocessed snapshot file within the model's data directory */
+#define CVMS5_SNAPSHOT_FILE "cvms5.snapshot"
+/** Magic bytes at the start of every snapshot file */
+#define CVMS5_SNAPSHOT_MAGIC "CVMS5SNP"
+/** Snapshot layout version, bumped whenever the header or a section changes */
+#define CVMS5_SNAPSHOT_VERSION 4
+/** Written as-is into the snapshot to detect files produced on a machine of different byte order */
+#define CVMS5_SNAPSHOT_BYTE_ORDER 0x01020304
+/** Alignment of the sections within the snapshot so that they can be mapped directly */
+#define CVMS5_SNAPSHOT_ALIGNMENT 4096
+/** Magic bytes at the start of every result cache file */
+#define CVMS5_CACHE_MAGIC "CVMS5RES"
+/** Result cache layout version, bumped whenever the layout or the results of a query change */
+#define CVMS5_CACHE_VERSION 1
+/** Batches of fewer points are always queried, as the cache would cost as much as the query */
+#define CVMS5_CACHE_MIN_POINTS 256
+/** Query longitudes and latitudes are rounded to this many degrees for the cache key */
+#define CVMS5_CACHE_DEGREES 1.0e-7
+/** Query depths are rounded to this many meters for the cache key */
+#define CVMS5_CACHE_METERS 1.0e-3
+/** Magic bytes at the start of every query trace */
+#define CVMS5_TRACE_MAGIC "CVMS5TRC"
+/** Query trace layout version */
+#define CVMS5_TRACE_VERSION 1
+/** Magic bytes at the start of every pyramid level file */
+#define CVMS5_LEVEL_MAGIC "CVMS5LVL"
+/** Pyramid level file layout version */
+#define CVMS5_LEVEL_VERSION 2
+/** Streaming window moving along the z axis, one depth plane at a time */
+#define CVMS5_WINDOW_Z 0
+/** Streaming window moving along the model's x axis */
+#define CVMS5_WINDOW_X 1
+
+/** Number of levels in the model pyramid, including the model itself as level 0 */
+#define CVMS5_PYRAMID_LEVELS 6
+
+/** Query depths are in meters below the surface, as UCVM_COORD_GEO_DEPTH */
+#define CVMS5_COORD_DEPTH 0
+/** Query depths are elevations in meters above sea level, as UCVM_COORD_GEO_ELEV */
+#define CVMS5_COORD_ELEVATION 1
+
+/** Properties are interpolated trilinearly between the eight corners of the cell */
+#define CVMS5_INTERP_TRILINEAR 0
+/** Properties are taken from the grid point nearest the query point */
+#define CVMS5_INTERP_NEAREST 1
+/** Properties are interpolated with Catmull-Rom cubics through the 4 x 4 x 4 grid points around the cell */
+#define CVMS5_INTERP_TRICUBIC 2
+
+/** The cell is outside the grid and there is no data */
+#define CVMS5_CELL_NONE 0
+/** The cell lies between two planes and is interpolated trilinearly */
+#define CVMS5_CELL_VOLUME 1
+/** The point is on the bottom plane and is interpolated bilinearly */
+#define CVMS5_CELL_BOTTOM 2
+/** The point is within the Vs30-based GTL */
+#define CVMS5_CELL_GTL 3
+
+/** Grid points of a file at most this far apart are read in one go when staging a batch */
+#define CVMS5_STAGING_GAP 1024
+/** Largest read, in grid points, when staging a batch */
+#define CVMS5_STAGING_RUN (1 << 20)
+
+/** Number of grid points along each axis of the finest bricks of the summary */
+#define CVMS5_BRICK_SIZE 8
+/** Magic bytes at the start of every overlay file */
+#define CVMS5_OVERLAY_MAGIC "CVMS5OVL"
+/** Overlay whose values are added to the grid beneath it */
+#define CVMS5_OVERLAY_DELTA 0
+/** Overlay whose values replace the grid beneath it */
+#define CVMS5_OVERLAY_REPLACE 1
+/** Longest list of overlays in the configuration file */
+#define CVMS5_OVERLAYS_MAX 256
+/** Most levels of bricks in the summary */
+#define CVMS5_SUMMARY_LEVELS 32
+/** Number of points along each edge of a box when it is traced into the model's frame */
+#define CVMS5_BOX_STEPS 16
+
+/** Number of points queried at a time by cvms5_query_arrays */
+#define CVMS5_ARRAYS_CHUNK 4096
+
+/** Number of Vs thresholds whose depth index is kept */
+#define CVMS5_ZDEPTH_INDEXES 4
+
+/** Number of threads reading and interpolating in the query pipeline */
+#define CVMS5_PIPELINE_READERS 4
+
+/** Largest Vs30 map raster (in map cells) that will be built */
+#define CVMS5_VS30_RASTER_MAX (1 << 25)
+
+/** Number of points traced along each edge of the model to bound its footprint */
+#define CVMS5_FOOTPRINT_STEPS 32
+/** Padding of the footprint, in degrees, so points near its edges are always projected */
+#define CVMS5_FOOTPRINT_MARGIN 0.01
+
+/** Number of cells interpolated at a time by the vector kernels */
+#define CVMS5_KERNEL_CHUNK 64
+/** Kernels built for the baseline instruction set, run on any CPU */
+#define CVMS5_ISA_BASELINE 0
+/** Kernels built for AVX2 */
+#define CVMS5_ISA_AVX2 1
+/** Kernels built for AVX-512 */
+#define CVMS5_ISA_AVX512 2
+#if defined(__GNUC__) && defined(__x86_64__)
+	/** Defined where kernels are built for the wider x86 instruction sets */
+	#define CVMS5_KERNELS_X86
+#endif
+
+/** Written at the start of every request to and reply from the query server */
+#define CVMS5_SERVER_MAGIC 0x43355351
+/** Most points in one request to the query server, larger queries are split by the client */
+#define CVMS5_SERVER_REQUEST_MAX (1 << 20)
+
 /* forward declaration */
 //void utm_geo_(double*, double*, double*, double*, int*, int*);
 
@@ -62,6 +179,30 @@ typedef struct cvms5_properties_t {
 	double qs;
 } cvms5_properties_t;
 
+/** Spatial gradients of Vp and Vs at a point, in m/s per meter. */
+typedef struct cvms5_gradient_t {
+	/** dVp along the model's x axis */
+	double vp_x;
+	/** dVp along the model's y axis */
+	double vp_y;
+	/** dVp with depth, positive down */
+	double vp_z;
+	/** dVs along the model's x axis */
+	double vs_x;
+	/** dVs along the model's y axis */
+	double vs_y;
+	/** dVs with depth, positive down */
+	double vs_z;
+	/** dVp to the UTM east */
+	double vp_east;
+	/** dVp to the UTM north */
+	double vp_north;
+	/** dVs to the UTM east */
+	double vs_east;
+	/** dVs to the UTM north */
+	double vs_north;
+} cvms5_gradient_t;
+
 /** The CVM-S5 configuration structure. */
 typedef struct cvms5_configuration_t {
 	/** The zone of UTM projection */
@@ -108,6 +249,8 @@ typedef struct cvms5_configuration_t {
 	double p4;
 	/** Brocher 2005 scaling polynomial coefficient 10^5 */
 	double p5;
+	/** Overlay files within the model directory, comma separated, applied in order */
+	char overlays[CVMS5_OVERLAYS_MAX];
 } cvms5_configuration_t;
 
 /** The configuration structure for the Vs30 map. */
@@ -146,6 +289,43 @@ typedef struct cvms5_vs30_map_config_t {
 	int z_ticks;
 } cvms5_vs30_map_config_t;
 
+/**
+ * Header of an overlay file. It is followed by each brick of the overlay: the brick's x, y and
+ * z indices as three ints, counted as the grid files count grid points divided by
+ * CVMS5_BRICK_SIZE, then CVMS5_BRICK_SIZE cubed Vp and as many Vs values as floats, with y
+ * varying fastest, then x, then z. NaN values leave the grid beneath them as it is.
+ */
+typedef struct cvms5_overlay_header_t {
+	/** CVMS5_OVERLAY_MAGIC, not NUL terminated */
+	char magic[8];
+	/** CVMS5_OVERLAY_DELTA or CVMS5_OVERLAY_REPLACE */
+	int mode;
+	/** Number of bricks in the file */
+	int bricks;
+} cvms5_overlay_header_t;
+
+/** A sparse layer of bricks over the model's grid, read from an overlay file. */
+typedef struct cvms5_overlay_t {
+	/** CVMS5_OVERLAY_DELTA or CVMS5_OVERLAY_REPLACE */
+	int mode;
+	/** Number of bricks along the model's x axis */
+	int nbx;
+	/** Number of bricks along the model's y axis */
+	int nby;
+	/** Number of bricks along the model's z axis */
+	int nbz;
+	/** Index of each of the model's bricks in the overlay's values, or -1 if the overlay does not cover it */
+	int *slots;
+	/** Number of bricks the overlay covers */
+	int count;
+	/** Vp of each brick covered */
+	float *vp;
+	/** Vs of each brick covered */
+	float *vs;
+	/** The next overlay loaded */
+	struct cvms5_overlay_t *next;
+} cvms5_overlay_t;
+
 /** The model structure which points to available portions of the model. */
 typedef struct cvms5_model_t {
 	/** A pointer to the Vs data either in memory or disk. Null if does not exist. */
@@ -168,8 +348,282 @@ typedef struct cvms5_model_t {
 	void *qs;
 	/** Qs status: 0 = not found, 1 = found and not in memory, 2 = found and in memory */
 	int qs_status;
+	/** First x index of the block of the grid that is held */
+	int block_x;
+	/** First y index of the block of the grid that is held */
+	int block_y;
+	/** First z index of the block of the grid that is held */
+	int block_z;
+	/** Number of x points held, nx unless a region of interest was requested */
+	int block_nx;
+	/** Number of y points held, ny unless a region of interest was requested */
+	int block_ny;
+	/** Number of z points held, nz unless a region of interest was requested */
+	int block_nz;
+	/** The overlays read over the grids, in the order they are applied */
+	cvms5_overlay_t **overlays;
+	/** Number of overlays */
+	int overlay_count;
+	/** 1 if the grids are the model's own, shared by a variant, 0 otherwise */
+	int shared;
 } cvms5_model_t;
 
+/** Streaming residency of the grid, for sweeps that move through the model one slab at a time. */
+typedef struct cvms5_window_t {
+	/** Axis the window moves along, CVMS5_WINDOW_Z or CVMS5_WINDOW_X */
+	int axis;
+	/** Number of planes to prefetch ahead of the window */
+	int planes;
+	/** 1 if the window follows the planes each query touches, 0 once the caller moves it */
+	int automatic;
+	/** First plane of the current window, -1 before the window is first placed */
+	int first;
+	/** Last plane of the current window */
+	int last;
+} cvms5_window_t;
+
+/** A conservative bound on the model's footprint in longitude and latitude, made of four half-planes. */
+typedef struct cvms5_footprint_t {
+	/** Longitude component of the outward normal of each edge */
+	double normal_longitude[4];
+	/** Latitude component of the outward normal of each edge */
+	double normal_latitude[4];
+	/** Largest projection of a point within the model onto each normal */
+	double offset[4];
+	/** Minimum longitude */
+	double min_longitude;
+	/** Minimum latitude */
+	double min_latitude;
+	/** Maximum longitude */
+	double max_longitude;
+	/** Maximum latitude */
+	double max_latitude;
+} cvms5_footprint_t;
+
+/** A region of interest, in WGS84 longitude and latitude and depth in meters. */
+typedef struct cvms5_region_t {
+	/** Minimum longitude */
+	double min_longitude;
+	/** Minimum latitude */
+	double min_latitude;
+	/** Maximum longitude */
+	double max_longitude;
+	/** Maximum latitude */
+	double max_latitude;
+	/** Minimum depth */
+	double min_depth;
+	/** Maximum depth */
+	double max_depth;
+} cvms5_region_t;
+
+/** The interpolation kernels built for one instruction set. Each blends a chunk of CVMS5_KERNEL_CHUNK cells, with a cell's values one lane of each of its chunk-long arrays. */
+typedef struct cvms5_kernels_t {
+	/** The instruction set's name, as CVMS5_ISA gives it */
+	const char *name;
+	/** Blends the 8 corners of each cell trilinearly */
+	void (*trilinear)(const double *corners, const double *x_percent, const double *y_percent, const double *z_percent,
+					  double *values);
+	/** Collapses the 64 grid points around each cell with their cubic weights */
+	void (*tricubic)(const double *points, const double *wx, const double *wy, const double *wz, double *values);
+} cvms5_kernels_t;
+
+/** Precedes every request to and reply from the query server, which are followed by the points or their properties. */
+typedef struct cvms5_server_header_t {
+	/** CVMS5_SERVER_MAGIC */
+	uint32_t magic;
+	/** Number of points */
+	int32_t numpoints;
+	/** The status of the query, in replies */
+	int32_t status;
+	/** Zero */
+	int32_t reserved;
+} cvms5_server_header_t;
+
+/** One process's share of a model partitioned between several, by slabs of cells along the x axis. */
+typedef struct cvms5_partition_t {
+	/** The process's rank */
+	int rank;
+	/** Number of processes sharing the model */
+	int ranks;
+} cvms5_partition_t;
+
+/** One level of the model pyramid. Level 0 is the model itself, each further level halves its resolution. */
+typedef struct cvms5_level_t {
+	/** Number of x points */
+	int nx;
+	/** Number of y points */
+	int ny;
+	/** Number of z points */
+	int nz;
+	/** Grid spacing relative to the model's: 1, 2, 4 and so on */
+	int factor;
+	/** Index of the plane at the surface */
+	double top_plane;
+	/** The grids of this level, null if the level is not loaded */
+	cvms5_model_t *model;
+} cvms5_level_t;
+
+/** Where a query point falls within one level of the grid. */
+typedef struct cvms5_cell_t {
+	/** The point along the model's x axis, in meters from the bottom-left corner */
+	double point_x;
+	/** The point along the model's y axis, in meters from the bottom-left corner */
+	double point_y;
+	/** X index of the cell's origin */
+	int x;
+	/** Y index of the cell's origin */
+	int y;
+	/** Z index of the cell's top plane, the bottom plane is z - 1 */
+	int z;
+	/** X percentage across the cell */
+	double x_percent;
+	/** Y percentage across the cell */
+	double y_percent;
+	/** Z percentage down the cell */
+	double z_percent;
+	/** Depth of the point below the surface, in meters */
+	double depth;
+	/** How the cell is interpolated, one of the CVMS5_CELL constants */
+	int type;
+	/** The pyramid level the cell was located in */
+	int level;
+} cvms5_cell_t;
+
+/** Vp and Vs statistics over the grid points in a box. */
+typedef struct cvms5_stats_t {
+	/** Minimum Vp */
+	double vp_min;
+	/** Maximum Vp */
+	double vp_max;
+	/** Mean Vp */
+	double vp_mean;
+	/** Minimum Vs */
+	double vs_min;
+	/** Maximum Vs */
+	double vs_max;
+	/** Mean Vs */
+	double vs_mean;
+	/** Number of grid points in the box */
+	int64_t count;
+} cvms5_stats_t;
+
+/** Vp and Vs summary of one brick of grid points. */
+typedef struct cvms5_brick_t {
+	/** Minimum and maximum Vp */
+	float vp_min;
+	float vp_max;
+	/** Minimum and maximum Vs */
+	float vs_min;
+	float vs_max;
+	/** Sums of Vp and Vs, for the means */
+	double vp_sum;
+	double vs_sum;
+	/** Number of grid points with Vp and with Vs */
+	int64_t vp_count;
+	int64_t vs_count;
+} cvms5_brick_t;
+
+/** The brick summary of the grid. Each level's bricks cover two by two by two of the level below. */
+typedef struct cvms5_summary_t {
+	/** Number of levels, the last holds a single brick */
+	int levels;
+	/** Number of bricks along each axis, per level */
+	int nx[CVMS5_SUMMARY_LEVELS];
+	int ny[CVMS5_SUMMARY_LEVELS];
+	int nz[CVMS5_SUMMARY_LEVELS];
+	/** The bricks, per level, indexed (z * nx + x) * ny + y */
+	cvms5_brick_t *bricks[CVMS5_SUMMARY_LEVELS];
+} cvms5_summary_t;
+
+/** For one Vs threshold, the first plane down each column of the grid at which Vs reaches it. */
+typedef struct cvms5_zdepth_index_t {
+	/** The Vs threshold */
+	double threshold;
+	/** The plane in the block per column, indexed x * ny + y, -1 if the column never reaches it */
+	int *first_plane;
+} cvms5_zdepth_index_t;
+
+/** A box traced into the model's frame, in grid point indices of the held block. */
+typedef struct cvms5_box_t {
+	/** The traced outline */
+	double x[4 * CVMS5_BOX_STEPS];
+	double y[4 * CVMS5_BOX_STEPS];
+	/** The bounds of the outline */
+	double min_x;
+	double max_x;
+	double min_y;
+	double max_y;
+	/** The planes of the block within the box's depths */
+	int min_z;
+	int max_z;
+} cvms5_box_t;
+
+/** The grid points of the model a batch of cells reads, read ahead in file order. */
+typedef struct cvms5_staging_t {
+	/** The grid points' locations in the model's files, sorted and unique */
+	size_t *locations;
+	/** Vp at each grid point, -1 if the model has none */
+	float *vp;
+	/** Vs at each grid point, -1 if the model has none */
+	float *vs;
+	/** Number of grid points */
+	size_t count;
+} cvms5_staging_t;
+
+typedef struct cvms5_batch_t cvms5_batch_t;
+
+/** Called once a submitted batch has been answered, with UCVM_CODE_SUCCESS or an error code. */
+typedef void (*cvms5_batch_callback_t)(cvms5_batch_t *batch, int status);
+
+/** A batch of query points submitted to the query pipeline. */
+struct cvms5_batch_t {
+	/** The query points */
+	cvms5_point_t *points;
+	/** The material properties, written by the pipeline */
+	cvms5_properties_t *data;
+	/** Number of query points */
+	int numpoints;
+	/** Left to the caller, for use in the callback */
+	void *user;
+	/** The callback, set by cvms5_query_submit */
+	cvms5_batch_callback_t callback;
+	/** The cells of the points, while the batch is in the pipeline */
+	cvms5_cell_t *cells;
+	/** UCVM_CODE_SUCCESS or the error that stopped the batch */
+	int status;
+	/** Next batch in the pipeline's queue */
+	cvms5_batch_t *next;
+};
+
+/** The query pipeline behind cvms5_query_submit. */
+typedef struct cvms5_pipeline_t {
+	/** Guards the queues and counters */
+	pthread_mutex_t lock;
+	/** Signalled whenever a batch moves between stages or a thread must stop */
+	pthread_cond_t changed;
+	/** Serializes GTL lookups, which share the model's projections and the Vs30 map */
+	pthread_mutex_t gtl_lock;
+	/** Batches waiting to be located */
+	cvms5_batch_t *submitted_head;
+	cvms5_batch_t *submitted_tail;
+	/** Batches waiting to be read and interpolated */
+	cvms5_batch_t *located_head;
+	cvms5_batch_t *located_tail;
+	/** Batches submitted and not yet called back */
+	int outstanding;
+	/** The first error since the last cvms5_query_wait */
+	int status;
+	/** Set when the threads must exit */
+	int stopping;
+	/** The thread that projects points and locates their cells */
+	pthread_t locator;
+	/** The threads that read the cells and interpolate */
+	pthread_t readers[CVMS5_PIPELINE_READERS];
+	/** The locator's own PROJ context and projection */
+	PJ_CONTEXT *context;
+	PJ *geo2utm;
+} cvms5_pipeline_t;
+
 /** Contains the Vs30 and surface values from the UCVM map. */
 typedef struct cvms5_vs30_mpayload_t {
 	/** Surface height in meters */
@@ -178,6 +632,143 @@ typedef struct cvms5_vs30_mpayload_t {
 	float vs30;
 } cvms5_vs30_mpayload_t;
 
+/** A rasterized window of the Vs30 map covering the model's footprint. */
+typedef struct cvms5_vs30_raster_t {
+	/** First map column held in the raster, in units of map cells */
+	int x0;
+	/** First map row held in the raster, in units of map cells */
+	int y0;
+	/** Number of map columns in the raster */
+	int nx;
+	/** Number of map rows in the raster */
+	int ny;
+	/** Payloads in row-major order, x fastest */
+	cvms5_vs30_mpayload_t *payload;
+} cvms5_vs30_raster_t;
+
+/** Describes one section of a snapshot file. */
+typedef struct cvms5_snapshot_section_t {
+	/** Byte offset of the section from the start of the file, 0 if absent */
+	uint64_t offset;
+	/** Size of the section in bytes */
+	uint64_t size;
+	/** FNV-1a checksum of the section contents */
+	uint64_t checksum;
+} cvms5_snapshot_section_t;
+
+/** Header of the preprocessed snapshot written by cvms5_prepare. */
+typedef struct cvms5_snapshot_header_t {
+	/** CVMS5_SNAPSHOT_MAGIC, not NUL terminated */
+	char magic[8];
+	/** CVMS5_SNAPSHOT_VERSION at the time of writing */
+	uint32_t version;
+	/** sizeof(cvms5_snapshot_header_t) at the time of writing */
+	uint32_t header_size;
+	/** CVMS5_SNAPSHOT_BYTE_ORDER in the writer's byte order */
+	uint32_t byte_order;
+	/** Padding, always zero */
+	uint32_t reserved;
+	/** FNV-1a checksum of the header with this field set to zero */
+	uint64_t header_checksum;
+	/** FNV-1a checksum of the data/config file the snapshot was prepared from */
+	uint64_t config_checksum;
+	/** Size of the vp.dat file the Vp grid was read from */
+	uint64_t vp_source_size;
+	/** Modification time of the vp.dat file the Vp grid was read from */
+	int64_t vp_source_mtime;
+	/** Size of the vs.dat file the Vs grid was read from */
+	uint64_t vs_source_size;
+	/** Modification time of the vs.dat file the Vs grid was read from */
+	int64_t vs_source_mtime;
+	/** Size of the UCVM ucvm.e file the Vs30 raster was built from */
+	uint64_t vs30_source_size;
+	/** Modification time of the UCVM ucvm.e file the Vs30 raster was built from */
+	int64_t vs30_source_mtime;
+	/** The validated model configuration */
+	cvms5_configuration_t configuration;
+	/** The Vs30 map configuration, with the e-tree pointer cleared */
+	cvms5_vs30_map_config_t vs30_map;
+	/** The cosine of the model rotation angle */
+	double cos_rotation_angle;
+	/** The sine of the model rotation angle */
+	double sin_rotation_angle;
+	/** The height of the model region, in meters */
+	double total_height_m;
+	/** The width of the model region, in meters */
+	double total_width_m;
+	/** The cosine of the Vs30 map's rotation */
+	double cos_vs30_rotation_angle;
+	/** The sine of the Vs30 map's rotation */
+	double sin_vs30_rotation_angle;
+	/** The Vs30 raster window, with the payload pointer cleared */
+	cvms5_vs30_raster_t vs30_raster;
+	/** The Vp grid in the in-memory layout used by cvms5_read_properties */
+	cvms5_snapshot_section_t vp;
+	/** The Vs grid in the in-memory layout used by cvms5_read_properties */
+	cvms5_snapshot_section_t vs;
+	/** The Vs30 raster payloads */
+	cvms5_snapshot_section_t vs30;
+} cvms5_snapshot_header_t;
+
+/**
+ * Header of a result cache file, which holds the properties of one batch of query points and
+ * is followed by them as a table of cvms5_properties_t.
+ */
+typedef struct cvms5_cache_header_t {
+	/** CVMS5_CACHE_MAGIC, not NUL terminated */
+	char magic[8];
+	/** CVMS5_CACHE_VERSION at the time of writing */
+	uint32_t version;
+	/** Number of points in the batch */
+	uint32_t numpoints;
+	/** cvms5_model_stamp at the time of writing */
+	uint64_t model_stamp;
+	/** Key of the batch, from cvms5_cache_key */
+	uint64_t key;
+} cvms5_cache_header_t;
+
+/** Header of a pyramid level file, which is followed by the level's grid laid out like the model's files. */
+typedef struct cvms5_level_header_t {
+	/** CVMS5_LEVEL_MAGIC, not NUL terminated */
+	char magic[8];
+	/** CVMS5_LEVEL_VERSION at the time of writing */
+	uint32_t version;
+	/** Padding, always zero */
+	uint32_t reserved;
+	/** Size of the grid file the level was built from */
+	uint64_t source_size;
+	/** Modification time of the grid file the level was built from */
+	int64_t source_mtime;
+	/** Stamp of the overlays applied over the grid file, zero without any */
+	uint64_t overlays_stamp;
+} cvms5_level_header_t;
+
+/** Header of a query trace, which is followed by a cvms5_trace_record_t for each batch. */
+typedef struct cvms5_trace_header_t {
+	/** CVMS5_TRACE_MAGIC, not NUL terminated */
+	char magic[8];
+	/** CVMS5_TRACE_VERSION at the time of writing */
+	uint32_t version;
+	/** Padding, always zero */
+	uint32_t reserved;
+} cvms5_trace_header_t;
+
+/** A batch of a query trace, followed by its points as cvms5_point_t. */
+typedef struct cvms5_trace_record_t {
+	/** Number of points in the batch */
+	uint32_t numpoints;
+	/** Query mode the batch was answered with, CVMS5_COORD_DEPTH or CVMS5_COORD_ELEVATION */
+	int32_t mode;
+	/** Interpolation the batch was answered with, one of the CVMS5_INTERP constants */
+	int32_t interpolation;
+	/** What cvms5_query returned */
+	int32_t status;
+	/** Seconds from the start of the trace to the start of the batch */
+	double start;
+	/** Seconds the batch took to answer */
+	double seconds;
+} cvms5_trace_record_t;
+
 // Constants
 /** The version of the model. */
 const char *cvms5_version_string = "CVM-S5";
@@ -197,6 +788,44 @@ cvms5_configuration_t *cvms5_configuration;
 cvms5_model_t *cvms5_velocity_model;
 /** Holds the configuration parameters for the Vs30 map. */
 cvms5_vs30_map_config_t *cvms5_vs30_map;
+/** The region of interest given to cvms5_init_region. Null if the whole model is loaded. */
+cvms5_region_t *cvms5_region = NULL;
+/** The bound on the model's footprint that queries are checked against before projection. Null if none. */
+cvms5_footprint_t *cvms5_footprint = NULL;
+/** The interpolation kernels queries run with, chosen by cvms5_set_isa. */
+cvms5_kernels_t *cvms5_kernels = NULL;
+/** The connection opened by cvms5_client_connect, -1 if there is none. */
+int cvms5_client_socket = -1;
+/** This process's share of the model set up by cvms5_mpi_init. Null if the model is not partitioned. */
+cvms5_partition_t *cvms5_partition = NULL;
+#ifdef CVMS5_MPI
+/** The communicator given to cvms5_mpi_init */
+MPI_Comm cvms5_mpi_comm;
+#endif
+/** The streaming window set up by cvms5_init_streaming. Null if the grid is fully resident. */
+cvms5_window_t *cvms5_window = NULL;
+/** The model pyramid. Level 0 is the model itself, further levels are loaded on demand. */
+cvms5_level_t cvms5_pyramid[CVMS5_PYRAMID_LEVELS];
+/** The pyramid level queries are answered from, chosen by cvms5_set_query_resolution. */
+int cvms5_query_level = 0;
+/** The grids of the iterations loaded by cvms5_init_ensemble. Null if there is no ensemble. */
+cvms5_model_t **cvms5_ensemble = NULL;
+/** Number of iterations in the ensemble. */
+int cvms5_ensemble_size = 0;
+/** Every overlay loaded, whichever models it is applied to. */
+cvms5_overlay_t *cvms5_overlays = NULL;
+/** How queries are interpolated, one of the CVMS5_INTERP constants. */
+int cvms5_interpolation = CVMS5_INTERP_TRILINEAR;
+/** How query depths are given, CVMS5_COORD_DEPTH or CVMS5_COORD_ELEVATION. */
+int cvms5_query_mode = CVMS5_COORD_DEPTH;
+/** The query pipeline, started by the first cvms5_query_submit. */
+cvms5_pipeline_t *cvms5_pipeline = NULL;
+/** The brick summary, built by the first cvms5_region_stats. */
+cvms5_summary_t *cvms5_summary = NULL;
+/** The depth indexes of the latest Vs thresholds given to cvms5_query_zdepth. */
+cvms5_zdepth_index_t cvms5_zdepth_indexes[CVMS5_ZDEPTH_INDEXES];
+/** The depth index replaced next. */
+int cvms5_zdepth_next = 0;
 
 
 /** Proj coordinate transformation objects. */
@@ -218,6 +847,24 @@ double cvms5_cos_vs30_rotation_angle = 0;
 /** The sine of the Vs30 map's rotation. */
 double cvms5_sin_vs30_rotation_angle = 0;
 
+/** The Vs30 map rasterized over the model's footprint. Null if not available. */
+cvms5_vs30_raster_t *cvms5_vs30_raster = NULL;
+
+/** Set to 0 to make cvms5_init ignore any snapshot and read the model's source files. */
+int cvms5_use_snapshot = 1;
+/** Base address of the mapped snapshot, NULL if the model was not loaded from a snapshot. */
+void *cvms5_snapshot_base = NULL;
+/** Size in bytes of the mapped snapshot. */
+size_t cvms5_snapshot_size = 0;
+/** Identifies the model's configuration and data files as loaded, set by cvms5_init. */
+uint64_t cvms5_model_stamp = 0;
+/** Directory of the result cache given to cvms5_set_cache. Null if results are not cached. */
+char *cvms5_cache_directory = NULL;
+/** The query trace started by cvms5_start_trace. Null if queries are not traced. */
+FILE *cvms5_trace = NULL;
+/** When the query trace was started, in seconds. */
+double cvms5_trace_start = 0;
+
 // UCVM API Required Functions
 
 #ifdef DYNAMIC_LIBRARY
@@ -232,6 +879,8 @@ int model_version(char *ver, int len);
 int model_config(char **config, int *sz);
 /** Queries the model */
 int model_query(cvms5_point_t *points, cvms5_properties_t *data, int numpts);
+/** Sets a model parameter */
+int model_setparam(int id, int param, ...);
 
 
 int (*get_model_init())(const char *, const char *);
@@ -239,6 +888,7 @@ int (*get_model_query())(cvms5_point_t *, cvms5_properties_t *, int);
 int (*get_model_finalize())();
 int (*get_model_version())(char *, int);
 int (*get_model_config())(char **, int*);
+int (*get_model_setparam())(int, int, ...);
 
 #endif
 
@@ -246,6 +896,16 @@ int (*get_model_config())(char **, int*);
 
 /** Initializes the model */
 int cvms5_init(const char *dir, const char *label);
+/** Initializes only the part of the model covering a region of interest */
+int cvms5_init_region(const char *dir, const char *label, double *bbox_lonlat, double zmin, double zmax);
+/** Initializes the model with the grid mapped for a slab by slab sweep */
+int cvms5_init_streaming(const char *dir, const char *label, int axis, int planes);
+/** Initializes the model along with further iterations sharing its grid */
+int cvms5_init_ensemble(const char *dir, const char *label, const char **model_dirs, int count);
+/** Adds a variant of the model with overlays over its grids to the ensemble */
+int cvms5_add_variant(const char *overlays);
+/** Moves the streaming window to the given planes */
+int cvms5_advance_window(int first, int last);
 /** Cleans up the model (frees memory, etc.) */
 int cvms5_finalize();
 /** Returns version information */
@@ -254,18 +914,126 @@ int cvms5_version(char *ver, int len);
 int cvms5_config(char **config, int *sz);
 /** Queries the model */
 int cvms5_query(cvms5_point_t *points, cvms5_properties_t *data, int numpts);
+/** Queries the model with depths given in either mode */
+int cvms5_query_points(cvms5_point_t *points, cvms5_properties_t *data, int numpts, int mode, int interpolation,
+					   cvms5_gradient_t *gradients, int *status);
+/** Queries the model and gives each point its own status */
+int cvms5_query_status(cvms5_point_t *points, cvms5_properties_t *data, int *status, int numpts);
+/** Queries the model with points and properties as separate arrays */
+int cvms5_query_arrays(const double *longitude, const double *latitude, const double *depth, int numpts,
+					   float *vp, float *vs, float *rho, float *qp, float *qs);
+/** Queries the model with the given interpolation */
+int cvms5_query_interpolated(cvms5_point_t *points, cvms5_properties_t *data, int numpts, int interpolation);
+/** Sets how queries are interpolated */
+int cvms5_set_interpolation(int interpolation);
+/** Queries the model along with the spatial gradients of Vp and Vs */
+int cvms5_query_gradient(cvms5_point_t *points, cvms5_properties_t *data, cvms5_gradient_t *gradients, int numpts);
+/** Sets whether query depths are depths or elevations */
+int cvms5_set_query_mode(int mode);
+/** Queries every iteration of the ensemble */
+int cvms5_query_ensemble(cvms5_point_t *points, cvms5_properties_t *data, int numpts);
 
 // Non-UCVM Helper Functions
 /** Reads the configuration file. */
 int cvms5_read_configuration(char *file, cvms5_configuration_t *config);
+/** Retrieves the surface elevation at a given point. */
+int cvms5_get_surface_value(double longitude, double latitude, cvms5_vs30_map_config_t *map, double *surface);
+/** Works out a query point's depth below the surface. */
+int cvms5_get_point_depth(cvms5_point_t *point, int mode, double *depth);
 /** Retrieves the vs30 value for a given point. */
 int cvms5_get_vs30_based_gtl(cvms5_point_t *point, cvms5_properties_t *data);
+/** Tapers the properties at the base of the GTL up to the Vs30 at a point. */
+void cvms5_apply_vs30_gtl(cvms5_point_t *point, cvms5_properties_t *base, cvms5_properties_t *data);
 /** Prints out the error string. */
 void cvms5_print_error(char *err);
 /** Retrieves the value at a specified grid point in the model. */
 void cvms5_read_properties(int x, int y, int z, cvms5_properties_t *data);
+/** Retrieves the value at a specified grid point in the given grids. */
+void cvms5_read_model_properties(cvms5_model_t *model, int x, int y, int z, cvms5_properties_t *data);
+/** Reads an overlay file. */
+int cvms5_read_overlay(const char *file, cvms5_overlay_t *overlay);
+/** Reads a list of overlay files and applies them over a model's grids. */
+int cvms5_add_overlays(const char *directory, const char *overlays, cvms5_model_t *model);
+/** Applies a model's overlays to the values at a grid point. */
+void cvms5_apply_overlays(cvms5_model_t *model, int x, int y, int z, cvms5_properties_t *data);
+/** Projects a query point into the model's frame. */
+int cvms5_project_point(PJ *geo2utm, PJ_CONTEXT *context, cvms5_point_t *point, cvms5_cell_t *cell);
+/** Bounds the model's footprint in longitude and latitude. */
+int cvms5_set_footprint(cvms5_footprint_t *footprint);
+/** Whether a point may fall within the model's footprint. */
+int cvms5_footprint_contains(cvms5_footprint_t *footprint, double longitude, double latitude);
+/** Projects a batch of query points into the model's frame. */
+void cvms5_project_points(PJ *geo2utm, cvms5_footprint_t *footprint, cvms5_point_t *points, int numpoints,
+						  cvms5_cell_t *cells);
+/** Rotates a point in UTM into the model's frame. */
+void cvms5_utm_to_model(double easting, double northing, cvms5_cell_t *cell);
+/** Works out the cell a projected point falls in at the query level. */
+void cvms5_locate_point(double depth, cvms5_cell_t *cell);
+/** Works out the cell of a level a projected point falls in. */
+void cvms5_locate_cell(cvms5_level_t *level, double depth, cvms5_cell_t *cell);
+/** Interpolates the material properties of a batch of located cells. */
+void cvms5_interpolate_cells(cvms5_point_t *points, cvms5_cell_t *cells, cvms5_properties_t *data, int numpoints,
+							 pthread_mutex_t *gtl_lock, int interpolation, cvms5_gradient_t *gradients);
+/** Interpolates a batch of located cells with one of the kernels. */
+void cvms5_interpolate_batch(cvms5_level_t *levels, cvms5_staging_t *staging, cvms5_point_t *points, cvms5_cell_t *cells,
+							 cvms5_properties_t *data, int stride, int numpoints, pthread_mutex_t *gtl_lock,
+							 int interpolation, cvms5_gradient_t *gradients);
+/** Takes a batch of cells' properties from their nearest grid points. */
+void cvms5_interpolate_nearest(cvms5_level_t *levels, cvms5_staging_t *staging, cvms5_cell_t *cells,
+							   cvms5_properties_t *data, int stride, int numpoints);
+/** Interpolates a batch of cells trilinearly, a chunk at a time. */
+void cvms5_interpolate_trilinear(cvms5_level_t *levels, cvms5_staging_t *staging, cvms5_cell_t *cells,
+								 cvms5_properties_t *data, int stride, int numpoints);
+/** Interpolates a batch of cells tricubically. */
+void cvms5_interpolate_tricubic(cvms5_level_t *levels, cvms5_staging_t *staging, cvms5_cell_t *cells,
+								cvms5_properties_t *data, int stride, int numpoints);
+/** Works out the Catmull-Rom weights of the four grid points around a fraction of a cell. */
+void cvms5_cubic_weights(double t, double *weights);
+/** Keeps a grid index within a block. */
+int cvms5_clamp_index(int index, int first, int count);
+/** Derives density, Qp and Qs from Vs. */
+void cvms5_derive_properties(cvms5_properties_t *data);
+/** Interpolates the material properties within a located cell. */
+void cvms5_interpolate_cell(cvms5_level_t *level, cvms5_staging_t *staging, cvms5_point_t *point, cvms5_cell_t *cell,
+							cvms5_properties_t *data, cvms5_gradient_t *gradient);
+/** Retrieves the value at one corner of a cell. */
+void cvms5_read_corner(cvms5_level_t *level, cvms5_staging_t *staging, int x, int y, int z, cvms5_properties_t *data);
+/** Compares two grid locations. */
+int cvms5_compare_locations(const void *a, const void *b);
+/** Works out the grid points a batch of cells reads. */
+void cvms5_plan_staging(cvms5_cell_t *cells, int numpoints, int interpolation, cvms5_staging_t *staging);
+/** Reads the planned grid points of a batch. */
+int cvms5_fill_staging(cvms5_model_t *model, cvms5_staging_t *staging);
+/** Retrieves the value at a grid point from a batch's staging. */
+int cvms5_read_staged_properties(cvms5_staging_t *staging, int x, int y, int z, cvms5_properties_t *data);
+/** Frees a batch's staging. */
+void cvms5_free_staging(cvms5_staging_t *staging);
 /** Attempts to malloc the model size in memory and read it in. */
 int cvms5_try_reading_model(cvms5_model_t *model);
+/** Reads the grids of an iteration directory */
+int cvms5_try_reading_model_from(char *directory, cvms5_model_t *model);
+/** Checks that an iteration directory's grids match the model's geometry */
+int cvms5_check_grid_geometry(char *directory);
+/** Reads one of the model's files into memory, or maps it for streaming. */
+int cvms5_load_grid_file(char *file, cvms5_model_t *model, void **grid);
+/** Releases one of the model's grids. */
+void cvms5_release_grid(void *grid, int status);
+/** Moves the streaming window, releasing the planes left behind and prefetching those ahead. */
+void cvms5_move_window(cvms5_window_t *window, int first, int last);
+/** Gives the kernel advice about a range of planes of every mapped grid. */
+void cvms5_advise_planes(int axis, int first, int last, int advice);
+/** Reads the block of the grid held by the model from one of its files. */
+int cvms5_read_model_block(FILE *fp, cvms5_model_t *model, float *dest);
+/** Works out the block of the grid covering a region of interest. */
+int cvms5_set_region_block(cvms5_region_t *region, cvms5_model_t *model);
+/** Checks that the grid points of a cell are held by the model. */
+int cvms5_cell_in_block(cvms5_model_t *model, int x, int y, int z_top, int z_bottom);
+/** Works out the block of the grid held by one process of a partitioned model. */
+int cvms5_set_partition_block(cvms5_partition_t *partition, cvms5_model_t *model);
+/** Returns the first x cell owned by a rank. */
+int cvms5_partition_first(int rank, int ranks, int cells);
+/** Returns the rank owning an x cell. */
+int cvms5_partition_owner(int x, int ranks, int cells);
 /** Reads the specified Vs30 map from UCVM. */
 int cvms5_read_vs30_map(char *filename, cvms5_vs30_map_config_t *map);
 /** Gets the Vs30 value at a point */
@@ -273,6 +1041,144 @@ double cvms5_get_vs30_value(double longitude, double latitude, cvms5_vs30_map_co
 /** Calculates density from Vs. */
 double cvms5_calculate_density(double vs);
 
+// Pipeline Functions
+/** Submits a batch of points to the query pipeline. */
+int cvms5_query_submit(cvms5_batch_t *batch, cvms5_batch_callback_t callback);
+/** Waits for all submitted batches to be answered. */
+int cvms5_query_wait();
+/** Starts the query pipeline. */
+int cvms5_start_pipeline();
+/** Stops the query pipeline. */
+void cvms5_stop_pipeline();
+/** The locating stage of the query pipeline. */
+void *cvms5_pipeline_locate(void *arg);
+/** The reading and interpolating stage of the query pipeline. */
+void *cvms5_pipeline_read(void *arg);
+
+// Extraction Functions
+/** Extracts a horizontal slice of the model at a fixed depth. */
+int cvms5_extract_slice(double *bbox_lonlat, double depth, int nx, int ny, cvms5_properties_t *data);
+/** Extracts a vertical cross-section of the model between two surface points. */
+int cvms5_extract_cross_section(double *start_lonlat, double *end_lonlat, double zmin, double zmax, int nh, int nz,
+								cvms5_properties_t *data);
+
+// Summary Functions
+/** Works out Vp and Vs statistics over the grid points in a box. */
+int cvms5_region_stats(double *bbox_lonlat, double zmin, double zmax, cvms5_stats_t *stats);
+/** Builds the brick summary of the held grid. */
+int cvms5_build_summary(cvms5_model_t *model, cvms5_summary_t *summary);
+/** Reads one row of the block the model holds, with its overlays applied. */
+int cvms5_read_model_row(cvms5_model_t *model, int x, int z, float *vp, float *vs);
+/** Reads one row of the block of a grid the model holds. */
+int cvms5_read_grid_row(cvms5_model_t *model, void *grid, int status, int x, int z, float *row);
+/** Frees the brick summary. */
+void cvms5_free_summary(cvms5_summary_t *summary);
+/** Adds one value to a brick. */
+void cvms5_brick_add(cvms5_brick_t *brick, float vp, float vs);
+/** Adds one brick to another. */
+void cvms5_brick_merge(cvms5_brick_t *brick, cvms5_brick_t *other);
+/** Traces a box into the model's frame. */
+int cvms5_trace_box(double *bbox_lonlat, double zmin, double zmax, cvms5_model_t *model, cvms5_box_t *box);
+/** Checks whether a grid point lies in the outline of a traced box. */
+int cvms5_box_contains(cvms5_box_t *box, double x, double y);
+/** Adds the part of a brick within a traced box to the total. */
+void cvms5_brick_stats(cvms5_model_t *model, cvms5_summary_t *summary, int level, int bx, int by, int bz,
+					   cvms5_box_t *box, cvms5_brick_t *total);
+
+// Basin Depth Functions
+/** Returns the depth at which Vs first reaches a threshold. */
+double cvms5_query_zdepth(double longitude, double latitude, double vs_threshold);
+/** Returns the depth index for a Vs threshold. */
+cvms5_zdepth_index_t *cvms5_get_zdepth_index(double vs_threshold);
+/** Builds the depth index for a Vs threshold. */
+int cvms5_build_zdepth_index(cvms5_model_t *model, cvms5_zdepth_index_t *index);
+
+// Pyramid Functions
+/** Chooses the pyramid level for the caller's target resolution. */
+int cvms5_set_query_resolution(double resolution);
+/** Loads one level of the model pyramid. */
+int cvms5_load_level(int level);
+/** Reads one grid of a pyramid level, if it was built from the model's current grid file. */
+int cvms5_read_level_grid(char *file, char *source, size_t points, void **grid);
+/** Builds the model pyramid from the model and writes it next to the model's files. */
+int cvms5_build_pyramid(int levels);
+/** Smooths and halves the resolution of a grid. */
+void cvms5_downsample_grid(float *src, int nx, int ny, int nz, float *dst, int dnx, int dny, int dnz);
+
+// Kernel Functions
+/** Returns the widest instruction set the host CPU runs. */
+int cvms5_host_isa();
+/** Chooses the instruction set the interpolation kernels run with. */
+int cvms5_set_isa(int isa);
+/** Chooses the interpolation kernels from CVMS5_ISA or the host CPU. */
+void cvms5_select_kernels();
+
+// Client Functions
+/** Connects to a query server. */
+int cvms5_client_connect(const char *socket_path);
+/** Queries the model through the query server. */
+int cvms5_client_query(cvms5_point_t *points, cvms5_properties_t *data, int numpts);
+/** Closes the connection to the query server. */
+void cvms5_client_close();
+/** Reads exactly the given number of bytes from a socket. */
+int cvms5_read_fully(int fd, void *buf, size_t len);
+/** Writes exactly the given number of bytes to a socket. */
+int cvms5_write_fully(int fd, const void *buf, size_t len);
+
+#ifdef CVMS5_MPI
+// MPI Functions
+/** Initializes the model partitioned between the ranks of a communicator. */
+int cvms5_mpi_init(const char *dir, const char *label, MPI_Comm comm);
+/** Queries the partitioned model, collectively over the communicator. */
+int cvms5_mpi_query(cvms5_point_t *points, cvms5_properties_t *data, int numpts);
+
+#endif
+// Snapshot Functions
+/** Writes the preprocessed snapshot for the given model. */
+int cvms5_prepare(const char *dir, const char *label);
+/** Maps the model, configuration and Vs30 raster from a snapshot. */
+int cvms5_load_snapshot(const char *dir, const char *label);
+/** Writes the currently loaded model to a snapshot file. */
+int cvms5_write_snapshot(char *file, char *config_file);
+/** Recomputes and checks every section checksum of a snapshot file. */
+int cvms5_verify_snapshot(char *file);
+/** Rasterizes the Vs30 map over the model's footprint. */
+int cvms5_rasterize_vs30_map(cvms5_vs30_map_config_t *map, cvms5_vs30_raster_t *raster);
+/** Reads the Vs30 map payload of one map cell, from the raster if possible. */
+void cvms5_get_vs30_payload(cvms5_vs30_map_config_t *map, int loc_x, int loc_y, cvms5_vs30_mpayload_t *payload);
+/** Computes the 64-bit FNV-1a checksum of a buffer. */
+uint64_t cvms5_checksum(const void *buf, size_t len, uint64_t hash);
+/** Computes the 64-bit FNV-1a checksum of a whole file. */
+int cvms5_checksum_file(char *file, uint64_t *checksum);
+/** Retrieves the size and modification time of a source data file. */
+int cvms5_source_stamp(char *file, uint64_t *size, int64_t *mtime);
+/** Checks the magic, version, checksum and section bounds of a snapshot header. */
+int cvms5_validate_snapshot_header(cvms5_snapshot_header_t *header, size_t file_size);
+
+// Result Cache Functions
+/** Caches the results of cvms5_query in a directory. */
+int cvms5_set_cache(const char *directory);
+/** Works out the stamp identifying the model's configuration and data files. */
+uint64_t cvms5_stamp_model(char *config_file);
+/** Works out the stamp of the model's overlays. */
+uint64_t cvms5_stamp_overlays(void);
+/** Works out the cache key of a batch of query points. */
+uint64_t cvms5_cache_key(cvms5_point_t *points, int numpoints);
+/** Reads the results of a batch from the cache. */
+int cvms5_cache_read(uint64_t key, cvms5_properties_t *data, int numpoints);
+/** Writes the results of a batch to the cache. */
+int cvms5_cache_write(uint64_t key, cvms5_properties_t *data, int numpoints);
+
+// Trace Functions
+/** Records every batch given to cvms5_query to a trace file. */
+int cvms5_start_trace(const char *file);
+/** Stops recording batches. */
+void cvms5_stop_trace();
+/** Records a batch to the trace. */
+void cvms5_trace_batch(cvms5_point_t *points, int numpoints, int status, double start, double seconds);
+/** Returns the time of day in seconds. */
+double cvms5_seconds();
+
 // Interpolation Functions
 /** Linearly interpolates two cvms5_properties_t structures */
 void cvms5_linear_interpolation(double percent, cvms5_properties_t *x0, cvms5_properties_t *x1, cvms5_properties_t *ret_properties);
@@ -281,3 +1187,6 @@ void cvms5_bilinear_interpolation(double x_percent, double y_percent, cvms5_prop
 /** Trilinearly interpolates the properties. */
 void cvms5_trilinear_interpolation(double x_percent, double y_percent, double z_percent, cvms5_properties_t *eight_points,
 							 cvms5_properties_t *ret_properties);
+/** Differentiates the trilinear interpolation within a cell. */
+void cvms5_trilinear_gradient(cvms5_level_t *level, cvms5_cell_t *cell, cvms5_properties_t *eight_points, int planes,
+							  cvms5_gradient_t *gradient);
@@ -0,0 +1,240 @@
+/**
+ * @file cvms5_extract.c
+ * @brief Extracts CVM-S5 slices and cross-sections as TIFF images.
+ * @version 1.0
+ *
+ * Writes one property of a horizontal slice as a single band, 32-bit
+ * float GeoTIFF in geographic coordinates, or of a vertical cross-section
+ * as a plain 32-bit float TIFF, with -1 where the model has no data.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <tiffio.h>
+#include "cvms5.h"
+
+/** GeoTIFF ModelPixelScaleTag */
+#define GEOTIFF_PIXEL_SCALE 33550
+/** GeoTIFF ModelTiepointTag */
+#define GEOTIFF_TIEPOINT 33922
+/** GeoTIFF GeoKeyDirectoryTag */
+#define GEOTIFF_KEY_DIRECTORY 34735
+/** GDAL's no-data tag */
+#define GDAL_NODATA 42113
+
+/** The GeoTIFF and GDAL tags, which libtiff does not know about on its own */
+static const TIFFFieldInfo geotiff_fields[] = {
+	{ GEOTIFF_PIXEL_SCALE, -1, -1, TIFF_DOUBLE, FIELD_CUSTOM, 1, 1, "ModelPixelScaleTag" },
+	{ GEOTIFF_TIEPOINT, -1, -1, TIFF_DOUBLE, FIELD_CUSTOM, 1, 1, "ModelTiepointTag" },
+	{ GEOTIFF_KEY_DIRECTORY, -1, -1, TIFF_SHORT, FIELD_CUSTOM, 1, 1, "GeoKeyDirectoryTag" },
+	{ GDAL_NODATA, -1, -1, TIFF_ASCII, FIELD_CUSTOM, 1, 0, "GDALNoDataValue" }
+};
+
+/** The tag extender in place before ours */
+static TIFFExtendProc parent_extender = NULL;
+
+/**
+ * Registers the GeoTIFF tags with every TIFF opened.
+ *
+ * @param tif The TIFF.
+ */
+static void geotiff_extender(TIFF *tif) {
+	TIFFMergeFieldInfo(tif, geotiff_fields, sizeof(geotiff_fields) / sizeof(geotiff_fields[0]));
+	if (parent_extender) parent_extender(tif);
+}
+
+/**
+ * Prints the usage message.
+ *
+ * @param name The program name.
+ */
+void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-e] [-p vp|vs|rho|qp|qs] [-l model label] <ucvm install dir> slice\n", name);
+	fprintf(stderr, "          <min lon> <min lat> <max lon> <max lat> <depth> <width> <height> <tiff file>\n");
+	fprintf(stderr, "       %s [-e] [-p vp|vs|rho|qp|qs] [-l model label] <ucvm install dir> section\n", name);
+	fprintf(stderr, "          <start lon> <start lat> <end lon> <end lat> <top depth> <bottom depth> <width> <height> <tiff file>\n\n");
+	fprintf(stderr, "Writes one property, vs by default, of a horizontal slice at a depth as a GeoTIFF, or of\n");
+	fprintf(stderr, "a vertical cross-section between two points as a TIFF. Depths are in meters.\n");
+	fprintf(stderr, "  -e  depths are elevations above sea level (m) instead\n");
+}
+
+/**
+ * Picks one property out of the extracted properties.
+ *
+ * @param data The properties.
+ * @param property The property's name.
+ * @return The value.
+ */
+float pick_property(cvms5_properties_t *data, const char *property) {
+	if (strcmp(property, "vp") == 0) return data->vp;
+	if (strcmp(property, "rho") == 0) return data->rho;
+	if (strcmp(property, "qp") == 0) return data->qp;
+	if (strcmp(property, "qs") == 0) return data->qs;
+	return data->vs;
+}
+
+/**
+ * Writes one property of the extracted properties as a 32-bit float TIFF, georeferenced
+ * in WGS84 longitude and latitude if a bounding box is given.
+ *
+ * @param file The TIFF file.
+ * @param data The properties, row by row from the top.
+ * @param width Number of columns.
+ * @param height Number of rows.
+ * @param property The property to write.
+ * @param description What the image shows.
+ * @param bbox_lonlat The slice's bounding box, or NULL.
+ * @return SUCCESS or FAIL.
+ */
+int write_tiff(const char *file, cvms5_properties_t *data, int width, int height, const char *property,
+			   const char *description, double *bbox_lonlat) {
+	// Geographic model, pixels as areas, WGS84.
+	uint16_t keys[16] = { 1, 1, 0, 3, 1024, 0, 1, 2, 1025, 0, 1, 1, 2048, 0, 1, 4326 };
+	double scale[3], tiepoint[6];
+	float *row = malloc(width * sizeof(float));
+	TIFF *tif = NULL;
+	int i = 0, j = 0;
+
+	parent_extender = TIFFSetTagExtender(geotiff_extender);
+
+	if ((tif = TIFFOpen(file, "w")) == NULL) {
+		fprintf(stderr, "Could not open %s.\n", file);
+		free(row);
+		return FAIL;
+	}
+
+	TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, width);
+	TIFFSetField(tif, TIFFTAG_IMAGELENGTH, height);
+	TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 1);
+	TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, 32);
+	TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_IEEEFP);
+	TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
+	TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+	TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, TIFFDefaultStripSize(tif, 0));
+	TIFFSetField(tif, TIFFTAG_IMAGEDESCRIPTION, description);
+	TIFFSetField(tif, GDAL_NODATA, "-1");
+
+	if (bbox_lonlat != NULL) {
+		scale[0] = (bbox_lonlat[2] - bbox_lonlat[0]) / width;
+		scale[1] = (bbox_lonlat[3] - bbox_lonlat[1]) / height;
+		scale[2] = 0;
+		tiepoint[0] = 0;
+		tiepoint[1] = 0;
+		tiepoint[2] = 0;
+		tiepoint[3] = bbox_lonlat[0];
+		tiepoint[4] = bbox_lonlat[3];
+		tiepoint[5] = 0;
+		TIFFSetField(tif, GEOTIFF_PIXEL_SCALE, 3, scale);
+		TIFFSetField(tif, GEOTIFF_TIEPOINT, 6, tiepoint);
+		TIFFSetField(tif, GEOTIFF_KEY_DIRECTORY, 16, keys);
+	}
+
+	for (j = 0; j < height; j++) {
+		for (i = 0; i < width; i++)
+			row[i] = pick_property(&(data[(size_t)j * width + i]), property);
+		if (TIFFWriteScanline(tif, row, j, 0) < 0) {
+			fprintf(stderr, "Could not write %s.\n", file);
+			TIFFClose(tif);
+			free(row);
+			return FAIL;
+		}
+	}
+
+	TIFFClose(tif);
+	free(row);
+
+	return SUCCESS;
+}
+
+/**
+ * Extracts the slice or cross-section and writes it out.
+ *
+ * @param argc The number of arguments.
+ * @param argv The argument strings.
+ * @return Zero on success.
+ */
+int main(int argc, const char* argv[]) {
+	const char *label = "cvms5";
+	const char *property = "vs";
+	cvms5_properties_t *data = NULL;
+	double bbox[4], start[2], end[2];
+	char description[256];
+	const char *vertical = "depth";
+	int width = 0, height = 0, slice = 0, elevation = 0;
+	int i = 1, retVal = 0;
+
+	for (; i + 1 < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "-e") == 0) {
+			elevation = 1;
+			vertical = "elevation";
+		} else if (strcmp(argv[i], "-p") == 0) {
+			property = argv[++i];
+		} else if (strcmp(argv[i], "-l") == 0) {
+			label = argv[++i];
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (argc - i < 2 || (strcmp(argv[i + 1], "slice") != 0 && strcmp(argv[i + 1], "section") != 0)) {
+		usage(argv[0]);
+		return 1;
+	}
+	slice = strcmp(argv[i + 1], "slice") == 0;
+	if (argc - i != (slice ? 10 : 11)) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (strcmp(property, "vp") != 0 && strcmp(property, "vs") != 0 && strcmp(property, "rho") != 0 &&
+		strcmp(property, "qp") != 0 && strcmp(property, "qs") != 0) {
+		fprintf(stderr, "Unknown property %s.\n", property);
+		return 1;
+	}
+
+	width = atoi(argv[argc - 3]);
+	height = atoi(argv[argc - 2]);
+	if (width < 1 || height < 1) {
+		fprintf(stderr, "The image must be at least one pixel wide and high.\n");
+		return 1;
+	}
+
+	if (cvms5_init(argv[i], label) != SUCCESS) {
+		fprintf(stderr, "Could not initialize the model.\n");
+		return 1;
+	}
+	if (elevation && cvms5_set_query_mode(CVMS5_COORD_ELEVATION) != SUCCESS) {
+		fprintf(stderr, "Could not extract by elevation.\n");
+		cvms5_finalize();
+		return 1;
+	}
+
+	data = malloc((size_t)width * height * sizeof(cvms5_properties_t));
+
+	if (slice) {
+		bbox[0] = atof(argv[i + 2]);
+		bbox[1] = atof(argv[i + 3]);
+		bbox[2] = atof(argv[i + 4]);
+		bbox[3] = atof(argv[i + 5]);
+		snprintf(description, sizeof(description), "CVM-S5 %s at %s m %s", property, argv[i + 6], vertical);
+		if (cvms5_extract_slice(bbox, atof(argv[i + 6]), width, height, data) != SUCCESS ||
+			write_tiff(argv[argc - 1], data, width, height, property, description, bbox) != SUCCESS)
+			retVal = 1;
+	} else {
+		start[0] = atof(argv[i + 2]);
+		start[1] = atof(argv[i + 3]);
+		end[0] = atof(argv[i + 4]);
+		end[1] = atof(argv[i + 5]);
+		snprintf(description, sizeof(description), "CVM-S5 %s from (%s, %s) to (%s, %s), %s to %s m %s",
+				 property, argv[i + 2], argv[i + 3], argv[i + 4], argv[i + 5], argv[i + 6], argv[i + 7], vertical);
+		if (cvms5_extract_cross_section(start, end, atof(argv[i + 6]), atof(argv[i + 7]), width, height, data) != SUCCESS ||
+			write_tiff(argv[argc - 1], data, width, height, property, description, NULL) != SUCCESS)
+			retVal = 1;
+	}
+
+	free(data);
+	cvms5_finalize();
+
+	return retVal;
+}
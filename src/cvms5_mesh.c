@@ -0,0 +1,331 @@
+/**
+ * @file cvms5_mesh.c
+ * @brief Writes a CVM-S5 solver mesh for a rotated grid.
+ * @version 1.0
+ *
+ * Samples the model at every node of a regular grid, rotated to an
+ * azimuth and starting at the surface, and writes vp, vs and rho for each
+ * node as 4-byte floats in native byte order, in the AWP-ODC layout: x
+ * fastest, then y, then z from the surface down. The grid is generated
+ * and queried one slab of planes at a time, with the next slab being
+ * generated while the last is answered, so memory stays at a few slabs.
+ * Built with -DCVMS5_MPI, the slabs are shared between the MPI ranks and
+ * every rank writes its own slabs into the same file.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include "cvms5.h"
+#ifdef CVMS5_MPI
+#include <mpi.h>
+#endif
+
+/** Number of slabs in flight at once */
+#define MESH_SLOTS 2
+
+/** The mesh definition */
+typedef struct mesh_t {
+	/** Easting and northing of the first node, in the model's UTM zone */
+	double origin_e;
+	double origin_n;
+	/** Sine and cosine of the azimuth of the x axis */
+	double sin_azimuth;
+	double cos_azimuth;
+	/** Node spacing, in meters */
+	double spacing;
+	/** Number of nodes along each axis */
+	int nx;
+	int ny;
+	int nz;
+	/** Smallest Vs written, or zero to write the model's values */
+	double vs_min;
+	/** Projection between geographic coordinates and UTM */
+	PJ *geo2utm;
+} mesh_t;
+
+/** A slab and the state of its slot */
+typedef struct mesh_slot_t {
+	/** The batch */
+	cvms5_batch_t batch;
+	/** The first plane of the slab */
+	int first_plane;
+	/** Set once the slab is answered */
+	int done;
+	/** Set while the slab is in the pipeline */
+	int busy;
+} mesh_slot_t;
+
+/** Guards the slots' done flags */
+pthread_mutex_t mesh_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Signalled when a slab is answered */
+pthread_cond_t mesh_done = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Prints the usage message.
+ *
+ * @param name The program name.
+ */
+void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-m vs min] [-s planes per slab] [-l model label] <ucvm install dir> <longitude> <latitude>\n", name);
+	fprintf(stderr, "          <azimuth> <spacing> <nx> <ny> <nz> <mesh file>\n\n");
+	fprintf(stderr, "Writes vp, vs and rho at each node of a grid as 4-byte floats, x fastest, then y, then z.\n");
+	fprintf(stderr, "The first node is at the longitude and latitude, at the surface. The x axis points along\n");
+	fprintf(stderr, "the azimuth, in degrees clockwise from north, the y axis 90 degrees anti-clockwise from it\n");
+	fprintf(stderr, "and z down. Nodes are the spacing apart, in meters, along each axis.\n");
+	fprintf(stderr, "  -m  raise Vs to at least this value, keeping Vp/Vs, and recompute density\n");
+	fprintf(stderr, "  -s  number of z planes generated and queried at a time, 1 by default\n");
+	fprintf(stderr, "  -l  model label, cvms5 by default\n");
+}
+
+/**
+ * Marks a slab as answered.
+ *
+ * @param batch The slab's batch.
+ * @param status The status of the batch.
+ */
+void mesh_callback(cvms5_batch_t *batch, int status) {
+	mesh_slot_t *slot = (mesh_slot_t *)batch->user;
+
+	pthread_mutex_lock(&mesh_lock);
+	slot->done = 1;
+	pthread_cond_broadcast(&mesh_done);
+	pthread_mutex_unlock(&mesh_lock);
+}
+
+/**
+ * Fills in the points of a slab.
+ *
+ * @param mesh The mesh.
+ * @param first_plane The first plane of the slab.
+ * @param planes Number of planes in the slab.
+ * @param points The points.
+ */
+void generate_slab(mesh_t *mesh, int first_plane, int planes, cvms5_point_t *points) {
+	PJ_COORD xyzSrc, xyzDest;
+	double along_x = 0, along_y = 0;
+	size_t n = 0;
+	int i = 0, j = 0, k = 0;
+
+	// Every plane of the slab has the same footprint.
+	for (j = 0; j < mesh->ny; j++) {
+		for (i = 0; i < mesh->nx; i++) {
+			along_x = i * mesh->spacing;
+			along_y = j * mesh->spacing;
+			xyzSrc = proj_coord(mesh->origin_e + along_x * mesh->sin_azimuth - along_y * mesh->cos_azimuth,
+								mesh->origin_n + along_x * mesh->cos_azimuth + along_y * mesh->sin_azimuth, 0.0, HUGE_VAL);
+			xyzDest = proj_trans(mesh->geo2utm, PJ_INV, xyzSrc);
+			points[n].latitude = xyzDest.xyzt.x;
+			points[n].longitude = xyzDest.xyzt.y;
+			points[n].depth = first_plane * mesh->spacing;
+			n++;
+		}
+	}
+
+	for (k = 1; k < planes; k++) {
+		for (j = 0; j < mesh->nx * mesh->ny; j++) {
+			points[n] = points[j];
+			points[n].depth = (first_plane + k) * mesh->spacing;
+			n++;
+		}
+	}
+}
+
+/**
+ * Waits for a slab and writes it to its place in the mesh file.
+ *
+ * @param mesh The mesh.
+ * @param slot The slab's slot.
+ * @param fd The mesh file.
+ * @return SUCCESS or FAIL.
+ */
+int write_slab(mesh_t *mesh, mesh_slot_t *slot, int fd) {
+	cvms5_batch_t *batch = &(slot->batch);
+	size_t plane_bytes = (size_t)mesh->nx * mesh->ny * 3 * sizeof(float);
+	float *values = malloc((size_t)batch->numpoints * 3 * sizeof(float));
+	double ratio = 0;
+	int i = 0, retVal = SUCCESS;
+
+	pthread_mutex_lock(&mesh_lock);
+	while (!slot->done) pthread_cond_wait(&mesh_done, &mesh_lock);
+	pthread_mutex_unlock(&mesh_lock);
+
+	if (batch->status != SUCCESS) retVal = FAIL;
+
+	for (i = 0; i < batch->numpoints; i++) {
+		if (mesh->vs_min > 0 && batch->data[i].vs > 0 && batch->data[i].vs < mesh->vs_min) {
+			ratio = batch->data[i].vp / batch->data[i].vs;
+			batch->data[i].vs = mesh->vs_min;
+			batch->data[i].vp = mesh->vs_min * ratio;
+			batch->data[i].rho = cvms5_calculate_density(mesh->vs_min);
+		}
+		values[i * 3] = batch->data[i].vp;
+		values[i * 3 + 1] = batch->data[i].vs;
+		values[i * 3 + 2] = batch->data[i].rho;
+	}
+
+	if (pwrite(fd, values, (size_t)batch->numpoints * 3 * sizeof(float), (off_t)slot->first_plane * plane_bytes) !=
+		(ssize_t)((size_t)batch->numpoints * 3 * sizeof(float))) {
+		fprintf(stderr, "Could not write planes from %d.\n", slot->first_plane);
+		retVal = FAIL;
+	}
+
+	free(values);
+	slot->busy = 0;
+
+	return retVal;
+}
+
+/**
+ * Generates and writes the mesh.
+ *
+ * @param argc The number of arguments.
+ * @param argv The argument strings.
+ * @return Zero on success.
+ */
+int main(int argc, char* argv[]) {
+	mesh_slot_t slots[MESH_SLOTS];
+	mesh_t mesh;
+	const char *label = "cvms5";
+	char projstr[64];
+	PJ_CONTEXT *context = NULL;
+	PJ_COORD xyzSrc, xyzDest;
+	double longitude = 0, latitude = 0, azimuth = 0;
+	int planes = 1, slab_planes = 0;
+	int first_slab = 0, last_slab = 0, slabs = 0, slab = 0;
+	int rank = 0, ranks = 1;
+	int next = 0, i = 1, fd = -1, retVal = 0;
+
+#ifdef CVMS5_MPI
+	MPI_Init(&argc, &argv);
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	MPI_Comm_size(MPI_COMM_WORLD, &ranks);
+#endif
+
+	memset(&mesh, 0, sizeof(mesh_t));
+
+	for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0' && strchr("msl", argv[i][1]) != NULL; i++) {
+		if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+			mesh.vs_min = atof(argv[++i]);
+		} else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+			planes = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+			label = argv[++i];
+		} else {
+			break;
+		}
+	}
+	if (argc - i != 9 || planes < 1) {
+		if (rank == 0) usage(argv[0]);
+		retVal = 1;
+		goto done;
+	}
+
+	longitude = atof(argv[i + 1]);
+	latitude = atof(argv[i + 2]);
+	azimuth = atof(argv[i + 3]);
+	mesh.spacing = atof(argv[i + 4]);
+	mesh.nx = atoi(argv[i + 5]);
+	mesh.ny = atoi(argv[i + 6]);
+	mesh.nz = atoi(argv[i + 7]);
+	mesh.sin_azimuth = sin(azimuth * DEG_TO_RAD);
+	mesh.cos_azimuth = cos(azimuth * DEG_TO_RAD);
+
+	if (mesh.spacing <= 0 || mesh.nx < 1 || mesh.ny < 1 || mesh.nz < 1) {
+		if (rank == 0) fprintf(stderr, "The spacing and the number of nodes must be positive.\n");
+		retVal = 1;
+		goto done;
+	}
+
+	if (cvms5_init(argv[i], label) != SUCCESS) {
+		fprintf(stderr, "Could not initialize the model.\n");
+		retVal = 1;
+		goto done;
+	}
+
+	// The generating thread gets its own projection, as the library's are in use by the pipeline.
+	context = proj_context_create();
+	snprintf(projstr, 64, "+proj=utm +zone=%d +datum=NAD27 +units=m +no_defs", cvms5_configuration->utm_zone);
+	mesh.geo2utm = proj_create_crs_to_crs(context, "EPSG:4326", projstr, NULL);
+	if (mesh.geo2utm == NULL) {
+		fprintf(stderr, "Could not set up the projection.\n");
+		retVal = 1;
+		goto done;
+	}
+	xyzSrc = proj_coord(latitude, longitude, 0.0, HUGE_VAL);
+	xyzDest = proj_trans(mesh.geo2utm, PJ_FWD, xyzSrc);
+	mesh.origin_e = xyzDest.xyzt.x;
+	mesh.origin_n = xyzDest.xyzt.y;
+
+	// Rank 0 truncates the file before any rank writes, so no tail of an older, larger mesh is left.
+	if (rank == 0) fd = open(argv[i + 8], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#ifdef CVMS5_MPI
+	MPI_Barrier(MPI_COMM_WORLD);
+#endif
+	if (rank != 0) fd = open(argv[i + 8], O_WRONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Could not open %s.\n", argv[i + 8]);
+		retVal = 1;
+		goto done;
+	}
+
+	// Each rank takes a contiguous range of slabs.
+	slabs = (mesh.nz + planes - 1) / planes;
+	first_slab = (int)((long)slabs * rank / ranks);
+	last_slab = (int)((long)slabs * (rank + 1) / ranks);
+
+	memset(slots, 0, sizeof(slots));
+	for (next = 0; next < MESH_SLOTS; next++) {
+		slots[next].batch.points = malloc((size_t)mesh.nx * mesh.ny * planes * sizeof(cvms5_point_t));
+		slots[next].batch.data = malloc((size_t)mesh.nx * mesh.ny * planes * sizeof(cvms5_properties_t));
+		slots[next].batch.user = &(slots[next]);
+	}
+
+	// While a slab is being answered the next is generated; the one before is written first.
+	next = 0;
+	for (slab = first_slab; slab < last_slab; slab++) {
+		if (slots[next].busy && write_slab(&mesh, &(slots[next]), fd) != SUCCESS) retVal = 1;
+
+		slots[next].first_plane = slab * planes;
+		slab_planes = slots[next].first_plane + planes > mesh.nz ? mesh.nz - slots[next].first_plane : planes;
+		generate_slab(&mesh, slots[next].first_plane, slab_planes, slots[next].batch.points);
+		slots[next].batch.numpoints = mesh.nx * mesh.ny * slab_planes;
+		slots[next].done = 0;
+		slots[next].busy = 1;
+		if (cvms5_query_submit(&(slots[next].batch), mesh_callback) != SUCCESS) {
+			retVal = 1;
+			break;
+		}
+
+		next = (next + 1) % MESH_SLOTS;
+	}
+
+	for (slab = 0; slab < MESH_SLOTS; slab++) {
+		if (slots[next].busy && write_slab(&mesh, &(slots[next]), fd) != SUCCESS) retVal = 1;
+		next = (next + 1) % MESH_SLOTS;
+	}
+
+	for (next = 0; next < MESH_SLOTS; next++) {
+		free(slots[next].batch.points);
+		free(slots[next].batch.data);
+	}
+
+	close(fd);
+
+	if (retVal == 0)
+		printf("Rank %d wrote planes %d to %d.\n", rank, first_slab * planes,
+			   (last_slab * planes > mesh.nz ? mesh.nz : last_slab * planes) - 1);
+
+done:
+	if (mesh.geo2utm) proj_destroy(mesh.geo2utm);
+	if (context) proj_context_destroy(context);
+	if (cvms5_is_initialized) cvms5_finalize();
+
+#ifdef CVMS5_MPI
+	MPI_Finalize();
+#endif
+
+	return retVal;
+}
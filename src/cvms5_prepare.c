@@ -0,0 +1,67 @@
+/**
+ * @file cvms5_prepare.c
+ * @brief Prepares the CVM-S5 snapshot for fast startup.
+ * @version 1.0
+ *
+ * Reads the model from its source files once and writes the single
+ * snapshot file that cvms5_init maps from then on.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "cvms5.h"
+
+/**
+ * Prints the usage message.
+ *
+ * @param name The program name.
+ */
+void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-v] <ucvm install dir> [model label]\n\n", name);
+	fprintf(stderr, "Writes %s into the model's data directory.\n", CVMS5_SNAPSHOT_FILE);
+	fprintf(stderr, "  -v  verify every section checksum of the snapshot after writing it\n");
+	fprintf(stderr, "The model label defaults to cvms5.\n");
+}
+
+/**
+ * Prepares and optionally verifies the snapshot.
+ *
+ * @param argc The number of arguments.
+ * @param argv The argument strings.
+ * @return Zero on success.
+ */
+int main(int argc, const char* argv[]) {
+	const char *dir = NULL;
+	const char *label = "cvms5";
+	char snapshot_file[512];
+	int verify = 0;
+	int i = 1;
+
+	if (i < argc && strcmp(argv[i], "-v") == 0) {
+		verify = 1;
+		i++;
+	}
+	if (i >= argc || argc - i > 2) {
+		usage(argv[0]);
+		return 1;
+	}
+	dir = argv[i];
+	if (i + 1 < argc) label = argv[i + 1];
+
+	if (cvms5_prepare(dir, label) != SUCCESS) {
+		fprintf(stderr, "Could not prepare the snapshot.\n");
+		return 1;
+	}
+
+	sprintf(snapshot_file, "%s/model/%s/data/%s", dir, label, CVMS5_SNAPSHOT_FILE);
+	printf("Wrote %s.\n", snapshot_file);
+
+	if (verify) {
+		if (cvms5_verify_snapshot(snapshot_file) != SUCCESS) return 1;
+		printf("Snapshot verified.\n");
+	}
+
+	return 0;
+}
@@ -0,0 +1,67 @@
+/**
+ * @file cvms5_pyramid.c
+ * @brief Builds the CVM-S5 model pyramid for coarse resolution queries.
+ * @version 1.0
+ *
+ * Reads the model once and writes each smoothed, decimated level of the
+ * pyramid next to the model's files, where cvms5_set_query_resolution
+ * picks them up.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "cvms5.h"
+
+/**
+ * Prints the usage message.
+ *
+ * @param name The program name.
+ */
+void usage(const char *name) {
+	fprintf(stderr, "Usage: %s <ucvm install dir> [model label] [levels]\n\n", name);
+	fprintf(stderr, "Writes the vp_level and vs_level files of the model pyramid into the model's directory.\n");
+	fprintf(stderr, "The model label defaults to cvms5 and the number of levels to 3.\n");
+}
+
+/**
+ * Builds the pyramid.
+ *
+ * @param argc The number of arguments.
+ * @param argv The argument strings.
+ * @return Zero on success.
+ */
+int main(int argc, const char* argv[]) {
+	const char *label = "cvms5";
+	int levels = 3;
+
+	if (argc < 2 || argc > 4) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (argc > 2) label = argv[2];
+	if (argc > 3) levels = atoi(argv[3]);
+
+	if (levels < 1 || levels >= CVMS5_PYRAMID_LEVELS) {
+		fprintf(stderr, "The number of levels must be between 1 and %d.\n", CVMS5_PYRAMID_LEVELS - 1);
+		return 1;
+	}
+
+	if (cvms5_init(argv[1], label) != SUCCESS) {
+		fprintf(stderr, "Could not initialize the model.\n");
+		return 1;
+	}
+
+	if (cvms5_build_pyramid(levels) != SUCCESS) {
+		fprintf(stderr, "Could not build the pyramid.\n");
+		cvms5_finalize();
+		return 1;
+	}
+
+	printf("Wrote %d pyramid levels.\n", levels);
+
+	cvms5_finalize();
+
+	return 0;
+}
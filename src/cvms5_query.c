@@ -0,0 +1,251 @@
+/**
+ * @file cvms5_query.c
+ * @brief Queries CVM-S5 for a stream of points.
+ * @version 1.0
+ *
+ * Reads longitude, latitude and depth triples from a file or stdin, as
+ * text or packed binary doubles, and writes Vp, Vs, density, Qp and Qs
+ * for each point in the same order. Points are sent through the query
+ * pipeline in large batches, with several batches in flight so reading,
+ * querying and writing overlap. The throughput is reported on stderr.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include "cvms5.h"
+
+/** Number of batches in flight at once */
+#define QUERY_SLOTS 4
+
+/** Default number of points in a batch */
+#define QUERY_BATCH 65536
+
+/** A batch and the state of its slot */
+typedef struct query_slot_t {
+	/** The batch */
+	cvms5_batch_t batch;
+	/** Set once the batch is answered */
+	int done;
+	/** Set while the batch is in the pipeline */
+	int busy;
+} query_slot_t;
+
+/** Guards the slots' done flags */
+pthread_mutex_t query_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Signalled when a batch is answered */
+pthread_cond_t query_done = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Prints the usage message.
+ *
+ * @param name The program name.
+ */
+void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-b] [-B] [-e] [-i interpolation] [-n batch size] [-l model label] <ucvm install dir> [input file]\n\n", name);
+	fprintf(stderr, "Reads longitude, latitude and depth (m) for each point from the input file, or stdin,\n");
+	fprintf(stderr, "and writes vp, vs, rho, qp and qs for each point to stdout.\n");
+	fprintf(stderr, "  -b  the input is packed binary doubles rather than text\n");
+	fprintf(stderr, "  -B  write packed binary doubles rather than text\n");
+	fprintf(stderr, "  -e  the third value is elevation above sea level (m) rather than depth\n");
+	fprintf(stderr, "  -i  trilinear, nearest or tricubic, trilinear by default\n");
+	fprintf(stderr, "  -n  number of points per batch, %d by default\n", QUERY_BATCH);
+	fprintf(stderr, "  -l  model label, cvms5 by default\n");
+}
+
+/**
+ * Marks a batch as answered.
+ *
+ * @param batch The batch.
+ * @param status The status of the batch.
+ */
+void query_callback(cvms5_batch_t *batch, int status) {
+	query_slot_t *slot = (query_slot_t *)batch->user;
+
+	pthread_mutex_lock(&query_lock);
+	slot->done = 1;
+	pthread_cond_broadcast(&query_done);
+	pthread_mutex_unlock(&query_lock);
+}
+
+/**
+ * Reads up to a batch of points.
+ *
+ * @param fp The input.
+ * @param binary Whether the input is binary.
+ * @param points Where the points are read to.
+ * @param size The most points to read.
+ * @return The number of points read.
+ */
+int read_points(FILE *fp, int binary, cvms5_point_t *points, int size) {
+	double triple[3];
+	char line[512];
+	int count = 0;
+
+	while (count < size) {
+		if (binary) {
+			if (fread(triple, sizeof(double), 3, fp) != 3) break;
+		} else {
+			if (fgets(line, sizeof(line), fp) == NULL) break;
+			if (line[0] == '#' || sscanf(line, "%lf %lf %lf", &triple[0], &triple[1], &triple[2]) != 3) continue;
+		}
+		points[count].longitude = triple[0];
+		points[count].latitude = triple[1];
+		points[count].depth = triple[2];
+		count++;
+	}
+
+	return count;
+}
+
+/**
+ * Waits for a batch and writes out its results.
+ *
+ * @param slot The batch's slot.
+ * @param binary Whether to write binary.
+ */
+void write_slot(query_slot_t *slot, int binary) {
+	cvms5_batch_t *batch = &(slot->batch);
+	double values[5];
+	int i = 0;
+
+	pthread_mutex_lock(&query_lock);
+	while (!slot->done) pthread_cond_wait(&query_done, &query_lock);
+	pthread_mutex_unlock(&query_lock);
+
+	for (i = 0; i < batch->numpoints; i++) {
+		if (binary) {
+			values[0] = batch->data[i].vp;
+			values[1] = batch->data[i].vs;
+			values[2] = batch->data[i].rho;
+			values[3] = batch->data[i].qp;
+			values[4] = batch->data[i].qs;
+			fwrite(values, sizeof(double), 5, stdout);
+		} else {
+			printf("%10.4f %10.4f %10.3f %10.4f %10.4f %10.4f %10.4f %10.4f\n",
+				   batch->points[i].longitude, batch->points[i].latitude, batch->points[i].depth,
+				   batch->data[i].vp, batch->data[i].vs, batch->data[i].rho,
+				   batch->data[i].qp, batch->data[i].qs);
+		}
+	}
+
+	slot->busy = 0;
+}
+
+/**
+ * Streams the points through the model.
+ *
+ * @param argc The number of arguments.
+ * @param argv The argument strings.
+ * @return Zero on success.
+ */
+int main(int argc, const char* argv[]) {
+	query_slot_t slots[QUERY_SLOTS];
+	const char *label = "cvms5";
+	int binary_in = 0, binary_out = 0, elevation = 0;
+	int interpolation = CVMS5_INTERP_TRILINEAR;
+	int size = QUERY_BATCH;
+	int next = 0, count = 0, i = 1;
+	long total = 0;
+	struct timeval start, end;
+	double seconds = 0;
+	FILE *fp = stdin;
+
+	for (; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "-b") == 0) {
+			binary_in = 1;
+		} else if (strcmp(argv[i], "-B") == 0) {
+			binary_out = 1;
+		} else if (strcmp(argv[i], "-e") == 0) {
+			elevation = 1;
+		} else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+			i++;
+			if (strcmp(argv[i], "nearest") == 0) interpolation = CVMS5_INTERP_NEAREST;
+			else if (strcmp(argv[i], "tricubic") == 0) interpolation = CVMS5_INTERP_TRICUBIC;
+			else if (strcmp(argv[i], "trilinear") != 0) {
+				usage(argv[0]);
+				return 1;
+			}
+		} else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+			size = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+			label = argv[++i];
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (i >= argc || argc - i > 2 || size < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (i + 1 < argc && (fp = fopen(argv[i + 1], binary_in ? "rb" : "r")) == NULL) {
+		fprintf(stderr, "Could not open %s.\n", argv[i + 1]);
+		return 1;
+	}
+
+	if (cvms5_init(argv[i], label) != SUCCESS) {
+		fprintf(stderr, "Could not initialize the model.\n");
+		return 1;
+	}
+	if (elevation && cvms5_set_query_mode(CVMS5_COORD_ELEVATION) != SUCCESS) {
+		fprintf(stderr, "Could not query by elevation.\n");
+		return 1;
+	}
+	cvms5_set_interpolation(interpolation);
+
+	memset(slots, 0, sizeof(slots));
+	for (i = 0; i < QUERY_SLOTS; i++) {
+		slots[i].batch.points = malloc(size * sizeof(cvms5_point_t));
+		slots[i].batch.data = malloc(size * sizeof(cvms5_properties_t));
+		slots[i].batch.user = &(slots[i]);
+	}
+
+	gettimeofday(&start, NULL);
+
+	// Slots are reused in turn, so results are written in input order while the
+	// batches after them are still being read and answered.
+	while (1) {
+		if (slots[next].busy) write_slot(&(slots[next]), binary_out);
+
+		count = read_points(fp, binary_in, slots[next].batch.points, size);
+		if (count == 0) break;
+
+		slots[next].batch.numpoints = count;
+		slots[next].done = 0;
+		slots[next].busy = 1;
+		if (cvms5_query_submit(&(slots[next].batch), query_callback) != SUCCESS) {
+			fprintf(stderr, "Could not submit a batch of points.\n");
+			return 1;
+		}
+		total += count;
+		next = (next + 1) % QUERY_SLOTS;
+	}
+
+	for (i = 0; i < QUERY_SLOTS; i++) {
+		if (slots[next].busy) write_slot(&(slots[next]), binary_out);
+		next = (next + 1) % QUERY_SLOTS;
+	}
+
+	if (cvms5_query_wait() != SUCCESS)
+		fprintf(stderr, "WARNING: Some points could not be queried.\n");
+
+	fflush(stdout);
+	gettimeofday(&end, NULL);
+	seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1.0e6;
+	fprintf(stderr, "Queried %ld points in %.3f s (%.0f points/sec).\n", total, seconds,
+			seconds > 0 ? total / seconds : 0.0);
+
+	for (i = 0; i < QUERY_SLOTS; i++) {
+		free(slots[i].batch.points);
+		free(slots[i].batch.data);
+	}
+	if (fp != stdin) fclose(fp);
+
+	cvms5_finalize();
+
+	return 0;
+}
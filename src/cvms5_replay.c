@@ -0,0 +1,311 @@
+/**
+ * @file cvms5_replay.c
+ * @brief Replays a query trace against CVM-S5.
+ * @version 1.0
+ *
+ * Reads a trace recorded with CVMS5_TRACE and queries the model again
+ * with the same batches and settings. With one thread the batches are
+ * answered in order with cvms5_query, as they were recorded; with more,
+ * each thread keeps one batch at a time in the query pipeline. The
+ * throughput and the percentiles of the batches' latencies are reported
+ * next to those recorded, so builds can be compared on one workload.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "cvms5.h"
+
+/** A batch of the trace */
+typedef struct replay_batch_t {
+	/** The batch as recorded */
+	cvms5_trace_record_t record;
+	/** The batch's points */
+	cvms5_point_t *points;
+	/** Seconds the batch took to answer when replayed */
+	double seconds;
+} replay_batch_t;
+
+/** Waits for a thread's batch to be answered by the pipeline */
+typedef struct replay_waiter_t {
+	/** Guards done */
+	pthread_mutex_t lock;
+	/** Signalled when the batch is answered */
+	pthread_cond_t answered;
+	/** Set once the batch is answered */
+	int done;
+} replay_waiter_t;
+
+/** The batches of the trace */
+replay_batch_t *batches = NULL;
+/** Number of batches */
+int batch_count = 0;
+/** Next batch for a thread to take */
+int next_batch = 0;
+/** Guards next_batch */
+pthread_mutex_t next_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Prints the usage message.
+ *
+ * @param name The program name.
+ */
+void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-t threads] [-l model label] <ucvm install dir> <trace file>\n\n", name);
+	fprintf(stderr, "Queries the model with the batches of a trace recorded with CVMS5_TRACE, and reports\n");
+	fprintf(stderr, "the throughput and the percentiles of the batches' latencies.\n");
+	fprintf(stderr, "  -t  number of threads, each with one batch at a time in the query pipeline,\n");
+	fprintf(stderr, "      1 by default to answer the batches in order with cvms5_query\n");
+	fprintf(stderr, "  -l  model label, cvms5 by default\n");
+}
+
+/**
+ * Reads every batch of a trace.
+ *
+ * @param file The trace file.
+ * @return Zero on success.
+ */
+int read_trace(const char *file) {
+	cvms5_trace_header_t header;
+	cvms5_trace_record_t record;
+	int size = 0;
+	FILE *fp = fopen(file, "rb");
+
+	if (fp == NULL) {
+		fprintf(stderr, "Could not open %s.\n", file);
+		return 1;
+	}
+	if (fread(&header, sizeof(cvms5_trace_header_t), 1, fp) != 1 ||
+		memcmp(header.magic, CVMS5_TRACE_MAGIC, sizeof(header.magic)) != 0 || header.version != CVMS5_TRACE_VERSION) {
+		fprintf(stderr, "%s is not a query trace of this version.\n", file);
+		fclose(fp);
+		return 1;
+	}
+
+	while (fread(&record, sizeof(cvms5_trace_record_t), 1, fp) == 1) {
+		if (batch_count == size) {
+			size = size > 0 ? size * 2 : 1024;
+			batches = realloc(batches, size * sizeof(replay_batch_t));
+		}
+		batches[batch_count].record = record;
+		batches[batch_count].points = malloc((record.numpoints > 0 ? record.numpoints : 1) * sizeof(cvms5_point_t));
+		batches[batch_count].seconds = 0;
+
+		// A trace cut short by its process ends at its last whole batch.
+		if (fread(batches[batch_count].points, sizeof(cvms5_point_t), record.numpoints, fp) != record.numpoints) {
+			free(batches[batch_count].points);
+			break;
+		}
+		batch_count++;
+	}
+
+	fclose(fp);
+
+	return 0;
+}
+
+/**
+ * Compares two latencies for qsort.
+ *
+ * @param a The first latency.
+ * @param b The second latency.
+ * @return Less than, equal to or greater than zero as a is less than, equal to or greater than b.
+ */
+int compare_seconds(const void *a, const void *b) {
+	double first = *(const double *)a, second = *(const double *)b;
+	return first < second ? -1 : (first > second ? 1 : 0);
+}
+
+/**
+ * Prints the percentiles of a set of latencies, in milliseconds.
+ *
+ * @param label What the latencies are.
+ * @param seconds The latencies, which are sorted.
+ * @param count Number of latencies.
+ */
+void print_percentiles(const char *label, double *seconds, int count) {
+	double percentiles[3] = { 50, 90, 99 };
+	int i = 0, index = 0;
+
+	qsort(seconds, count, sizeof(double), compare_seconds);
+
+	printf("%-10s", label);
+	for (i = 0; i < 3; i++) {
+		index = (int)(percentiles[i] / 100.0 * count + 0.5) - 1;
+		if (index < 0) index = 0;
+		if (index > count - 1) index = count - 1;
+		printf(" %10.3f", seconds[index] * 1000.0);
+	}
+	printf(" %10.3f\n", seconds[count - 1] * 1000.0);
+}
+
+/**
+ * Marks a thread's batch as answered.
+ *
+ * @param batch The batch.
+ * @param status The status of the batch.
+ */
+void replay_callback(cvms5_batch_t *batch, int status) {
+	replay_waiter_t *waiter = (replay_waiter_t *)batch->user;
+
+	pthread_mutex_lock(&(waiter->lock));
+	waiter->done = 1;
+	pthread_cond_signal(&(waiter->answered));
+	pthread_mutex_unlock(&(waiter->lock));
+}
+
+/**
+ * Takes batches in trace order and submits each to the pipeline, waiting for it to be answered
+ * before taking the next.
+ *
+ * @param arg Unused.
+ * @return NULL.
+ */
+void *replay_thread(void *arg) {
+	replay_waiter_t waiter;
+	cvms5_batch_t batch;
+	cvms5_properties_t *data = NULL;
+	int size = 0, i = 0;
+	double start = 0;
+
+	pthread_mutex_init(&(waiter.lock), NULL);
+	pthread_cond_init(&(waiter.answered), NULL);
+
+	while (1) {
+		pthread_mutex_lock(&next_lock);
+		i = next_batch++;
+		pthread_mutex_unlock(&next_lock);
+		if (i >= batch_count) break;
+
+		if ((int)batches[i].record.numpoints > size) {
+			size = batches[i].record.numpoints;
+			data = realloc(data, size * sizeof(cvms5_properties_t));
+		}
+
+		memset(&batch, 0, sizeof(cvms5_batch_t));
+		batch.points = batches[i].points;
+		batch.data = data;
+		batch.numpoints = batches[i].record.numpoints;
+		batch.user = &waiter;
+		waiter.done = 0;
+
+		start = cvms5_seconds();
+		if (cvms5_query_submit(&batch, replay_callback) != SUCCESS) break;
+
+		pthread_mutex_lock(&(waiter.lock));
+		while (!waiter.done) pthread_cond_wait(&(waiter.answered), &(waiter.lock));
+		pthread_mutex_unlock(&(waiter.lock));
+		batches[i].seconds = cvms5_seconds() - start;
+	}
+
+	free(data);
+	pthread_mutex_destroy(&(waiter.lock));
+	pthread_cond_destroy(&(waiter.answered));
+
+	return NULL;
+}
+
+/**
+ * Replays the trace.
+ *
+ * @param argc The number of arguments.
+ * @param argv The argument strings.
+ * @return Zero on success.
+ */
+int main(int argc, const char* argv[]) {
+	const char *label = "cvms5";
+	cvms5_properties_t *data = NULL;
+	pthread_t *threads = NULL;
+	double *seconds = NULL;
+	double start = 0, elapsed = 0, recorded = 0;
+	long points = 0;
+	int thread_count = 1, size = 0, mixed = 0, i = 1;
+
+	for (; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+			thread_count = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+			label = argv[++i];
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (argc - i != 2 || thread_count < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (read_trace(argv[i + 1]) != 0) return 1;
+	if (batch_count == 0) {
+		fprintf(stderr, "The trace has no batches.\n");
+		return 1;
+	}
+
+	if (cvms5_init(argv[i], label) != SUCCESS) {
+		fprintf(stderr, "Could not initialize the model.\n");
+		return 1;
+	}
+	// The replay itself is not traced, and every batch is answered by the model rather than
+	// from the result cache, so that the latencies measure the build.
+	cvms5_stop_trace();
+	cvms5_set_cache(NULL);
+
+	for (i = 0; i < batch_count; i++) {
+		points += batches[i].record.numpoints;
+		recorded += batches[i].record.seconds;
+		if (batches[i].record.mode != batches[0].record.mode ||
+			batches[i].record.interpolation != batches[0].record.interpolation) mixed = 1;
+	}
+
+	cvms5_set_query_mode(batches[0].record.mode);
+	cvms5_set_interpolation(batches[0].record.interpolation);
+
+	start = cvms5_seconds();
+	if (thread_count == 1) {
+		for (i = 0; i < batch_count; i++) {
+			if ((int)batches[i].record.numpoints > size) {
+				size = batches[i].record.numpoints;
+				data = realloc(data, size * sizeof(cvms5_properties_t));
+			}
+			if (batches[i].record.mode != cvms5_query_mode) cvms5_set_query_mode(batches[i].record.mode);
+			if (batches[i].record.interpolation != cvms5_interpolation) cvms5_set_interpolation(batches[i].record.interpolation);
+
+			batches[i].seconds = cvms5_seconds();
+			cvms5_query(batches[i].points, data, batches[i].record.numpoints);
+			batches[i].seconds = cvms5_seconds() - batches[i].seconds;
+		}
+	} else {
+		// The pipeline answers every batch with the same settings.
+		if (mixed)
+			fprintf(stderr, "WARNING: The trace changes query settings, every batch is replayed with those of the first.\n");
+
+		threads = malloc(thread_count * sizeof(pthread_t));
+		for (i = 0; i < thread_count; i++) pthread_create(&(threads[i]), NULL, replay_thread, NULL);
+		for (i = 0; i < thread_count; i++) pthread_join(threads[i], NULL);
+		cvms5_query_wait();
+	}
+	elapsed = cvms5_seconds() - start;
+
+	printf("Replayed %d batches, %ld points, with %d thread%s in %.3f s (%.0f points/sec).\n", batch_count, points,
+		   thread_count, thread_count > 1 ? "s" : "", elapsed, elapsed > 0 ? points / elapsed : 0.0);
+	printf("Recorded %.3f s answering them (%.0f points/sec).\n", recorded, recorded > 0 ? points / recorded : 0.0);
+	printf("%-10s %10s %10s %10s %10s\n", "ms", "p50", "p90", "p99", "max");
+
+	seconds = malloc(batch_count * sizeof(double));
+	for (i = 0; i < batch_count; i++) seconds[i] = batches[i].seconds;
+	print_percentiles("replayed", seconds, batch_count);
+	for (i = 0; i < batch_count; i++) seconds[i] = batches[i].record.seconds;
+	print_percentiles("recorded", seconds, batch_count);
+
+	for (i = 0; i < batch_count; i++) free(batches[i].points);
+	free(batches);
+	free(seconds);
+	free(threads);
+	free(data);
+
+	cvms5_finalize();
+
+	return 0;
+}
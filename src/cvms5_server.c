@@ -0,0 +1,374 @@
+/**
+ * @file cvms5_server.c
+ * @brief Serves CVM-S5 queries over a Unix domain socket.
+ * @version 1.0
+ *
+ * Initializes the model once and answers batched binary queries from
+ * cvms5_client_query, so that short jobs do not each pay for cvms5_init.
+ * Connections are served by a pool of threads. Requests that arrive while
+ * the query pipeline is busy are coalesced into one batch, so their grid
+ * points are read together.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "cvms5.h"
+
+/** Default number of threads serving connections */
+#define SERVER_THREADS 8
+
+/** Default number of points in a coalesced batch */
+#define SERVER_BATCH 65536
+
+/** Number of coalesced batches in the pipeline at once */
+#define SERVER_IN_FLIGHT 2
+
+/** Number of accepted connections waiting for a thread */
+#define SERVER_QUEUE 256
+
+/** A request waiting to be answered */
+typedef struct server_request_t {
+	/** The query points */
+	cvms5_point_t *points;
+	/** The material properties */
+	cvms5_properties_t *data;
+	/** Number of query points */
+	int numpoints;
+	/** The status of the query */
+	int status;
+	/** Set once the request is answered */
+	int done;
+	/** Next request waiting, or in the same batch */
+	struct server_request_t *next;
+} server_request_t;
+
+/** Guards the queues and counters below */
+pthread_mutex_t server_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Signalled when a connection is queued or taken */
+pthread_cond_t server_connections = PTHREAD_COND_INITIALIZER;
+/** Signalled when a request is queued or a batch leaves the pipeline */
+pthread_cond_t server_work = PTHREAD_COND_INITIALIZER;
+/** Signalled when a request is answered */
+pthread_cond_t server_done = PTHREAD_COND_INITIALIZER;
+
+/** Accepted connections waiting for a thread */
+int server_queue[SERVER_QUEUE];
+/** Index of the first waiting connection */
+int server_queue_first = 0;
+/** Number of waiting connections */
+int server_queue_count = 0;
+/** First and last requests waiting to be batched */
+server_request_t *server_pending = NULL;
+server_request_t *server_pending_last = NULL;
+/** Number of coalesced batches in the pipeline */
+int server_in_flight = 0;
+/** Most points in a coalesced batch */
+int server_batch_size = SERVER_BATCH;
+/** Set by SIGINT or SIGTERM */
+volatile sig_atomic_t server_stopping = 0;
+/** The listening socket, shut down by SIGINT or SIGTERM */
+int server_listener = -1;
+
+/**
+ * Prints the usage message.
+ *
+ * @param name The program name.
+ */
+void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-e] [-i interpolation] [-t threads] [-n batch size] [-l model label] <ucvm install dir>\n", name);
+	fprintf(stderr, "          <socket path>\n\n");
+	fprintf(stderr, "Initializes the model once and answers cvms5_client_query over a Unix domain socket\n");
+	fprintf(stderr, "until interrupted.\n");
+	fprintf(stderr, "  -e  the depths of the points are elevations above sea level (m)\n");
+	fprintf(stderr, "  -i  trilinear, nearest or tricubic, trilinear by default\n");
+	fprintf(stderr, "  -t  number of threads serving connections, %d by default\n", SERVER_THREADS);
+	fprintf(stderr, "  -n  most points coalesced into one batch, %d by default\n", SERVER_BATCH);
+	fprintf(stderr, "  -l  model label, cvms5 by default\n");
+}
+
+/**
+ * Stops the server. Shutting the listening socket down wakes accept even if the signal
+ * arrived just before it was called.
+ *
+ * @param signal The signal.
+ */
+void stop_server(int signal) {
+	server_stopping = 1;
+	shutdown(server_listener, SHUT_RDWR);
+}
+
+/**
+ * Hands a coalesced batch's properties back to its requests.
+ *
+ * @param batch The batch.
+ * @param status The status of the batch.
+ */
+void batch_answered(cvms5_batch_t *batch, int status) {
+	server_request_t *request = (server_request_t *)batch->user;
+	int offset = 0;
+
+	pthread_mutex_lock(&server_lock);
+	for (; request != NULL; request = request->next) {
+		memcpy(request->data, &(batch->data[offset]), request->numpoints * sizeof(cvms5_properties_t));
+		offset += request->numpoints;
+		request->status = status;
+		request->done = 1;
+	}
+	server_in_flight--;
+	pthread_cond_broadcast(&server_done);
+	pthread_cond_broadcast(&server_work);
+	pthread_mutex_unlock(&server_lock);
+
+	free(batch->points);
+	free(batch->data);
+	free(batch);
+}
+
+/**
+ * Gathers the waiting requests into batches and sends them through the query pipeline. Only
+ * a few batches are let into the pipeline at once, so requests arriving while it is busy
+ * wait and are answered together in the next batch.
+ *
+ * @param arg Unused.
+ * @return NULL.
+ */
+void *coalesce_requests(void *arg) {
+	server_request_t *first = NULL, *last = NULL, *request = NULL;
+	cvms5_batch_t *batch = NULL;
+	int count = 0, offset = 0;
+
+	while (1) {
+		pthread_mutex_lock(&server_lock);
+		while (server_pending == NULL || server_in_flight >= SERVER_IN_FLIGHT)
+			pthread_cond_wait(&server_work, &server_lock);
+
+		// Take whole requests up to the batch size, and always at least one.
+		first = server_pending;
+		count = 0;
+		for (request = first; request != NULL && (count == 0 || count + request->numpoints <= server_batch_size);
+			 request = request->next) {
+			count += request->numpoints;
+			last = request;
+		}
+		server_pending = last->next;
+		if (server_pending == NULL) server_pending_last = NULL;
+		last->next = NULL;
+		server_in_flight++;
+		pthread_mutex_unlock(&server_lock);
+
+		batch = calloc(1, sizeof(cvms5_batch_t));
+		batch->points = malloc(count * sizeof(cvms5_point_t));
+		batch->data = malloc(count * sizeof(cvms5_properties_t));
+		batch->numpoints = count;
+		batch->user = first;
+		for (offset = 0, request = first; request != NULL; request = request->next) {
+			memcpy(&(batch->points[offset]), request->points, request->numpoints * sizeof(cvms5_point_t));
+			offset += request->numpoints;
+		}
+
+		if (cvms5_query_submit(batch, batch_answered) != SUCCESS) {
+			for (offset = 0; offset < count; offset++)
+				batch->data[offset].vp = batch->data[offset].vs = batch->data[offset].rho =
+					batch->data[offset].qp = batch->data[offset].qs = -1;
+			batch_answered(batch, FAIL);
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Answers the requests on one connection until the client closes it.
+ *
+ * @param fd The connection.
+ */
+void serve_connection(int fd) {
+	cvms5_server_header_t header;
+	server_request_t request;
+	int capacity = 0;
+
+	memset(&request, 0, sizeof(request));
+
+	while (cvms5_read_fully(fd, &header, sizeof(header)) == SUCCESS) {
+		if (header.magic != CVMS5_SERVER_MAGIC || header.numpoints < 0 || header.numpoints > CVMS5_SERVER_REQUEST_MAX) {
+			fprintf(stderr, "WARNING: Dropped a connection after a malformed request.\n");
+			break;
+		}
+
+		if (header.numpoints > capacity) {
+			capacity = header.numpoints;
+			request.points = realloc(request.points, capacity * sizeof(cvms5_point_t));
+			request.data = realloc(request.data, capacity * sizeof(cvms5_properties_t));
+		}
+		if (cvms5_read_fully(fd, request.points, header.numpoints * sizeof(cvms5_point_t)) != SUCCESS) break;
+
+		request.numpoints = header.numpoints;
+		request.status = SUCCESS;
+		request.done = 0;
+		request.next = NULL;
+
+		if (request.numpoints > 0) {
+			pthread_mutex_lock(&server_lock);
+			if (server_pending_last != NULL) server_pending_last->next = &request;
+			else server_pending = &request;
+			server_pending_last = &request;
+			pthread_cond_broadcast(&server_work);
+			while (!request.done) pthread_cond_wait(&server_done, &server_lock);
+			pthread_mutex_unlock(&server_lock);
+		}
+
+		header.status = request.status;
+		if (cvms5_write_fully(fd, &header, sizeof(header)) != SUCCESS ||
+			cvms5_write_fully(fd, request.data, request.numpoints * sizeof(cvms5_properties_t)) != SUCCESS)
+			break;
+	}
+
+	free(request.points);
+	free(request.data);
+}
+
+/**
+ * Serves the accepted connections, one at a time.
+ *
+ * @param arg Unused.
+ * @return NULL.
+ */
+void *serve_connections(void *arg) {
+	int fd = -1;
+
+	while (1) {
+		pthread_mutex_lock(&server_lock);
+		while (server_queue_count == 0) pthread_cond_wait(&server_connections, &server_lock);
+		fd = server_queue[server_queue_first];
+		server_queue_first = (server_queue_first + 1) % SERVER_QUEUE;
+		server_queue_count--;
+		pthread_cond_broadcast(&server_connections);
+		pthread_mutex_unlock(&server_lock);
+
+		serve_connection(fd);
+		close(fd);
+	}
+
+	return NULL;
+}
+
+/**
+ * Initializes the model and serves queries until interrupted.
+ *
+ * @param argc The number of arguments.
+ * @param argv The argument strings.
+ * @return Zero on success.
+ */
+int main(int argc, const char* argv[]) {
+	const char *label = "cvms5";
+	int elevation = 0, threads = SERVER_THREADS;
+	int interpolation = CVMS5_INTERP_TRILINEAR;
+	struct sockaddr_un address;
+	struct sigaction action;
+	sigset_t signals, previous;
+	pthread_t thread;
+	int fd = -1, i = 1;
+
+	for (; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "-e") == 0) {
+			elevation = 1;
+		} else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+			i++;
+			if (strcmp(argv[i], "nearest") == 0) interpolation = CVMS5_INTERP_NEAREST;
+			else if (strcmp(argv[i], "tricubic") == 0) interpolation = CVMS5_INTERP_TRICUBIC;
+			else if (strcmp(argv[i], "trilinear") != 0) {
+				usage(argv[0]);
+				return 1;
+			}
+		} else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+			threads = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+			server_batch_size = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+			label = argv[++i];
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (argc - i != 2 || threads < 1 || server_batch_size < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (strlen(argv[i + 1]) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "The socket path is too long.\n");
+		return 1;
+	}
+
+	if (cvms5_init(argv[i], label) != SUCCESS) {
+		fprintf(stderr, "Could not initialize the model.\n");
+		return 1;
+	}
+	if (elevation && cvms5_set_query_mode(CVMS5_COORD_ELEVATION) != SUCCESS) {
+		fprintf(stderr, "Could not query by elevation.\n");
+		return 1;
+	}
+	cvms5_set_interpolation(interpolation);
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, argv[i + 1]);
+
+	// A socket left behind by a server that was killed would stop the bind.
+	unlink(address.sun_path);
+	if ((server_listener = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+		bind(server_listener, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+		listen(server_listener, SOMAXCONN) != 0) {
+		fprintf(stderr, "Could not listen on %s.\n", address.sun_path);
+		return 1;
+	}
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = stop_server;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	// The threads start with the signals blocked, so they are only taken by this thread and
+	// never interrupt a connection being served.
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, &previous);
+	pthread_create(&thread, NULL, coalesce_requests, NULL);
+	pthread_detach(thread);
+	for (; threads > 0; threads--) {
+		pthread_create(&thread, NULL, serve_connections, NULL);
+		pthread_detach(thread);
+	}
+	pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+	fprintf(stderr, "Serving queries on %s.\n", address.sun_path);
+
+	while (!server_stopping) {
+		if ((fd = accept(server_listener, NULL, NULL)) < 0) {
+			if (errno != EINTR && !server_stopping) fprintf(stderr, "WARNING: Could not accept a connection.\n");
+			continue;
+		}
+
+		pthread_mutex_lock(&server_lock);
+		while (server_queue_count == SERVER_QUEUE) pthread_cond_wait(&server_connections, &server_lock);
+		server_queue[(server_queue_first + server_queue_count) % SERVER_QUEUE] = fd;
+		server_queue_count++;
+		pthread_cond_broadcast(&server_connections);
+		pthread_mutex_unlock(&server_lock);
+	}
+
+	// Connections still being served are dropped with the process, so the model is not
+	// finalized under them.
+	close(server_listener);
+	unlink(address.sun_path);
+	fprintf(stderr, "Stopped serving queries.\n");
+
+	return 0;
+}
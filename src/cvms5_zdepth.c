@@ -0,0 +1,101 @@
+/**
+ * @file cvms5_zdepth.c
+ * @brief Maps CVM-S5 basin depths over a grid of points.
+ * @version 1.0
+ *
+ * Writes the depths at which Vs first reaches each of a set of
+ * thresholds, Z1.0 and Z2.5 by default, for every point of a regular
+ * longitude and latitude grid, one point per line.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "cvms5.h"
+
+/** Most thresholds on the command line, as many as the library keeps indexes for */
+#define ZDEPTH_MAX_THRESHOLDS CVMS5_ZDEPTH_INDEXES
+
+/**
+ * Prints the usage message.
+ *
+ * @param name The program name.
+ */
+void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-t vs threshold]... [-l model label] <ucvm install dir>\n", name);
+	fprintf(stderr, "          <min lon> <min lat> <max lon> <max lat> <spacing>\n\n");
+	fprintf(stderr, "Writes longitude, latitude and the depth (m) at which Vs first reaches each threshold,\n");
+	fprintf(stderr, "or -1 if it never does, for every point of the grid. The spacing is in degrees.\n");
+	fprintf(stderr, "  -t  a Vs threshold in m/s, up to %d, 1000 and 2500 by default\n", ZDEPTH_MAX_THRESHOLDS);
+	fprintf(stderr, "  -l  model label, cvms5 by default\n");
+}
+
+/**
+ * Maps the basin depths.
+ *
+ * @param argc The number of arguments.
+ * @param argv The argument strings.
+ * @return Zero on success.
+ */
+int main(int argc, const char* argv[]) {
+	double thresholds[ZDEPTH_MAX_THRESHOLDS] = { 1000, 2500 };
+	const char *label = "cvms5";
+	double bbox[4], spacing = 0, lon = 0, lat = 0;
+	int numthresholds = 0, nx = 0, ny = 0;
+	int i = 1, j = 0, t = 0;
+
+	for (; i < argc && argv[i][0] == '-' && (argv[i][1] == 't' || argv[i][1] == 'l'); i += 2) {
+		if (i + 1 >= argc) {
+			usage(argv[0]);
+			return 1;
+		}
+		if (strcmp(argv[i], "-t") == 0) {
+			if (numthresholds == ZDEPTH_MAX_THRESHOLDS) {
+				fprintf(stderr, "At most %d thresholds can be given.\n", ZDEPTH_MAX_THRESHOLDS);
+				return 1;
+			}
+			thresholds[numthresholds++] = atof(argv[i + 1]);
+		} else if (strcmp(argv[i], "-l") == 0) {
+			label = argv[i + 1];
+		}
+	}
+	if (argc - i != 6) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (numthresholds == 0) numthresholds = 2;
+
+	for (j = 0; j < 4; j++) bbox[j] = atof(argv[i + 1 + j]);
+	spacing = atof(argv[i + 5]);
+	if (spacing <= 0 || bbox[2] < bbox[0] || bbox[3] < bbox[1]) {
+		fprintf(stderr, "The spacing must be positive and the box given as min then max.\n");
+		return 1;
+	}
+	nx = (int)((bbox[2] - bbox[0]) / spacing + 1e-9) + 1;
+	ny = (int)((bbox[3] - bbox[1]) / spacing + 1e-9) + 1;
+
+	if (cvms5_init(argv[i], label) != SUCCESS) {
+		fprintf(stderr, "Could not initialize the model.\n");
+		return 1;
+	}
+
+	printf("# lon lat");
+	for (t = 0; t < numthresholds; t++) printf(" z%g", thresholds[t]);
+	printf("\n");
+
+	for (j = 0; j < ny; j++) {
+		lat = bbox[1] + j * spacing;
+		for (i = 0; i < nx; i++) {
+			lon = bbox[0] + i * spacing;
+			printf("%10.4f %10.4f", lon, lat);
+			for (t = 0; t < numthresholds; t++)
+				printf(" %10.2f", cvms5_query_zdepth(lon, lat, thresholds[t]));
+			printf("\n");
+		}
+	}
+
+	cvms5_finalize();
+
+	return 0;
+}
@@ -11,8 +11,151 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
 #include <assert.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include "cvms5.h"
+#include "ucvm_model_dtypes.h"
+
+/**
+ * Whether a value matches the expected one to within a relative tolerance.
+ *
+ * @param value The value.
+ * @param expected The expected value.
+ * @return Non-zero if the value is close enough.
+ */
+int close_to(double value, double expected) {
+	return fabs(value - expected) <= 1e-3 * (1 + fabs(expected));
+}
+
+/**
+ * Works out where a point of the model's grid lies, at a fraction of a cell further along
+ * the model's x and y axes.
+ *
+ * @param x The grid point along the model's x axis.
+ * @param y The grid point along the model's y axis.
+ * @param z The grid plane, from the bottom of the model.
+ * @param offset The fraction of a cell to move the point by.
+ * @param point Set to the point.
+ */
+void grid_point(int x, int y, int z, double offset, cvms5_point_t *point) {
+	double point_x = (x + offset) * cvms5_total_width_m / (cvms5_configuration->nx - 1);
+	double point_y = (y + offset) * cvms5_total_height_m / (cvms5_configuration->ny - 1);
+	double easting = cvms5_cos_rotation_angle * point_x + cvms5_sin_rotation_angle * point_y +
+					 cvms5_configuration->bottom_left_corner_e;
+	double northing = cvms5_cos_rotation_angle * point_y - cvms5_sin_rotation_angle * point_x +
+					  cvms5_configuration->bottom_left_corner_n;
+	PJ_COORD geo = proj_trans(cvms5_geo2utm, PJ_INV, proj_coord(easting, northing, 0.0, HUGE_VAL));
+
+	point->latitude = geo.xyzt.x;
+	point->longitude = geo.xyzt.y;
+	point->depth = (cvms5_configuration->nz - 1 - z) * cvms5_configuration->depth_interval;
+}
+
+/**
+ * Links everything in one of the model's directories into the same directory of a scratch
+ * install, except a snapshot of the real model. Directories are made anew with their files
+ * linked, so that files written into them stay within the scratch install.
+ *
+ * @param dir The real UCVM install directory.
+ * @param path The directory within the install.
+ * @param scratch The scratch install directory.
+ */
+void link_directory(const char *dir, const char *path, const char *scratch) {
+	char src[1024], dst[1024], sub[1024];
+	struct dirent *entry;
+	struct stat st;
+	DIR *data;
+
+	assert(realpath(dir, src) != NULL);
+	strncat(src, path, sizeof(src) - strlen(src) - 1);
+	assert((data = opendir(src)) != NULL);
+	while ((entry = readdir(data)) != NULL) {
+		if (entry->d_name[0] == '.' || strcmp(entry->d_name, CVMS5_SNAPSHOT_FILE) == 0) continue;
+		assert(realpath(dir, src) != NULL);
+		snprintf(src + strlen(src), sizeof(src) - strlen(src), "%s/%s", path, entry->d_name);
+		snprintf(dst, sizeof(dst), "%s%s/%s", scratch, path, entry->d_name);
+		assert(stat(src, &st) == 0);
+		if (S_ISDIR(st.st_mode)) {
+			assert(mkdir(dst, 0755) == 0);
+			snprintf(sub, sizeof(sub), "%s/%s", path, entry->d_name);
+			link_directory(dir, sub, scratch);
+		} else {
+			assert(symlink(src, dst) == 0);
+		}
+	}
+	closedir(data);
+}
+
+/**
+ * Sets up a scratch UCVM install whose model and map link to those of the real one, so that
+ * files can be written next to the model without touching it.
+ *
+ * @param dir The real UCVM install directory.
+ * @param scratch Set to the scratch directory, at least 32 characters.
+ */
+void make_scratch_install(const char *dir, char *scratch) {
+	char src[1024], dst[1024];
+
+	strcpy(scratch, "/tmp/cvms5_test_XXXXXX");
+	assert(mkdtemp(scratch) != NULL);
+	snprintf(dst, sizeof(dst), "%s/model", scratch);
+	assert(mkdir(dst, 0755) == 0);
+	snprintf(dst, sizeof(dst), "%s/model/cvms5", scratch);
+	assert(mkdir(dst, 0755) == 0);
+	snprintf(dst, sizeof(dst), "%s/model/cvms5/data", scratch);
+	assert(mkdir(dst, 0755) == 0);
+
+	assert(realpath(dir, src) != NULL);
+	snprintf(dst, sizeof(dst), "%s/model/ucvm", scratch);
+	strncat(src, "/model/ucvm", sizeof(src) - strlen(src) - 1);
+	assert(symlink(src, dst) == 0);
+
+	link_directory(dir, "/model/cvms5/data", scratch);
+}
+
+/**
+ * Removes a scratch UCVM install along with anything written to it.
+ *
+ * @param scratch The scratch directory.
+ */
+void remove_scratch_install(const char *scratch) {
+	char command[1100];
+
+	snprintf(command, sizeof(command), "rm -rf '%s'", scratch);
+	assert(system(command) == 0);
+}
+
+/**
+ * Finds one of the library's tools, built next to the library or installed next to the tests.
+ *
+ * @param name The tool.
+ * @param path Set to the path of the tool.
+ * @param size The size of the path.
+ */
+void tool_path(const char *name, char *path, size_t size) {
+	snprintf(path, size, "../src/%s", name);
+	if (access(path, X_OK) == 0) return;
+	snprintf(path, size, "../bin/%s", name);
+	assert(access(path, X_OK) == 0);
+}
+
+/**
+ * Records the status a batch of the query pipeline was answered with and frees the batch, as
+ * a caller handing its batches off to the pipeline would.
+ *
+ * @param batch The batch, whose user pointer is where to record the status.
+ * @param status The status the batch was answered with.
+ */
+void free_answered_batch(cvms5_batch_t *batch, int status) {
+	*(int *)batch->user = status + 1;
+	free(batch);
+}
 
 /**
  * Initializes and runs the test program. Tests link against the
@@ -31,6 +174,7 @@ int main(int argc, const char* argv[]) {
 
 	// Initialize the model.
         char *envstr=getenv("UCVM_INSTALL_PATH");
+        const char *dir = envstr != NULL ? envstr : "..";
         if(envstr != NULL) {
            assert(cvms5_init(envstr, "cvms5") == 0);
            } else {
@@ -56,6 +200,1178 @@ int main(int argc, const char* argv[]) {
 
 	printf("Model closed successfully.\n");
 
+	// Load only the region around the point and query it again.
+	cvms5_properties_t region_ret;
+	double bbox[4] = { -118.1, 33.9, -117.9, 34.1 };
+	if(envstr != NULL) {
+	   assert(cvms5_init_region(envstr, "cvms5", bbox, 0, 1000) == 0);
+	   } else {
+	     assert(cvms5_init_region("..", "cvms5", bbox, 0, 1000) == 0);
+	}
+
+	cvms5_query(&pt, &region_ret, 1);
+
+	assert(region_ret.vs == ret.vs);
+	assert(region_ret.vp == ret.vp);
+
+	// Points outside the region return no data.
+	pt.depth = 5000;
+	cvms5_query(&pt, &region_ret, 1);
+
+	assert(region_ret.vs == -1);
+
+	assert(cvms5_finalize() == 0);
+
+	// A grid file too short for the model makes initialization fail rather than leave part of
+	// the grid unread.
+	char scratch[64];
+	char grid_file[1024];
+	float short_grid = 0;
+	FILE *fp;
+
+	make_scratch_install(dir, scratch);
+	assert(cvms5_init(scratch, "cvms5") == 0);
+	assert(cvms5_finalize() == 0);
+	snprintf(grid_file, sizeof(grid_file), "%s/vs.dat", cvms5_iteration_directory);
+	assert(unlink(grid_file) == 0);
+	assert((fp = fopen(grid_file, "wb")) != NULL);
+	assert(fwrite(&short_grid, sizeof(float), 1, fp) == 1);
+	fclose(fp);
+	assert(cvms5_init(scratch, "cvms5") != 0);
+
+	remove_scratch_install(scratch);
+
+	printf("Region of interest query was successful.\n");
+
+	// Sweep the model along x with a streaming window, forwards and back, and check that the
+	// queries match the fully loaded model as the window moves.
+	cvms5_point_t stream_pts[16];
+	cvms5_properties_t stream_expected[16], stream_ret;
+	int stop = 0, sweep = 0;
+
+	assert(cvms5_init(dir, "cvms5") == 0);
+	for (stop = 0; stop < 16; stop++) {
+		grid_point(1 + stop * (cvms5_configuration->nx - 3) / 15, cvms5_configuration->ny / 2,
+				   cvms5_configuration->nz - 2, 0.5, &stream_pts[stop]);
+		cvms5_query(&stream_pts[stop], &stream_expected[stop], 1);
+	}
+	assert(cvms5_finalize() == 0);
+
+	assert(cvms5_init_streaming(dir, "cvms5", CVMS5_WINDOW_X, 2) == 0);
+	for (sweep = 0; sweep < 32; sweep++) {
+		stop = sweep < 16 ? sweep : 31 - sweep;
+		cvms5_query(&stream_pts[stop], &stream_ret, 1);
+		assert(stream_ret.vs == stream_expected[stop].vs);
+		assert(stream_ret.vp == stream_expected[stop].vp);
+		assert(stream_ret.rho == stream_expected[stop].rho);
+	}
+	assert(cvms5_window->first >= 0);
+	assert(cvms5_finalize() == 0);
+
+	printf("Streaming window was successful.\n");
+
+	// Prepare a snapshot in a scratch install, load the model from it and query it again.
+	cvms5_properties_t snapshot_ret;
+	char snapshot_file[1024];
+
+	make_scratch_install(dir, scratch);
+	snprintf(snapshot_file, sizeof(snapshot_file), "%s/model/cvms5/data/%s", scratch, CVMS5_SNAPSHOT_FILE);
+
+	assert(cvms5_prepare(scratch, "cvms5") == 0);
+	assert(cvms5_verify_snapshot(snapshot_file) == 0);
+	assert(cvms5_init(scratch, "cvms5") == 0);
+	assert(cvms5_snapshot_base != NULL);
+
+	pt.depth = 0;
+	cvms5_query(&pt, &snapshot_ret, 1);
+
+	assert(snapshot_ret.vs == ret.vs);
+	assert(snapshot_ret.vp == ret.vp);
+	assert(snapshot_ret.rho == ret.rho);
+
+	assert(cvms5_finalize() == 0);
+
+	// A different Vs30 map makes the snapshot out of date. The scratch map is a link, so it is
+	// pointed somewhere else rather than changed.
+	snprintf(snapshot_file, sizeof(snapshot_file), "%s/model/ucvm", scratch);
+	assert(unlink(snapshot_file) == 0);
+	assert(mkdir(snapshot_file, 0755) == 0);
+	snprintf(snapshot_file, sizeof(snapshot_file), "%s/model/ucvm/ucvm.e", scratch);
+	assert(symlink(dir, snapshot_file) == 0);
+	assert(cvms5_load_snapshot(scratch, "cvms5") != 0);
+
+	remove_scratch_install(scratch);
+
+	printf("Snapshot round trip was successful.\n");
+
+	// Build two pyramid levels in a scratch install and choose between them by resolution.
+	cvms5_properties_t pyramid_ret;
+	double spacing = 0;
+
+	make_scratch_install(dir, scratch);
+	assert(cvms5_init(scratch, "cvms5") == 0);
+	assert(cvms5_build_pyramid(2) == 0);
+	assert(cvms5_finalize() == 0);
+
+	assert(cvms5_init(scratch, "cvms5") == 0);
+	spacing = cvms5_total_width_m / (cvms5_configuration->nx - 1);
+	if (cvms5_total_height_m / (cvms5_configuration->ny - 1) > spacing)
+		spacing = cvms5_total_height_m / (cvms5_configuration->ny - 1);
+	if (cvms5_configuration->depth_interval > spacing)
+		spacing = cvms5_configuration->depth_interval;
+
+	assert(cvms5_set_query_resolution(spacing) == 0);
+	assert(cvms5_set_query_resolution(2 * spacing) == 1);
+	assert(cvms5_set_query_resolution(3.9 * spacing) == 1);
+	assert(cvms5_set_query_resolution(4 * spacing) == 2);
+
+	// Only the levels built can be chosen.
+	assert(cvms5_set_query_resolution(64 * spacing) == 2);
+
+	cvms5_query(&pt, &pyramid_ret, 1);
+	assert(pyramid_ret.vs > 0);
+
+	// Back at the model's own resolution, queries are answered as before.
+	assert(cvms5_set_query_resolution(0) == 0);
+	cvms5_query(&pt, &pyramid_ret, 1);
+	assert(pyramid_ret.vs == ret.vs);
+
+	assert(cvms5_finalize() == 0);
+
+	// A level stamped with another version of the Vs grid file is out of date and not chosen.
+	cvms5_level_header_t level_header;
+	char level_file[1024];
+	FILE *level_fp = NULL;
+
+	snprintf(level_file, sizeof(level_file), "%s/vs_level1.dat", cvms5_iteration_directory);
+	assert((level_fp = fopen(level_file, "r+b")) != NULL);
+	assert(fread(&level_header, sizeof(level_header), 1, level_fp) == 1);
+	level_header.source_mtime++;
+	assert(fseek(level_fp, 0, SEEK_SET) == 0);
+	assert(fwrite(&level_header, sizeof(level_header), 1, level_fp) == 1);
+	fclose(level_fp);
+
+	assert(cvms5_init(scratch, "cvms5") == 0);
+	assert(cvms5_set_query_resolution(4 * spacing) == 0);
+	assert(cvms5_finalize() == 0);
+	remove_scratch_install(scratch);
+
+	printf("Pyramid level selection was successful.\n");
+
+	// Batches submitted to the query pipeline are answered as cvms5_query answers them, even
+	// when their callbacks free them.
+	cvms5_point_t pipeline_pts[8][64];
+	cvms5_properties_t pipeline_ret[8][64], pipeline_expected[8][64];
+	cvms5_batch_t *batch = NULL;
+	int answered[8];
+	int b = 0, p = 0;
+
+	assert(cvms5_init(dir, "cvms5") == 0);
+	for (b = 0; b < 8; b++) {
+		for (p = 0; p < 64; p++) {
+			pipeline_pts[b][p].longitude = -118 + 0.01 * (p % 8) + 0.08 * b;
+			pipeline_pts[b][p].latitude = 34 + 0.01 * (p / 8);
+			pipeline_pts[b][p].depth = 250 * (p % 5);
+		}
+		assert(cvms5_query(pipeline_pts[b], pipeline_expected[b], 64) == 0);
+	}
+
+	for (b = 0; b < 8; b++) {
+		assert((batch = calloc(1, sizeof(cvms5_batch_t))) != NULL);
+		batch->points = pipeline_pts[b];
+		batch->data = pipeline_ret[b];
+		batch->numpoints = 64;
+		batch->user = &answered[b];
+		answered[b] = 0;
+		assert(cvms5_query_submit(batch, free_answered_batch) == 0);
+	}
+	assert(cvms5_query_wait() == UCVM_CODE_SUCCESS);
+
+	for (b = 0; b < 8; b++) {
+		assert(answered[b] == UCVM_CODE_SUCCESS + 1);
+		assert(memcmp(pipeline_ret[b], pipeline_expected[b], sizeof(pipeline_ret[b])) == 0);
+	}
+	assert(cvms5_finalize() == 0);
+
+	printf("Query pipeline was successful.\n");
+
+	// With the grids read from their files, a dense batch is answered from coalesced reads
+	// exactly as it is from memory.
+	cvms5_point_t staged_pts[256];
+	cvms5_properties_t staged_ret[256], staged_expected[256];
+	char staged_file[1024];
+
+	assert(cvms5_init(dir, "cvms5") == 0);
+	for (p = 0; p < 256; p++) {
+		staged_pts[p].longitude = -118 + 0.002 * (p % 16);
+		staged_pts[p].latitude = 34 + 0.002 * (p / 16);
+		staged_pts[p].depth = 100 * (p % 3);
+	}
+	assert(cvms5_query(staged_pts, staged_expected, 256) == 0);
+
+	cvms5_release_grid(cvms5_velocity_model->vp, cvms5_velocity_model->vp_status);
+	snprintf(staged_file, sizeof(staged_file), "%s/vp.dat", cvms5_iteration_directory);
+	assert((cvms5_velocity_model->vp = fopen(staged_file, "rb")) != NULL);
+	cvms5_velocity_model->vp_status = 1;
+	cvms5_release_grid(cvms5_velocity_model->vs, cvms5_velocity_model->vs_status);
+	snprintf(staged_file, sizeof(staged_file), "%s/vs.dat", cvms5_iteration_directory);
+	assert((cvms5_velocity_model->vs = fopen(staged_file, "rb")) != NULL);
+	cvms5_velocity_model->vs_status = 1;
+
+	assert(cvms5_query(staged_pts, staged_ret, 256) == 0);
+	assert(memcmp(staged_ret, staged_expected, sizeof(staged_ret)) == 0);
+	assert(cvms5_finalize() == 0);
+
+	printf("Coalesced file reads were successful.\n");
+
+	// The query tool streams points through the pipeline in small batches, several in flight at
+	// once, and writes their properties in input order.
+	cvms5_point_t tool_pts[100];
+	cvms5_properties_t tool_expected[100];
+	char tool[1024], tool_command[4096], tool_file[64];
+	double tool_values[5];
+	FILE *tool_fp = NULL;
+	int tool_fd = -1;
+
+	assert(cvms5_init(dir, "cvms5") == 0);
+	for (p = 0; p < 100; p++) {
+		tool_pts[p].longitude = -118.2 + 0.004 * (p % 10);
+		tool_pts[p].latitude = 33.9 + 0.004 * (p / 10);
+		tool_pts[p].depth = 150 * (p % 4);
+	}
+	assert(cvms5_query(tool_pts, tool_expected, 100) == 0);
+	assert(cvms5_finalize() == 0);
+
+	strcpy(tool_file, "/tmp/cvms5_points_XXXXXX");
+	tool_fd = mkstemp(tool_file);
+	assert(tool_fd >= 0);
+	for (p = 0; p < 100; p++) {
+		tool_values[0] = tool_pts[p].longitude;
+		tool_values[1] = tool_pts[p].latitude;
+		tool_values[2] = tool_pts[p].depth;
+		assert(write(tool_fd, tool_values, 3 * sizeof(double)) == 3 * sizeof(double));
+	}
+	close(tool_fd);
+
+	tool_path("cvms5_query", tool, sizeof(tool));
+	snprintf(tool_command, sizeof(tool_command), "'%s' -b -B -n 7 '%s' '%s'", tool, dir, tool_file);
+	assert((tool_fp = popen(tool_command, "r")) != NULL);
+	for (p = 0; p < 100; p++) {
+		assert(fread(tool_values, sizeof(double), 5, tool_fp) == 5);
+		assert(tool_values[0] == tool_expected[p].vp);
+		assert(tool_values[1] == tool_expected[p].vs);
+		assert(tool_values[2] == tool_expected[p].rho);
+		assert(tool_values[3] == tool_expected[p].qp);
+		assert(tool_values[4] == tool_expected[p].qs);
+	}
+	assert(fread(tool_values, sizeof(double), 1, tool_fp) == 0);
+	assert(pclose(tool_fp) == 0);
+	unlink(tool_file);
+
+	printf("Query tool was successful.\n");
+
+	// The mesh tool writes vp, vs and rho for every node of a rotated grid, x fastest and z
+	// last, slab by slab, with Vs raised to the minimum asked for.
+	cvms5_point_t mesh_pts[60];
+	cvms5_properties_t mesh_expected[60];
+	PJ_COORD mesh_origin, mesh_node;
+	double mesh_sin = sin(30 * DEG_TO_RAD), mesh_cos = cos(30 * DEG_TO_RAD);
+	double mesh_vs_min = 0, mesh_vs_max = 0, mesh_ratio = 0;
+	float mesh_values[3];
+	int mesh_x = 0, mesh_y = 0, mesh_z = 0;
+
+	assert(cvms5_init(dir, "cvms5") == 0);
+	mesh_origin = proj_trans(cvms5_geo2utm, PJ_FWD, proj_coord(33.95, -118.1, 0.0, HUGE_VAL));
+	for (p = 0; p < 60; p++) {
+		mesh_x = p % 4;
+		mesh_y = (p / 4) % 3;
+		mesh_z = p / 12;
+		mesh_node = proj_trans(cvms5_geo2utm, PJ_INV,
+							   proj_coord(mesh_origin.xyzt.x + mesh_x * 500 * mesh_sin - mesh_y * 500 * mesh_cos,
+										  mesh_origin.xyzt.y + mesh_x * 500 * mesh_cos + mesh_y * 500 * mesh_sin, 0.0, HUGE_VAL));
+		mesh_pts[p].latitude = mesh_node.xyzt.x;
+		mesh_pts[p].longitude = mesh_node.xyzt.y;
+		mesh_pts[p].depth = mesh_z * 500;
+	}
+	assert(cvms5_query(mesh_pts, mesh_expected, 60) == 0);
+
+	// Raise Vs at about half the nodes.
+	mesh_vs_min = mesh_vs_max = mesh_expected[0].vs;
+	for (p = 0; p < 60; p++) {
+		if (mesh_expected[p].vs < mesh_vs_min) mesh_vs_min = mesh_expected[p].vs;
+		if (mesh_expected[p].vs > mesh_vs_max) mesh_vs_max = mesh_expected[p].vs;
+	}
+	mesh_vs_min = (mesh_vs_min + mesh_vs_max) / 2;
+	for (p = 0; p < 60; p++) {
+		if (mesh_expected[p].vs > 0 && mesh_expected[p].vs < mesh_vs_min) {
+			mesh_ratio = mesh_expected[p].vp / mesh_expected[p].vs;
+			mesh_expected[p].vs = mesh_vs_min;
+			mesh_expected[p].vp = mesh_vs_min * mesh_ratio;
+			mesh_expected[p].rho = cvms5_calculate_density(mesh_vs_min);
+		}
+	}
+	assert(cvms5_finalize() == 0);
+
+	strcpy(tool_file, "/tmp/cvms5_mesh_XXXXXX");
+	tool_fd = mkstemp(tool_file);
+	assert(tool_fd >= 0);
+	close(tool_fd);
+
+	tool_path("cvms5_mesh", tool, sizeof(tool));
+	snprintf(tool_command, sizeof(tool_command), "'%s' -m %.17g -s 2 '%s' -118.1 33.95 30 500 4 3 5 '%s' > /dev/null",
+			 tool, mesh_vs_min, dir, tool_file);
+	assert(system(tool_command) == 0);
+
+	assert((tool_fp = fopen(tool_file, "rb")) != NULL);
+	for (p = 0; p < 60; p++) {
+		assert(fread(mesh_values, sizeof(float), 3, tool_fp) == 3);
+		assert(mesh_values[0] == (float)mesh_expected[p].vp);
+		assert(mesh_values[1] == (float)mesh_expected[p].vs);
+		assert(mesh_values[2] == (float)mesh_expected[p].rho);
+	}
+	assert(fread(mesh_values, sizeof(float), 1, tool_fp) == 0);
+	fclose(tool_fp);
+	unlink(tool_file);
+
+	printf("Mesh tool was successful.\n");
+
+	// A slice matches cvms5_query at the centre of each pixel, and a cross-section at points
+	// evenly spaced along the line between its ends in UTM.
+	double slice_bbox[4] = { -118.2, 33.9, -118.0, 34.05 };
+	double section_start[2] = { -118.15, 33.92 }, section_end[2] = { -118.02, 34.03 };
+	cvms5_properties_t extract_ret[48], extract_expected;
+	cvms5_point_t extract_pt;
+	PJ_COORD section_a, section_b, section_pt;
+
+	assert(cvms5_init(dir, "cvms5") == 0);
+	assert(cvms5_extract_slice(slice_bbox, 400, 8, 6, extract_ret) == 0);
+	for (p = 0; p < 48; p++) {
+		extract_pt.longitude = slice_bbox[0] + (p % 8 + 0.5) * (slice_bbox[2] - slice_bbox[0]) / 8;
+		extract_pt.latitude = slice_bbox[3] - (p / 8 + 0.5) * (slice_bbox[3] - slice_bbox[1]) / 6;
+		extract_pt.depth = 400;
+		cvms5_query(&extract_pt, &extract_expected, 1);
+		assert(extract_expected.vs > 0);
+		assert(close_to(extract_ret[p].vp, extract_expected.vp));
+		assert(close_to(extract_ret[p].vs, extract_expected.vs));
+		assert(close_to(extract_ret[p].rho, extract_expected.rho));
+	}
+
+	assert(cvms5_extract_cross_section(section_start, section_end, 0, 3000, 6, 4, extract_ret) == 0);
+	section_a = proj_trans(cvms5_geo2utm, PJ_FWD, proj_coord(section_start[1], section_start[0], 0.0, HUGE_VAL));
+	section_b = proj_trans(cvms5_geo2utm, PJ_FWD, proj_coord(section_end[1], section_end[0], 0.0, HUGE_VAL));
+	for (p = 0; p < 24; p++) {
+		section_pt = proj_trans(cvms5_geo2utm, PJ_INV,
+								proj_coord(section_a.xyzt.x + (p % 6) / 5.0 * (section_b.xyzt.x - section_a.xyzt.x),
+										   section_a.xyzt.y + (p % 6) / 5.0 * (section_b.xyzt.y - section_a.xyzt.y),
+										   0.0, HUGE_VAL));
+		extract_pt.latitude = section_pt.xyzt.x;
+		extract_pt.longitude = section_pt.xyzt.y;
+		extract_pt.depth = (p / 6) * 1000;
+		cvms5_query(&extract_pt, &extract_expected, 1);
+		assert(extract_expected.vs > 0);
+		assert(close_to(extract_ret[p].vp, extract_expected.vp));
+		assert(close_to(extract_ret[p].vs, extract_expected.vs));
+		assert(close_to(extract_ret[p].rho, extract_expected.rho));
+	}
+	assert(cvms5_finalize() == 0);
+
+	printf("Slice and cross-section extraction were successful.\n");
+
+	// An ensemble answers each iteration from its own directory at the same cells. The second
+	// iteration here has the model's Vp grid in place of its Vs grid.
+	const char *ensemble_dirs[2] = { NULL, "swapped" };
+	cvms5_point_t ensemble_pts[16];
+	cvms5_properties_t ensemble_ret[32], ensemble_expected[16];
+	char ensemble_model_dir[256], ensemble_src[1024], ensemble_dst[1024];
+
+	make_scratch_install(dir, scratch);
+	assert(cvms5_init(scratch, "cvms5") == 0);
+	strcpy(ensemble_model_dir, cvms5_configuration->model_dir);
+	snprintf(ensemble_src, sizeof(ensemble_src), "%s/vp.dat", cvms5_iteration_directory);
+	assert(cvms5_finalize() == 0);
+
+	snprintf(ensemble_dst, sizeof(ensemble_dst), "%s/model/cvms5/data/swapped", scratch);
+	assert(mkdir(ensemble_dst, 0755) == 0);
+	snprintf(ensemble_dst, sizeof(ensemble_dst), "%s/model/cvms5/data/swapped/vp.dat", scratch);
+	assert(symlink(ensemble_src, ensemble_dst) == 0);
+	snprintf(ensemble_dst, sizeof(ensemble_dst), "%s/model/cvms5/data/swapped/vs.dat", scratch);
+	assert(symlink(ensemble_src, ensemble_dst) == 0);
+
+	ensemble_dirs[0] = ensemble_model_dir;
+	assert(cvms5_init_ensemble(scratch, "cvms5", ensemble_dirs, 2) == 0);
+	for (p = 0; p < 16; p++) {
+		ensemble_pts[p].longitude = -118.1 + 0.01 * (p % 4);
+		ensemble_pts[p].latitude = 33.95 + 0.01 * (p / 4);
+		ensemble_pts[p].depth = 1000 + 250 * (p % 3);
+	}
+	assert(cvms5_query(ensemble_pts, ensemble_expected, 16) == 0);
+	assert(cvms5_query_ensemble(ensemble_pts, ensemble_ret, 16) == 0);
+	for (p = 0; p < 16; p++) {
+		assert(ensemble_expected[p].vs > 0);
+		assert(ensemble_ret[2 * p].vp == ensemble_expected[p].vp);
+		assert(ensemble_ret[2 * p].vs == ensemble_expected[p].vs);
+		assert(ensemble_ret[2 * p + 1].vp == ensemble_expected[p].vp);
+		assert(close_to(ensemble_ret[2 * p + 1].vs, ensemble_expected[p].vp));
+	}
+	assert(cvms5_finalize() == 0);
+	remove_scratch_install(scratch);
+
+	printf("Ensemble query was successful.\n");
+
+	// Array queries match cvms5_query across more than one chunk, including points outside the
+	// model, and skip the properties passed as NULL.
+	int array_count = CVMS5_ARRAYS_CHUNK + 5;
+	double *array_lon = malloc(array_count * sizeof(double));
+	double *array_lat = malloc(array_count * sizeof(double));
+	double *array_depth = malloc(array_count * sizeof(double));
+	float *array_vp = malloc(array_count * sizeof(float));
+	float *array_vs = malloc(array_count * sizeof(float));
+	cvms5_point_t *array_pts = malloc(array_count * sizeof(cvms5_point_t));
+	cvms5_properties_t *array_expected = malloc(array_count * sizeof(cvms5_properties_t));
+
+	assert(cvms5_init(dir, "cvms5") == 0);
+	for (p = 0; p < array_count; p++) {
+		array_pts[p].longitude = array_lon[p] = p % 97 == 0 ? -125 : -118.2 + 0.003 * (p % 64);
+		array_pts[p].latitude = array_lat[p] = 33.9 + 0.002 * (p / 64);
+		array_pts[p].depth = array_depth[p] = 100 * (p % 7);
+	}
+	assert(cvms5_query(array_pts, array_expected, array_count) == 0);
+	assert(cvms5_query_arrays(array_lon, array_lat, array_depth, array_count, array_vp, array_vs, NULL, NULL, NULL) == 0);
+	for (p = 0; p < array_count; p++) {
+		assert(array_vp[p] == (float)array_expected[p].vp);
+		assert(array_vs[p] == (float)array_expected[p].vs);
+	}
+	assert(array_vs[0] == -1 && array_vs[CVMS5_ARRAYS_CHUNK + 1] > 0);
+	assert(cvms5_finalize() == 0);
+
+	free(array_lon);
+	free(array_lat);
+	free(array_depth);
+	free(array_vp);
+	free(array_vs);
+	free(array_pts);
+	free(array_expected);
+
+	printf("Array query was successful.\n");
+
+	// Each rank of a partitioned model holds a slab of cells along x, and answers the points in
+	// the cells it owns as the whole model does. The partition is set up by hand here, as
+	// cvms5_mpi_init would for each rank.
+	cvms5_point_t part_pts[32];
+	cvms5_properties_t part_ret, part_expected[32];
+	int part_x[32];
+	int rank = 0, owner = 0;
+
+	assert(cvms5_init(dir, "cvms5") == 0);
+	for (p = 0; p < 32; p++) {
+		part_x[p] = p * (cvms5_configuration->nx - 1) / 32;
+		grid_point(part_x[p], cvms5_configuration->ny / 2, cvms5_configuration->nz - 3, 0.5, &part_pts[p]);
+		cvms5_query(&part_pts[p], &part_expected[p], 1);
+		assert(part_expected[p].vs > 0);
+	}
+	for (p = 0; p < cvms5_configuration->nx - 1; p++) {
+		owner = cvms5_partition_owner(p, 3, cvms5_configuration->nx - 1);
+		assert(cvms5_partition_first(owner, 3, cvms5_configuration->nx - 1) <= p);
+		assert(cvms5_partition_first(owner + 1, 3, cvms5_configuration->nx - 1) > p);
+	}
+	assert(cvms5_finalize() == 0);
+
+	for (rank = 0; rank < 3; rank++) {
+		assert((cvms5_partition = calloc(1, sizeof(cvms5_partition_t))) != NULL);
+		cvms5_partition->rank = rank;
+		cvms5_partition->ranks = 3;
+		assert(cvms5_init(dir, "cvms5") == 0);
+		assert(cvms5_velocity_model->block_nx < cvms5_configuration->nx);
+
+		for (p = 0; p < 32; p++) {
+			cvms5_query(&part_pts[p], &part_ret, 1);
+			if (cvms5_partition_owner(part_x[p], 3, cvms5_configuration->nx - 1) == rank) {
+				assert(part_ret.vp == part_expected[p].vp);
+				assert(part_ret.vs == part_expected[p].vs);
+			} else if (part_x[p] < cvms5_velocity_model->block_x ||
+					   part_x[p] + 1 >= cvms5_velocity_model->block_x + cvms5_velocity_model->block_nx) {
+				assert(part_ret.vs == -1);
+			}
+		}
+		assert(cvms5_finalize() == 0);
+		assert(cvms5_partition == NULL);
+	}
+
+	printf("Partitioned model was successful.\n");
+
+	// The query server answers over its socket as cvms5_query answers in process, on more than
+	// one connection, and stops cleanly on SIGTERM.
+	cvms5_point_t served_pts[200];
+	cvms5_properties_t served_ret[200], served_expected[200];
+	char server_dir[64], server_socket[128], server_line[256];
+	int server_pipe[2], server_status = 0;
+	FILE *server_fp = NULL;
+	pid_t server_pid;
+
+	assert(cvms5_init(dir, "cvms5") == 0);
+	for (p = 0; p < 200; p++) {
+		served_pts[p].longitude = -118.15 + 0.005 * (p % 20);
+		served_pts[p].latitude = 33.95 + 0.005 * (p / 20);
+		served_pts[p].depth = 200 * (p % 6);
+	}
+	assert(cvms5_query(served_pts, served_expected, 200) == 0);
+	assert(cvms5_finalize() == 0);
+
+	strcpy(server_dir, "/tmp/cvms5_server_XXXXXX");
+	assert(mkdtemp(server_dir) != NULL);
+	snprintf(server_socket, sizeof(server_socket), "%s/socket", server_dir);
+	tool_path("cvms5_server", tool, sizeof(tool));
+
+	// The server reports on stderr once it is listening.
+	assert(pipe(server_pipe) == 0);
+	assert((server_pid = fork()) >= 0);
+	if (server_pid == 0) {
+		dup2(server_pipe[1], 2);
+		close(server_pipe[0]);
+		execl(tool, tool, "-t", "2", "-n", "64", dir, server_socket, (char *)NULL);
+		_exit(127);
+	}
+	close(server_pipe[1]);
+	assert((server_fp = fdopen(server_pipe[0], "r")) != NULL);
+	while (fgets(server_line, sizeof(server_line), server_fp) != NULL && strstr(server_line, "Serving queries") == NULL);
+
+	assert(cvms5_client_connect(server_socket) == 0);
+	assert(cvms5_client_query(served_pts, served_ret, 100) == 0);
+	assert(cvms5_client_connect(server_socket) == 0);
+	assert(cvms5_client_query(served_pts + 100, served_ret + 100, 100) == 0);
+	cvms5_client_close();
+	assert(memcmp(served_ret, served_expected, sizeof(served_ret)) == 0);
+
+	assert(kill(server_pid, SIGTERM) == 0);
+	while (fgets(server_line, sizeof(server_line), server_fp) != NULL);
+	fclose(server_fp);
+	assert(waitpid(server_pid, &server_status, 0) == server_pid);
+	assert(WIFEXITED(server_status) && WEXITSTATUS(server_status) == 0);
+	assert(access(server_socket, F_OK) != 0);
+	assert(rmdir(server_dir) == 0);
+
+	printf("Query server was successful.\n");
+
+	// Statistics over a box match those of every grid point within it, visited one by one.
+	cvms5_stats_t stats;
+	cvms5_box_t box;
+	cvms5_properties_t grid_ret;
+	double stats_bbox[4] = { -118.5, 33.7, -117.5, 34.3 };
+	double vs_min = 1e30, vs_max = -1, vs_sum = 0;
+	long vp_count = 0, vs_count = 0;
+	int x = 0, y = 0, z = 0;
+
+	assert(cvms5_init(dir, "cvms5") == 0);
+	assert(cvms5_region_stats(stats_bbox, 0, 2000, &stats) == 0);
+	assert(cvms5_trace_box(stats_bbox, 0, 2000, cvms5_velocity_model, &box) == 0);
+
+	for (z = box.min_z; z <= box.max_z; z++) {
+		for (x = 0; x < cvms5_velocity_model->block_nx; x++) {
+			for (y = 0; y < cvms5_velocity_model->block_ny; y++) {
+				if (!cvms5_box_contains(&box, x, y)) continue;
+				cvms5_read_model_properties(cvms5_velocity_model, x, y, z, &grid_ret);
+				if (grid_ret.vp >= 0) vp_count++;
+				if (grid_ret.vs < 0) continue;
+				if (grid_ret.vs < vs_min) vs_min = grid_ret.vs;
+				if (grid_ret.vs > vs_max) vs_max = grid_ret.vs;
+				vs_sum += grid_ret.vs;
+				vs_count++;
+			}
+		}
+	}
+
+	assert(vs_count > 0);
+	assert(stats.count == (vp_count > vs_count ? vp_count : vs_count));
+	assert(stats.vs_min == vs_min);
+	assert(stats.vs_max == vs_max);
+	assert(fabs(stats.vs_mean - vs_sum / vs_count) < 1e-6 * stats.vs_mean);
+
+	assert(cvms5_finalize() == 0);
+
+	printf("Region statistics were successful.\n");
+
+	// Basin depths match the depth at which the queried profile first reaches each threshold.
+	cvms5_point_t profile_pt = pt;
+	cvms5_properties_t profile_ret;
+	double thresholds[2] = { 1000, 2500 };
+	double interval = 0, expected = 0, above_vs = 0;
+	int t = 0, k = 0;
+
+	assert(cvms5_init(dir, "cvms5") == 0);
+	interval = cvms5_configuration->depth_interval;
+
+	for (t = 0; t < 2; t++) {
+		expected = -1;
+		above_vs = -1;
+		for (k = 0; k < cvms5_configuration->nz; k++) {
+			profile_pt.depth = k * interval;
+			cvms5_query(&profile_pt, &profile_ret, 1);
+			if (profile_ret.vs >= thresholds[t]) {
+				expected = above_vs < 0 ? profile_pt.depth :
+						   profile_pt.depth - interval + interval * (thresholds[t] - above_vs) / (profile_ret.vs - above_vs);
+				break;
+			}
+			above_vs = profile_ret.vs;
+		}
+		assert(fabs(cvms5_query_zdepth(pt.longitude, pt.latitude, thresholds[t]) - expected) < 1e-3);
+	}
+
+	// A threshold the profile never reaches has no depth.
+	assert(cvms5_query_zdepth(pt.longitude, pt.latitude, 1e9) == -1);
+
+	assert(cvms5_finalize() == 0);
+
+	printf("Basin depth query was successful.\n");
+
+	// Gradients match central differences of queries a meter either side of a point within a cell.
+	cvms5_point_t grad_pt = pt, fd_pt[2];
+	cvms5_properties_t grad_ret, fd_ret[2];
+	cvms5_gradient_t gradient;
+	PJ_COORD utm, geo;
+	double step = 1;
+
+	assert(cvms5_init(dir, "cvms5") == 0);
+	grad_pt.depth = 2.5 * cvms5_configuration->depth_interval;
+	assert(cvms5_query_gradient(&grad_pt, &grad_ret, &gradient, 1) == 0);
+	assert(grad_ret.vs > 0);
+
+	fd_pt[0] = fd_pt[1] = grad_pt;
+	fd_pt[0].depth -= step;
+	fd_pt[1].depth += step;
+	cvms5_query(fd_pt, fd_ret, 2);
+	assert(close_to(gradient.vp_z, (fd_ret[1].vp - fd_ret[0].vp) / (2 * step)));
+	assert(close_to(gradient.vs_z, (fd_ret[1].vs - fd_ret[0].vs) / (2 * step)));
+
+	utm = proj_trans(cvms5_geo2utm, PJ_FWD, proj_coord(grad_pt.latitude, grad_pt.longitude, 0.0, HUGE_VAL));
+	for (k = 0; k < 2; k++) {
+		geo = proj_trans(cvms5_geo2utm, PJ_INV, proj_coord(utm.xyzt.x + (2 * k - 1) * step, utm.xyzt.y, 0.0, HUGE_VAL));
+		fd_pt[k].latitude = geo.xyzt.x;
+		fd_pt[k].longitude = geo.xyzt.y;
+		fd_pt[k].depth = grad_pt.depth;
+	}
+	cvms5_query(fd_pt, fd_ret, 2);
+	assert(close_to(gradient.vp_east, (fd_ret[1].vp - fd_ret[0].vp) / (2 * step)));
+	assert(close_to(gradient.vs_east, (fd_ret[1].vs - fd_ret[0].vs) / (2 * step)));
+
+	for (k = 0; k < 2; k++) {
+		geo = proj_trans(cvms5_geo2utm, PJ_INV, proj_coord(utm.xyzt.x, utm.xyzt.y + (2 * k - 1) * step, 0.0, HUGE_VAL));
+		fd_pt[k].latitude = geo.xyzt.x;
+		fd_pt[k].longitude = geo.xyzt.y;
+	}
+	cvms5_query(fd_pt, fd_ret, 2);
+	assert(close_to(gradient.vp_north, (fd_ret[1].vp - fd_ret[0].vp) / (2 * step)));
+	assert(close_to(gradient.vs_north, (fd_ret[1].vs - fd_ret[0].vs) / (2 * step)));
+
+	assert(cvms5_finalize() == 0);
+
+	printf("Gradient query was successful.\n");
+
+	// Every interpolation gives the grid's own values at grid points across a plane, and the
+	// nearest grid point's values a fifth of a cell away from one.
+	cvms5_point_t node_pt;
+	cvms5_properties_t node, interp_ret;
+	int interpolations[3] = { CVMS5_INTERP_TRILINEAR, CVMS5_INTERP_NEAREST, CVMS5_INTERP_TRICUBIC };
+	int node_x = 0, node_y = 0, node_z = 0;
+
+	assert(cvms5_init(dir, "cvms5") == 0);
+	node_z = cvms5_configuration->nz - 4;
+	for (node_x = 1; node_x < cvms5_configuration->nx - 1; node_x += (cvms5_configuration->nx - 2) / 32 + 1) {
+		for (node_y = 1; node_y < cvms5_configuration->ny - 1; node_y += (cvms5_configuration->ny - 2) / 32 + 1) {
+			cvms5_read_properties(node_x, node_y, node_z, &node);
+			assert(node.vs > 0);
+
+			grid_point(node_x, node_y, node_z, 0, &node_pt);
+			for (k = 0; k < 3; k++) {
+				assert(cvms5_query_interpolated(&node_pt, &interp_ret, 1, interpolations[k]) == 0);
+				assert(fabs(interp_ret.vp - node.vp) < 1e-3);
+				assert(fabs(interp_ret.vs - node.vs) < 1e-3);
+			}
+		}
+	}
+
+	node_x = cvms5_configuration->nx / 2;
+	node_y = cvms5_configuration->ny / 2;
+	cvms5_read_properties(node_x, node_y, node_z, &node);
+	grid_point(node_x, node_y, node_z, 0.2, &node_pt);
+	assert(cvms5_query_interpolated(&node_pt, &interp_ret, 1, CVMS5_INTERP_NEAREST) == 0);
+	assert(interp_ret.vp == node.vp);
+	assert(interp_ret.vs == node.vs);
+
+	assert(cvms5_finalize() == 0);
+
+	printf("Nearest and tricubic interpolation were successful.\n");
+
+	// Every instruction set the host runs gives the same bits as the baseline kernels, with
+	// each interpolation.
+	cvms5_point_t isa_pts[64];
+	cvms5_properties_t isa_base[64], isa_ret[64];
+	int isa = 0;
+
+	assert(cvms5_init(dir, "cvms5") == 0);
+	for (k = 0; k < 64; k++) {
+		grid_point(cvms5_configuration->nx / 4 + k % 4, cvms5_configuration->ny / 4 + k / 16, cvms5_configuration->nz - 3,
+				   0.37 * (k % 3), &isa_pts[k]);
+		isa_pts[k].depth += 0.31 * (k / 4 % 4) * cvms5_configuration->depth_interval;
+	}
+
+	for (t = 0; t < 3; t++) {
+		assert(cvms5_set_isa(CVMS5_ISA_BASELINE) == 0);
+		assert(cvms5_query_interpolated(isa_pts, isa_base, 64, interpolations[t]) == 0);
+		for (isa = CVMS5_ISA_AVX2; isa <= CVMS5_ISA_AVX512; isa++) {
+			if (isa > cvms5_host_isa()) {
+				assert(cvms5_set_isa(isa) != 0);
+				continue;
+			}
+			assert(cvms5_set_isa(isa) == 0);
+			assert(cvms5_query_interpolated(isa_pts, isa_ret, 64, interpolations[t]) == 0);
+			assert(memcmp(isa_ret, isa_base, sizeof(isa_base)) == 0);
+		}
+	}
+
+	assert(cvms5_finalize() == 0);
+
+	printf("Instruction set selection was successful.\n");
+
+	// Each point gets its own status: answered, above the surface, below the model's bottom and
+	// far outside its footprint.
+	cvms5_point_t status_pts[4];
+	cvms5_properties_t status_ret[4];
+	int status[4];
+
+	assert(cvms5_init(dir, "cvms5") == 0);
+	for (k = 0; k < 4; k++) {
+		status_pts[k].longitude = -118;
+		status_pts[k].latitude = 34;
+		status_pts[k].depth = 1000;
+	}
+	status_pts[1].depth = -10;
+	status_pts[2].depth = 1.0e6;
+	status_pts[3].longitude = 0;
+	status_pts[3].latitude = 0;
+
+	assert(cvms5_query_status(status_pts, status_ret, status, 4) == 0);
+	assert(status[0] == UCVM_CODE_SUCCESS && status_ret[0].vs > 0);
+	assert(status[1] == UCVM_CODE_DATAGAP && status_ret[1].vs == -1);
+	assert(status[2] == UCVM_CODE_NODATA && status_ret[2].vs == -1);
+	assert(status[3] == UCVM_CODE_NODATA && status_ret[3].vs == -1);
+
+	// Far above sea level is above the surface when queried by elevation.
+	assert(cvms5_set_query_mode(CVMS5_COORD_ELEVATION) == 0);
+	status_pts[1].depth = 10000;
+	assert(cvms5_query_status(&status_pts[1], &status_ret[1], &status[1], 1) == 0);
+	assert(status[1] == UCVM_CODE_DATAGAP);
+	assert(cvms5_set_query_mode(CVMS5_COORD_DEPTH) == 0);
+
+	// A point that cannot be projected does not stop the points after it being projected.
+	cvms5_cell_t status_cells[3], status_cell;
+
+	status_pts[1].latitude = 95;
+	status_pts[2].depth = 1000;
+	cvms5_project_points(cvms5_geo2utm, NULL, status_pts, 3, status_cells);
+	cvms5_project_points(cvms5_geo2utm, NULL, &status_pts[2], 1, &status_cell);
+	assert(status_cells[1].point_x == HUGE_VAL);
+	assert(status_cells[2].point_x == status_cell.point_x && status_cells[2].point_y == status_cell.point_y);
+	assert(status_cells[0].point_x == status_cell.point_x && status_cells[0].point_x != HUGE_VAL);
+
+	assert(cvms5_finalize() == 0);
+
+	printf("Per-point status was successful.\n");
+
+	// The footprint holds every point along the model's edges, and rejects points far from it
+	// without projecting them.
+	cvms5_point_t edge_pt;
+	cvms5_cell_t far_cell;
+
+	assert(cvms5_init(dir, "cvms5") == 0);
+	assert(cvms5_footprint != NULL);
+	for (k = 0; k <= 16; k++) {
+		grid_point(k * (cvms5_configuration->nx - 1) / 16, 0, 0, 0, &edge_pt);
+		assert(cvms5_footprint_contains(cvms5_footprint, edge_pt.longitude, edge_pt.latitude) == 1);
+		grid_point(k * (cvms5_configuration->nx - 1) / 16, cvms5_configuration->ny - 1, 0, 0, &edge_pt);
+		assert(cvms5_footprint_contains(cvms5_footprint, edge_pt.longitude, edge_pt.latitude) == 1);
+		grid_point(0, k * (cvms5_configuration->ny - 1) / 16, 0, 0, &edge_pt);
+		assert(cvms5_footprint_contains(cvms5_footprint, edge_pt.longitude, edge_pt.latitude) == 1);
+		grid_point(cvms5_configuration->nx - 1, k * (cvms5_configuration->ny - 1) / 16, 0, 0, &edge_pt);
+		assert(cvms5_footprint_contains(cvms5_footprint, edge_pt.longitude, edge_pt.latitude) == 1);
+	}
+
+	edge_pt.longitude = 0;
+	edge_pt.latitude = 0;
+	edge_pt.depth = 1000;
+	assert(cvms5_footprint_contains(cvms5_footprint, edge_pt.longitude, edge_pt.latitude) == 0);
+	assert(cvms5_footprint_contains(cvms5_footprint, -110, 34) == 0);
+	cvms5_project_points(cvms5_geo2utm, cvms5_footprint, &edge_pt, 1, &far_cell);
+	assert(far_cell.point_x == -HUGE_VAL);
+
+	assert(cvms5_finalize() == 0);
+
+	printf("Footprint rejection was successful.\n");
+
+	// A delta overlay over one brick, added as a variant, shifts the grid within the brick and
+	// nowhere else. NaN leaves the grid beneath it as it is.
+	cvms5_overlay_header_t overlay_header;
+	cvms5_point_t overlay_pts[3];
+	cvms5_properties_t overlay_ret[6], overlay_node[3];
+	float overlay_vp[CVMS5_BRICK_SIZE * CVMS5_BRICK_SIZE * CVMS5_BRICK_SIZE];
+	float overlay_vs[CVMS5_BRICK_SIZE * CVMS5_BRICK_SIZE * CVMS5_BRICK_SIZE];
+	int overlay_brick[3] = { 1, 1, 0 };
+	int centre = CVMS5_BRICK_SIZE + CVMS5_BRICK_SIZE / 2;
+	char overlay_file[1024];
+	FILE *overlay_fp = NULL;
+
+	make_scratch_install(dir, scratch);
+	assert(cvms5_init(scratch, "cvms5") == 0);
+
+	for (k = 0; k < CVMS5_BRICK_SIZE * CVMS5_BRICK_SIZE * CVMS5_BRICK_SIZE; k++) {
+		overlay_vp[k] = 100;
+		overlay_vs[k] = 50;
+	}
+	// The brick's second point along y at the centre of the brick in x and z.
+	overlay_vs[((CVMS5_BRICK_SIZE / 2) * CVMS5_BRICK_SIZE + CVMS5_BRICK_SIZE / 2) * CVMS5_BRICK_SIZE + 1] = NAN;
+
+	memcpy(overlay_header.magic, CVMS5_OVERLAY_MAGIC, sizeof(overlay_header.magic));
+	overlay_header.mode = CVMS5_OVERLAY_DELTA;
+	overlay_header.bricks = 1;
+	snprintf(overlay_file, sizeof(overlay_file), "%stest.ovl", cvms5_iteration_directory);
+	overlay_fp = fopen(overlay_file, "wb");
+	assert(overlay_fp != NULL);
+	assert(fwrite(&overlay_header, sizeof(overlay_header), 1, overlay_fp) == 1);
+	assert(fwrite(overlay_brick, sizeof(int), 3, overlay_fp) == 3);
+	assert(fwrite(overlay_vp, sizeof(overlay_vp), 1, overlay_fp) == 1);
+	assert(fwrite(overlay_vs, sizeof(overlay_vs), 1, overlay_fp) == 1);
+	fclose(overlay_fp);
+
+	assert(cvms5_add_variant("test.ovl") == 0);
+
+	// The centre of the brick, the point left as it is and the centre of the next brick along x.
+	grid_point(centre, centre, CVMS5_BRICK_SIZE / 2, 0, &overlay_pts[0]);
+	grid_point(centre, CVMS5_BRICK_SIZE + 1, CVMS5_BRICK_SIZE / 2, 0, &overlay_pts[1]);
+	grid_point(centre + CVMS5_BRICK_SIZE, centre, CVMS5_BRICK_SIZE / 2, 0, &overlay_pts[2]);
+	cvms5_read_properties(centre, centre, CVMS5_BRICK_SIZE / 2, &overlay_node[0]);
+	cvms5_read_properties(centre, CVMS5_BRICK_SIZE + 1, CVMS5_BRICK_SIZE / 2, &overlay_node[1]);
+	cvms5_read_properties(centre + CVMS5_BRICK_SIZE, centre, CVMS5_BRICK_SIZE / 2, &overlay_node[2]);
+
+	assert(cvms5_query_ensemble(overlay_pts, overlay_ret, 3) == 0);
+	for (k = 0; k < 3; k++) {
+		assert(fabs(overlay_ret[2 * k].vp - overlay_node[k].vp) < 1e-3);
+		assert(fabs(overlay_ret[2 * k].vs - overlay_node[k].vs) < 1e-3);
+	}
+	assert(fabs(overlay_ret[1].vp - (overlay_node[0].vp + 100)) < 1e-3);
+	assert(fabs(overlay_ret[1].vs - (overlay_node[0].vs + 50)) < 1e-3);
+	assert(fabs(overlay_ret[3].vp - (overlay_node[1].vp + 100)) < 1e-3);
+	assert(fabs(overlay_ret[3].vs - overlay_node[1].vs) < 1e-3);
+	assert(fabs(overlay_ret[5].vp - overlay_node[2].vp) < 1e-3);
+	assert(fabs(overlay_ret[5].vs - overlay_node[2].vs) < 1e-3);
+
+	assert(cvms5_finalize() == 0);
+	remove_scratch_install(scratch);
+
+	printf("Overlay variant was successful.\n");
+
+	// The brick summary, the basin depth index and the pyramid are worked out with the overlays
+	// named in the configuration file applied, and agree with the grid points a query reads.
+	cvms5_summary_t derived_summary[2];
+	cvms5_zdepth_index_t *derived_index = NULL;
+	cvms5_properties_t derived_node;
+	cvms5_brick_t *derived_brick[2];
+	int *derived_planes = NULL;
+	float *derived_level[2], *derived_grid[2], *derived_expected[2];
+	char derived_config[1024], derived_text[CVMS5_CONFIG_MAX * 4];
+	size_t derived_size = 0, derived_points = 0, derived_columns = 0;
+	double derived_threshold = 0;
+	int derived_plane = 0, derived_x = 0, derived_y = 0, derived_z = 0, derived_nx = 0, derived_ny = 0;
+	FILE *derived_fp = NULL;
+
+	make_scratch_install(dir, scratch);
+
+	// Everything is worked out once without the overlay, to compare with.
+	assert(cvms5_init(scratch, "cvms5") == 0);
+	derived_nx = cvms5_configuration->nx;
+	derived_ny = cvms5_configuration->ny;
+	derived_columns = (size_t)derived_nx * derived_ny;
+	derived_points = derived_columns * cvms5_configuration->nz;
+
+	memset(derived_summary, 0, sizeof(derived_summary));
+	assert(cvms5_build_summary(cvms5_velocity_model, &derived_summary[0]) == 0);
+
+	// Deep enough that the centre of the overlaid brick only reaches it with the overlay.
+	cvms5_read_properties(centre, centre, 0, &derived_node);
+	derived_threshold = derived_node.vs + 25;
+	assert((derived_index = cvms5_get_zdepth_index(derived_threshold)) != NULL);
+	derived_planes = malloc(derived_columns * sizeof(int));
+	for (k = 0; k < (int)derived_columns; k++) derived_planes[k] = derived_index->first_plane[k];
+
+	assert(cvms5_build_pyramid(1) == 0);
+	for (k = 0; k < 2; k++) {
+		derived_level[k] = malloc(derived_points * sizeof(float));
+		memcpy(derived_level[k], k == 0 ? cvms5_pyramid[1].model->vp : cvms5_pyramid[1].model->vs,
+			   (size_t)cvms5_pyramid[1].nx * cvms5_pyramid[1].ny * cvms5_pyramid[1].nz * sizeof(float));
+	}
+
+	snprintf(overlay_file, sizeof(overlay_file), "%stest.ovl", cvms5_iteration_directory);
+	assert(cvms5_finalize() == 0);
+
+	for (k = 0; k < CVMS5_BRICK_SIZE * CVMS5_BRICK_SIZE * CVMS5_BRICK_SIZE; k++) {
+		overlay_vp[k] = 100;
+		overlay_vs[k] = 50;
+	}
+	overlay_fp = fopen(overlay_file, "wb");
+	assert(overlay_fp != NULL);
+	assert(fwrite(&overlay_header, sizeof(overlay_header), 1, overlay_fp) == 1);
+	assert(fwrite(overlay_brick, sizeof(int), 3, overlay_fp) == 3);
+	assert(fwrite(overlay_vp, sizeof(overlay_vp), 1, overlay_fp) == 1);
+	assert(fwrite(overlay_vs, sizeof(overlay_vs), 1, overlay_fp) == 1);
+	fclose(overlay_fp);
+
+	// The scratch configuration file is a link to the real one, so write a copy naming the overlay.
+	snprintf(derived_config, sizeof(derived_config), "%s/model/cvms5/data/config", scratch);
+	derived_fp = fopen(derived_config, "r");
+	assert(derived_fp != NULL);
+	derived_size = fread(derived_text, 1, sizeof(derived_text) - 1, derived_fp);
+	fclose(derived_fp);
+	assert(unlink(derived_config) == 0);
+	derived_fp = fopen(derived_config, "w");
+	assert(derived_fp != NULL);
+	assert(fwrite(derived_text, 1, derived_size, derived_fp) == derived_size);
+	fprintf(derived_fp, "\noverlay = test.ovl\n");
+	fclose(derived_fp);
+
+	assert(cvms5_init(scratch, "cvms5") == 0);
+	assert(cvms5_velocity_model->overlay_count == 1);
+
+	// The level built without the overlay is out of date.
+	assert(cvms5_set_query_resolution(2 * spacing) == 0);
+
+	// The overlaid brick is shifted by the overlay, and its neighbour along x is not.
+	assert(cvms5_build_summary(cvms5_velocity_model, &derived_summary[1]) == 0);
+	for (k = 0; k < 2; k++)
+		derived_brick[k] = &(derived_summary[k].bricks[0][derived_summary[k].ny[0] + 1]);
+	assert(derived_brick[1]->vp_count == derived_brick[0]->vp_count);
+	assert(derived_brick[1]->vs_count == derived_brick[0]->vs_count);
+	assert(close_to(derived_brick[1]->vp_min, derived_brick[0]->vp_min + 100));
+	assert(close_to(derived_brick[1]->vp_max, derived_brick[0]->vp_max + 100));
+	assert(close_to(derived_brick[1]->vs_min, derived_brick[0]->vs_min + 50));
+	assert(close_to(derived_brick[1]->vs_max, derived_brick[0]->vs_max + 50));
+	assert(close_to(derived_brick[1]->vp_sum, derived_brick[0]->vp_sum + 100.0 * derived_brick[0]->vp_count));
+	assert(memcmp(&(derived_summary[1].bricks[0][2 * derived_summary[1].ny[0] + 1]),
+				  &(derived_summary[0].bricks[0][2 * derived_summary[0].ny[0] + 1]), sizeof(cvms5_brick_t)) == 0);
+
+	// Each column of the depth index is where a query first reaches the threshold from the surface.
+	assert((derived_index = cvms5_get_zdepth_index(derived_threshold)) != NULL);
+	for (derived_x = 0; derived_x < derived_nx; derived_x++) {
+		for (derived_y = 0; derived_y < derived_ny; derived_y++) {
+			derived_plane = -1;
+			for (derived_z = cvms5_configuration->nz - 1; derived_z >= 0 && derived_plane < 0; derived_z--) {
+				cvms5_read_properties(derived_x, derived_y, derived_z, &derived_node);
+				if (derived_node.vs >= derived_threshold) derived_plane = derived_z;
+			}
+			assert(derived_index->first_plane[derived_x * derived_ny + derived_y] == derived_plane);
+		}
+	}
+	assert(derived_index->first_plane[centre * derived_ny + centre] != derived_planes[centre * derived_ny + centre]);
+
+	// The level is the overlaid grid, read a point at a time, smoothed and decimated.
+	for (k = 0; k < 2; k++) {
+		derived_grid[k] = malloc(derived_points * sizeof(float));
+		derived_expected[k] = malloc(derived_points * sizeof(float));
+	}
+	for (derived_z = 0; derived_z < cvms5_configuration->nz; derived_z++)
+		for (derived_x = 0; derived_x < derived_nx; derived_x++)
+			for (derived_y = 0; derived_y < derived_ny; derived_y++) {
+				cvms5_read_properties(derived_x, derived_y, derived_z, &derived_node);
+				derived_size = ((size_t)derived_z * derived_nx + (derived_nx - derived_x - 1)) * derived_ny + derived_y;
+				derived_grid[0][derived_size] = derived_node.vp;
+				derived_grid[1][derived_size] = derived_node.vs;
+			}
+
+	assert(cvms5_build_pyramid(1) == 0);
+	derived_size = (size_t)cvms5_pyramid[1].nx * cvms5_pyramid[1].ny * cvms5_pyramid[1].nz;
+	for (k = 0; k < 2; k++) {
+		cvms5_downsample_grid(derived_grid[k], derived_nx, derived_ny, cvms5_configuration->nz, derived_expected[k],
+							  cvms5_pyramid[1].nx, cvms5_pyramid[1].ny, cvms5_pyramid[1].nz);
+		assert(memcmp(derived_expected[k], k == 0 ? cvms5_pyramid[1].model->vp : cvms5_pyramid[1].model->vs,
+					  derived_size * sizeof(float)) == 0);
+	}
+
+	// Within the brick, away from its edges, the level is shifted by the whole of the overlay.
+	derived_size = ((size_t)2 * cvms5_pyramid[1].nx + (cvms5_pyramid[1].nx - 6 - 1)) * cvms5_pyramid[1].ny + 6;
+	assert(close_to(((float *)cvms5_pyramid[1].model->vp)[derived_size], derived_level[0][derived_size] + 100));
+	assert(close_to(((float *)cvms5_pyramid[1].model->vs)[derived_size], derived_level[1][derived_size] + 50));
+
+	// The level built with the overlay is loaded from then on.
+	assert(cvms5_finalize() == 0);
+	assert(cvms5_init(scratch, "cvms5") == 0);
+	assert(cvms5_set_query_resolution(2 * spacing) == 1);
+	assert(cvms5_finalize() == 0);
+
+	for (k = 0; k < 2; k++) {
+		free(derived_level[k]);
+		free(derived_grid[k]);
+		free(derived_expected[k]);
+		for (derived_z = 0; derived_z < CVMS5_SUMMARY_LEVELS; derived_z++) free(derived_summary[k].bricks[derived_z]);
+	}
+	free(derived_planes);
+	remove_scratch_install(scratch);
+
+	printf("Overlaid summary, depth index and pyramid were successful.\n");
+
+	// A batch queried again is answered from the cache, until the model's configuration changes.
+	cvms5_point_t cache_pts[CVMS5_CACHE_MIN_POINTS];
+	cvms5_properties_t cache_ret[CVMS5_CACHE_MIN_POINTS], cache_again[CVMS5_CACHE_MIN_POINTS];
+	char cache_dir[128], cache_file[1024], config_file[1024], config_text[CVMS5_CONFIG_MAX * 4];
+	uint64_t cache_key = 0, cache_stamp = 0;
+	struct stat cache_st;
+	size_t config_size = 0;
+	FILE *config_fp = NULL;
+
+	make_scratch_install(dir, scratch);
+	snprintf(cache_dir, sizeof(cache_dir), "%s/cache", scratch);
+	assert(cvms5_init(scratch, "cvms5") == 0);
+	assert(cvms5_set_cache(cache_dir) == 0);
+
+	for (k = 0; k < CVMS5_CACHE_MIN_POINTS; k++) {
+		cache_pts[k].longitude = -118 + 0.01 * (k % 16);
+		cache_pts[k].latitude = 34 + 0.01 * (k / 16);
+		cache_pts[k].depth = 100 * (k % 7);
+	}
+
+	assert(cvms5_query(cache_pts, cache_ret, CVMS5_CACHE_MIN_POINTS) == 0);
+	cache_key = cvms5_cache_key(cache_pts, CVMS5_CACHE_MIN_POINTS);
+	cache_stamp = cvms5_model_stamp;
+	snprintf(cache_file, sizeof(cache_file), "%s/%016llx.res", cache_dir, (unsigned long long)cache_key);
+	assert(stat(cache_file, &cache_st) == 0);
+	assert(cvms5_cache_read(cache_key, cache_again, CVMS5_CACHE_MIN_POINTS) == 0);
+	assert(memcmp(cache_again, cache_ret, sizeof(cache_ret)) == 0);
+
+	// Mark the cached results, so that a query answered from the cache can be told apart.
+	for (k = 0; k < CVMS5_CACHE_MIN_POINTS; k++) cache_again[k].vs = 12345;
+	assert(cvms5_cache_write(cache_key, cache_again, CVMS5_CACHE_MIN_POINTS) == 0);
+	assert(cvms5_query(cache_pts, cache_again, CVMS5_CACHE_MIN_POINTS) == 0);
+	assert(cache_again[0].vs == 12345 && cache_again[CVMS5_CACHE_MIN_POINTS - 1].vs == 12345);
+	assert(cvms5_finalize() == 0);
+
+	// The scratch configuration file is a link to the real one, so write a changed copy in its place.
+	snprintf(config_file, sizeof(config_file), "%s/model/cvms5/data/config", scratch);
+	config_fp = fopen(config_file, "r");
+	assert(config_fp != NULL);
+	config_size = fread(config_text, 1, sizeof(config_text) - 1, config_fp);
+	fclose(config_fp);
+	assert(unlink(config_file) == 0);
+	config_fp = fopen(config_file, "w");
+	assert(config_fp != NULL);
+	assert(fwrite(config_text, 1, config_size, config_fp) == config_size);
+	fprintf(config_fp, "\n# Changed by the tests\n");
+	fclose(config_fp);
+
+	assert(cvms5_init(scratch, "cvms5") == 0);
+	assert(cvms5_set_cache(cache_dir) == 0);
+	assert(cvms5_model_stamp != cache_stamp);
+	assert(cvms5_cache_key(cache_pts, CVMS5_CACHE_MIN_POINTS) != cache_key);
+	assert(cvms5_cache_read(cache_key, cache_again, CVMS5_CACHE_MIN_POINTS) != 0);
+	assert(cvms5_query(cache_pts, cache_again, CVMS5_CACHE_MIN_POINTS) == 0);
+	assert(memcmp(cache_again, cache_ret, sizeof(cache_ret)) == 0);
+
+	assert(cvms5_finalize() == 0);
+	remove_scratch_install(scratch);
+
+	printf("Result cache was successful.\n");
+
+	// A trace holds every batch given to cvms5_query, with its points and settings.
+	cvms5_trace_header_t trace_header;
+	cvms5_trace_record_t trace_record;
+	cvms5_point_t trace_pts[3], trace_read[3];
+	cvms5_properties_t trace_ret[3];
+	char trace_file[64];
+	FILE *trace_fp = NULL;
+	int trace_fd = -1;
+
+	strcpy(trace_file, "/tmp/cvms5_trace_XXXXXX");
+	trace_fd = mkstemp(trace_file);
+	assert(trace_fd >= 0);
+	close(trace_fd);
+
+	for (k = 0; k < 3; k++) {
+		trace_pts[k].longitude = -118 + 0.1 * k;
+		trace_pts[k].latitude = 34;
+		trace_pts[k].depth = 500 * k;
+	}
+
+	assert(cvms5_init(dir, "cvms5") == 0);
+	assert(cvms5_start_trace(trace_file) == 0);
+	assert(cvms5_query(trace_pts, trace_ret, 3) == 0);
+	assert(cvms5_set_interpolation(CVMS5_INTERP_NEAREST) == 0);
+	assert(cvms5_query(trace_pts, trace_ret, 2) == 0);
+	cvms5_stop_trace();
+	assert(cvms5_finalize() == 0);
+
+	trace_fp = fopen(trace_file, "rb");
+	assert(trace_fp != NULL);
+	assert(fread(&trace_header, sizeof(trace_header), 1, trace_fp) == 1);
+	assert(memcmp(trace_header.magic, CVMS5_TRACE_MAGIC, sizeof(trace_header.magic)) == 0);
+	assert(trace_header.version == CVMS5_TRACE_VERSION);
+
+	assert(fread(&trace_record, sizeof(trace_record), 1, trace_fp) == 1);
+	assert(trace_record.numpoints == 3 && trace_record.status == 0);
+	assert(trace_record.mode == CVMS5_COORD_DEPTH && trace_record.interpolation == CVMS5_INTERP_TRILINEAR);
+	assert(trace_record.start >= 0 && trace_record.seconds >= 0);
+	assert(fread(trace_read, sizeof(cvms5_point_t), 3, trace_fp) == 3);
+	assert(memcmp(trace_read, trace_pts, 3 * sizeof(cvms5_point_t)) == 0);
+
+	assert(fread(&trace_record, sizeof(trace_record), 1, trace_fp) == 1);
+	assert(trace_record.numpoints == 2 && trace_record.interpolation == CVMS5_INTERP_NEAREST);
+	assert(fread(trace_read, sizeof(cvms5_point_t), 2, trace_fp) == 2);
+	assert(memcmp(trace_read, trace_pts, 2 * sizeof(cvms5_point_t)) == 0);
+
+	assert(fread(&trace_record, sizeof(trace_record), 1, trace_fp) == 0);
+	fclose(trace_fp);
+	unlink(trace_file);
+
+	printf("Query trace was successful.\n");
+
+	// The replay tool answers every batch from the model, even with a result cache set for it.
+	cvms5_point_t replay_pts[CVMS5_CACHE_MIN_POINTS];
+	cvms5_properties_t replay_ret[CVMS5_CACHE_MIN_POINTS];
+	char replay_tool[1024], replay_cache[128], replay_command[2048];
+	struct dirent *replay_entry;
+	DIR *replay_dir;
+	int replay_files = 0;
+
+	make_scratch_install(dir, scratch);
+	snprintf(replay_cache, sizeof(replay_cache), "%s/cache", scratch);
+	strcpy(trace_file, "/tmp/cvms5_trace_XXXXXX");
+	trace_fd = mkstemp(trace_file);
+	assert(trace_fd >= 0);
+	close(trace_fd);
+
+	for (k = 0; k < CVMS5_CACHE_MIN_POINTS; k++) {
+		replay_pts[k].longitude = -118 + 0.01 * (k % 16);
+		replay_pts[k].latitude = 34 + 0.01 * (k / 16);
+		replay_pts[k].depth = 100 * (k % 7);
+	}
+
+	assert(cvms5_init(scratch, "cvms5") == 0);
+	assert(cvms5_start_trace(trace_file) == 0);
+	assert(cvms5_query(replay_pts, replay_ret, CVMS5_CACHE_MIN_POINTS) == 0);
+	cvms5_stop_trace();
+	assert(cvms5_finalize() == 0);
+
+	tool_path("cvms5_replay", replay_tool, sizeof(replay_tool));
+	snprintf(replay_command, sizeof(replay_command), "CVMS5_CACHE='%s' %s %s %s > /dev/null", replay_cache, replay_tool,
+			 scratch, trace_file);
+	assert(system(replay_command) == 0);
+
+	if ((replay_dir = opendir(replay_cache)) != NULL) {
+		while ((replay_entry = readdir(replay_dir)) != NULL)
+			if (replay_entry->d_name[0] != '.') replay_files++;
+		closedir(replay_dir);
+	}
+	assert(replay_files == 0);
+
+	unlink(trace_file);
+	remove_scratch_install(scratch);
+
+	printf("Trace replay was successful.\n");
+
 	printf("\nALL CVM-S5 TESTS PASSED");
 
 	return 0;